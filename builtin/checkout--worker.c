@@ -0,0 +1,76 @@
+#include "builtin.h"
+#include "cache.h"
+#include "pkt-line.h"
+#include "streaming.h"
+#include "parallel-checkout.h"
+
+static const char checkout_worker_usage[] =
+"git checkout--worker";
+
+struct worker_item {
+	int id;
+	unsigned int mode;
+	unsigned char sha1[20];
+	char *path;
+};
+
+static int write_item(const struct worker_item *item, struct stat *st)
+{
+	int fd, mode = (item->mode & 0100) ? 0777 : 0666;
+
+	fd = open(item->path, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (fd < 0)
+		return errno == EEXIST ? CHECKOUT_COLLIDED : CHECKOUT_FAILED;
+	if (stream_blob_to_fd(fd, item->sha1, NULL, 1) ||
+	    (fstat_is_reliable() && fstat(fd, st))) {
+		close(fd);
+		unlink(item->path);
+		return CHECKOUT_FAILED;
+	}
+	if (close(fd) || (!fstat_is_reliable() && lstat(item->path, st))) {
+		unlink(item->path);
+		return CHECKOUT_FAILED;
+	}
+	return CHECKOUT_WRITTEN;
+}
+
+int cmd_checkout__worker(int argc, const char **argv, const char *prefix)
+{
+	struct worker_item *items = NULL;
+	int i, nr = 0, alloc = 0;
+	char *line = packet_buffer;
+
+	if (argc != 1)
+		usage(checkout_worker_usage);
+	git_config(git_default_config, NULL);
+
+	/* not packet_read_line(): a path may well end in a newline */
+	while (packet_read(0, NULL, NULL, packet_buffer,
+			   sizeof(packet_buffer), 0) > 0) {
+		struct worker_item *item;
+		char *end;
+
+		ALLOC_GROW(items, nr + 1, alloc);
+		item = &items[nr++];
+		item->id = strtol(line, &end, 10);
+		if (*end != ' ')
+			die("bad checkout entry: %s", line);
+		item->mode = strtoul(end + 1, &end, 8);
+		if (*end != ' ' || get_sha1_hex(end + 1, item->sha1) ||
+		    end[41] != ' ' || !end[42])
+			die("bad checkout entry: %s", line);
+		item->path = xstrdup(end + 42);
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct checkout_result res;
+
+		memset(&res, 0, sizeof(res));
+		res.id = items[i].id;
+		res.status = write_item(&items[i], &res.st);
+		write_or_die(1, &res, sizeof(res));
+		free(items[i].path);
+	}
+	free(items);
+	return 0;
+}
@@ -651,11 +651,10 @@ static void update_refs_for_switch(const struct checkout_opts *opts,
 			}
 		}
 		if (old->path && old->name) {
-			char log_file[PATH_MAX], ref_file[PATH_MAX];
+			char log_file[PATH_MAX];
 
 			git_snpath(log_file, sizeof(log_file), "logs/%s", old->path);
-			git_snpath(ref_file, sizeof(ref_file), "%s", old->path);
-			if (!file_exists(ref_file) && file_exists(log_file))
+			if (!ref_exists(old->path) && file_exists(log_file))
 				remove_path(log_file);
 		}
 	}
@@ -0,0 +1,78 @@
+/*
+ * Builtin "git commit-graph"
+ */
+
+#include "builtin.h"
+#include "cache.h"
+#include "commit.h"
+#include "commit-graph.h"
+#include "parse-options.h"
+
+static const char * const builtin_commit_graph_usage[] = {
+	N_("git commit-graph write [--[no-]progress]"),
+	N_("git commit-graph verify"),
+	NULL
+};
+
+static const char * const builtin_commit_graph_write_usage[] = {
+	N_("git commit-graph write [--[no-]progress]"),
+	NULL
+};
+
+static const char * const builtin_commit_graph_verify_usage[] = {
+	N_("git commit-graph verify"),
+	NULL
+};
+
+static int graph_write(int argc, const char **argv, const char *prefix)
+{
+	int show_progress = isatty(2);
+	struct option options[] = {
+		OPT_BOOL(0, "progress", &show_progress, N_("show progress")),
+		OPT_END(),
+	};
+
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_commit_graph_write_usage, 0);
+	if (argc)
+		usage_with_options(builtin_commit_graph_write_usage, options);
+
+	return !!write_commit_graph_reachable(show_progress);
+}
+
+static int graph_verify(int argc, const char **argv, const char *prefix)
+{
+	struct option options[] = {
+		OPT_END(),
+	};
+
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_commit_graph_verify_usage, 0);
+	if (argc)
+		usage_with_options(builtin_commit_graph_verify_usage, options);
+
+	/* the graph is checked even when core.commitGraph is not set */
+	core_commit_graph = 1;
+	return !!verify_commit_graph();
+}
+
+int cmd_commit_graph(int argc, const char **argv, const char *prefix)
+{
+	struct option options[] = {
+		OPT_END(),
+	};
+
+	git_config(git_default_config, NULL);
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_commit_graph_usage,
+			     PARSE_OPT_STOP_AT_NON_OPTION);
+
+	save_commit_buffer = 0;
+
+	if (argc > 0 && !strcmp(argv[0], "write"))
+		return graph_write(argc, argv, prefix);
+	else if (argc > 0 && !strcmp(argv[0], "verify"))
+		return graph_verify(argc, argv, prefix);
+
+	usage_with_options(builtin_commit_graph_usage, options);
+}
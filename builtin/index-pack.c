@@ -142,6 +142,7 @@ static void init_thread(void)
 	pthread_key_create(&key, NULL);
 	thread_data = xcalloc(nr_threads, sizeof(*thread_data));
 	threads_active = 1;
+	enable_obj_read_lock();
 }
 
 static void cleanup_thread(void)
@@ -149,6 +150,7 @@ static void cleanup_thread(void)
 	if (!threads_active)
 		return;
 	threads_active = 0;
+	disable_obj_read_lock();
 	pthread_mutex_destroy(&read_mutex);
 	pthread_mutex_destroy(&counter_mutex);
 	pthread_mutex_destroy(&work_mutex);
@@ -709,26 +711,22 @@ static void sha1_object(const void *data, struct object_entry *obj_entry,
 
 	assert(data || obj_entry);
 
-	read_lock();
 	collision_test_needed = has_sha1_file(sha1);
-	read_unlock();
 
 	if (collision_test_needed && !data) {
-		read_lock();
+		obj_read_lock();
 		if (!check_collison(obj_entry))
 			collision_test_needed = 0;
-		read_unlock();
+		obj_read_unlock();
 	}
 	if (collision_test_needed) {
 		void *has_data;
 		enum object_type has_type;
 		unsigned long has_size;
-		read_lock();
 		has_type = sha1_object_info(sha1, &has_size);
 		if (has_type != type || has_size != size)
 			die(_("SHA1 COLLISION FOUND WITH %s !"), sha1_to_hex(sha1));
 		has_data = read_sha1_file(sha1, &has_type, &has_size);
-		read_unlock();
 		if (!data)
 			data = new_data = get_data_from_pack(obj_entry);
 		if (!has_data)
@@ -1162,7 +1160,7 @@ static int write_compressed(struct sha1file *f, void *in, unsigned int size)
 	unsigned char outbuf[4096];
 
 	memset(&stream, 0, sizeof(stream));
-	git_deflate_init(&stream, zlib_compression_level);
+	git_deflate_init_codec(&stream, zlib_compression_level, object_codec);
 	stream.next_in = in;
 	stream.avail_in = size;
 
@@ -1264,6 +1262,7 @@ static void fix_unresolved_deltas(struct sha1file *f, int nr_unresolved)
 
 static void final(const char *final_pack_name, const char *curr_pack_name,
 		  const char *final_index_name, const char *curr_index_name,
+		  const char *final_rev_name, const char *curr_rev_name,
 		  const char *keep_name, const char *keep_msg,
 		  unsigned char *sha1)
 {
@@ -1315,6 +1314,17 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 	} else if (from_stdin)
 		chmod(final_pack_name, 0444);
 
+	if (curr_rev_name && final_rev_name != curr_rev_name) {
+		if (!final_rev_name) {
+			snprintf(name, sizeof(name), "%s/pack/pack-%s.rev",
+				 get_object_directory(), sha1_to_hex(sha1));
+			final_rev_name = name;
+		}
+		if (move_temp_to_file(curr_rev_name, final_rev_name))
+			die(_("cannot store reverse index file"));
+	} else if (curr_rev_name)
+		chmod(final_rev_name, 0444);
+
 	if (final_index_name != curr_index_name) {
 		if (!final_index_name) {
 			snprintf(name, sizeof(name), "%s/pack/pack-%s.idx",
@@ -1370,6 +1380,13 @@ static int git_index_pack_config(const char *k, const char *v, void *cb)
 #endif
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		if (git_config_bool(k, v))
+			opts->flags |= WRITE_REV;
+		else
+			opts->flags &= ~WRITE_REV;
+		return 0;
+	}
 	return git_default_config(k, v, cb);
 }
 
@@ -1490,10 +1507,10 @@ static void show_pack_info(int stat_only)
 int cmd_index_pack(int argc, const char **argv, const char *prefix)
 {
 	int i, fix_thin_pack = 0, verify = 0, stat_only = 0;
-	const char *curr_pack, *curr_index;
-	const char *index_name = NULL, *pack_name = NULL;
+	const char *curr_pack, *curr_index, *curr_rev = NULL;
+	const char *index_name = NULL, *pack_name = NULL, *rev_name = NULL;
 	const char *keep_name = NULL, *keep_msg = NULL;
-	char *index_name_buf = NULL, *keep_name_buf = NULL;
+	char *index_name_buf = NULL, *keep_name_buf = NULL, *rev_name_buf = NULL;
 	struct pack_idx_entry **idx_objects;
 	struct pack_idx_option opts;
 	unsigned char pack_sha1[20];
@@ -1505,6 +1522,7 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 	check_replace_refs = 0;
 
 	reset_pack_idx_option(&opts);
+	opts.flags |= WRITE_REV;
 	git_config(git_index_pack_config, &opts);
 	if (prefix && chdir(prefix))
 		die(_("Cannot come back to cwd"));
@@ -1599,6 +1617,16 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 		strcpy(index_name_buf + len - 5, ".idx");
 		index_name = index_name_buf;
 	}
+	if (index_name && has_extension(index_name, ".idx")) {
+		int len = strlen(index_name);
+		rev_name_buf = xmalloc(len + 1);
+		memcpy(rev_name_buf, index_name, len - 4);
+		strcpy(rev_name_buf + len - 4, ".rev");
+		rev_name = rev_name_buf;
+	} else if (index_name) {
+		/* no sensible place for the .rev of an oddly named index */
+		opts.flags &= ~WRITE_REV;
+	}
 	if (keep_msg && !keep_name && pack_name) {
 		int len = strlen(pack_name);
 		if (!has_extension(pack_name, ".pack"))
@@ -1645,11 +1673,15 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 	for (i = 0; i < nr_objects; i++)
 		idx_objects[i] = &objects[i].idx;
 	curr_index = write_idx_file(index_name, idx_objects, nr_objects, &opts, pack_sha1);
+	if (!verify && (opts.flags & WRITE_REV))
+		curr_rev = write_rev_file(rev_name, idx_objects, nr_objects,
+					  pack_sha1);
 	free(idx_objects);
 
 	if (!verify)
 		final(pack_name, curr_pack,
 		      index_name, curr_index,
+		      rev_name, curr_rev,
 		      keep_name, keep_msg,
 		      pack_sha1);
 	else
@@ -1657,10 +1689,13 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 	free(objects);
 	free(index_name_buf);
 	free(keep_name_buf);
+	free(rev_name_buf);
 	if (pack_name == NULL)
 		free((void *) curr_pack);
 	if (index_name == NULL)
 		free((void *) curr_index);
+	if (rev_name == NULL)
+		free((void *) curr_rev);
 
 	/*
 	 * Let the caller know this pack is not self contained
@@ -183,10 +183,12 @@ static int create_default_files(const char *template_path)
 	unsigned len = strlen(git_dir);
 	static char path[PATH_MAX];
 	struct stat st1;
-	char repo_version_string[10];
+	char repo_version_string[16];
 	char junk[2];
 	int reinit;
 	int filemode;
+	/* a repository we reinitialize may need a later version for its extensions */
+	int repo_version = repository_format_version;
 
 	if (len > sizeof(path)-50)
 		die(_("insane git directory %s"), git_dir);
@@ -242,7 +244,8 @@ static int create_default_files(const char *template_path)
 	}
 
 	/* This forces creation of new config file */
-	sprintf(repo_version_string, "%d", GIT_REPO_VERSION);
+	snprintf(repo_version_string, sizeof(repo_version_string), "%d",
+		 repo_version > GIT_REPO_VERSION ? repo_version : GIT_REPO_VERSION);
 	git_config_set("core.repositoryformatversion", repo_version_string);
 
 	path[len] = 0;
@@ -225,6 +225,7 @@ int cmd_merge_base(int argc, const char **argv, const char *prefix)
 
 	git_config(git_default_config, NULL);
 	argc = parse_options(argc, argv, prefix, options, merge_base_usage, 0);
+	save_commit_buffer = 0;
 
 	if (cmdmode == 'a') {
 		if (argc < 2)
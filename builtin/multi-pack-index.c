@@ -0,0 +1,73 @@
+/*
+ * Builtin "git multi-pack-index"
+ */
+
+#include "builtin.h"
+#include "cache.h"
+#include "midx.h"
+#include "parse-options.h"
+
+static const char * const builtin_multi_pack_index_usage[] = {
+	N_("git multi-pack-index write [--[no-]progress]"),
+	N_("git multi-pack-index verify"),
+	NULL
+};
+
+static const char * const builtin_multi_pack_index_write_usage[] = {
+	N_("git multi-pack-index write [--[no-]progress]"),
+	NULL
+};
+
+static const char * const builtin_multi_pack_index_verify_usage[] = {
+	N_("git multi-pack-index verify"),
+	NULL
+};
+
+static int midx_write(int argc, const char **argv, const char *prefix)
+{
+	int show_progress = isatty(2);
+	struct option options[] = {
+		OPT_BOOL(0, "progress", &show_progress, N_("show progress")),
+		OPT_END(),
+	};
+
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_multi_pack_index_write_usage, 0);
+	if (argc)
+		usage_with_options(builtin_multi_pack_index_write_usage, options);
+
+	return !!write_midx_file(get_object_directory(), show_progress);
+}
+
+static int midx_verify(int argc, const char **argv, const char *prefix)
+{
+	struct option options[] = {
+		OPT_END(),
+	};
+
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_multi_pack_index_verify_usage, 0);
+	if (argc)
+		usage_with_options(builtin_multi_pack_index_verify_usage, options);
+
+	return !!verify_midx_file(get_object_directory());
+}
+
+int cmd_multi_pack_index(int argc, const char **argv, const char *prefix)
+{
+	struct option options[] = {
+		OPT_END(),
+	};
+
+	git_config(git_default_config, NULL);
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_multi_pack_index_usage,
+			     PARSE_OPT_STOP_AT_NON_OPTION);
+
+	if (argc > 0 && !strcmp(argv[0], "write"))
+		return midx_write(argc, argv, prefix);
+	else if (argc > 0 && !strcmp(argv[0], "verify"))
+		return midx_verify(argc, argv, prefix);
+
+	usage_with_options(builtin_multi_pack_index_usage, options);
+}
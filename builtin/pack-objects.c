@@ -20,6 +20,8 @@
 #include "streaming.h"
 #include "thread-utils.h"
 #include "pack-bitmap.h"
+#include "delta-islands.h"
+#include "parallel-deflate.h"
 
 static const char *pack_usage[] = {
 	N_("git pack-objects --stdout [options...] [< ref-list | < object-list]"),
@@ -52,17 +54,28 @@ static int window = 10;
 static unsigned long pack_size_limit;
 static int depth = 50;
 static int delta_search_threads;
+static int write_threads;
 static int pack_to_stdout;
 static int num_preferred_base;
 static struct progress *progress_state;
 static int pack_compression_level = Z_DEFAULT_COMPRESSION;
 static int pack_compression_seen;
 
+/*
+ * The codec of objects we compress afresh, and whether we may copy
+ * data in any codec from existing packs; a pack for another
+ * repository may only carry zlib and what --object-codec allows.
+ */
+static const char *object_codec_arg;
+static enum object_codec pack_codec;
+static int reuse_any_codec;
+
 static struct packed_git *reuse_packfile;
 static uint32_t reuse_packfile_objects;
 static off_t reuse_packfile_offset;
 
 static int use_bitmap_index = 1;
+static int use_delta_islands;
 static int write_bitmap_index;
 static uint16_t write_bitmap_options;
 
@@ -124,7 +137,7 @@ static unsigned long do_compress(void **pptr, unsigned long size)
 	unsigned long maxsize;
 
 	memset(&stream, 0, sizeof(stream));
-	git_deflate_init(&stream, pack_compression_level);
+	git_deflate_init_codec(&stream, pack_compression_level, pack_codec);
 	maxsize = git_deflate_bound(&stream, size);
 
 	in = *pptr;
@@ -143,16 +156,70 @@ static unsigned long do_compress(void **pptr, unsigned long size)
 	return stream.total_out;
 }
 
+struct large_blob_data {
+	struct git_istream *st;
+	struct sha1file *f;
+	const unsigned char *sha1;
+	unsigned long olen;
+};
+
+static void read_large_blob(void *data, void *buf, size_t len)
+{
+	struct large_blob_data *lb = data;
+
+	while (len) {
+		ssize_t readlen;
+
+		obj_read_lock();
+		readlen = read_istream(lb->st, buf, len);
+		obj_read_unlock();
+		if (readlen <= 0)
+			die(_("unable to read %s"), sha1_to_hex(lb->sha1));
+		buf = (char *)buf + readlen;
+		len -= readlen;
+	}
+}
+
+static int write_large_blob(void *data, const void *buf, size_t len)
+{
+	struct large_blob_data *lb = data;
+
+	sha1write(lb->f, buf, len);
+	lb->olen += len;
+	return 0;
+}
+
+static void close_large_blob(struct git_istream *st)
+{
+	obj_read_lock();
+	close_istream(st);
+	obj_read_unlock();
+}
+
 static unsigned long write_large_blob_data(struct git_istream *st, struct sha1file *f,
-					   const unsigned char *sha1)
+					   const unsigned char *sha1,
+					   unsigned long size)
 {
 	git_zstream stream;
 	unsigned char ibuf[1024 * 16];
 	unsigned char obuf[1024 * 16];
 	unsigned long olen = 0;
 
+	/* parallel_deflate() writes zlib only */
+	if (write_threads > 1 && pack_codec == OBJECT_CODEC_ZLIB) {
+		struct large_blob_data lb;
+
+		lb.st = st;
+		lb.f = f;
+		lb.sha1 = sha1;
+		lb.olen = 0;
+		parallel_deflate(pack_compression_level, write_threads, size,
+				 read_large_blob, write_large_blob, &lb);
+		return lb.olen;
+	}
+
 	memset(&stream, 0, sizeof(stream));
-	git_deflate_init(&stream, pack_compression_level);
+	git_deflate_init_codec(&stream, pack_compression_level, pack_codec);
 
 	for (;;) {
 		ssize_t readlen;
@@ -232,6 +299,302 @@ static void copy_pack_data(struct sha1file *f,
 	}
 }
 
+/*
+ * Whether write_object() copies the data of entry from the pack it is
+ * in, rather than compressing it afresh.
+ */
+static int reuse_packed_object(struct object_entry *entry, int usable_delta)
+{
+	if (!reuse_object)
+		return 0;	/* explicit */
+	else if (!entry->in_pack)
+		return 0;	/* can't reuse what we don't have */
+	else if (entry->foreign_codec)
+		return 0;	/* the receiver can't read it */
+	else if (entry->type == OBJ_REF_DELTA || entry->type == OBJ_OFS_DELTA)
+				/* check_object() decided it for us ... */
+		return usable_delta;
+				/* ... but pack split may override that */
+	else if (entry->type != entry->in_pack_type)
+		return 0;	/* pack has delta which is unusable */
+	else if (entry->delta)
+		return 0;	/* we want to pack afresh */
+	else
+		return 1;	/* we have it in-pack undeltified,
+				 * and we do not need to deltify it.
+				 */
+}
+
+#ifndef NO_PTHREADS
+
+/*
+ * While write_pack_file() writes the objects in write order, threads
+ * compress the objects coming up next, so that the writer mostly
+ * finds them ready.  The positions in write order from the one being
+ * written to the last one queued map onto a ring of slots.
+ */
+enum compress_state {
+	COMPRESS_QUEUED,
+	COMPRESS_BUSY,
+	COMPRESS_DONE
+};
+
+struct compressed_object {
+	struct object_entry *entry;	/* NULL if no thread is to touch it */
+	enum compress_state state;
+	unsigned delta:1;
+	enum object_type type;
+	unsigned long size;	/* before compression */
+	void *data;
+	unsigned long datalen;
+};
+
+static struct compressed_object *write_ahead;
+static uint32_t write_ahead_nr;
+static uint32_t write_ahead_begin;	/* oldest position not written yet */
+static uint32_t write_ahead_queued;	/* position to queue next */
+static uint32_t write_ahead_next;	/* position to compress next */
+static int write_ahead_stop;
+static pthread_t *write_ahead_threads;
+static pthread_mutex_t write_ahead_mutex;
+static pthread_cond_t write_ahead_work_cond;
+static pthread_cond_t write_ahead_done_cond;
+
+#define write_ahead_slot(pos) (&write_ahead[(pos) % write_ahead_nr])
+
+static int want_write_ahead(struct object_entry *entry)
+{
+	/* without a pack size limit, every delta is usable */
+	int usable_delta = !!entry->delta;
+
+	if (entry->preferred_base || entry->idx.offset)
+		return 0;
+	if (reuse_packed_object(entry, usable_delta))
+		return 0;
+	if (usable_delta)
+		return !entry->z_delta_size;
+	/* large blobs are streamed by write_no_reuse_object() */
+	return !(entry->type == OBJ_BLOB && entry->size > big_file_threshold);
+}
+
+static void compress_ahead(struct compressed_object *c)
+{
+	struct object_entry *entry = c->entry;
+	void *buf;
+
+	c->delta = !!entry->delta;
+	if (c->delta) {
+		if (entry->delta_data) {
+			buf = entry->delta_data;
+			entry->delta_data = NULL;
+		} else
+			buf = get_delta(entry);
+		c->size = entry->delta_size;
+	} else {
+		buf = read_sha1_file(entry->idx.sha1, &c->type, &c->size);
+		if (!buf)
+			die(_("unable to read %s"), sha1_to_hex(entry->idx.sha1));
+	}
+	c->datalen = do_compress(&buf, c->size);
+	c->data = buf;
+}
+
+static void *write_ahead_thread(void *data)
+{
+	pthread_mutex_lock(&write_ahead_mutex);
+	for (;;) {
+		struct compressed_object *c;
+
+		while (write_ahead_next == write_ahead_queued && !write_ahead_stop)
+			pthread_cond_wait(&write_ahead_work_cond, &write_ahead_mutex);
+		if (write_ahead_stop)
+			break;
+
+		c = write_ahead_slot(write_ahead_next++);
+		if (!c->entry || c->state != COMPRESS_QUEUED)
+			continue;
+		c->state = COMPRESS_BUSY;
+		pthread_mutex_unlock(&write_ahead_mutex);
+
+		compress_ahead(c);
+
+		pthread_mutex_lock(&write_ahead_mutex);
+		c->state = COMPRESS_DONE;
+		pthread_cond_broadcast(&write_ahead_done_cond);
+	}
+	pthread_mutex_unlock(&write_ahead_mutex);
+	return NULL;
+}
+
+static void start_write_ahead(uint32_t pos)
+{
+	int i;
+
+	/*
+	 * With a pack size limit, whether a delta can be written
+	 * depends on where its base went, which is only known when
+	 * it is its turn.
+	 */
+	if (write_threads <= 1 || pack_size_limit)
+		return;
+
+	write_ahead_nr = 4 * write_threads;
+	write_ahead = xcalloc(write_ahead_nr, sizeof(*write_ahead));
+	write_ahead_begin = write_ahead_queued = write_ahead_next = pos;
+	write_ahead_stop = 0;
+
+	enable_obj_read_lock();
+	pthread_mutex_init(&write_ahead_mutex, NULL);
+	pthread_cond_init(&write_ahead_work_cond, NULL);
+	pthread_cond_init(&write_ahead_done_cond, NULL);
+	write_ahead_threads = xcalloc(write_threads, sizeof(*write_ahead_threads));
+	for (i = 0; i < write_threads; i++)
+		if (pthread_create(&write_ahead_threads[i], NULL,
+				   write_ahead_thread, NULL))
+			die("unable to create thread: %s", strerror(errno));
+}
+
+static void stop_write_ahead(void)
+{
+	uint32_t i;
+
+	if (!write_ahead)
+		return;
+
+	pthread_mutex_lock(&write_ahead_mutex);
+	write_ahead_stop = 1;
+	pthread_cond_broadcast(&write_ahead_work_cond);
+	pthread_mutex_unlock(&write_ahead_mutex);
+	for (i = 0; i < write_threads; i++)
+		pthread_join(write_ahead_threads[i], NULL);
+	free(write_ahead_threads);
+
+	pthread_cond_destroy(&write_ahead_done_cond);
+	pthread_cond_destroy(&write_ahead_work_cond);
+	pthread_mutex_destroy(&write_ahead_mutex);
+	disable_obj_read_lock();
+
+	for (i = 0; i < write_ahead_nr; i++)
+		free(write_ahead[i].data);
+	free(write_ahead);
+	write_ahead = NULL;
+}
+
+/* Queue the objects up to a ring ahead of the one at pos */
+static void queue_write_ahead(struct object_entry **write_order, uint32_t pos)
+{
+	uint32_t end = pos + write_ahead_nr;
+
+	if (!write_ahead)
+		return;
+	if (end > to_pack.nr_objects)
+		end = to_pack.nr_objects;
+
+	pthread_mutex_lock(&write_ahead_mutex);
+	for (; write_ahead_queued < end; write_ahead_queued++) {
+		struct compressed_object *c = write_ahead_slot(write_ahead_queued);
+		struct object_entry *entry = write_order[write_ahead_queued];
+
+		c->entry = want_write_ahead(entry) ? entry : NULL;
+		c->state = COMPRESS_QUEUED;
+	}
+	pthread_cond_broadcast(&write_ahead_work_cond);
+	pthread_mutex_unlock(&write_ahead_mutex);
+}
+
+/* The position at pos has been written; let its slot go */
+static void release_write_ahead(uint32_t pos)
+{
+	if (!write_ahead)
+		return;
+
+	pthread_mutex_lock(&write_ahead_mutex);
+	for (; write_ahead_begin <= pos; write_ahead_begin++) {
+		struct compressed_object *c = write_ahead_slot(write_ahead_begin);
+
+		while (c->state == COMPRESS_BUSY)
+			pthread_cond_wait(&write_ahead_done_cond, &write_ahead_mutex);
+		free(c->data);
+		c->data = NULL;
+		c->entry = NULL;
+	}
+	if (write_ahead_next < write_ahead_begin)
+		write_ahead_next = write_ahead_begin;
+	pthread_mutex_unlock(&write_ahead_mutex);
+}
+
+static struct compressed_object *find_write_ahead(struct object_entry *entry)
+{
+	uint32_t pos;
+
+	if (!write_ahead)
+		return NULL;
+	for (pos = write_ahead_begin; pos < write_ahead_queued; pos++) {
+		struct compressed_object *c = write_ahead_slot(pos);
+		if (c->entry == entry)
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * Make sure that no thread touches entry any more: wait for the one
+ * compressing it, or take it back if none has started yet.
+ */
+static void wait_write_ahead(struct object_entry *entry)
+{
+	struct compressed_object *c = find_write_ahead(entry);
+
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&write_ahead_mutex);
+	if (c->state == COMPRESS_QUEUED)
+		c->entry = NULL;
+	else
+		while (c->state != COMPRESS_DONE)
+			pthread_cond_wait(&write_ahead_done_cond, &write_ahead_mutex);
+	pthread_mutex_unlock(&write_ahead_mutex);
+}
+
+/*
+ * Hand over what a thread compressed for entry, if it was compressed
+ * the way we are about to write it.
+ */
+static void *take_write_ahead(struct object_entry *entry, int usable_delta,
+			      enum object_type *type, unsigned long *size,
+			      unsigned long *datalen)
+{
+	struct compressed_object *c = find_write_ahead(entry);
+	void *data;
+
+	if (!c)
+		return NULL;
+
+	data = c->data;
+	c->data = NULL;
+	c->entry = NULL;
+	if (c->delta != usable_delta) {
+		free(data);
+		return NULL;
+	}
+	*type = c->type;
+	*size = c->size;
+	*datalen = c->datalen;
+	return data;
+}
+
+#else
+
+#define start_write_ahead(pos)			(void)0
+#define stop_write_ahead()			(void)0
+#define queue_write_ahead(write_order, pos)	(void)0
+#define release_write_ahead(pos)		(void)0
+#define wait_write_ahead(entry)			(void)0
+#define take_write_ahead(entry, usable_delta, type, size, datalen) NULL
+
+#endif
+
 /* Return 0 if we will bust the pack-size limit */
 static unsigned long write_no_reuse_object(struct sha1file *f, struct object_entry *entry,
 					   unsigned long limit, int usable_delta)
@@ -242,13 +605,28 @@ static unsigned long write_no_reuse_object(struct sha1file *f, struct object_ent
 	enum object_type type;
 	void *buf;
 	struct git_istream *st = NULL;
-
-	if (!usable_delta) {
-		if (entry->type == OBJ_BLOB &&
-		    entry->size > big_file_threshold &&
-		    (st = open_istream(entry->idx.sha1, &type, &size, NULL)) != NULL)
-			buf = NULL;
+	int compressed;
+
+	buf = take_write_ahead(entry, usable_delta, &type, &size, &datalen);
+	compressed = !!buf;
+	if (compressed) {
+		if (usable_delta)
+			type = (allow_ofs_delta && entry->delta->idx.offset) ?
+				OBJ_OFS_DELTA : OBJ_REF_DELTA;
 		else {
+			free(entry->delta_data);
+			entry->delta_data = NULL;
+			entry->z_delta_size = 0;
+		}
+	} else if (!usable_delta) {
+		if (entry->type == OBJ_BLOB &&
+		    entry->size > big_file_threshold) {
+			/* the pack windows are shared with the write-ahead threads */
+			obj_read_lock();
+			st = open_istream(entry->idx.sha1, &type, &size, NULL);
+			obj_read_unlock();
+		}
+		if (!st) {
 			buf = read_sha1_file(entry->idx.sha1, &type, &size);
 			if (!buf)
 				die(_("unable to read %s"), sha1_to_hex(entry->idx.sha1));
@@ -275,6 +653,8 @@ static unsigned long write_no_reuse_object(struct sha1file *f, struct object_ent
 
 	if (st)	/* large blob case, just assume we don't compress well */
 		datalen = size;
+	else if (compressed)
+		; /* by a write-ahead thread */
 	else if (entry->z_delta_size)
 		datalen = entry->z_delta_size;
 	else
@@ -299,7 +679,7 @@ static unsigned long write_no_reuse_object(struct sha1file *f, struct object_ent
 			dheader[--pos] = 128 | (--ofs & 127);
 		if (limit && hdrlen + sizeof(dheader) - pos + datalen + 20 >= limit) {
 			if (st)
-				close_istream(st);
+				close_large_blob(st);
 			free(buf);
 			return 0;
 		}
@@ -313,7 +693,7 @@ static unsigned long write_no_reuse_object(struct sha1file *f, struct object_ent
 		 */
 		if (limit && hdrlen + 20 + datalen + 20 >= limit) {
 			if (st)
-				close_istream(st);
+				close_large_blob(st);
 			free(buf);
 			return 0;
 		}
@@ -323,15 +703,15 @@ static unsigned long write_no_reuse_object(struct sha1file *f, struct object_ent
 	} else {
 		if (limit && hdrlen + datalen + 20 >= limit) {
 			if (st)
-				close_istream(st);
+				close_large_blob(st);
 			free(buf);
 			return 0;
 		}
 		sha1write(f, header, hdrlen);
 	}
 	if (st) {
-		datalen = write_large_blob_data(st, f, entry->idx.sha1);
-		close_istream(st);
+		datalen = write_large_blob_data(st, f, entry->idx.sha1, size);
+		close_large_blob(st);
 	} else {
 		sha1write(f, buf, datalen);
 		free(buf);
@@ -346,7 +726,8 @@ static unsigned long write_reuse_object(struct sha1file *f, struct object_entry
 {
 	struct packed_git *p = entry->in_pack;
 	struct pack_window *w_curs = NULL;
-	struct revindex_entry *revidx;
+	struct pack_revindex *revidx;
+	uint32_t pos;
 	off_t offset;
 	enum object_type type = entry->type;
 	unsigned long datalen;
@@ -359,10 +740,11 @@ static unsigned long write_reuse_object(struct sha1file *f, struct object_entry
 	hdrlen = encode_in_pack_object_header(type, entry->size, header);
 
 	offset = entry->in_pack_offset;
-	revidx = find_pack_revindex(p, offset);
-	datalen = revidx[1].offset - offset;
+	revidx = find_pack_revindex(p, offset, &pos);
+	datalen = revindex_offset(revidx, pos + 1) - offset;
 	if (!pack_to_stdout && p->index_version > 1 &&
-	    check_pack_crc(p, &w_curs, offset, datalen, revidx->nr)) {
+	    check_pack_crc(p, &w_curs, offset, datalen,
+			   revindex_nr(revidx, pos))) {
 		error("bad packed object CRC for %s", sha1_to_hex(entry->idx.sha1));
 		unuse_pack(&w_curs);
 		return write_no_reuse_object(f, entry, limit, usable_delta);
@@ -420,7 +802,7 @@ static unsigned long write_object(struct sha1file *f,
 				  off_t write_offset)
 {
 	unsigned long limit, len;
-	int usable_delta, to_reuse;
+	int usable_delta;
 
 	if (!pack_to_stdout)
 		crc32_begin(f);
@@ -448,27 +830,14 @@ static unsigned long write_object(struct sha1file *f,
 	else
 		usable_delta = 0;	/* base could end up in another pack */
 
-	if (!reuse_object)
-		to_reuse = 0;	/* explicit */
-	else if (!entry->in_pack)
-		to_reuse = 0;	/* can't reuse what we don't have */
-	else if (entry->type == OBJ_REF_DELTA || entry->type == OBJ_OFS_DELTA)
-				/* check_object() decided it for us ... */
-		to_reuse = usable_delta;
-				/* ... but pack split may override that */
-	else if (entry->type != entry->in_pack_type)
-		to_reuse = 0;	/* pack has delta which is unusable */
-	else if (entry->delta)
-		to_reuse = 0;	/* we want to pack afresh */
-	else
-		to_reuse = 1;	/* we have it in-pack undeltified,
-				 * and we do not need to deltify it.
-				 */
-
-	if (!to_reuse)
+	if (!reuse_packed_object(entry, usable_delta))
 		len = write_no_reuse_object(f, entry, limit, usable_delta);
-	else
+	else {
+		/* the pack windows are shared with the write-ahead threads */
+		obj_read_lock();
 		len = write_reuse_object(f, entry, limit, usable_delta);
+		obj_read_unlock();
+	}
 	if (!len)
 		return 0;
 
@@ -509,6 +878,9 @@ static enum write_one_status write_one(struct sha1file *f,
 		return WRITE_ONE_SKIP;
 	}
 
+	/* no write-ahead thread may look at e while we change it */
+	wait_write_ahead(e);
+
 	/* if we are deltified, write out base object first. */
 	if (e->delta) {
 		e->idx.offset = 1; /* now recurse */
@@ -779,12 +1151,16 @@ static void write_pack_file(void)
 		}
 
 		nr_written = 0;
+		start_write_ahead(i);
 		for (; i < to_pack.nr_objects; i++) {
 			struct object_entry *e = write_order[i];
+			queue_write_ahead(write_order, i);
 			if (write_one(f, e, &offset) == WRITE_ONE_BREAK)
 				break;
+			release_write_ahead(i);
 			display_progress(progress_state, written);
 		}
+		stop_write_ahead();
 
 		/*
 		 * Did we write the wrong # entries in the header?
@@ -843,6 +1219,7 @@ static void write_pack_file(void)
 				stop_progress(&progress_state);
 
 				bitmap_writer_show_progress(progress);
+				bitmap_writer_set_threads(delta_search_threads);
 				bitmap_writer_reuse_bitmaps(&to_pack);
 				bitmap_writer_select_commits(indexed_commits, indexed_commits_nr, -1);
 				bitmap_writer_build(&to_pack);
@@ -1301,6 +1678,26 @@ static void cleanup_preferred_base(void)
 	done_pbase_paths_num = done_pbase_paths_alloc = 0;
 }
 
+/*
+ * Whether the data of entry in its pack is in a codec that the pack
+ * we write may carry.
+ */
+static int reusable_codec(struct packed_git *p, struct pack_window **w_curs,
+			  struct object_entry *entry)
+{
+	unsigned char *data;
+	unsigned long avail;
+	int codec;
+
+	if (reuse_any_codec)
+		return 1;
+	data = use_pack(p, w_curs,
+			entry->in_pack_offset + entry->in_pack_header_size,
+			&avail);
+	codec = object_codec_of(data, avail);
+	return codec == OBJECT_CODEC_ZLIB || codec == pack_codec;
+}
+
 static void check_object(struct object_entry *entry)
 {
 	if (entry->in_pack) {
@@ -1337,6 +1734,7 @@ static void check_object(struct object_entry *entry)
 			entry->in_pack_header_size = used;
 			if (entry->type < OBJ_COMMIT || entry->type > OBJ_BLOB)
 				goto give_up;
+			entry->foreign_codec = !reusable_codec(p, &w_curs, entry);
 			unuse_pack(&w_curs);
 			return;
 		case OBJ_REF_DELTA:
@@ -1368,21 +1766,29 @@ static void check_object(struct object_entry *entry)
 				goto give_up;
 			}
 			if (reuse_delta && !entry->preferred_base) {
-				struct revindex_entry *revidx;
-				revidx = find_pack_revindex(p, ofs);
+				struct pack_revindex *revidx;
+				uint32_t pos;
+				revidx = find_pack_revindex(p, ofs, &pos);
 				if (!revidx)
 					goto give_up;
-				base_ref = nth_packed_object_sha1(p, revidx->nr);
+				base_ref = nth_packed_object_sha1(p, revindex_nr(revidx, pos));
 			}
 			entry->in_pack_header_size = used + used_0;
 			break;
 		}
 
-		if (base_ref && (base_entry = packlist_find(&to_pack, base_ref, NULL))) {
+		if (!reusable_codec(p, &w_curs, entry)) {
+			entry->foreign_codec = 1;
+			base_ref = NULL;
+		}
+
+		if (base_ref && (base_entry = packlist_find(&to_pack, base_ref, NULL)) &&
+		    in_same_island(entry->idx.sha1, base_entry->idx.sha1)) {
 			/*
 			 * If base_ref was set above that means we wish to
 			 * reuse delta data, and we even found that base
-			 * in the list of objects we want to pack. Goodie!
+			 * in the list of objects we want to pack, in the
+			 * islands of this object. Goodie!
 			 *
 			 * Depth value does not matter - find_deltas() will
 			 * never consider reused delta as the base object to
@@ -1493,6 +1899,11 @@ static int type_size_sort(const void *_a, const void *_b)
 		return -1;
 	if (a->preferred_base < b->preferred_base)
 		return 1;
+	if (use_delta_islands) {
+		int island_cmp = island_delta_cmp(a->idx.sha1, b->idx.sha1);
+		if (island_cmp)
+			return island_cmp;
+	}
 	if (a->size > b->size)
 		return -1;
 	if (a->size < b->size)
@@ -1525,10 +1936,6 @@ static int delta_cacheable(unsigned long src_size, unsigned long trg_size,
 
 #ifndef NO_PTHREADS
 
-static pthread_mutex_t read_mutex;
-#define read_lock()		pthread_mutex_lock(&read_mutex)
-#define read_unlock()		pthread_mutex_unlock(&read_mutex)
-
 static pthread_mutex_t cache_mutex;
 #define cache_lock()		pthread_mutex_lock(&cache_mutex)
 #define cache_unlock()		pthread_mutex_unlock(&cache_mutex)
@@ -1539,8 +1946,6 @@ static pthread_mutex_t progress_mutex;
 
 #else
 
-#define read_lock()		(void)0
-#define read_unlock()		(void)0
 #define cache_lock()		(void)0
 #define cache_unlock()		(void)0
 #define progress_lock()		(void)0
@@ -1562,6 +1967,11 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 	if (trg_entry->type != src_entry->type)
 		return -1;
 
+	/* Nor against a base that some island of the target lacks */
+	if (use_delta_islands &&
+	    !in_same_island(trg_entry->idx.sha1, src_entry->idx.sha1))
+		return 0;
+
 	/*
 	 * We do not bother to try a delta that we discarded on an
 	 * earlier try, but only when reusing delta data.  Note that
@@ -1603,9 +2013,7 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 
 	/* Load data if not already done */
 	if (!trg->data) {
-		read_lock();
 		trg->data = read_sha1_file(trg_entry->idx.sha1, &type, &sz);
-		read_unlock();
 		if (!trg->data)
 			die("object %s cannot be read",
 			    sha1_to_hex(trg_entry->idx.sha1));
@@ -1615,9 +2023,7 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 		*mem_usage += sz;
 	}
 	if (!src->data) {
-		read_lock();
 		src->data = read_sha1_file(src_entry->idx.sha1, &type, &sz);
-		read_unlock();
 		if (!src->data) {
 			if (src_entry->preferred_base) {
 				static int warned = 0;
@@ -1856,15 +2262,6 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 
 #ifndef NO_PTHREADS
 
-static void try_to_free_from_threads(size_t size)
-{
-	read_lock();
-	release_pack_memory(size);
-	read_unlock();
-}
-
-static try_to_free_t old_try_to_free_routine;
-
 /*
  * The main thread waits on the condition that (at least) one of the workers
  * has stopped working (which is indicated in the .working member of
@@ -1895,18 +2292,16 @@ static pthread_cond_t progress_cond;
  */
 static void init_threaded_search(void)
 {
-	init_recursive_mutex(&read_mutex);
 	pthread_mutex_init(&cache_mutex, NULL);
 	pthread_mutex_init(&progress_mutex, NULL);
 	pthread_cond_init(&progress_cond, NULL);
-	old_try_to_free_routine = set_try_to_free_routine(try_to_free_from_threads);
+	enable_obj_read_lock();
 }
 
 static void cleanup_threaded_search(void)
 {
-	set_try_to_free_routine(old_try_to_free_routine);
+	disable_obj_read_lock();
 	pthread_cond_destroy(&progress_cond);
-	pthread_mutex_destroy(&read_mutex);
 	pthread_mutex_destroy(&cache_mutex);
 	pthread_mutex_destroy(&progress_mutex);
 }
@@ -2205,6 +2600,8 @@ static int git_pack_config(const char *k, const char *v, void *cb)
 		use_bitmap_index = git_config_bool(k, v);
 		return 0;
 	}
+	if (!strcmp(k, "pack.island"))
+		return island_config(k, v, cb);
 	if (!strcmp(k, "pack.threads")) {
 		delta_search_threads = git_config_int(k, v);
 		if (delta_search_threads < 0)
@@ -2223,6 +2620,13 @@ static int git_pack_config(const char *k, const char *v, void *cb)
 			    pack_idx_opts.version);
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		if (git_config_bool(k, v))
+			pack_idx_opts.flags |= WRITE_REV;
+		else
+			pack_idx_opts.flags &= ~WRITE_REV;
+		return 0;
+	}
 	return git_default_config(k, v, cb);
 }
 
@@ -2266,6 +2670,9 @@ static void show_commit(struct commit *commit, void *data)
 
 	if (write_bitmap_index)
 		index_commit_for_bitmap(commit);
+
+	if (use_delta_islands)
+		propagate_island_marks(commit);
 }
 
 static void show_object(struct object *obj,
@@ -2278,6 +2685,21 @@ static void show_object(struct object *obj,
 	add_object_entry(obj->sha1, obj->type, name, 0);
 	obj->flags |= OBJECT_ADDED;
 
+	if (use_delta_islands && obj->type == OBJ_TREE) {
+		struct object_entry *ent = packlist_find(&to_pack, obj->sha1, NULL);
+		const char *p;
+		unsigned int depth = 0;
+
+		if (*name) {
+			depth++;
+			for (p = name; *p; p++)
+				if (*p == '/')
+					depth++;
+		}
+		if (ent && depth > oe_tree_depth(&to_pack, ent))
+			oe_set_tree_depth(&to_pack, ent, depth);
+	}
+
 	/*
 	 * We will have generated the hash from the name,
 	 * but not saved a pointer to it - we can free it
@@ -2421,7 +2843,13 @@ static int get_object_list_from_bitmap(struct rev_info *revs)
 	if (prepare_bitmap_walk(revs) < 0)
 		return -1;
 
-	if (!reuse_partial_packfile_from_bitmap(
+	/*
+	 * Our packs may only be copied wholesale if the receiver can
+	 * read every codec that is in them.
+	 */
+	if ((reuse_any_codec || object_codec == OBJECT_CODEC_ZLIB ||
+	     object_codec == pack_codec) &&
+	    !reuse_partial_packfile_from_bitmap(
 			&reuse_packfile,
 			&reuse_packfile_objects,
 			&reuse_packfile_offset)) {
@@ -2470,6 +2898,9 @@ static void get_object_list(int ac, const char **av)
 	if (use_bitmap_index && !get_object_list_from_bitmap(&revs))
 		return;
 
+	if (use_delta_islands)
+		load_delta_islands(progress);
+
 	if (prepare_revision_walk(&revs))
 		die("revision walk setup failed");
 	mark_edges_uninteresting(&revs, show_edge);
@@ -2533,7 +2964,7 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	int use_internal_rev_list = 0;
 	int thin = 0;
 	int all_progress_implied = 0;
-	const char *rp_av[6];
+	const char *rp_av[7];
 	int rp_ac = 0;
 	int rev_list_unpacked = 0, rev_list_all = 0, rev_list_reflog = 0;
 	struct option pack_objects_options[] = {
@@ -2603,12 +3034,17 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 			 N_("use a bitmap index if available to speed up counting objects")),
 		OPT_BOOL(0, "write-bitmap-index", &write_bitmap_index,
 			 N_("write a bitmap index together with the pack index")),
+		OPT_BOOL(0, "delta-islands", &use_delta_islands,
+			 N_("respect islands during delta compression")),
+		OPT_STRING(0, "object-codec", &object_codec_arg, N_("codec"),
+			   N_("compress objects with <codec>, which the receiver reads")),
 		OPT_END(),
 	};
 
 	check_replace_refs = 0;
 
 	reset_pack_idx_option(&pack_idx_opts);
+	pack_idx_opts.flags |= WRITE_REV;
 	git_config(git_pack_config, NULL);
 	if (!pack_compression_seen && core_compression_seen)
 		pack_compression_level = core_compression_level;
@@ -2643,6 +3079,8 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 		use_internal_rev_list = 1;
 		rp_av[rp_ac++] = "--unpacked";
 	}
+	if (use_delta_islands)
+		rp_av[rp_ac++] = "--topo-order";
 
 	if (!reuse_object)
 		reuse_delta = 0;
@@ -2653,6 +3091,13 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 #ifdef NO_PTHREADS
 	if (delta_search_threads != 1)
 		warning("no threads support, ignoring --threads");
+#endif
+#ifndef NO_PTHREADS
+	write_threads = pack_write_threads;
+	if (!write_threads)	/* pack.writeThreads=0 means autodetect */
+		write_threads = online_cpus();
+#else
+	write_threads = 1;
 #endif
 	if (!pack_to_stdout && !pack_size_limit)
 		pack_size_limit = pack_size_limit_cfg;
@@ -2666,12 +3111,27 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	if (!pack_to_stdout && thin)
 		die("--thin cannot be used to build an indexable pack.");
 
+	if (object_codec_arg) {
+		int codec = object_codec_by_name(object_codec_arg);
+
+		if (codec < 0 || !object_codec_supported(codec))
+			die("unsupported object codec: %s", object_codec_arg);
+		pack_codec = codec;
+	} else if (!pack_to_stdout) {
+		pack_codec = object_codec;
+		reuse_any_codec = 1;
+	}
+
 	if (keep_unreachable && unpack_unreachable)
 		die("--keep-unreachable and --unpack-unreachable are incompatible.");
 
 	if (!use_internal_rev_list || !pack_to_stdout || is_repository_shallow())
 		use_bitmap_index = 0;
 
+	/* Islands are marked during the walk, which bitmaps skip */
+	if (use_delta_islands)
+		use_bitmap_index = 0;
+
 	if (pack_to_stdout || !rev_list_all)
 		write_bitmap_index = 0;
 
@@ -2693,6 +3153,9 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 		for_each_ref(add_ref_tag, NULL);
 	stop_progress(&progress_state);
 
+	if (use_delta_islands)
+		resolve_tree_islands(progress, &to_pack);
+
 	if (non_empty && !nr_result)
 		return 0;
 	if (nr_result)
@@ -37,6 +37,7 @@ static int unpack_limit = 100;
 static int report_status;
 static int use_sideband;
 static int quiet;
+static int use_atomic;
 static int prefer_ofs_delta = 1;
 static int auto_update_server_info;
 static int auto_gc = 1;
@@ -142,7 +143,7 @@ static void show_ref(const char *path, const unsigned char *sha1)
 	else
 		packet_write(1, "%s %s%c%s%s agent=%s\n",
 			     sha1_to_hex(sha1), path, 0,
-			     " report-status delete-refs side-band-64k quiet",
+			     " report-status delete-refs side-band-64k quiet atomic",
 			     prefer_ofs_delta ? " ofs-delta" : "",
 			     git_user_agent_sanitized());
 	sent_capabilities = 1;
@@ -468,14 +469,18 @@ static int update_shallow_ref(struct command *cmd, struct shallow_info *si)
 	return 0;
 }
 
-static const char *update(struct command *cmd, struct shallow_info *si)
+/*
+ * Check the command and queue its update in the transaction, to be
+ * committed by the caller.
+ */
+static const char *update(struct command *cmd, struct shallow_info *si,
+			  struct ref_transaction *transaction)
 {
 	const char *name = cmd->ref_name;
 	struct strbuf namespaced_name_buf = STRBUF_INIT;
 	const char *namespaced_name;
 	unsigned char *old_sha1 = cmd->old_sha1;
 	unsigned char *new_sha1 = cmd->new_sha1;
-	struct ref_lock *lock;
 
 	/* only refs/... are allowed */
 	if (!starts_with(name, "refs/") || check_refname_format(name + 5, 0)) {
@@ -569,10 +574,8 @@ static const char *update(struct command *cmd, struct shallow_info *si)
 				cmd->did_not_exist = 1;
 			}
 		}
-		if (delete_ref(namespaced_name, old_sha1, 0)) {
-			rp_error("failed to delete %s", name);
-			return "failed to delete";
-		}
+		ref_transaction_delete(transaction, namespaced_name,
+				       old_sha1, 0, old_sha1 != NULL);
 		return NULL; /* good */
 	}
 	else {
@@ -580,15 +583,8 @@ static const char *update(struct command *cmd, struct shallow_info *si)
 		    update_shallow_ref(cmd, si))
 			return "shallow error";
 
-		lock = lock_any_ref_for_update(namespaced_name, old_sha1,
-					       0, NULL);
-		if (!lock) {
-			rp_error("failed to lock %s", name);
-			return "failed to lock";
-		}
-		if (write_ref_sha1(lock, new_sha1, "push")) {
-			return "failed to write"; /* error() already called */
-		}
+		ref_transaction_update(transaction, namespaced_name,
+				       new_sha1, old_sha1, 0, 1);
 		return NULL; /* good */
 	}
 }
@@ -784,6 +780,7 @@ static void execute_commands(struct command *commands,
 	struct command *cmd;
 	unsigned char sha1[20];
 	struct iterate_data data;
+	struct ref_transaction *transaction = NULL;
 
 	if (unpacker_error) {
 		for (cmd = commands; cmd; cmd = cmd->next)
@@ -812,6 +809,8 @@ static void execute_commands(struct command *commands,
 	head_name = head_name_to_free = resolve_refdup("HEAD", sha1, 0, NULL);
 
 	checked_connectivity = 1;
+	if (use_atomic)
+		transaction = ref_transaction_begin();
 	for (cmd = commands; cmd; cmd = cmd->next) {
 		if (cmd->error_string)
 			continue;
@@ -819,13 +818,44 @@ static void execute_commands(struct command *commands,
 		if (cmd->skip_update)
 			continue;
 
-		cmd->error_string = update(cmd, si);
+		if (!use_atomic)
+			transaction = ref_transaction_begin();
+		cmd->error_string = update(cmd, si, transaction);
 		if (shallow_update && !cmd->error_string &&
 		    si->shallow_ref[cmd->index]) {
 			error("BUG: connectivity check has not been run on ref %s",
 			      cmd->ref_name);
 			checked_connectivity = 0;
 		}
+		if (use_atomic) {
+			if (cmd->error_string)
+				break;
+			continue;
+		}
+		if (!cmd->error_string &&
+		    ref_transaction_commit(transaction, "push", MSG_ON_ERR)) {
+			rp_error("failed to update %s", cmd->ref_name);
+			cmd->error_string = "failed to update ref";
+		}
+		ref_transaction_free(transaction);
+	}
+
+	if (use_atomic) {
+		const char *error_string = NULL;
+
+		for (cmd = commands; cmd; cmd = cmd->next)
+			if (cmd->error_string)
+				error_string = "atomic push failure";
+		if (!error_string &&
+		    ref_transaction_commit(transaction, "push", MSG_ON_ERR)) {
+			rp_error("failed to update refs atomically");
+			error_string = "atomic transaction failed";
+		}
+		if (error_string)
+			for (cmd = commands; cmd; cmd = cmd->next)
+				if (!cmd->error_string)
+					cmd->error_string = error_string;
+		ref_transaction_free(transaction);
 	}
 
 	if (shallow_update) {
@@ -878,6 +908,8 @@ static struct command *read_head_info(struct sha1_array *shallow)
 				use_sideband = LARGE_PACKET_MAX;
 			if (parse_feature_request(feature_list, "quiet"))
 				quiet = 1;
+			if (parse_feature_request(feature_list, "atomic"))
+				use_atomic = 1;
 		}
 		cmd = xcalloc(1, sizeof(struct command) + len - 80);
 		hashcpy(cmd->old_sha1, old_sha1);
@@ -1,6 +1,7 @@
 #include "builtin.h"
 #include "cache.h"
 #include "dir.h"
+#include "midx.h"
 #include "parse-options.h"
 #include "run-command.h"
 #include "sigchain.h"
@@ -10,6 +11,8 @@
 
 static int delta_base_offset = 1;
 static int pack_kept_objects = -1;
+static int write_midx = -1;
+static int use_delta_islands;
 static char *packdir, *packtmp;
 
 static const char *const git_repack_usage[] = {
@@ -27,6 +30,14 @@ static int repack_config(const char *var, const char *value, void *cb)
 		pack_kept_objects = git_config_bool(var, value);
 		return 0;
 	}
+	if (!strcmp(var, "repack.writemultipackindex")) {
+		write_midx = git_config_bool(var, value);
+		return 0;
+	}
+	if (!strcmp(var, "repack.usedeltaislands")) {
+		use_delta_islands = git_config_bool(var, value);
+		return 0;
+	}
 	return git_default_config(var, value, cb);
 }
 
@@ -99,7 +110,7 @@ static void get_non_kept_pack_filenames(struct string_list *fname_list)
 
 static void remove_redundant_pack(const char *dir_name, const char *base_name)
 {
-	const char *exts[] = {".pack", ".idx", ".keep", ".bitmap"};
+	const char *exts[] = {".pack", ".idx", ".keep", ".bitmap", ".rev"};
 	int i;
 	struct strbuf buf = STRBUF_INIT;
 	size_t plen;
@@ -127,6 +138,7 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		{".pack"},
 		{".idx"},
 		{".bitmap", 1},
+		{".rev", 1},
 	};
 	struct child_process cmd;
 	struct string_list_item *item;
@@ -182,6 +194,10 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 				N_("maximum size of each packfile")),
 		OPT_BOOL(0, "pack-kept-objects", &pack_kept_objects,
 				N_("repack objects in packs marked with .keep")),
+		OPT_BOOL(0, "write-midx", &write_midx,
+				N_("write a multi-pack index of the resulting packs")),
+		OPT_BOOL('i', "delta-islands", &use_delta_islands,
+				N_("pass --delta-islands to git-pack-objects")),
 		OPT_END()
 	};
 
@@ -220,6 +236,8 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	if (write_bitmap >= 0)
 		argv_array_pushf(&cmd_args, "--%swrite-bitmap-index",
 				 write_bitmap ? "" : "no-");
+	if (use_delta_islands)
+		argv_array_push(&cmd_args, "--delta-islands");
 
 	if (pack_everything & ALL_INTO_ONE) {
 		get_non_kept_pack_filenames(&existing_packs);
@@ -396,6 +414,17 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		argv_array_clear(&cmd_args);
 	}
 
+	/*
+	 * An existing multi-pack index is kept up to date even when we
+	 * were not asked to write one, as otherwise it would keep
+	 * pointing at the packs we just removed.
+	 */
+	if (write_midx < 0)
+		write_midx = file_exists(mkpath("%s/multi-pack-index", packdir));
+	if (write_midx && write_midx_file(get_object_directory(),
+					  !quiet && isatty(2)))
+		warning(_("failed to write multi-pack-index"));
+
 	if (!no_update_server_info) {
 		argv_array_push(&cmd_args, "update-server-info");
 		memset(&cmd, 0, sizeof(cmd));
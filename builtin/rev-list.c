@@ -38,6 +38,7 @@ static const char rev_list_usage[] =
 "    --children\n"
 "    --objects | --objects-edge\n"
 "    --unpacked\n"
+"    --disk-usage\n"
 "    --header | --pretty\n"
 "    --abbrev=<n> | --no-abbrev\n"
 "    --abbrev-commit\n"
@@ -48,13 +49,30 @@ static const char rev_list_usage[] =
 "    --bisect-all"
 ;
 
+static int show_disk_usage;
+static off_t total_disk_usage;
+
+static off_t get_object_disk_usage(struct object *obj)
+{
+	struct object_info oi = {NULL};
+	unsigned long size;
+
+	oi.disk_sizep = &size;
+	if (sha1_object_info_extended(obj->sha1, &oi, 0) < 0)
+		die("unable to get disk usage of %s", sha1_to_hex(obj->sha1));
+	return size;
+}
+
 static void finish_commit(struct commit *commit, void *data);
 static void show_commit(struct commit *commit, void *data)
 {
 	struct rev_list_info *info = data;
 	struct rev_info *revs = info->revs;
 
-	if (info->flags & REV_LIST_QUIET) {
+	if (show_disk_usage)
+		total_disk_usage += get_object_disk_usage(&commit->object);
+
+	if (info->flags & REV_LIST_QUIET || show_disk_usage) {
 		finish_commit(commit, data);
 		return;
 	}
@@ -194,8 +212,21 @@ static void show_object(struct object *obj,
 {
 	struct rev_list_info *info = cb_data;
 	finish_object(obj, path, component, cb_data);
+	if (show_disk_usage) {
+		total_disk_usage += get_object_disk_usage(obj);
+		return;
+	}
 	if (info->flags & REV_LIST_QUIET)
 		return;
+	if (info->revs->count) {
+		/*
+		 * Non-commit objects are only counted by a count that does
+		 * not ask for --left-right or --cherry-mark; see
+		 * cmd_rev_list().
+		 */
+		info->revs->count_right++;
+		return;
+	}
 	show_object_with_name(stdout, obj, path, component);
 }
 
@@ -321,6 +352,11 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 			bisect_show_vars = 1;
 			continue;
 		}
+		if (!strcmp(arg, "--disk-usage")) {
+			show_disk_usage = 1;
+			info.flags |= REV_LIST_QUIET;
+			continue;
+		}
 		if (!strcmp(arg, "--use-bitmap-index")) {
 			use_bitmap_index = 1;
 			continue;
@@ -356,16 +392,34 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 	if (bisect_list)
 		revs.limited = 1;
 
+	if (revs.count &&
+	    (revs.tag_objects || revs.tree_objects || revs.blob_objects) &&
+	    (revs.left_right || revs.cherry_mark))
+		die(_("marked counting is incompatible with --objects"));
+	if (revs.count && show_disk_usage)
+		die(_("--count cannot be used with --disk-usage"));
+
 	if (use_bitmap_index) {
-		if (revs.count && !revs.left_right && !revs.cherry_mark) {
-			uint32_t commit_count;
+		if (show_disk_usage) {
 			if (!prepare_bitmap_walk(&revs)) {
-				count_bitmap_commit_list(&commit_count, NULL, NULL, NULL);
-				printf("%d\n", commit_count);
+				printf("%"PRIuMAX"\n",
+				       (uintmax_t)get_disk_usage_from_bitmap(&revs));
+				return 0;
+			}
+		} else if (revs.count && !revs.left_right && !revs.cherry_mark) {
+			uint32_t commit_count = 0, tag_count = 0, tree_count = 0, blob_count = 0;
+			if (!prepare_bitmap_walk(&revs)) {
+				count_bitmap_commit_list(&commit_count,
+							 revs.tree_objects ? &tree_count : NULL,
+							 revs.blob_objects ? &blob_count : NULL,
+							 revs.tag_objects ? &tag_count : NULL);
+				printf("%d\n", commit_count + tree_count + blob_count + tag_count);
 				return 0;
 			}
 		} else if (revs.tag_objects && revs.tree_objects && revs.blob_objects) {
 			if (!prepare_bitmap_walk(&revs)) {
+				if (info.flags & REV_LIST_QUIET)
+					return 0;
 				traverse_bitmap_commit_list(&show_object_fast);
 				return 0;
 			}
@@ -400,5 +454,8 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 			printf("%d\n", revs.count_left + revs.count_right);
 	}
 
+	if (show_disk_usage)
+		printf("%"PRIuMAX"\n", (uintmax_t)total_disk_usage);
+
 	return 0;
 }
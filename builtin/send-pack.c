@@ -13,7 +13,7 @@
 #include "sha1-array.h"
 
 static const char send_pack_usage[] =
-"git send-pack [--all | --mirror] [--dry-run] [--force] [--receive-pack=<git-receive-pack>] [--verbose] [--thin] [<host>:]<directory> [<ref>...]\n"
+"git send-pack [--all | --mirror] [--dry-run] [--force] [--atomic] [--receive-pack=<git-receive-pack>] [--verbose] [--thin] [<host>:]<directory> [<ref>...]\n"
 "  --all and explicit <ref> specification are mutually exclusive.";
 
 static struct send_pack_args args;
@@ -71,6 +71,11 @@ static void print_helper_status(struct ref *ref)
 			res = "error";
 			break;
 
+		case REF_STATUS_ATOMIC_PUSH_FAILED:
+			res = "error";
+			msg = "atomic push failed";
+			break;
+
 		case REF_STATUS_EXPECTING_REPORT:
 		default:
 			continue;
@@ -145,6 +150,10 @@ int cmd_send_pack(int argc, const char **argv, const char *prefix)
 				args.force_update = 1;
 				continue;
 			}
+			if (!strcmp(arg, "--atomic")) {
+				args.atomic = 1;
+				continue;
+			}
 			if (!strcmp(arg, "--quiet")) {
 				args.quiet = 1;
 				continue;
@@ -17,6 +17,7 @@
 #include "gpg-interface.h"
 #include "sha1-array.h"
 #include "column.h"
+#include "commit-graph.h"
 
 static const char * const git_tag_usage[] = {
 	N_("git tag [-a|-s|-u <key-id>] [-f] [-m <msg>|-F <file>] <tagname> [<head>]"),
@@ -74,7 +75,8 @@ static int in_commit_list(const struct commit_list *want, struct commit *c)
 }
 
 static int contains_recurse(struct commit *candidate,
-			    const struct commit_list *want)
+			    const struct commit_list *want,
+			    uint32_t cutoff)
 {
 	struct commit_list *p;
 
@@ -91,9 +93,15 @@ static int contains_recurse(struct commit *candidate,
 	if (parse_commit(candidate) < 0)
 		return 0;
 
+	/* or too far down the history to reach any of them? */
+	if (commit_generation(candidate) < cutoff) {
+		candidate->object.flags |= UNINTERESTING;
+		return 0;
+	}
+
 	/* Otherwise recurse and mark ourselves for future traversals. */
 	for (p = candidate->parents; p; p = p->next) {
-		if (contains_recurse(p->item, want)) {
+		if (contains_recurse(p->item, want, cutoff)) {
 			candidate->object.flags |= TMP_MARK;
 			return 1;
 		}
@@ -104,7 +112,25 @@ static int contains_recurse(struct commit *candidate,
 
 static int contains(struct commit *candidate, const struct commit_list *want)
 {
-	return contains_recurse(candidate, want);
+	static uint32_t cutoff = GENERATION_NUMBER_INFINITY;
+
+	/*
+	 * A commit can only contain the wanted ones if its generation is
+	 * at least that of the lowest of them.
+	 */
+	if (cutoff == GENERATION_NUMBER_INFINITY) {
+		const struct commit_list *p;
+
+		for (p = want; p; p = p->next) {
+			if (parse_commit(p->item) < 0) {
+				cutoff = GENERATION_NUMBER_UNKNOWN;
+				break;
+			}
+			if (p->item->generation < cutoff)
+				cutoff = p->item->generation;
+		}
+	}
+	return contains_recurse(candidate, want, cutoff);
 }
 
 static void show_tag_lines(const unsigned char *sha1, int lines)
@@ -186,6 +212,8 @@ static int list_tags(const char **patterns, int lines,
 	filter.lines = lines;
 	filter.with_commit = with_commit;
 
+	/* the tag lines are read on their own; only walk the history */
+	save_commit_buffer = 0;
 	for_each_tag_ref(show_reference, (void *) &filter);
 
 	return 0;
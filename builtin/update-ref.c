@@ -12,54 +12,35 @@ static const char * const git_update_ref_usage[] = {
 	NULL
 };
 
-static int updates_alloc;
-static int updates_count;
-static const struct ref_update **updates;
+static struct ref_transaction *transaction;
 
 static char line_termination = '\n';
 static int update_flags;
 
-static struct ref_update *update_alloc(void)
-{
-	struct ref_update *update;
-
-	/* Allocate and zero-init a struct ref_update */
-	update = xcalloc(1, sizeof(*update));
-	ALLOC_GROW(updates, updates_count + 1, updates_alloc);
-	updates[updates_count++] = update;
-
-	/* Store and reset accumulated options */
-	update->flags = update_flags;
-	update_flags = 0;
-
-	return update;
-}
-
-static void update_store_ref_name(struct ref_update *update,
-				  const char *ref_name)
+static void check_ref_name(const char *ref_name)
 {
 	if (check_refname_format(ref_name, REFNAME_ALLOW_ONELEVEL))
 		die("invalid ref format: %s", ref_name);
-	update->ref_name = xstrdup(ref_name);
 }
 
-static void update_store_new_sha1(struct ref_update *update,
-				  const char *newvalue)
+static void parse_new_sha1(const char *ref_name, const char *newvalue,
+			   unsigned char *new_sha1)
 {
-	if (*newvalue && get_sha1(newvalue, update->new_sha1))
-		die("invalid new value for ref %s: %s",
-		    update->ref_name, newvalue);
+	hashclr(new_sha1);
+	if (*newvalue && get_sha1(newvalue, new_sha1))
+		die("invalid new value for ref %s: %s", ref_name, newvalue);
 }
 
-static void update_store_old_sha1(struct ref_update *update,
-				  const char *oldvalue)
+/* Returns whether there is an old value to check */
+static int parse_old_sha1(const char *ref_name, const char *oldvalue,
+			  unsigned char *old_sha1)
 {
-	if (*oldvalue && get_sha1(oldvalue, update->old_sha1))
-		die("invalid old value for ref %s: %s",
-		    update->ref_name, oldvalue);
+	hashclr(old_sha1);
+	if (*oldvalue && get_sha1(oldvalue, old_sha1))
+		die("invalid old value for ref %s: %s", ref_name, oldvalue);
 
 	/* We have an old value if non-empty, or if empty without -z */
-	update->have_old = *oldvalue || line_termination;
+	return *oldvalue || line_termination;
 }
 
 static const char *parse_arg(const char *next, struct strbuf *arg)
@@ -117,98 +98,118 @@ static void parse_cmd_update(const char *next)
 	struct strbuf ref = STRBUF_INIT;
 	struct strbuf newvalue = STRBUF_INIT;
 	struct strbuf oldvalue = STRBUF_INIT;
-	struct ref_update *update;
-
-	update = update_alloc();
+	unsigned char new_sha1[20], old_sha1[20];
+	int have_old = 0;
 
 	if ((next = parse_first_arg(next, &ref)) != NULL && ref.buf[0])
-		update_store_ref_name(update, ref.buf);
+		check_ref_name(ref.buf);
 	else
 		die("update line missing <ref>");
 
 	if ((next = parse_next_arg(next, &newvalue)) != NULL)
-		update_store_new_sha1(update, newvalue.buf);
+		parse_new_sha1(ref.buf, newvalue.buf, new_sha1);
 	else
 		die("update %s missing <newvalue>", ref.buf);
 
 	if ((next = parse_next_arg(next, &oldvalue)) != NULL)
-		update_store_old_sha1(update, oldvalue.buf);
+		have_old = parse_old_sha1(ref.buf, oldvalue.buf, old_sha1);
 	else if(!line_termination)
 		die("update %s missing [<oldvalue>] NUL", ref.buf);
 
 	if (next && *next)
 		die("update %s has extra input: %s", ref.buf, next);
+
+	ref_transaction_update(transaction, ref.buf, new_sha1, old_sha1,
+			       update_flags, have_old);
+	update_flags = 0;
+	strbuf_release(&ref);
+	strbuf_release(&newvalue);
+	strbuf_release(&oldvalue);
 }
 
 static void parse_cmd_create(const char *next)
 {
 	struct strbuf ref = STRBUF_INIT;
 	struct strbuf newvalue = STRBUF_INIT;
-	struct ref_update *update;
-
-	update = update_alloc();
+	unsigned char new_sha1[20];
 
 	if ((next = parse_first_arg(next, &ref)) != NULL && ref.buf[0])
-		update_store_ref_name(update, ref.buf);
+		check_ref_name(ref.buf);
 	else
 		die("create line missing <ref>");
 
 	if ((next = parse_next_arg(next, &newvalue)) != NULL)
-		update_store_new_sha1(update, newvalue.buf);
+		parse_new_sha1(ref.buf, newvalue.buf, new_sha1);
 	else
 		die("create %s missing <newvalue>", ref.buf);
-	if (is_null_sha1(update->new_sha1))
+	if (is_null_sha1(new_sha1))
 		die("create %s given zero new value", ref.buf);
 
 	if (next && *next)
 		die("create %s has extra input: %s", ref.buf, next);
+
+	ref_transaction_create(transaction, ref.buf, new_sha1, update_flags);
+	update_flags = 0;
+	strbuf_release(&ref);
+	strbuf_release(&newvalue);
 }
 
 static void parse_cmd_delete(const char *next)
 {
 	struct strbuf ref = STRBUF_INIT;
 	struct strbuf oldvalue = STRBUF_INIT;
-	struct ref_update *update;
-
-	update = update_alloc();
+	unsigned char old_sha1[20];
+	int have_old = 0;
 
 	if ((next = parse_first_arg(next, &ref)) != NULL && ref.buf[0])
-		update_store_ref_name(update, ref.buf);
+		check_ref_name(ref.buf);
 	else
 		die("delete line missing <ref>");
 
 	if ((next = parse_next_arg(next, &oldvalue)) != NULL)
-		update_store_old_sha1(update, oldvalue.buf);
+		have_old = parse_old_sha1(ref.buf, oldvalue.buf, old_sha1);
 	else if(!line_termination)
 		die("delete %s missing [<oldvalue>] NUL", ref.buf);
-	if (update->have_old && is_null_sha1(update->old_sha1))
+	if (have_old && is_null_sha1(old_sha1))
 		die("delete %s given zero old value", ref.buf);
 
 	if (next && *next)
 		die("delete %s has extra input: %s", ref.buf, next);
+
+	ref_transaction_delete(transaction, ref.buf, old_sha1, update_flags,
+			       have_old);
+	update_flags = 0;
+	strbuf_release(&ref);
+	strbuf_release(&oldvalue);
 }
 
 static void parse_cmd_verify(const char *next)
 {
 	struct strbuf ref = STRBUF_INIT;
 	struct strbuf value = STRBUF_INIT;
-	struct ref_update *update;
-
-	update = update_alloc();
+	unsigned char sha1[20];
+	int have_old = 1; /* a missing value means the ref must not exist */
 
+	hashclr(sha1);
 	if ((next = parse_first_arg(next, &ref)) != NULL && ref.buf[0])
-		update_store_ref_name(update, ref.buf);
+		check_ref_name(ref.buf);
 	else
 		die("verify line missing <ref>");
 
-	if ((next = parse_next_arg(next, &value)) != NULL) {
-		update_store_old_sha1(update, value.buf);
-		update_store_new_sha1(update, value.buf);
-	} else if(!line_termination)
+	if ((next = parse_next_arg(next, &value)) != NULL)
+		have_old = parse_old_sha1(ref.buf, value.buf, sha1);
+	else if(!line_termination)
 		die("verify %s missing [<oldvalue>] NUL", ref.buf);
 
 	if (next && *next)
 		die("verify %s has extra input: %s", ref.buf, next);
+
+	/* checked while locking, and left as it is */
+	ref_transaction_update(transaction, ref.buf, sha1, sha1,
+			       update_flags, have_old);
+	update_flags = 0;
+	strbuf_release(&ref);
+	strbuf_release(&value);
 }
 
 static void parse_cmd_option(const char *next)
@@ -250,6 +251,7 @@ int cmd_update_ref(int argc, const char **argv, const char *prefix)
 	const char *refname, *oldval, *msg = NULL;
 	unsigned char sha1[20], oldsha1[20];
 	int delete = 0, no_deref = 0, read_stdin = 0, end_null = 0, flags = 0;
+	int ret;
 	struct option options[] = {
 		OPT_STRING( 'm', NULL, &msg, N_("reason"), N_("reason of the update")),
 		OPT_BOOL('d', NULL, &delete, N_("delete the reference")),
@@ -271,8 +273,11 @@ int cmd_update_ref(int argc, const char **argv, const char *prefix)
 			usage_with_options(git_update_ref_usage, options);
 		if (end_null)
 			line_termination = '\0';
+		transaction = ref_transaction_begin();
 		update_refs_stdin();
-		return update_refs(msg, updates, updates_count, DIE_ON_ERR);
+		ret = ref_transaction_commit(transaction, msg, DIE_ON_ERR);
+		ref_transaction_free(transaction);
+		return ret;
 	}
 
 	if (end_null)
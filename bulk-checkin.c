@@ -5,6 +5,8 @@
 #include "csum-file.h"
 #include "pack.h"
 #include "strbuf.h"
+#include "thread-utils.h"
+#include "parallel-deflate.h"
 
 static int pack_compression_level = Z_DEFAULT_COMPRESSION;
 
@@ -77,6 +79,87 @@ static int already_written(struct bulk_checkin_state *state, unsigned char sha1[
 	return 0;
 }
 
+static int bulk_checkin_threads(void)
+{
+#ifndef NO_PTHREADS
+	if (!pack_write_threads)
+		return online_cpus();
+	return pack_write_threads;
+#else
+	return 1;
+#endif
+}
+
+struct stream_data {
+	struct bulk_checkin_state *state;
+	git_SHA_CTX *ctx;
+	off_t *already_hashed_to;
+	off_t offset;
+	int fd;
+	const char *path;
+};
+
+static void read_to_deflate(void *data, void *buf, size_t len)
+{
+	struct stream_data *sd = data;
+
+	if (read_in_full(sd->fd, buf, len) != (ssize_t)len)
+		die("failed to read %d bytes from '%s'", (int)len, sd->path);
+	sd->offset += len;
+	if (*sd->already_hashed_to < sd->offset) {
+		size_t hsize = sd->offset - *sd->already_hashed_to;
+		if (len < hsize)
+			hsize = len;
+		if (hsize)
+			git_SHA1_Update(sd->ctx, (char *)buf + len - hsize, hsize);
+		*sd->already_hashed_to = sd->offset;
+	}
+}
+
+static int write_deflated(void *data, const void *buf, size_t len)
+{
+	struct bulk_checkin_state *state = ((struct stream_data *)data)->state;
+
+	/* would we bust the size limit? */
+	if (state->nr_written &&
+	    pack_size_limit_cfg &&
+	    pack_size_limit_cfg < state->offset + len)
+		return -1;
+
+	sha1write(state->f, buf, len);
+	state->offset += len;
+	return 0;
+}
+
+/*
+ * Like stream_to_pack() below, but deflating on several threads while
+ * this one reads ahead and writes out what they compressed.
+ */
+static int stream_to_pack_threaded(struct bulk_checkin_state *state,
+				   git_SHA_CTX *ctx, off_t *already_hashed_to,
+				   int fd, size_t size, enum object_type type,
+				   const char *path, int nr_threads)
+{
+	struct stream_data sd;
+	unsigned char hdr[10];
+	unsigned hdrlen;
+	int ret;
+
+	sd.state = state;
+	sd.ctx = ctx;
+	sd.already_hashed_to = already_hashed_to;
+	sd.offset = 0;
+	sd.fd = fd;
+	sd.path = path;
+
+	hdrlen = encode_in_pack_object_header(type, size, hdr);
+	ret = write_deflated(&sd, hdr, hdrlen);
+	if (!ret)
+		ret = parallel_deflate(pack_compression_level, nr_threads, size,
+				       read_to_deflate, write_deflated, &sd);
+	return ret;
+}
+
 /*
  * Read the contents from fd for size bytes, streaming it to the
  * packfile in state while updating the hash in ctx. Signal a failure
@@ -103,9 +186,15 @@ static int stream_to_pack(struct bulk_checkin_state *state,
 	int status = Z_OK;
 	int write_object = (flags & HASH_WRITE_OBJECT);
 	off_t offset = 0;
+	int nr_threads = bulk_checkin_threads();
+
+	/* parallel_deflate() writes zlib only */
+	if (write_object && nr_threads > 1 && object_codec == OBJECT_CODEC_ZLIB)
+		return stream_to_pack_threaded(state, ctx, already_hashed_to,
+					       fd, size, type, path, nr_threads);
 
 	memset(&s, 0, sizeof(s));
-	git_deflate_init(&s, pack_compression_level);
+	git_deflate_init_codec(&s, pack_compression_level, object_codec);
 
 	hdrlen = encode_in_pack_object_header(type, size, obuf);
 	s.next_out = obuf + hdrlen;
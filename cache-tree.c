@@ -284,6 +284,15 @@ static int update_one(struct cache_tree *it,
 		sub = find_subtree(it, path + baselen, sublen, 1);
 		if (!sub->cache_tree)
 			sub->cache_tree = cache_tree();
+		if (S_ISSPARSEDIR(ce->ce_mode) && !slash[1]) {
+			/* a directory of a sparse index is its tree */
+			sub->cache_tree->entry_count = 1;
+			hashcpy(sub->cache_tree->sha1, ce->sha1);
+			i++;
+			sub->count = 1;
+			sub->used = 1;
+			continue;
+		}
 		subcnt = update_one(sub->cache_tree,
 				    cache + i, entries - i,
 				    path,
@@ -541,7 +550,7 @@ struct cache_tree *cache_tree_read(const char *buffer, unsigned long size)
 	return read_one(&buffer, &size);
 }
 
-static struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
+struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
 {
 	if (!it)
 		return NULL;
@@ -17,6 +17,17 @@
 #endif
 
 #include <zlib.h>
+
+/*
+ * The compression of object data, in loose objects and pack entries.
+ * Readers tell the codecs apart by the first bytes of the data; which
+ * one new objects are written with is up to extensions.objectCodec.
+ */
+enum object_codec {
+	OBJECT_CODEC_ZLIB = 0,
+	OBJECT_CODEC_ZSTD
+};
+
 typedef struct git_zstream {
 	z_stream z;
 	unsigned long avail_in;
@@ -25,8 +36,18 @@ typedef struct git_zstream {
 	unsigned long total_out;
 	unsigned char *next_in;
 	unsigned char *next_out;
+	enum object_codec codec;
+	unsigned detect_codec:1;
+	unsigned codec_peeked:1;
+	unsigned codec_stream_end:1;
+	void *codec_stream;	/* the state of a codec other than zlib */
 } git_zstream;
 
+int object_codec_by_name(const char *name);
+const char *object_codec_name(enum object_codec codec);
+int object_codec_supported(enum object_codec codec);
+int object_codec_of(const unsigned char *buf, unsigned long len);
+
 void git_inflate_init(git_zstream *);
 void git_inflate_init_gzip_only(git_zstream *);
 void git_inflate_end(git_zstream *);
@@ -35,6 +56,7 @@ int git_inflate(git_zstream *, int flush);
 void git_deflate_init(git_zstream *, int level);
 void git_deflate_init_gzip(git_zstream *, int level);
 void git_deflate_init_raw(git_zstream *, int level);
+void git_deflate_init_codec(git_zstream *, int level, enum object_codec);
 void git_deflate_end(git_zstream *);
 int git_deflate_abort(git_zstream *);
 int git_deflate_end_gently(git_zstream *);
@@ -74,6 +96,13 @@ unsigned long git_deflate_bound(git_zstream *, unsigned long);
 #define S_IFGITLINK	0160000
 #define S_ISGITLINK(m)	(((m) & S_IFMT) == S_IFGITLINK)
 
+/*
+ * A sparse index stores a directory that is wholly outside of the
+ * sparse checkout as one entry, with the mode of a tree and a name
+ * ending with '/'.
+ */
+#define S_ISSPARSEDIR(m)	((m) == S_IFDIR)
+
 /*
  * Intensive research over the course of many years has shown that
  * port 9418 is totally unused by anything else. Or
@@ -159,6 +188,7 @@ struct cache_entry {
 #define CE_ADDED             (1 << 19)
 
 #define CE_HASHED            (1 << 20)
+#define CE_FSMONITOR_VALID   (1 << 21)
 #define CE_WT_REMOVE         (1 << 22) /* remove in work directory */
 #define CE_CONFLICTED        (1 << 23)
 
@@ -274,9 +304,17 @@ struct index_state {
 	unsigned int cache_nr, cache_alloc, cache_changed;
 	struct string_list *resolve_undo;
 	struct cache_tree *cache_tree;
+	struct untracked_cache *untracked;
+	uint64_t fsmonitor_last_update;
+	struct ewah_bitmap *fsmonitor_dirty;
+	struct split_index *split_index;
+	/* the sparse-checkout patterns the skip-worktree bits follow */
+	unsigned char sparse_checkout_sha1[20];
 	struct cache_time timestamp;
 	unsigned name_hash_initialized : 1,
-		 initialized : 1;
+		 initialized : 1,
+		 fsmonitor_trusted : 1,
+		 sparse_index : 1;
 	struct hashmap name_hash;
 	struct hashmap dir_hash;
 };
@@ -581,6 +619,7 @@ extern size_t packed_git_limit;
 extern size_t delta_base_cache_limit;
 extern unsigned long big_file_threshold;
 extern unsigned long pack_size_limit_cfg;
+extern int pack_write_threads;
 
 /*
  * Do replace refs need to be checked this run?  This variable is
@@ -594,7 +633,14 @@ extern int check_replace_refs;
 
 extern int fsync_object_files;
 extern int core_preload_index;
+extern int core_commit_graph;
+extern int core_multi_pack_index;
+extern int core_untracked_cache;
+extern int core_split_index;
+extern int split_index_max_percent_change;
 extern int core_apply_sparse_checkout;
+extern int core_sparse_checkout_cone;
+extern int command_requires_full_index;
 extern int precomposed_unicode;
 
 /*
@@ -639,11 +685,22 @@ enum object_creation_mode {
 
 extern enum object_creation_mode object_creation_mode;
 
+enum ref_storage {
+	REF_STORAGE_FILES = 0,
+	REF_STORAGE_REFTABLE
+};
+
+extern enum ref_storage ref_storage;
+
+/* what new objects are compressed with, by extensions.objectCodec */
+extern enum object_codec object_codec;
+
 extern char *notes_ref_name;
 
 extern int grafts_replace_parents;
 
 #define GIT_REPO_VERSION 0
+#define GIT_REPO_VERSION_READ 1
 extern int repository_format_version;
 extern int check_repository_format(void);
 
@@ -845,6 +902,18 @@ static inline const unsigned char *lookup_replace_object_extended(const unsigned
 	return lookup_replace_object(sha1);
 }
 
+/*
+ * Reading objects is not thread-safe unless the object read lock is
+ * enabled, which threaded callers do while their threads run.  The
+ * functions reading objects then take the lock themselves; other code
+ * using the object store behind their back (e.g. open_istream()) must
+ * hold it with obj_read_lock() while it is enabled.
+ */
+extern void enable_obj_read_lock(void);
+extern void disable_obj_read_lock(void);
+extern void obj_read_lock(void);
+extern void obj_read_unlock(void);
+
 /* Read and unpack a sha1 file into memory, write memory to a sha1 file */
 extern int sha1_object_info(const unsigned char *, unsigned long *);
 extern int hash_sha1_file(const void *buf, unsigned long len, const char *type, unsigned char *sha1);
@@ -1115,7 +1184,8 @@ extern struct packed_git {
 	int pack_fd;
 	unsigned pack_local:1,
 		 pack_keep:1,
-		 do_not_close:1;
+		 do_not_close:1,
+		 multi_pack_index:1;
 	unsigned char sha1[20];
 	/* something like ".git/objects/pack/xxxxx.pack" */
 	char pack_name[FLEX_ARRAY]; /* more */
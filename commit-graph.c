@@ -0,0 +1,771 @@
+#include "cache.h"
+#include "commit.h"
+#include "commit-graph.h"
+#include "tag.h"
+#include "refs.h"
+#include "csum-file.h"
+#include "progress.h"
+#include "sha1-lookup.h"
+
+#define GRAPH_SIGNATURE 0x43475048 /* "CGPH" */
+#define GRAPH_VERSION 1
+#define GRAPH_HASH_VERSION 1 /* SHA-1 */
+
+#define GRAPH_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define GRAPH_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define GRAPH_CHUNKID_DATA 0x43444154 /* "CDAT" */
+#define GRAPH_CHUNKID_EXTRAEDGES 0x45444745 /* "EDGE" */
+
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_CHUNKLOOKUP_WIDTH 12
+#define GRAPH_FANOUT_SIZE (4 * 256)
+#define GRAPH_DATA_WIDTH (20 + 16)
+
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_OCTOPUS_EDGES_NEEDED 0x80000000
+#define GRAPH_EDGE_LAST_MASK 0x7fffffff
+#define GRAPH_LAST_EDGE 0x80000000
+
+/* Used while collecting the commits to write; cleared afterwards. */
+#define GRAPH_SEEN (1u<<23)
+
+struct commit_graph {
+	unsigned char *data;
+	size_t data_len;
+
+	uint32_t num_commits;
+
+	const unsigned char *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_commit_data;
+	const unsigned char *chunk_extra_edges;
+	size_t extra_edges_len;
+};
+
+static struct commit_graph *commit_graph;
+static int commit_graph_prepared;
+
+/*
+ * Set while verifying, so that the commits we compare the graph against
+ * are parsed from the object database and not from the graph itself.
+ */
+static int commit_graph_disabled;
+
+char *get_commit_graph_filename(const char *obj_dir)
+{
+	return mkpathdup("%s/info/commit-graph", obj_dir);
+}
+
+static int has_commit_graft(const struct commit_graft *graft, void *cb_data)
+{
+	return 1;
+}
+
+/*
+ * Parent information in the graph is only valid as long as neither
+ * grafts (including shallow boundaries) nor replacement objects rewrite
+ * the history, and the generation numbers of every descendant of such a
+ * commit would be off as well; in that case we do not use it at all.
+ */
+static int commit_graph_compatible(void)
+{
+	if (check_replace_refs) {
+		/* this reads the replace refs, and clears the flag if none */
+		lookup_replace_object(null_sha1);
+		if (check_replace_refs)
+			return 0;
+	}
+	/* this reads the graft and shallow files */
+	lookup_commit_graft(null_sha1);
+	if (for_each_commit_graft(has_commit_graft, NULL))
+		return 0;
+	return 1;
+}
+
+static struct commit_graph *load_commit_graph_one(const char *graph_file)
+{
+	struct commit_graph *graph;
+	unsigned char *data, *chunk_lookup;
+	size_t data_len;
+	struct stat st;
+	uint32_t i;
+	int fd, num_chunks;
+	uint64_t last_offset = 0;
+
+	fd = git_open_noatime(graph_file);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	data_len = xsize_t(st.st_size);
+	if (data_len < GRAPH_HEADER_SIZE + GRAPH_CHUNKLOOKUP_WIDTH + 20) {
+		close(fd);
+		error("commit-graph file %s is too small", graph_file);
+		return NULL;
+	}
+	data = xmmap(NULL, data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (get_be32(data) != GRAPH_SIGNATURE) {
+		error("commit-graph signature %X does not match signature %X",
+		      get_be32(data), GRAPH_SIGNATURE);
+		goto cleanup_fail;
+	}
+	if (data[4] != GRAPH_VERSION) {
+		error("commit-graph version %d does not match version %d",
+		      data[4], GRAPH_VERSION);
+		goto cleanup_fail;
+	}
+	if (data[5] != GRAPH_HASH_VERSION) {
+		error("commit-graph hash version %d does not match version %d",
+		      data[5], GRAPH_HASH_VERSION);
+		goto cleanup_fail;
+	}
+
+	graph = xcalloc(1, sizeof(*graph));
+	graph->data = data;
+	graph->data_len = data_len;
+
+	num_chunks = data[6];
+	if (GRAPH_HEADER_SIZE + (num_chunks + 1) * GRAPH_CHUNKLOOKUP_WIDTH + 20 > data_len) {
+		error("commit-graph chunk lookup table is truncated");
+		goto cleanup_graph;
+	}
+
+	chunk_lookup = data + GRAPH_HEADER_SIZE;
+	for (i = 0; i < num_chunks; i++) {
+		uint32_t chunk_id = get_be32(chunk_lookup);
+		uint64_t chunk_offset = ((uint64_t)get_be32(chunk_lookup + 4) << 32) |
+					get_be32(chunk_lookup + 8);
+		uint64_t next_offset = ((uint64_t)get_be32(chunk_lookup + 16) << 32) |
+				       get_be32(chunk_lookup + 20);
+
+		chunk_lookup += GRAPH_CHUNKLOOKUP_WIDTH;
+
+		if (chunk_offset < last_offset || next_offset < chunk_offset ||
+		    next_offset > data_len - 20) {
+			error("improper chunk offset %08x%08x",
+			      (uint32_t)(chunk_offset >> 32), (uint32_t)chunk_offset);
+			goto cleanup_graph;
+		}
+		last_offset = chunk_offset;
+
+		switch (chunk_id) {
+		case GRAPH_CHUNKID_OIDFANOUT:
+			if (next_offset - chunk_offset != GRAPH_FANOUT_SIZE)
+				break;
+			graph->chunk_oid_fanout = data + chunk_offset;
+			break;
+		case GRAPH_CHUNKID_OIDLOOKUP:
+			graph->chunk_oid_lookup = data + chunk_offset;
+			graph->num_commits = (next_offset - chunk_offset) / 20;
+			break;
+		case GRAPH_CHUNKID_DATA:
+			graph->chunk_commit_data = data + chunk_offset;
+			if ((next_offset - chunk_offset) / GRAPH_DATA_WIDTH !=
+			    graph->num_commits)
+				graph->chunk_commit_data = NULL;
+			break;
+		case GRAPH_CHUNKID_EXTRAEDGES:
+			graph->chunk_extra_edges = data + chunk_offset;
+			graph->extra_edges_len = (next_offset - chunk_offset) / 4;
+			break;
+		}
+	}
+
+	if (!graph->chunk_oid_fanout || !graph->chunk_oid_lookup ||
+	    !graph->chunk_commit_data) {
+		error("commit-graph is missing required chunks");
+		goto cleanup_graph;
+	}
+	if (get_be32(graph->chunk_oid_fanout + 4 * 255) != graph->num_commits) {
+		error("commit-graph fanout does not match its object count");
+		goto cleanup_graph;
+	}
+	return graph;
+
+cleanup_graph:
+	free(graph);
+cleanup_fail:
+	munmap(data, data_len);
+	return NULL;
+}
+
+static void prepare_commit_graph(void)
+{
+	char *graph_name;
+
+	if (commit_graph_prepared)
+		return;
+	commit_graph_prepared = 1;
+
+	if (!core_commit_graph || !commit_graph_compatible())
+		return;
+
+	graph_name = get_commit_graph_filename(get_object_directory());
+	commit_graph = load_commit_graph_one(graph_name);
+	free(graph_name);
+}
+
+void close_commit_graph(void)
+{
+	if (!commit_graph)
+		return;
+	munmap(commit_graph->data, commit_graph->data_len);
+	free(commit_graph);
+	commit_graph = NULL;
+	commit_graph_prepared = 0;
+}
+
+static int bsearch_graph(struct commit_graph *g, const unsigned char *sha1,
+			 uint32_t *pos)
+{
+	uint32_t lo, hi;
+
+	hi = get_be32(g->chunk_oid_fanout + 4 * sha1[0]);
+	lo = sha1[0] ? get_be32(g->chunk_oid_fanout + 4 * (sha1[0] - 1)) : 0;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(g->chunk_oid_lookup + 20 * mi, sha1);
+		if (!cmp) {
+			*pos = mi;
+			return 1;
+		}
+		if (cmp > 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return 0;
+}
+
+static struct commit *insert_parent_or_die(struct commit_graph *g,
+					   uint32_t pos,
+					   struct commit_list **pptr)
+{
+	struct commit *c;
+
+	if (pos >= g->num_commits)
+		die("invalid parent position %"PRIu32, pos);
+	c = lookup_commit(g->chunk_oid_lookup + 20 * pos);
+	if (!c)
+		die("could not find commit %s",
+		    sha1_to_hex(g->chunk_oid_lookup + 20 * pos));
+	commit_list_insert(c, pptr);
+	return c;
+}
+
+static int fill_commit_in_graph(struct commit_graph *g, struct commit *item,
+				uint32_t pos)
+{
+	const unsigned char *commit_data = g->chunk_commit_data +
+					   GRAPH_DATA_WIDTH * pos;
+	struct commit_list **pptr;
+	uint32_t edge_value, date_high, date_low;
+
+	item->object.parsed = 1;
+	item->tree = lookup_tree(commit_data);
+
+	date_high = get_be32(commit_data + 28) & 0x3;
+	date_low = get_be32(commit_data + 32);
+	item->date = (unsigned long)(((uint64_t)date_high << 32) | date_low);
+	item->generation = get_be32(commit_data + 28) >> 2;
+
+	pptr = &item->parents;
+
+	edge_value = get_be32(commit_data + 20);
+	if (edge_value == GRAPH_PARENT_NONE)
+		return 1;
+	insert_parent_or_die(g, edge_value, pptr);
+	pptr = &(*pptr)->next;
+
+	edge_value = get_be32(commit_data + 24);
+	if (edge_value == GRAPH_PARENT_NONE)
+		return 1;
+	if (!(edge_value & GRAPH_OCTOPUS_EDGES_NEEDED)) {
+		insert_parent_or_die(g, edge_value, pptr);
+		return 1;
+	}
+
+	edge_value &= GRAPH_EDGE_LAST_MASK;
+	do {
+		uint32_t parent;
+
+		if (edge_value >= g->extra_edges_len)
+			die("commit-graph extra edge list is truncated");
+		parent = get_be32(g->chunk_extra_edges + 4 * edge_value++);
+		insert_parent_or_die(g, parent & GRAPH_EDGE_LAST_MASK, pptr);
+		pptr = &(*pptr)->next;
+		if (parent & GRAPH_LAST_EDGE)
+			break;
+	} while (1);
+
+	return 1;
+}
+
+int parse_commit_in_graph(struct commit *item)
+{
+	uint32_t pos;
+
+	if (item->object.parsed)
+		return 1;
+	if (commit_graph_disabled)
+		return 0;
+	prepare_commit_graph();
+	if (!commit_graph)
+		return 0;
+	/* e.g. a shallow boundary registered after the graph was loaded */
+	if (lookup_commit_graft(item->object.sha1))
+		return 0;
+	if (!bsearch_graph(commit_graph, item->object.sha1, &pos))
+		return 0;
+	return fill_commit_in_graph(commit_graph, item, pos);
+}
+
+void load_commit_graph_info(struct commit *item)
+{
+	uint32_t pos;
+
+	if (commit_graph_disabled)
+		return;
+	prepare_commit_graph();
+	if (!commit_graph)
+		return;
+	if (!bsearch_graph(commit_graph, item->object.sha1, &pos))
+		return;
+	item->generation = get_be32(commit_graph->chunk_commit_data +
+				    GRAPH_DATA_WIDTH * pos + 28) >> 2;
+}
+
+/*
+ * Writing
+ */
+
+struct graph_commits {
+	struct commit **list;
+	int nr, alloc;
+};
+
+static const unsigned char *graph_commit_sha1_access(size_t index, void *table)
+{
+	struct commit **commits = table;
+	return commits[index]->object.sha1;
+}
+
+static int commit_pos(struct graph_commits *commits, struct commit *c)
+{
+	return sha1_pos(c->object.sha1, commits->list, commits->nr,
+			graph_commit_sha1_access);
+}
+
+static int add_ref_tip(const char *refname, const unsigned char *sha1,
+		       int flags, void *cb_data)
+{
+	struct commit_list **tips = cb_data;
+	struct object *o = parse_object(sha1);
+	struct commit *c;
+
+	if (!o)
+		return 0;
+	o = deref_tag(o, refname, 0);
+	if (!o || o->type != OBJ_COMMIT)
+		return 0;
+	c = (struct commit *)o;
+	if (!(c->object.flags & GRAPH_SEEN)) {
+		c->object.flags |= GRAPH_SEEN;
+		commit_list_insert(c, tips);
+	}
+	return 0;
+}
+
+static void collect_reachable_commits(struct graph_commits *commits,
+				      struct progress *progress)
+{
+	struct commit_list *stack = NULL;
+	struct commit *c;
+
+	head_ref(add_ref_tip, &stack);
+	for_each_ref(add_ref_tip, &stack);
+
+	while ((c = pop_commit(&stack)) != NULL) {
+		struct commit_list *parents;
+
+		parse_commit_or_die(c);
+		ALLOC_GROW(commits->list, commits->nr + 1, commits->alloc);
+		commits->list[commits->nr++] = c;
+		display_progress(progress, commits->nr);
+
+		for (parents = c->parents; parents; parents = parents->next) {
+			struct commit *p = parents->item;
+			if (p->object.flags & GRAPH_SEEN)
+				continue;
+			p->object.flags |= GRAPH_SEEN;
+			commit_list_insert(p, &stack);
+		}
+	}
+}
+
+static int commit_compare(const void *a_, const void *b_)
+{
+	const struct commit *a = *(const struct commit **)a_;
+	const struct commit *b = *(const struct commit **)b_;
+	return hashcmp(a->object.sha1, b->object.sha1);
+}
+
+/*
+ * Compute the generation number of each commit: one more than the
+ * maximum generation of its parents, with root commits at 1. The
+ * commits are reachable closures, so every parent has a position.
+ */
+static void compute_generation_numbers(struct graph_commits *commits,
+				       uint32_t *generation)
+{
+	struct commit_list *stack = NULL;
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		if (generation[i])
+			continue;
+		commit_list_insert(commits->list[i], &stack);
+		while (stack) {
+			struct commit *c = stack->item;
+			struct commit_list *parents;
+			uint32_t max_generation = 0;
+			int all_parents_computed = 1;
+
+			for (parents = c->parents; parents; parents = parents->next) {
+				int pos = commit_pos(commits, parents->item);
+				if (!generation[pos]) {
+					all_parents_computed = 0;
+					commit_list_insert(parents->item, &stack);
+				} else if (generation[pos] > max_generation)
+					max_generation = generation[pos];
+			}
+
+			if (all_parents_computed) {
+				int pos = commit_pos(commits, c);
+				if (max_generation >= GENERATION_NUMBER_MAX)
+					max_generation = GENERATION_NUMBER_MAX - 1;
+				generation[pos] = max_generation + 1;
+				pop_commit(&stack);
+			}
+		}
+	}
+}
+
+static void write_graph_chunk_fanout(struct sha1file *f,
+				     struct graph_commits *commits)
+{
+	int i, count = 0;
+
+	/*
+	 * Write the first-level table (the list is sorted, but we use a
+	 * 256-entry lookup to be able to avoid having to do eight extra
+	 * binary search iterations).
+	 */
+	for (i = 0; i < 256; i++) {
+		uint32_t n;
+		while (count < commits->nr &&
+		       commits->list[count]->object.sha1[0] == i)
+			count++;
+		n = htonl(count);
+		sha1write(f, &n, 4);
+	}
+}
+
+static void write_graph_chunk_oids(struct sha1file *f,
+				   struct graph_commits *commits)
+{
+	int i;
+	for (i = 0; i < commits->nr; i++)
+		sha1write(f, commits->list[i]->object.sha1, 20);
+}
+
+static void write_graph_chunk_data(struct sha1file *f,
+				   struct graph_commits *commits,
+				   uint32_t *generation)
+{
+	uint32_t num_extra_edges = 0;
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		struct commit *c = commits->list[i];
+		struct commit_list *parent = c->parents;
+		uint32_t packed[4];
+		uint64_t date = c->date;
+
+		sha1write(f, c->tree->object.sha1, 20);
+
+		if (!parent)
+			packed[0] = GRAPH_PARENT_NONE;
+		else {
+			packed[0] = commit_pos(commits, parent->item);
+			parent = parent->next;
+		}
+
+		if (!parent)
+			packed[1] = GRAPH_PARENT_NONE;
+		else if (parent->next) {
+			packed[1] = GRAPH_OCTOPUS_EDGES_NEEDED | num_extra_edges;
+			for (; parent; parent = parent->next)
+				num_extra_edges++;
+		} else
+			packed[1] = commit_pos(commits, parent->item);
+
+		packed[2] = (generation[i] << 2) | (uint32_t)((date >> 32) & 0x3);
+		packed[3] = (uint32_t)date;
+
+		packed[0] = htonl(packed[0]);
+		packed[1] = htonl(packed[1]);
+		packed[2] = htonl(packed[2]);
+		packed[3] = htonl(packed[3]);
+		sha1write(f, packed, sizeof(packed));
+	}
+}
+
+static void write_graph_chunk_extra_edges(struct sha1file *f,
+					  struct graph_commits *commits)
+{
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		struct commit_list *parent = commits->list[i]->parents;
+
+		if (!parent || !parent->next || !parent->next->next)
+			continue;
+		/* the first parent is stored in the data chunk */
+		for (parent = parent->next; parent; parent = parent->next) {
+			uint32_t edge = commit_pos(commits, parent->item);
+			if (!parent->next)
+				edge |= GRAPH_LAST_EDGE;
+			edge = htonl(edge);
+			sha1write(f, &edge, 4);
+		}
+	}
+}
+
+static uint32_t count_extra_edges(struct graph_commits *commits)
+{
+	uint32_t count = 0;
+	int i;
+
+	for (i = 0; i < commits->nr; i++) {
+		struct commit_list *parent = commits->list[i]->parents;
+		if (!parent || !parent->next || !parent->next->next)
+			continue;
+		count += commit_list_count(parent) - 1;
+	}
+	return count;
+}
+
+static void write_chunk_lookup_entry(struct sha1file *f, uint32_t id,
+				     uint64_t offset)
+{
+	uint32_t entry[3];
+
+	entry[0] = htonl(id);
+	entry[1] = htonl((uint32_t)(offset >> 32));
+	entry[2] = htonl((uint32_t)offset);
+	sha1write(f, entry, sizeof(entry));
+}
+
+int write_commit_graph_reachable(int show_progress)
+{
+	static struct lock_file lock;
+	struct graph_commits commits = { NULL, 0, 0 };
+	struct progress *progress = NULL;
+	struct sha1file *f;
+	uint32_t *generation;
+	uint32_t chunk_ids[5];
+	uint64_t chunk_offsets[5];
+	uint32_t num_extra_edges;
+	unsigned char header[GRAPH_HEADER_SIZE], checksum[20];
+	char *graph_name;
+	int i, fd, num_chunks;
+
+	if (!commit_graph_compatible())
+		return error("not writing a commit-graph in a repository "
+			     "with grafts or replace refs");
+
+	if (show_progress)
+		progress = start_progress("Collecting commits", 0);
+	collect_reachable_commits(&commits, progress);
+	stop_progress(&progress);
+
+	for (i = 0; i < commits.nr; i++)
+		commits.list[i]->object.flags &= ~GRAPH_SEEN;
+
+	qsort(commits.list, commits.nr, sizeof(*commits.list), commit_compare);
+	if (commits.nr >= GRAPH_PARENT_NONE)
+		return error("too many commits to write a commit-graph");
+
+	generation = xcalloc(commits.nr ? commits.nr : 1, sizeof(*generation));
+	compute_generation_numbers(&commits, generation);
+	num_extra_edges = count_extra_edges(&commits);
+
+	graph_name = get_commit_graph_filename(get_object_directory());
+	if (safe_create_leading_directories(graph_name))
+		die_errno("unable to create leading directories of %s",
+			  graph_name);
+	fd = hold_lock_file_for_update(&lock, graph_name, LOCK_DIE_ON_ERROR);
+	f = sha1fd(fd, lock.filename);
+
+	num_chunks = num_extra_edges ? 4 : 3;
+	chunk_ids[0] = GRAPH_CHUNKID_OIDFANOUT;
+	chunk_ids[1] = GRAPH_CHUNKID_OIDLOOKUP;
+	chunk_ids[2] = GRAPH_CHUNKID_DATA;
+	chunk_ids[3] = num_extra_edges ? GRAPH_CHUNKID_EXTRAEDGES : 0;
+	chunk_ids[4] = 0;
+
+	chunk_offsets[0] = GRAPH_HEADER_SIZE +
+			   (num_chunks + 1) * GRAPH_CHUNKLOOKUP_WIDTH;
+	chunk_offsets[1] = chunk_offsets[0] + GRAPH_FANOUT_SIZE;
+	chunk_offsets[2] = chunk_offsets[1] + 20 * commits.nr;
+	chunk_offsets[3] = chunk_offsets[2] + GRAPH_DATA_WIDTH * commits.nr;
+	chunk_offsets[4] = chunk_offsets[3] + 4 * num_extra_edges;
+
+	put_be32(header, GRAPH_SIGNATURE);
+	header[4] = GRAPH_VERSION;
+	header[5] = GRAPH_HASH_VERSION;
+	header[6] = num_chunks;
+	header[7] = 0; /* unused */
+	sha1write(f, header, sizeof(header));
+
+	for (i = 0; i <= num_chunks; i++)
+		write_chunk_lookup_entry(f, chunk_ids[i], chunk_offsets[i]);
+
+	write_graph_chunk_fanout(f, &commits);
+	write_graph_chunk_oids(f, &commits);
+	write_graph_chunk_data(f, &commits, generation);
+	if (num_extra_edges)
+		write_graph_chunk_extra_edges(f, &commits);
+
+	/* the lock owns the descriptor, so write the trailer ourselves */
+	sha1close(f, checksum, 0);
+	write_or_die(fd, checksum, 20);
+	fsync_or_die(fd, lock.filename);
+	close_commit_graph();
+	if (commit_lock_file(&lock))
+		die_errno("unable to write commit-graph file '%s'", graph_name);
+
+	free(graph_name);
+	free(generation);
+	free(commits.list);
+	return 0;
+}
+
+/*
+ * Verification
+ */
+
+static int verify_error;
+
+static void graph_report(const char *fmt, ...)
+{
+	va_list ap;
+
+	verify_error++;
+	va_start(ap, fmt);
+	vreportf("error: ", fmt, ap);
+	va_end(ap);
+}
+
+int verify_commit_graph(void)
+{
+	struct commit_graph *g;
+	git_SHA_CTX ctx;
+	unsigned char checksum[20];
+	uint32_t i;
+
+	verify_error = 0;
+	prepare_commit_graph();
+	g = commit_graph;
+	if (!g)
+		return 0;
+
+	git_SHA1_Init(&ctx);
+	git_SHA1_Update(&ctx, g->data, g->data_len - 20);
+	git_SHA1_Final(checksum, &ctx);
+	if (hashcmp(checksum, g->data + g->data_len - 20))
+		graph_report("commit-graph has incorrect checksum");
+
+	commit_graph_disabled = 1;
+	for (i = 0; i < g->num_commits; i++) {
+		const unsigned char *sha1 = g->chunk_oid_lookup + 20 * i;
+		const unsigned char *data = g->chunk_commit_data +
+					    GRAPH_DATA_WIDTH * i;
+		struct commit *graph_commit, *odb_commit;
+		struct commit_list *graph_parents, *odb_parents;
+		uint32_t max_generation = 0, generation;
+
+		if (i && hashcmp(sha1 - 20, sha1) >= 0) {
+			graph_report("commit-graph has incorrect oid order: %s then %s",
+				     sha1_to_hex(sha1 - 20), sha1_to_hex(sha1));
+			continue;
+		}
+
+		odb_commit = lookup_commit(sha1);
+		if (!odb_commit || parse_commit(odb_commit)) {
+			graph_report("failed to parse %s from object database",
+				     sha1_to_hex(sha1));
+			continue;
+		}
+
+		if (hashcmp(odb_commit->tree->object.sha1, data))
+			graph_report("root tree for commit %s in commit-graph is %s != %s",
+				     sha1_to_hex(sha1), sha1_to_hex(data),
+				     sha1_to_hex(odb_commit->tree->object.sha1));
+
+		/* Parse the graph side into a scratch commit. */
+		graph_commit = xcalloc(1, sizeof(*graph_commit));
+		hashcpy(graph_commit->object.sha1, sha1);
+		fill_commit_in_graph(g, graph_commit, i);
+		generation = graph_commit->generation;
+
+		graph_parents = graph_commit->parents;
+		odb_parents = odb_commit->parents;
+		while (graph_parents && odb_parents) {
+			if (graph_parents->item != odb_parents->item)
+				graph_report("commit-graph parent for %s is %s != %s",
+					     sha1_to_hex(sha1),
+					     sha1_to_hex(graph_parents->item->object.sha1),
+					     sha1_to_hex(odb_parents->item->object.sha1));
+			graph_parents = graph_parents->next;
+			odb_parents = odb_parents->next;
+		}
+		if (graph_parents || odb_parents)
+			graph_report("commit-graph parent list for commit %s has the wrong length",
+				     sha1_to_hex(sha1));
+
+		for (graph_parents = graph_commit->parents; graph_parents;
+		     graph_parents = graph_parents->next) {
+			uint32_t pos, parent_generation;
+			if (!bsearch_graph(g, graph_parents->item->object.sha1, &pos))
+				continue;
+			parent_generation = get_be32(g->chunk_commit_data +
+						     GRAPH_DATA_WIDTH * pos + 28) >> 2;
+			if (parent_generation > max_generation)
+				max_generation = parent_generation;
+		}
+		if (max_generation == GENERATION_NUMBER_MAX)
+			max_generation--;
+		if (generation != max_generation + 1)
+			graph_report("commit-graph generation for commit %s is %u != %u",
+				     sha1_to_hex(sha1), generation,
+				     max_generation + 1);
+
+		if (graph_commit->date != odb_commit->date)
+			graph_report("commit date for commit %s in commit-graph is %lu != %lu",
+				     sha1_to_hex(sha1), graph_commit->date,
+				     odb_commit->date);
+
+		free_commit_list(graph_commit->parents);
+		free(graph_commit);
+	}
+	commit_graph_disabled = 0;
+
+	return verify_error;
+}
@@ -0,0 +1,63 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include "commit.h"
+
+/*
+ * Generation numbers as stored in struct commit. A value of zero means
+ * that the commit was not loaded from the commit-graph file and that its
+ * generation is unknown; such commits must be treated as if they could
+ * be anywhere in the history, i.e. as having an infinite generation.
+ */
+#define GENERATION_NUMBER_UNKNOWN 0
+#define GENERATION_NUMBER_INFINITY 0xFFFFFFFF
+#define GENERATION_NUMBER_MAX 0x3FFFFFFF
+
+/*
+ * Return the path of the commit-graph file for the given object
+ * directory. The result is newly allocated.
+ */
+extern char *get_commit_graph_filename(const char *obj_dir);
+
+/*
+ * Fill in "item" (tree, parents, date and generation) from the
+ * commit-graph file of the repository, without inflating the commit
+ * object. Returns 1 if the commit was found in the graph and parsed,
+ * 0 if the caller must fall back to parsing the object itself.
+ */
+extern int parse_commit_in_graph(struct commit *item);
+
+/*
+ * Record the generation number of an already parsed commit, if the
+ * commit-graph file knows about it.
+ */
+extern void load_commit_graph_info(struct commit *item);
+
+/*
+ * Return the generation number of a commit, or GENERATION_NUMBER_INFINITY
+ * if it is not known.
+ */
+static inline uint32_t commit_generation(const struct commit *item)
+{
+	return item->generation == GENERATION_NUMBER_UNKNOWN ?
+		GENERATION_NUMBER_INFINITY : item->generation;
+}
+
+/*
+ * Write a commit-graph file covering every commit reachable from the
+ * refs of the repository (and HEAD) into the local object directory.
+ */
+extern int write_commit_graph_reachable(int show_progress);
+
+/*
+ * Check the commit-graph file of the repository against the object
+ * database, reporting any discrepancy. Returns the number of errors.
+ */
+extern int verify_commit_graph(void);
+
+/*
+ * Release the mapped commit-graph file, if any.
+ */
+extern void close_commit_graph(void);
+
+#endif
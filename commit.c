@@ -11,6 +11,7 @@
 #include "commit-slab.h"
 #include "prio-queue.h"
 #include "sha1-lookup.h"
+#include "commit-graph.h"
 
 static struct commit_extra_header *read_commit_extra_header_lines(const char *buf, size_t len, const char **);
 
@@ -298,6 +299,7 @@ int parse_commit_buffer(struct commit *item, const void *buffer, unsigned long s
 		}
 	}
 	item->date = parse_commit_date(bufptr, tail);
+	load_commit_graph_info(item);
 
 	return 0;
 }
@@ -313,6 +315,12 @@ int parse_commit(struct commit *item)
 		return -1;
 	if (item->object.parsed)
 		return 0;
+	/*
+	 * Callers that keep the commit buffer expect to find it in
+	 * item->buffer, so only serve the others from the commit-graph.
+	 */
+	if (!save_commit_buffer && parse_commit_in_graph(item))
+		return 0;
 	buffer = read_sha1_file(item->object.sha1, &type, &size);
 	if (!buffer)
 		return error("Could not read %s",
@@ -741,20 +749,53 @@ static struct commit *interesting(struct commit_list *list)
 	return NULL;
 }
 
-/* all input commits in one and twos[] must have been parsed! */
-static struct commit_list *paint_down_to_common(struct commit *one, int n, struct commit **twos)
+/*
+ * Insert "item" into a list ordered by generation number, then by
+ * commit date. A commit can never be an ancestor of one with a lower
+ * generation, so popping from the front of such a list visits every
+ * commit after all of its descendants that are on the list, even in
+ * the face of clock skew. Commits without a known generation sort
+ * first, in date order, as before.
+ */
+static struct commit_list *insert_by_generation(struct commit *item,
+						struct commit_list **list)
+{
+	struct commit_list **pp = list;
+	struct commit_list *p;
+	uint32_t generation = commit_generation(item);
+
+	while ((p = *pp) != NULL) {
+		uint32_t p_generation = commit_generation(p->item);
+		if (p_generation < generation ||
+		    (p_generation == generation && p->item->date < item->date))
+			break;
+		pp = &p->next;
+	}
+	return commit_list_insert(item, pp);
+}
+
+/*
+ * all input commits in one and twos[] must have been parsed!
+ *
+ * Commits whose generation is below "min_generation" cannot be
+ * ancestors of a commit at that generation, so the walk stops once it
+ * has gone past them; pass 0 to paint the whole common history.
+ */
+static struct commit_list *paint_down_to_common(struct commit *one, int n,
+						struct commit **twos,
+						uint32_t min_generation)
 {
 	struct commit_list *list = NULL;
 	struct commit_list *result = NULL;
 	int i;
 
 	one->object.flags |= PARENT1;
-	commit_list_insert_by_date(one, &list);
+	insert_by_generation(one, &list);
 	if (!n)
 		return list;
 	for (i = 0; i < n; i++) {
 		twos[i]->object.flags |= PARENT2;
-		commit_list_insert_by_date(twos[i], &list);
+		insert_by_generation(twos[i], &list);
 	}
 
 	while (interesting(list)) {
@@ -768,6 +809,9 @@ static struct commit_list *paint_down_to_common(struct commit *one, int n, struc
 		free(list);
 		list = next;
 
+		if (commit_generation(commit) < min_generation)
+			break;
+
 		flags = commit->object.flags & (PARENT1 | PARENT2 | STALE);
 		if (flags == (PARENT1 | PARENT2)) {
 			if (!(commit->object.flags & RESULT)) {
@@ -786,7 +830,7 @@ static struct commit_list *paint_down_to_common(struct commit *one, int n, struc
 			if (parse_commit(p))
 				return NULL;
 			p->object.flags |= flags;
-			commit_list_insert_by_date(p, &list);
+			insert_by_generation(p, &list);
 		}
 	}
 
@@ -816,7 +860,7 @@ static struct commit_list *merge_bases_many(struct commit *one, int n, struct co
 			return NULL;
 	}
 
-	list = paint_down_to_common(one, n, twos);
+	list = paint_down_to_common(one, n, twos, 0);
 
 	while (list) {
 		struct commit_list *next = list->next;
@@ -885,7 +929,7 @@ static int remove_redundant(struct commit **array, int cnt)
 			filled_index[filled] = j;
 			work[filled++] = array[j];
 		}
-		common = paint_down_to_common(array[i], filled, work);
+		common = paint_down_to_common(array[i], filled, work, 0);
 		if (array[i]->object.flags & PARENT2)
 			redundant[i] = 1;
 		for (j = 0; j < filled; j++)
@@ -987,6 +1031,7 @@ int is_descendant_of(struct commit *commit, struct commit_list *with_commit)
 int in_merge_bases_many(struct commit *commit, int nr_reference, struct commit **reference)
 {
 	struct commit_list *bases;
+	uint32_t min_generation;
 	int ret = 0, i;
 
 	if (parse_commit(commit))
@@ -995,7 +1040,10 @@ int in_merge_bases_many(struct commit *commit, int nr_reference, struct commit *
 		if (parse_commit(reference[i]))
 			return ret;
 
-	bases = paint_down_to_common(commit, nr_reference, reference);
+	/* nothing below "commit" in the graph can reach it */
+	min_generation = commit->generation;
+	bases = paint_down_to_common(commit, nr_reference, reference,
+				     min_generation);
 	if (commit->object.flags & PARENT2)
 		ret = 1;
 	clear_commit_marks(commit, all_flags);
@@ -18,6 +18,7 @@ struct commit {
 	void *util;
 	unsigned int index;
 	unsigned long date;
+	uint32_t generation;
 	struct commit_list *parents;
 	struct tree *tree;
 	char *buffer;
@@ -853,6 +853,26 @@ static int git_default_core_config(const char *var, const char *value)
 		return 0;
 	}
 
+	if (!strcmp(var, "core.commitgraph")) {
+		core_commit_graph = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.multipackindex")) {
+		core_multi_pack_index = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.untrackedcache")) {
+		core_untracked_cache = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.splitindex")) {
+		core_split_index = git_config_bool(var, value);
+		return 0;
+	}
+
 	if (!strcmp(var, "core.createobject")) {
 		if (!strcmp(value, "rename"))
 			object_creation_mode = OBJECT_CREATION_USES_RENAMES;
@@ -863,11 +883,28 @@ static int git_default_core_config(const char *var, const char *value)
 		return 0;
 	}
 
+	if (!strcmp(var, "core.refstorage")) {
+		if (!value)
+			return config_error_nonbool(var);
+		if (!strcmp(value, "files"))
+			ref_storage = REF_STORAGE_FILES;
+		else if (!strcmp(value, "reftable"))
+			ref_storage = REF_STORAGE_REFTABLE;
+		else
+			return error("unknown core.refStorage: %s", value);
+		return 0;
+	}
+
 	if (!strcmp(var, "core.sparsecheckout")) {
 		core_apply_sparse_checkout = git_config_bool(var, value);
 		return 0;
 	}
 
+	if (!strcmp(var, "core.sparsecheckoutcone")) {
+		core_sparse_checkout_cone = git_config_bool(var, value);
+		return 0;
+	}
+
 	if (!strcmp(var, "core.precomposeunicode")) {
 		precomposed_unicode = git_config_bool(var, value);
 		return 0;
@@ -991,6 +1028,27 @@ int git_default_config(const char *var, const char *value, void *dummy)
 		pack_size_limit_cfg = git_config_ulong(var, value);
 		return 0;
 	}
+
+	if (!strcmp(var, "pack.writethreads")) {
+		pack_write_threads = git_config_int(var, value);
+		if (pack_write_threads < 0)
+			return error("invalid number of threads specified (%d)",
+				     pack_write_threads);
+#ifdef NO_PTHREADS
+		if (pack_write_threads != 1)
+			warning("no threads support, ignoring %s", var);
+#endif
+		return 0;
+	}
+
+	if (!strcmp(var, "splitindex.maxpercentchange")) {
+		int v = git_config_int(var, value);
+		if (v < 0 || v > 100)
+			return error("splitIndex.maxPercentChange must be "
+				     "between 0 and 100, not %d", v);
+		split_index_max_percent_change = v;
+		return 0;
+	}
 	/* Add other config variables here and to Documentation/config.txt. */
 	return 0;
 }
@@ -0,0 +1,4 @@
+NO_OPENSSL=1
+NO_TCLTK=1
+NO_GETTEXT=1
+CFLAGS=-g -O2 -Wall -Wno-unused-value -Wno-deprecated-declarations
@@ -3,11 +3,162 @@
 #include "sigchain.h"
 #include "connected.h"
 #include "transport.h"
+#include "commit.h"
+#include "tag.h"
+#include "diff.h"
+#include "revision.h"
+#include "list-objects.h"
+#include "pack.h"
+#include "pack-bitmap.h"
 
 int check_everything_connected(sha1_iterate_fn fn, int quiet, void *cb_data)
 {
 	return check_everything_connected_with_transport(fn, quiet, cb_data, NULL);
 }
+struct connected_data {
+	struct bitmap *haves;
+	int quiet;
+	int missing;
+};
+
+/*
+ * With a pack bitmap, the commits reachable from our refs are known
+ * without walking them: stop at the first one the walk meets.
+ */
+static int exclude_reachable(struct commit *commit, void *data)
+{
+	struct connected_data *cd = data;
+
+	if (!bitmap_has_object(cd->haves, commit->object.sha1))
+		return 1;
+	commit->object.flags |= UNINTERESTING;
+	return 0;
+}
+
+static void connected_show_commit(struct commit *commit, void *data)
+{
+}
+
+static void connected_show_object(struct object *obj,
+				  const struct name_path *path,
+				  const char *last, void *data)
+{
+	struct connected_data *cd = data;
+
+	if (obj->type == OBJ_TREE ? obj->parsed : has_sha1_file(obj->sha1))
+		return;
+	if (!cd->quiet)
+		error(_("missing %s object %s"), typename(obj->type),
+		      sha1_to_hex(obj->sha1));
+	cd->missing++;
+}
+
+static struct object *parse_tip(const unsigned char *sha1, int quiet)
+{
+	struct object *tip = parse_object(sha1), *obj = tip;
+
+	while (obj && obj->type == OBJ_TAG)
+		obj = parse_object(((struct tag *)obj)->tagged->sha1);
+	if (!obj) {
+		if (!quiet)
+			error(_("missing object %s"), sha1_to_hex(sha1));
+		return NULL;
+	}
+	return tip;
+}
+
+/*
+ * The same check as "git rev-list --objects --stdin --not --all" (see
+ * below), run in this process so that the packs, the refs and the
+ * objects already loaded are reused. Errors are reported instead of
+ * dying, as the caller still has to tell its peer about them.
+ *
+ * The walk uses the revision flags of every object in memory; the
+ * flags that the caller had set on them are put back afterwards.
+ */
+static int check_connected_in_process(sha1_iterate_fn fn, int quiet,
+				      void *cb_data,
+				      const unsigned char *first,
+				      struct packed_git *new_pack)
+{
+	struct saved_flags {
+		struct object *obj;
+		unsigned int flags;
+	} *saved = NULL;
+	unsigned int i, saved_nr = 0, saved_alloc = 0;
+	int save_buffer = save_commit_buffer;
+	struct connected_data cd;
+	struct rev_info revs;
+	unsigned char sha1[20];
+	int err = 0;
+
+	for (i = 0; i < get_max_object_index(); i++) {
+		struct object *obj = get_indexed_object(i);
+
+		if (!obj || !(obj->flags & ALL_REV_FLAGS))
+			continue;
+		ALLOC_GROW(saved, saved_nr + 1, saved_alloc);
+		saved[saved_nr].obj = obj;
+		saved[saved_nr].flags = obj->flags & ALL_REV_FLAGS;
+		saved_nr++;
+		obj->flags &= ~ALL_REV_FLAGS;
+	}
+	save_commit_buffer = 0;
+
+	memset(&cd, 0, sizeof(cd));
+	cd.quiet = quiet;
+
+	init_revisions(&revs, NULL);
+	revs.tag_objects = 1;
+	revs.tree_objects = 1;
+	revs.blob_objects = 1;
+	revs.limited = 1;
+	revs.do_not_die_on_missing_tree = 1;
+
+	cd.haves = bitmap_for_reachable_refs();
+	if (cd.haves) {
+		revs.include_check = exclude_reachable;
+		revs.include_check_data = &cd;
+	} else {
+		const char *argv[] = { NULL, "--not", "--all", NULL };
+		setup_revisions(ARRAY_SIZE(argv) - 1, argv, &revs, NULL);
+	}
+
+	hashcpy(sha1, first);
+	do {
+		struct object *tip;
+
+		/* see check_everything_connected_real() */
+		if (new_pack && find_pack_entry_one(sha1, new_pack))
+			continue;
+
+		tip = parse_tip(sha1, quiet);
+		if (!tip) {
+			err = -1;
+			break;
+		}
+		add_pending_object(&revs, tip, "");
+	} while (!fn(cb_data, sha1));
+
+	if (!err && prepare_revision_walk(&revs))
+		err = quiet ? -1 : error(_("revision walk setup failed"));
+	if (!err) {
+		mark_edges_uninteresting(&revs, NULL);
+		traverse_commit_list(&revs, connected_show_commit,
+				     connected_show_object, &cd);
+		if (cd.missing)
+			err = -1;
+	}
+
+	bitmap_free(cd.haves);
+	clear_object_flags(ALL_REV_FLAGS);
+	for (i = 0; i < saved_nr; i++)
+		saved[i].obj->flags |= saved[i].flags;
+	free(saved);
+	save_commit_buffer = save_buffer;
+	return err;
+}
+
 /*
  * If we feed all the commits we want to verify to this command
  *
@@ -17,6 +168,10 @@ int check_everything_connected(sha1_iterate_fn fn, int quiet, void *cb_data)
  * these commits locally exists and is connected to our existing refs.
  * Note that this does _not_ validate the individual objects.
  *
+ * This is done in-process, except when the repository is (or has just
+ * been made) shallow, or a temporary shallow file is given: the check
+ * then runs in "rev-list", which reads the shallow boundary afresh.
+ *
  * Returns 0 if everything is connected, non-zero otherwise.
  */
 static int check_everything_connected_real(sha1_iterate_fn fn,
@@ -47,6 +202,11 @@ static int check_everything_connected_real(sha1_iterate_fn fn,
 		strbuf_release(&idx_file);
 	}
 
+	if (!shallow_file && !is_repository_shallow() &&
+	    access(git_path("shallow"), F_OK))
+		return check_connected_in_process(fn, quiet, cb_data,
+						  sha1, new_pack);
+
 	if (shallow_file) {
 		argv[ac++] = "--shallow-file";
 		argv[ac++] = shallow_file;
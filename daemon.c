@@ -4,6 +4,7 @@
 #include "run-command.h"
 #include "strbuf.h"
 #include "string-list.h"
+#include "sigchain.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 256
@@ -21,6 +22,7 @@ static int informative_errors;
 static const char daemon_usage[] =
 "git daemon [--verbose] [--syslog] [--export-all]\n"
 "           [--timeout=<n>] [--init-timeout=<n>] [--max-connections=<n>]\n"
+"           [--workers=<n>] [--listen-backlog=<n>]\n"
 "           [--strict-paths] [--base-path=<path>] [--base-path-relaxed]\n"
 "           [--user-path | --user-path=<path>]\n"
 "           [--interpolated-path=<path>]\n"
@@ -56,6 +58,10 @@ static const char *user_path;
 static unsigned int timeout;
 static unsigned int init_timeout;
 
+/* Number of pre-forked workers, and the length of the accept queue */
+static int nr_workers;
+static int listen_backlog = 5;
+
 static char *hostname;
 static char *canon_hostname;
 static char *ip_address;
@@ -318,6 +324,24 @@ error_return:
 	return -1;
 }
 
+/*
+ * With --workers, each worker has a slot in memory shared with the
+ * main process, which reports them on SIGUSR1.
+ */
+static struct worker {
+	pid_t pid;
+	int busy;
+	time_t since;
+	unsigned long served;
+	char path[256];
+} *workers, *this_worker;
+
+static void worker_serving(const char *path)
+{
+	if (this_worker)
+		strlcpy(this_worker->path, path, sizeof(this_worker->path));
+}
+
 static int run_service(char *dir, struct daemon_service *service)
 {
 	const char *path;
@@ -333,6 +357,7 @@ static int run_service(char *dir, struct daemon_service *service)
 
 	if (!(path = path_ok(dir)))
 		return daemon_error(dir, "no such repository");
+	worker_serving(path);
 
 	/*
 	 * Security on the cheap.
@@ -626,6 +651,7 @@ static int execute(void)
 	free(ip_address);
 	free(tcp_port);
 	hostname = canon_hostname = ip_address = tcp_port = NULL;
+	saw_extended_args = 0;
 
 	if (len != pktlen)
 		parse_host_arg(line + len + 1, pktlen - len - 1);
@@ -893,7 +919,7 @@ static int setup_named_sock(char *listen_addr, int listen_port, struct socketlis
 			close(sockfd);
 			continue;	/* not fatal */
 		}
-		if (listen(sockfd, 5) < 0) {
+		if (listen(sockfd, listen_backlog) < 0) {
 			logerror("Could not listen to %s: %s",
 				 ip2str(ai->ai_family, ai->ai_addr, ai->ai_addrlen),
 				 strerror(errno));
@@ -956,7 +982,7 @@ static int setup_named_sock(char *listen_addr, int listen_port, struct socketlis
 		return 0;
 	}
 
-	if (listen(sockfd, 5) < 0) {
+	if (listen(sockfd, listen_backlog) < 0) {
 		logerror("Could not listen to %s: %s",
 			 ip2str(AF_INET, (struct sockaddr *)&sin, sizeof(sin)),
 			 strerror(errno));
@@ -1047,6 +1073,248 @@ static int service_loop(struct socketlist *socklist)
 	}
 }
 
+#if defined(NO_POSIX_GOODIES) || defined(NO_MMAP)
+
+static int worker_loop(struct socketlist *socklist)
+{
+	die("--workers not supported on this platform");
+}
+
+#else
+
+static volatile sig_atomic_t report_workers;
+
+static void report_workers_handler(int signo)
+{
+	report_workers = 1;
+}
+
+static void log_workers(void)
+{
+	time_t now = time(NULL);
+	unsigned long served = 0;
+	int i, busy = 0;
+
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *w = &workers[i];
+
+		served += w->served;
+		if (!w->busy)
+			continue;
+		busy++;
+		logerror("[%"PRIuMAX"] busy for %lus with '%s'",
+			 (uintmax_t)w->pid, (unsigned long)(now - w->since),
+			 w->path);
+	}
+	logerror("%d of %d workers busy, %lu connections served",
+		 busy, nr_workers, served);
+}
+
+/*
+ * Serve one connection in the worker itself, the same way as
+ * "git daemon --serve" would, and then go back to a clean state.
+ */
+static void worker_handle(int incoming, struct sockaddr *addr)
+{
+	char addrbuf[300] = "", portbuf[300] = "";
+	int i, busy = 0;
+
+	this_worker->busy = 1;
+	this_worker->since = time(NULL);
+	this_worker->path[0] = '\0';
+	for (i = 0; i < nr_workers; i++)
+		busy += workers[i].busy;
+	if (busy == nr_workers)
+		loginfo("All %d workers busy", nr_workers);
+
+	if (addr->sa_family == AF_INET) {
+		struct sockaddr_in *sin_addr = (void *) addr;
+		inet_ntop(addr->sa_family, &sin_addr->sin_addr, addrbuf,
+		    sizeof(addrbuf));
+		snprintf(portbuf, sizeof(portbuf), "%d",
+		    ntohs(sin_addr->sin_port));
+#ifndef NO_IPV6
+	} else if (addr->sa_family == AF_INET6) {
+		struct sockaddr_in6 *sin6_addr = (void *) addr;
+
+		addrbuf[0] = '[';
+		inet_ntop(AF_INET6, &sin6_addr->sin6_addr, addrbuf + 1,
+		    sizeof(addrbuf) - 2);
+		strcat(addrbuf, "]");
+		snprintf(portbuf, sizeof(portbuf), "%d",
+		    ntohs(sin6_addr->sin6_port));
+#endif
+	}
+	setenv("REMOTE_ADDR", addrbuf, 1);
+	setenv("REMOTE_PORT", portbuf, 1);
+
+	dup2(incoming, 0);
+	dup2(incoming, 1);
+	close(incoming);
+	execute();
+	close(0);
+	close(1);
+	sanitize_stdfds();
+
+	/* run_service() leaves us in the repository, and deaf to SIGTERM */
+	signal(SIGTERM, SIG_DFL);
+	loginfo("Disconnected");
+
+	this_worker->served++;
+	this_worker->busy = 0;
+}
+
+static void NORETURN worker_main(struct socketlist *socklist, pid_t parent)
+{
+	char cwd[PATH_MAX];
+	struct pollfd *pfd;
+	int i;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		die_errno("unable to get current working directory");
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+
+	pfd = xcalloc(socklist->nr, sizeof(struct pollfd));
+	for (i = 0; i < socklist->nr; i++) {
+		pfd[i].fd = socklist->list[i];
+		pfd[i].events = POLLIN;
+	}
+
+	while (getppid() == parent) {
+		if (poll(pfd, socklist->nr, -1) < 0) {
+			if (errno != EINTR)
+				die_errno("poll failed");
+			continue;
+		}
+		for (i = 0; i < socklist->nr; i++) {
+			union {
+				struct sockaddr sa;
+				struct sockaddr_in sai;
+#ifndef NO_IPV6
+				struct sockaddr_in6 sai6;
+#endif
+			} ss;
+			socklen_t sslen = sizeof(ss);
+			int incoming;
+
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			/* another worker may have taken it already */
+			incoming = accept(pfd[i].fd, &ss.sa, &sslen);
+			if (incoming < 0) {
+				switch (errno) {
+				case EAGAIN:
+				case EINTR:
+				case ECONNABORTED:
+					continue;
+				default:
+					die_errno("accept returned");
+				}
+			}
+			fcntl(incoming, F_SETFL,
+			      fcntl(incoming, F_GETFL) & ~O_NONBLOCK);
+			worker_handle(incoming, &ss.sa);
+			if (chdir(cwd))
+				die_errno("cannot go back to '%s'", cwd);
+		}
+	}
+	exit(0);
+}
+
+static void start_worker(struct socketlist *socklist, int nr)
+{
+	pid_t parent = getpid();
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		logerror("unable to fork worker: %s", strerror(errno));
+		return;
+	}
+	if (!pid) {
+		this_worker = &workers[nr];
+		this_worker->pid = getpid();
+		worker_main(socklist, parent);
+	}
+	workers[nr].pid = pid;
+}
+
+static void kill_workers(int signo)
+{
+	int i;
+
+	for (i = 0; i < nr_workers; i++)
+		if (workers[i].pid)
+			kill(workers[i].pid, SIGTERM);
+	sigchain_pop(signo);
+	raise(signo);
+}
+
+/*
+ * The workers accept connections themselves, so that a connection
+ * waits in the kernel's accept queue (see --listen-backlog) until one
+ * of them is free; this process only starts them again when they exit.
+ */
+static int worker_loop(struct socketlist *socklist)
+{
+	struct sigaction sa;
+	int i;
+
+	workers = mmap(NULL, nr_workers * sizeof(*workers),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (workers == MAP_FAILED)
+		die_errno("unable to set up workers");
+	memset(workers, 0, nr_workers * sizeof(*workers));
+
+	/* workers must not block in accept() when another one was faster */
+	for (i = 0; i < socklist->nr; i++) {
+		int fd = socklist->list[i];
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	sigchain_push(SIGTERM, kill_workers);
+
+	/* no SA_RESTART, so that waitpid() below returns to report */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = report_workers_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	for (i = 0; i < nr_workers; i++)
+		start_worker(socklist, i);
+
+	for (;;) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (report_workers) {
+			report_workers = 0;
+			log_workers();
+		}
+		if (pid < 0) {
+			if (errno != EINTR && errno != ECHILD)
+				die_errno("waitpid failed");
+			if (errno == ECHILD)
+				sleep(1);
+			continue;
+		}
+		for (i = 0; i < nr_workers; i++) {
+			struct worker *w = &workers[i];
+
+			if (w->pid != pid)
+				continue;
+			loginfo("[%"PRIuMAX"] Worker exited%s",
+				(uintmax_t)pid, status ? " (with error)" : "");
+			memset(w, 0, sizeof(*w));
+			start_worker(socklist, i);
+			break;
+		}
+	}
+}
+
+#endif
+
 #ifdef NO_POSIX_GOODIES
 
 struct credentials;
@@ -1122,6 +1390,8 @@ static int serve(struct string_list *listen_addr, int listen_port,
 
 	loginfo("Ready to rumble");
 
+	if (nr_workers)
+		return worker_loop(&socklist);
 	return service_loop(&socklist);
 }
 
@@ -1194,6 +1464,18 @@ int main(int argc, char **argv)
 				max_connections = 0;	        /* unlimited */
 			continue;
 		}
+		if (starts_with(arg, "--workers=")) {
+			nr_workers = atoi(arg + 10);
+			if (nr_workers < 0)
+				nr_workers = 0;
+			continue;
+		}
+		if (starts_with(arg, "--listen-backlog=")) {
+			listen_backlog = atoi(arg + 17);
+			if (listen_backlog <= 0)
+				listen_backlog = 5;
+			continue;
+		}
 		if (!strcmp(arg, "--strict-paths")) {
 			strict_paths = 1;
 			continue;
@@ -0,0 +1,454 @@
+#include "cache.h"
+#include "object.h"
+#include "commit.h"
+#include "tag.h"
+#include "tree.h"
+#include "tree-walk.h"
+#include "refs.h"
+#include "progress.h"
+#include "pack.h"
+#include "pack-objects.h"
+#include "sha1-array.h"
+#include "string-list.h"
+#include "khash.h"
+#include "delta-islands.h"
+
+/*
+ * The islands an object belongs to, as a bitmap indexed by island.
+ * Objects reached from the same tips share a single bitmap, which is
+ * copied before it is modified.
+ */
+struct island_bitmap {
+	uint32_t refcount;
+	uint32_t bits[FLEX_ARRAY];
+};
+
+static uint32_t island_bitmap_size;
+
+/* object name -> struct island_bitmap of the islands reaching it */
+static khash_sha1 *island_marks;
+
+static regex_t *island_regexes;
+static int island_regexes_nr, island_regexes_alloc;
+
+/*
+ * The refs of one island.  Islands whose refs point at the very same
+ * objects cannot be told apart, and get the same bit.
+ */
+struct remote_island {
+	struct sha1_array tips;
+	uint32_t bit;
+};
+
+static struct string_list remote_islands = STRING_LIST_INIT_DUP;
+
+#define ISLAND_BITMAP_BLOCK(x) ((x) / 32)
+#define ISLAND_BITMAP_MASK(x) (1u << ((x) % 32))
+
+static struct island_bitmap *island_bitmap_new(const struct island_bitmap *old)
+{
+	size_t size = sizeof(struct island_bitmap) +
+		      island_bitmap_size * sizeof(uint32_t);
+	struct island_bitmap *b = xcalloc(1, size);
+
+	if (old)
+		memcpy(b, old, size);
+	b->refcount = 1;
+	return b;
+}
+
+static void island_bitmap_or(struct island_bitmap *self,
+			     const struct island_bitmap *other)
+{
+	uint32_t i;
+
+	for (i = 0; i < island_bitmap_size; i++)
+		self->bits[i] |= other->bits[i];
+}
+
+static int island_bitmap_is_subset(const struct island_bitmap *self,
+				   const struct island_bitmap *super)
+{
+	uint32_t i;
+
+	if (self == super)
+		return 1;
+
+	for (i = 0; i < island_bitmap_size; i++)
+		if ((self->bits[i] & super->bits[i]) != self->bits[i])
+			return 0;
+	return 1;
+}
+
+static void island_bitmap_set(struct island_bitmap *self, uint32_t i)
+{
+	self->bits[ISLAND_BITMAP_BLOCK(i)] |= ISLAND_BITMAP_MASK(i);
+}
+
+static unsigned island_bitmap_popcount(const struct island_bitmap *self)
+{
+	unsigned count = 0;
+	uint32_t i;
+
+	for (i = 0; i < island_bitmap_size; i++) {
+		uint32_t word = self->bits[i];
+		while (word) {
+			word &= word - 1;
+			count++;
+		}
+	}
+	return count;
+}
+
+static struct island_bitmap *find_island_marks(const unsigned char *sha1)
+{
+	khiter_t pos;
+
+	if (!island_marks)
+		return NULL;
+
+	pos = kh_get_sha1(island_marks, sha1);
+	if (pos == kh_end(island_marks))
+		return NULL;
+	return kh_value(island_marks, pos);
+}
+
+int in_same_island(const unsigned char *trg_sha1, const unsigned char *src_sha1)
+{
+	struct island_bitmap *trg_marks, *src_marks;
+
+	/* Without islands, everything goes together. */
+	if (!island_marks)
+		return 1;
+
+	/*
+	 * An object no island reaches can be deltified against
+	 * anything; it is not fetched by anybody on its own.
+	 */
+	trg_marks = find_island_marks(trg_sha1);
+	if (!trg_marks)
+		return 1;
+
+	/*
+	 * But no object of an island may be based on one that is not
+	 * in all of its islands.
+	 */
+	src_marks = find_island_marks(src_sha1);
+	if (!src_marks)
+		return 0;
+
+	return island_bitmap_is_subset(trg_marks, src_marks);
+}
+
+int island_delta_cmp(const unsigned char *a, const unsigned char *b)
+{
+	struct island_bitmap *a_marks, *b_marks;
+	unsigned a_count, b_count;
+
+	if (!island_marks)
+		return 0;
+
+	/*
+	 * Objects in more islands sort first, so that they come
+	 * before the objects of a subset of their islands that may
+	 * use them as delta bases.
+	 */
+	a_marks = find_island_marks(a);
+	b_marks = find_island_marks(b);
+	a_count = a_marks ? island_bitmap_popcount(a_marks) : 0;
+	b_count = b_marks ? island_bitmap_popcount(b_marks) : 0;
+
+	if (a_count > b_count)
+		return -1;
+	if (a_count < b_count)
+		return 1;
+	return 0;
+}
+
+static struct island_bitmap *create_or_get_island_marks(struct object *obj)
+{
+	khiter_t pos;
+	int hash_ret;
+
+	pos = kh_put_sha1(island_marks, obj->sha1, &hash_ret);
+	if (hash_ret)
+		kh_value(island_marks, pos) = island_bitmap_new(NULL);
+
+	return kh_value(island_marks, pos);
+}
+
+static void set_island_marks(struct object *obj, struct island_bitmap *marks)
+{
+	struct island_bitmap *b;
+	khiter_t pos;
+	int hash_ret;
+
+	pos = kh_put_sha1(island_marks, obj->sha1, &hash_ret);
+	if (hash_ret) {
+		/* The first marks we see for this object are shared. */
+		marks->refcount++;
+		kh_value(island_marks, pos) = marks;
+		return;
+	}
+
+	b = kh_value(island_marks, pos);
+	if (island_bitmap_is_subset(marks, b))
+		return;
+
+	/* Copy the bitmap before adding to it, if others share it. */
+	if (b->refcount > 1) {
+		b->refcount--;
+		b = kh_value(island_marks, pos) = island_bitmap_new(b);
+	}
+	island_bitmap_or(b, marks);
+}
+
+static void mark_remote_island(struct remote_island *rl)
+{
+	int i;
+
+	for (i = 0; i < rl->tips.nr; i++) {
+		struct object *obj = parse_object(rl->tips.sha1[i]);
+
+		if (!obj)
+			continue;
+		island_bitmap_set(create_or_get_island_marks(obj), rl->bit);
+
+		/* A tag puts what it points at in the island, too. */
+		while (obj->type == OBJ_TAG) {
+			obj = ((struct tag *)obj)->tagged;
+			if (!obj || !parse_object(obj->sha1))
+				break;
+			island_bitmap_set(create_or_get_island_marks(obj),
+					  rl->bit);
+		}
+	}
+}
+
+static int find_island_for_ref(const char *refname, const unsigned char *sha1,
+			       int flags, void *data)
+{
+	/* Room for the whole match and 7 captures. */
+	regmatch_t matches[8];
+	struct strbuf island_name = STRBUF_INIT;
+	struct string_list_item *item;
+	struct remote_island *rl;
+	int i, m;
+
+	/* The last matching pattern wins, like later config does. */
+	for (i = island_regexes_nr - 1; i >= 0; i--)
+		if (!regexec(&island_regexes[i], refname,
+			     ARRAY_SIZE(matches), matches, 0))
+			break;
+	if (i < 0)
+		return 0;
+
+	/* The island is named after what the groups of the pattern matched. */
+	for (m = 1; m < ARRAY_SIZE(matches); m++) {
+		regmatch_t *match = &matches[m];
+
+		if (match->rm_so == -1)
+			continue;
+		if (island_name.len)
+			strbuf_addch(&island_name, '-');
+		strbuf_add(&island_name, refname + match->rm_so,
+			   match->rm_eo - match->rm_so);
+	}
+
+	item = string_list_insert(&remote_islands, island_name.buf);
+	if (!item->util)
+		item->util = xcalloc(1, sizeof(struct remote_island));
+	rl = item->util;
+	sha1_array_append(&rl->tips, sha1);
+
+	strbuf_release(&island_name);
+	return 0;
+}
+
+static int sha1_cmp(const void *a, const void *b)
+{
+	return hashcmp(a, b);
+}
+
+static int remote_island_cmp(const void *_a, const void *_b)
+{
+	const struct remote_island *a = *(const struct remote_island **)_a;
+	const struct remote_island *b = *(const struct remote_island **)_b;
+
+	if (a->tips.nr != b->tips.nr)
+		return a->tips.nr < b->tips.nr ? -1 : 1;
+	return memcmp(a->tips.sha1, b->tips.sha1, a->tips.nr * 20);
+}
+
+/*
+ * Give every island its bit, with islands of the same tips sharing
+ * one, and return the number of bits.
+ */
+static uint32_t assign_island_bits(void)
+{
+	struct remote_island **sorted;
+	uint32_t nr_bits = 0;
+	int i;
+
+	if (!remote_islands.nr)
+		return 0;
+
+	sorted = xmalloc(remote_islands.nr * sizeof(*sorted));
+	for (i = 0; i < remote_islands.nr; i++) {
+		struct remote_island *rl = remote_islands.items[i].util;
+
+		qsort(rl->tips.sha1, rl->tips.nr, 20, sha1_cmp);
+		sorted[i] = rl;
+	}
+	qsort(sorted, remote_islands.nr, sizeof(*sorted), remote_island_cmp);
+
+	for (i = 0; i < remote_islands.nr; i++) {
+		if (i && remote_island_cmp(&sorted[i - 1], &sorted[i]))
+			nr_bits++;
+		sorted[i]->bit = nr_bits;
+	}
+
+	free(sorted);
+	return nr_bits + 1;
+}
+
+void load_delta_islands(int progress)
+{
+	uint32_t nr_bits;
+	int i;
+
+	if (!island_regexes_nr)
+		return;
+
+	for_each_ref(find_island_for_ref, NULL);
+
+	nr_bits = assign_island_bits();
+	island_bitmap_size = (nr_bits + 31) / 32;
+	island_marks = kh_init_sha1();
+
+	for (i = 0; i < remote_islands.nr; i++)
+		mark_remote_island(remote_islands.items[i].util);
+
+	if (progress)
+		fprintf(stderr, _("Marked %d islands, done.\n"),
+			remote_islands.nr);
+
+	for (i = 0; i < remote_islands.nr; i++) {
+		struct remote_island *rl = remote_islands.items[i].util;
+		sha1_array_clear(&rl->tips);
+	}
+	string_list_clear(&remote_islands, 1);
+}
+
+void propagate_island_marks(struct commit *commit)
+{
+	struct island_bitmap *marks = find_island_marks(commit->object.sha1);
+	struct commit_list *p;
+
+	if (!marks)
+		return;
+
+	parse_commit(commit);
+	set_island_marks(&commit->tree->object, marks);
+	for (p = commit->parents; p; p = p->next)
+		set_island_marks(&p->item->object, marks);
+}
+
+struct tree_islands_todo {
+	struct object_entry *entry;
+	unsigned int depth;
+};
+
+static int tree_depth_compare(const void *_a, const void *_b)
+{
+	const struct tree_islands_todo *a = _a;
+	const struct tree_islands_todo *b = _b;
+
+	if (a->depth != b->depth)
+		return a->depth < b->depth ? -1 : 1;
+	return a->entry < b->entry ? -1 : (a->entry > b->entry);
+}
+
+/*
+ * The walk only marks the root trees of commits; hand the marks of
+ * every tree to its entries, outer trees first so that a subtree has
+ * all of its marks before it passes them on.
+ */
+void resolve_tree_islands(int progress, struct packing_data *to_pack)
+{
+	struct progress *progress_state = NULL;
+	struct tree_islands_todo *todo;
+	int nr = 0;
+	uint32_t i;
+
+	if (!island_marks)
+		return;
+
+	todo = xmalloc(to_pack->nr_objects * sizeof(*todo));
+	for (i = 0; i < to_pack->nr_objects; i++) {
+		if (to_pack->objects[i].type != OBJ_TREE)
+			continue;
+		todo[nr].entry = &to_pack->objects[i];
+		todo[nr].depth = oe_tree_depth(to_pack, &to_pack->objects[i]);
+		nr++;
+	}
+	qsort(todo, nr, sizeof(*todo), tree_depth_compare);
+
+	if (progress)
+		progress_state = start_progress(_("Propagating island marks"), nr);
+
+	for (i = 0; i < nr; i++) {
+		struct object_entry *ent = todo[i].entry;
+		struct island_bitmap *marks;
+		struct tree *tree;
+		struct tree_desc desc;
+		struct name_entry entry;
+
+		marks = find_island_marks(ent->idx.sha1);
+		if (marks) {
+			tree = lookup_tree(ent->idx.sha1);
+			if (!tree || parse_tree(tree) < 0)
+				die(_("bad tree object %s"),
+				    sha1_to_hex(ent->idx.sha1));
+
+			init_tree_desc(&desc, tree->buffer, tree->size);
+			while (tree_entry(&desc, &entry)) {
+				struct object *obj;
+
+				if (S_ISGITLINK(entry.mode))
+					continue;
+				obj = lookup_object(entry.sha1);
+				if (obj)
+					set_island_marks(obj, marks);
+			}
+			free_tree_buffer(tree);
+		}
+		display_progress(progress_state, i + 1);
+	}
+
+	stop_progress(&progress_state);
+	free(todo);
+}
+
+int island_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "pack.island")) {
+		struct strbuf re = STRBUF_INIT;
+
+		if (!value)
+			return config_error_nonbool(var);
+
+		ALLOC_GROW(island_regexes, island_regexes_nr + 1,
+			   island_regexes_alloc);
+		if (*value != '^')
+			strbuf_addch(&re, '^');
+		strbuf_addstr(&re, value);
+		if (regcomp(&island_regexes[island_regexes_nr], re.buf,
+			    REG_EXTENDED))
+			die(_("failed to load island regex for '%s': %s"),
+			    var, re.buf);
+		island_regexes_nr++;
+		strbuf_release(&re);
+	}
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef DELTA_ISLANDS_H
+#define DELTA_ISLANDS_H
+
+struct commit;
+struct packing_data;
+
+/*
+ * Delta islands partition the objects of a repository by the refs
+ * that reach them, so that pack-objects never picks a delta base
+ * that is missing from one of the islands of the object deltified
+ * against it.  The islands are named by the `pack.island` config.
+ */
+int island_config(const char *var, const char *value, void *cb);
+
+void load_delta_islands(int progress);
+void propagate_island_marks(struct commit *commit);
+void resolve_tree_islands(int progress, struct packing_data *to_pack);
+
+int in_same_island(const unsigned char *trg_sha1, const unsigned char *src_sha1);
+int island_delta_cmp(const unsigned char *a, const unsigned char *b);
+
+#endif
@@ -12,6 +12,7 @@
 #include "refs.h"
 #include "submodule.h"
 #include "dir.h"
+#include "sparse-index.h"
 
 /*
  * diff-files
@@ -193,6 +194,9 @@ int run_diff_files(struct rev_info *revs, unsigned int option)
 
 		if (ce_uptodate(ce) || ce_skip_worktree(ce))
 			continue;
+		/* the fsmonitor did not report a change to it */
+		if (ce->ce_flags & CE_FSMONITOR_VALID)
+			continue;
 
 		/* If CE_VALID is set, don't look at workdir for file removal */
 		changed = (ce->ce_flags & CE_VALID) ? 0 : check_removed(ce, &st);
@@ -463,6 +467,10 @@ static int diff_cache(struct rev_info *revs,
 	opts.index_only = cached;
 	opts.diff_index_cached = (cached &&
 				  !DIFF_OPT_TST(&revs->diffopt, FIND_COPIES_HARDER));
+	/* the sparse directories are skipped, if they are all the same */
+	if (opts.diff_index_cached &&
+	    !sparse_index_matches_tree(&the_index, tree->object.sha1))
+		ensure_full_index(&the_index);
 	opts.merge = 1;
 	opts.fn = oneway_diff;
 	opts.unpack_data = revs;
@@ -12,6 +12,7 @@
 #include "refs.h"
 #include "wildmatch.h"
 #include "pathspec.h"
+#include "sparse-index.h"
 
 struct path_simplify {
 	int len;
@@ -32,7 +33,7 @@ enum path_treatment {
 };
 
 static enum path_treatment read_directory_recursive(struct dir_struct *dir,
-	const char *path, int len,
+	const char *path, int len, struct untracked_cache_dir *untracked,
 	int check_only, const struct path_simplify *simplify);
 static int get_dtype(struct dirent *de, const char *path, int len);
 
@@ -500,10 +501,221 @@ void clear_exclude_list(struct exclude_list *el)
 		free(el->excludes[i]);
 	free(el->excludes);
 	free(el->filebuf);
+	if (el->use_cone_patterns) {
+		hashmap_free(&el->recursive_hashmap, 1);
+		hashmap_free(&el->parent_hashmap, 1);
+	}
 
 	el->nr = 0;
 	el->excludes = NULL;
 	el->filebuf = NULL;
+	el->use_cone_patterns = 0;
+}
+
+struct cone_dir {
+	struct hashmap_entry ent;
+	/* where the patterns that name it are, for checking their order */
+	int pos, negative_pos;
+	int len;
+	char path[FLEX_ARRAY];
+};
+
+struct cone_dir_key {
+	const char *path;
+	int len;
+};
+
+static int cone_dir_cmp(const struct cone_dir *a, const struct cone_dir *b,
+			const struct cone_dir_key *key)
+{
+	const char *path = key ? key->path : b->path;
+	int len = key ? key->len : b->len;
+
+	if (a->len != len)
+		return 1;
+	return ignore_case ? strncasecmp(a->path, path, len) :
+		memcmp(a->path, path, len);
+}
+
+static struct cone_dir *find_cone_dir(struct hashmap *map,
+				      const char *path, int len)
+{
+	struct hashmap_entry ent;
+	struct cone_dir_key key;
+
+	key.path = path;
+	key.len = len;
+	hashmap_entry_init(&ent, ignore_case ? memihash(path, len) :
+			   memhash(path, len));
+	return hashmap_get(map, &ent, &key);
+}
+
+/* Whether "len" bytes of "path", or a directory above it, are included */
+static int in_recursive_cone(struct exclude_list *el, const char *path, int len)
+{
+	while (len > 0) {
+		if (find_cone_dir(&el->recursive_hashmap, path, len))
+			return 1;
+		while (--len > 0 && path[len] != '/')
+			; /* up to the parent */
+	}
+	return 0;
+}
+
+/*
+ * In cone mode, a file is included when its directory is in either
+ * set, or is below one of the recursive set; a directory is included
+ * as a whole when it is in the recursive set or below one, is looked
+ * into when it is in the parent set, and is excluded otherwise.
+ */
+static int is_excluded_from_cone(const char *pathname, int pathlen,
+				 int dtype, struct exclude_list *el)
+{
+	const char *slash;
+
+	if (el->full_cone)
+		return 1;
+	if (dtype == DT_DIR) {
+		if (in_recursive_cone(el, pathname, pathlen))
+			return 1;
+		if (find_cone_dir(&el->parent_hashmap, pathname, pathlen))
+			return -1;
+		return 0;
+	}
+	for (slash = pathname + pathlen; slash > pathname; slash--)
+		if (slash[-1] == '/')
+			break;
+	if (slash == pathname)
+		return el->cone_root_files;
+	if (find_cone_dir(&el->parent_hashmap, pathname, slash - 1 - pathname))
+		return 1;
+	return in_recursive_cone(el, pathname, slash - 1 - pathname);
+}
+
+static int add_cone_dir(struct hashmap *map, const char *path, int len,
+			int pos)
+{
+	struct cone_dir *d;
+
+	/* "path" is followed by the rest of the pattern, if any */
+	if (!len || *path == '/' || simple_length(path) < len)
+		return -1;
+	d = xmalloc(sizeof(*d) + len + 1);
+	hashmap_entry_init(d, ignore_case ? memihash(path, len) :
+			   memhash(path, len));
+	d->pos = pos;
+	d->negative_pos = -1;
+	d->len = len;
+	memcpy(d->path, path, len);
+	d->path[len] = '\0';
+	hashmap_add(map, d);
+	return 0;
+}
+
+/*
+ * The directories a directory of the cone is in must all be in the
+ * parent set, and the patterns that made them parents come before its
+ * own, for the patterns to mean the same matched one by one.
+ */
+static int check_cone_dir(struct exclude_list *el, const struct cone_dir *d)
+{
+	int len = d->len;
+
+	while (--len > 0) {
+		const struct cone_dir *parent;
+
+		if (d->path[len] != '/')
+			continue;
+		parent = find_cone_dir(&el->parent_hashmap, d->path, len);
+		if (!parent || d->pos < parent->negative_pos)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * See "Cone mode" in Documentation/git-read-tree.txt for the patterns
+ * a sparse-checkout file has in cone mode, and in which order.
+ *
+ * If the patterns of "el" are of these forms, set it up for matching
+ * paths with the directories named, in O(depth), and return 0;
+ * otherwise warn and return -1, and "el" is matched pattern by
+ * pattern as usual.
+ */
+int use_cone_patterns(struct exclude_list *el)
+{
+	struct hashmap_iter iter;
+	struct cone_dir *d;
+	int i, has_dirs = 0;
+
+	hashmap_init(&el->recursive_hashmap, (hashmap_cmp_fn)cone_dir_cmp, 0);
+	hashmap_init(&el->parent_hashmap, (hashmap_cmp_fn)cone_dir_cmp, 0);
+	el->cone_root_files = 0;
+	el->full_cone = 0;
+
+	for (i = 0; i < el->nr; i++) {
+		const struct exclude *x = el->excludes[i];
+		const char *p = x->pattern + 1;
+		int len = x->patternlen - 1;
+		int negative = x->flags & EXC_FLAG_NEGATIVE;
+		int dir = x->flags & EXC_FLAG_MUSTBEDIR;
+
+		if (x->baselen || x->patternlen < 2 || x->pattern[0] != '/')
+			goto not_cone;
+		if (len == 1 && *p == '*') {
+			if (!negative && !dir) {
+				el->cone_root_files = 1;
+				el->full_cone = 1;
+			} else if (negative && dir && !has_dirs) {
+				el->full_cone = 0;
+			} else {
+				goto not_cone;
+			}
+			continue;
+		}
+		if (!dir)
+			goto not_cone;
+		has_dirs = 1;
+		if (!negative) {
+			d = find_cone_dir(&el->recursive_hashmap, p, len);
+			if (d)
+				d->pos = i;
+			else if (find_cone_dir(&el->parent_hashmap, p, len) ||
+				 add_cone_dir(&el->recursive_hashmap, p, len, i))
+				goto not_cone;
+			continue;
+		}
+		/* "/A/" followed by its negated subdirectories */
+		if (len < 3 || p[len - 2] != '/' || p[len - 1] != '*')
+			goto not_cone;
+		len -= 2;
+		d = find_cone_dir(&el->recursive_hashmap, p, len);
+		if (!d)
+			goto not_cone;
+		hashmap_remove(&el->recursive_hashmap, d, NULL);
+		d->negative_pos = i;
+		hashmap_add(&el->parent_hashmap, d);
+	}
+
+	if (el->full_cone && el->parent_hashmap.size)
+		goto not_cone;
+	hashmap_iter_init(&el->recursive_hashmap, &iter);
+	while ((d = hashmap_iter_next(&iter)))
+		if (check_cone_dir(el, d))
+			goto not_cone;
+	hashmap_iter_init(&el->parent_hashmap, &iter);
+	while ((d = hashmap_iter_next(&iter)))
+		if (check_cone_dir(el, d))
+			goto not_cone;
+	el->use_cone_patterns = 1;
+	return 0;
+
+not_cone:
+	warning("the sparse-checkout patterns are not those of the cone mode; "
+		"matching them one by one");
+	hashmap_free(&el->recursive_hashmap, 1);
+	hashmap_free(&el->parent_hashmap, 1);
+	return -1;
 }
 
 static void trim_trailing_spaces(char *buf)
@@ -750,6 +962,12 @@ int is_excluded_from_list(const char *pathname,
 			  struct exclude_list *el)
 {
 	struct exclude *exclude;
+
+	if (el->use_cone_patterns) {
+		if (*dtype == DT_UNKNOWN)
+			*dtype = get_dtype(NULL, pathname, pathlen);
+		return is_excluded_from_cone(pathname, pathlen, *dtype, el);
+	}
 	exclude = last_exclude_matching_from_list(pathname, pathlen, basename, dtype, el);
 	if (exclude)
 		return exclude->flags & EXC_FLAG_NEGATIVE ? 0 : 1;
@@ -776,6 +994,324 @@ static struct exclude *last_exclude_matching_from_lists(struct dir_struct *dir,
 	return NULL;
 }
 
+/*
+ * Position of the subdirectory "name" (of length len) in the sorted
+ * dirs[] of "d", or -1 - the position where it would be inserted.
+ */
+static int untracked_dir_pos(const struct untracked_cache_dir *d,
+			     const char *name, int len)
+{
+	int lo = 0, hi = d->dirs_nr;
+
+	while (lo < hi) {
+		int mi = lo + (hi - lo) / 2;
+		const char *mi_name = d->dirs[mi]->name;
+		int cmp = strncmp(name, mi_name, len);
+
+		if (!cmp && mi_name[len])
+			cmp = -1;
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -lo - 1;
+}
+
+static struct untracked_cache_dir *lookup_untracked(struct untracked_cache_dir *d,
+						    const char *name, int len)
+{
+	struct untracked_cache_dir *sub;
+	int pos = untracked_dir_pos(d, name, len);
+
+	if (pos >= 0)
+		return d->dirs[pos];
+	pos = -pos - 1;
+	sub = xcalloc(1, sizeof(*sub) + len + 1);
+	memcpy(sub->name, name, len);
+	ALLOC_GROW(d->dirs, d->dirs_nr + 1, d->dirs_alloc);
+	memmove(d->dirs + pos + 1, d->dirs + pos,
+		(d->dirs_nr - pos) * sizeof(*d->dirs));
+	d->dirs[pos] = sub;
+	d->dirs_nr++;
+	return sub;
+}
+
+static void free_untracked(struct untracked_cache_dir *d)
+{
+	int i;
+
+	if (!d)
+		return;
+	for (i = 0; i < d->untracked_nr; i++)
+		free(d->untracked[i]);
+	for (i = 0; i < d->dirs_nr; i++)
+		free_untracked(d->dirs[i]);
+	free(d->untracked);
+	free(d->dirs);
+	free(d);
+}
+
+void free_untracked_cache(struct untracked_cache *uc)
+{
+	if (uc)
+		free_untracked(uc->root);
+	free(uc);
+}
+
+static void invalidate_gitignore(struct untracked_cache_dir *d)
+{
+	int i;
+
+	d->valid = 0;
+	for (i = 0; i < d->dirs_nr; i++)
+		invalidate_gitignore(d->dirs[i]);
+}
+
+/*
+ * Adding or removing an index entry can change what is untracked in
+ * its directory, and whether the directories leading to it are known
+ * to the index. When "path" is a directory, it is invalidated too.
+ */
+void untracked_cache_invalidate_path(struct index_state *istate, const char *path)
+{
+	struct untracked_cache_dir *d;
+
+	if (!istate->untracked)
+		return;
+	for (d = istate->untracked->root; d; ) {
+		const char *slash = strchrnul(path, '/');
+		int pos;
+
+		d->valid = 0;
+		if (slash == path)
+			break;
+		pos = untracked_dir_pos(d, path, slash - path);
+		d = pos < 0 ? NULL : d->dirs[pos];
+		if (!*slash) {
+			if (d)
+				d->valid = 0;
+			break;
+		}
+		path = slash + 1;
+	}
+}
+
+void untracked_cache_invalidate_all(struct index_state *istate)
+{
+	if (istate->untracked && istate->untracked->root)
+		invalidate_gitignore(istate->untracked->root);
+}
+
+#define UNTRACKED_VALID		(1 << 0)
+#define UNTRACKED_CHECK_ONLY	(1 << 1)
+#define UNTRACKED_RECURSE	(1 << 2)
+#define UNTRACKED_MAYBE		(1 << 3)
+
+static void write_uint32(struct strbuf *out, uint32_t v)
+{
+	v = htonl(v);
+	strbuf_add(out, &v, sizeof(v));
+}
+
+static void write_one_untracked(struct strbuf *out, struct untracked_cache_dir *d)
+{
+	const struct stat_data *sd = &d->stat_data;
+	int i;
+
+	strbuf_add(out, d->name, strlen(d->name) + 1);
+	write_uint32(out, sd->sd_ctime.sec);
+	write_uint32(out, sd->sd_ctime.nsec);
+	write_uint32(out, sd->sd_mtime.sec);
+	write_uint32(out, sd->sd_mtime.nsec);
+	write_uint32(out, sd->sd_dev);
+	write_uint32(out, sd->sd_ino);
+	write_uint32(out, sd->sd_uid);
+	write_uint32(out, sd->sd_gid);
+	write_uint32(out, sd->sd_size);
+	strbuf_add(out, d->exclude_sha1, 20);
+	write_uint32(out, (d->valid ? UNTRACKED_VALID : 0) |
+		     (d->check_only ? UNTRACKED_CHECK_ONLY : 0) |
+		     (d->recurse ? UNTRACKED_RECURSE : 0) |
+		     (d->maybe_untracked ? UNTRACKED_MAYBE : 0));
+	write_uint32(out, d->untracked_nr);
+	write_uint32(out, d->dirs_nr);
+	for (i = 0; i < d->untracked_nr; i++)
+		strbuf_add(out, d->untracked[i], strlen(d->untracked[i]) + 1);
+	for (i = 0; i < d->dirs_nr; i++)
+		write_one_untracked(out, d->dirs[i]);
+}
+
+void write_untracked_extension(struct strbuf *out, struct untracked_cache *uc)
+{
+	write_uint32(out, uc->dir_flags);
+	strbuf_add(out, uc->exclude_sha1, 20);
+	if (uc->root)
+		write_one_untracked(out, uc->root);
+}
+
+struct untracked_reader {
+	const unsigned char *data, *end;
+};
+
+static int read_uint32(struct untracked_reader *rd, uint32_t *v)
+{
+	if (rd->end - rd->data < 4)
+		return -1;
+	*v = get_be32(rd->data);
+	rd->data += 4;
+	return 0;
+}
+
+static const char *read_untracked_name(struct untracked_reader *rd, int *len)
+{
+	const unsigned char *eos = memchr(rd->data, '\0', rd->end - rd->data);
+	const char *name = (const char *)rd->data;
+
+	if (!eos)
+		return NULL;
+	*len = eos - rd->data;
+	rd->data = eos + 1;
+	return name;
+}
+
+static struct untracked_cache_dir *read_one_untracked(struct untracked_reader *rd)
+{
+	struct untracked_cache_dir *d;
+	struct stat_data *sd;
+	const char *name;
+	uint32_t bits, untracked_nr, dirs_nr, i;
+	int len;
+
+	name = read_untracked_name(rd, &len);
+	if (!name)
+		return NULL;
+	d = xcalloc(1, sizeof(*d) + len + 1);
+	memcpy(d->name, name, len);
+	sd = &d->stat_data;
+	if (read_uint32(rd, &sd->sd_ctime.sec) ||
+	    read_uint32(rd, &sd->sd_ctime.nsec) ||
+	    read_uint32(rd, &sd->sd_mtime.sec) ||
+	    read_uint32(rd, &sd->sd_mtime.nsec) ||
+	    read_uint32(rd, &sd->sd_dev) ||
+	    read_uint32(rd, &sd->sd_ino) ||
+	    read_uint32(rd, &sd->sd_uid) ||
+	    read_uint32(rd, &sd->sd_gid) ||
+	    read_uint32(rd, &sd->sd_size) ||
+	    rd->end - rd->data < 20)
+		goto error;
+	hashcpy(d->exclude_sha1, rd->data);
+	rd->data += 20;
+	if (read_uint32(rd, &bits) ||
+	    read_uint32(rd, &untracked_nr) ||
+	    read_uint32(rd, &dirs_nr) ||
+	    untracked_nr > rd->end - rd->data ||
+	    dirs_nr > rd->end - rd->data)
+		goto error;
+	d->valid = !!(bits & UNTRACKED_VALID);
+	d->check_only = !!(bits & UNTRACKED_CHECK_ONLY);
+	d->recurse = !!(bits & UNTRACKED_RECURSE);
+	d->maybe_untracked = !!(bits & UNTRACKED_MAYBE);
+
+	d->untracked_alloc = untracked_nr;
+	d->untracked = xcalloc(untracked_nr ? untracked_nr : 1, sizeof(*d->untracked));
+	for (i = 0; i < untracked_nr; i++) {
+		name = read_untracked_name(rd, &len);
+		if (!name)
+			goto error;
+		d->untracked[d->untracked_nr++] = xmemdupz(name, len);
+	}
+	d->dirs_alloc = dirs_nr;
+	d->dirs = xcalloc(dirs_nr ? dirs_nr : 1, sizeof(*d->dirs));
+	for (i = 0; i < dirs_nr; i++) {
+		struct untracked_cache_dir *sub = read_one_untracked(rd);
+		if (!sub)
+			goto error;
+		d->dirs[d->dirs_nr++] = sub;
+	}
+	return d;
+
+error:
+	free_untracked(d);
+	return NULL;
+}
+
+struct untracked_cache *read_untracked_extension(const void *data, unsigned long sz)
+{
+	struct untracked_reader rd;
+	struct untracked_cache *uc;
+	uint32_t flags;
+
+	rd.data = data;
+	rd.end = rd.data + sz;
+	if (read_uint32(&rd, &flags) || rd.end - rd.data < 20)
+		goto error;
+	uc = xcalloc(1, sizeof(*uc));
+	uc->dir_flags = flags;
+	hashcpy(uc->exclude_sha1, rd.data);
+	rd.data += 20;
+	if (rd.data < rd.end) {
+		uc->root = read_one_untracked(&rd);
+		if (!uc->root || rd.data != rd.end) {
+			free_untracked_cache(uc);
+			goto error;
+		}
+	}
+	return uc;
+
+error:
+	warning("ignoring invalid untracked cache in the index");
+	return NULL;
+}
+
+void hash_exclude_list(git_SHA_CTX *ctx, const struct exclude_list *el)
+{
+	int i;
+
+	for (i = 0; i < el->nr; i++) {
+		const struct exclude *x = el->excludes[i];
+		uint32_t flags = htonl(x->flags);
+
+		git_SHA1_Update(ctx, x->pattern, x->patternlen);
+		git_SHA1_Update(ctx, "", 1);
+		git_SHA1_Update(ctx, &flags, sizeof(flags));
+	}
+}
+
+/*
+ * A directory whose .gitignore now has other patterns than when it
+ * was cached has to be read again, and so does everything below it.
+ * Must be called right after prep_exclude() for that directory.
+ */
+static void check_gitignore(struct dir_struct *dir,
+			    struct untracked_cache_dir *d, int baselen)
+{
+	struct exclude_stack *stk = dir->exclude_stack;
+	unsigned char sha1[20];
+
+	hashclr(sha1);
+	if (stk && stk->baselen == baselen) {
+		struct exclude_list *el;
+
+		el = &dir->exclude_list_group[EXC_DIRS].el[stk->exclude_ix];
+		if (el->nr) {
+			git_SHA_CTX ctx;
+
+			git_SHA1_Init(&ctx);
+			hash_exclude_list(&ctx, el);
+			git_SHA1_Final(sha1, &ctx);
+		}
+	}
+	if (!hashcmp(sha1, d->exclude_sha1))
+		return;
+	if (d->valid)
+		dir->untracked->gitignore_invalidated++;
+	invalidate_gitignore(d);
+	hashcpy(d->exclude_sha1, sha1);
+}
+
 /*
  * Loads the per-directory exclude list for the substring of base
  * which has a char length of baselen.
@@ -957,6 +1493,11 @@ static enum exist_status directory_exists_in_index_icase(const char *dirname, in
 
 	if (!ce)
 		return index_nonexistent;
+	if (S_ISSPARSEDIR(ce->ce_mode) && ce_namelen(ce) == len + 1) {
+		/* what is in there is tracked or not, file by file */
+		ensure_full_index(&the_index);
+		return directory_exists_in_index_icase(dirname, len);
+	}
 	endchar = ce->name[len];
 
 	/*
@@ -1004,6 +1545,12 @@ static enum exist_status directory_exists_in_index(const char *dirname, int len)
 		endchar = ce->name[len];
 		if (endchar > '/')
 			break;
+		if (endchar == '/' && S_ISSPARSEDIR(ce->ce_mode) &&
+		    ce_namelen(ce) == len + 1) {
+			/* what is in there is tracked or not, file by file */
+			ensure_full_index(&the_index);
+			return directory_exists_in_index(dirname, len);
+		}
 		if (endchar == '/')
 			return index_directory;
 		if (!endchar && S_ISGITLINK(ce->ce_mode))
@@ -1046,6 +1593,7 @@ static enum exist_status directory_exists_in_index(const char *dirname, int len)
  *  (c) otherwise, we recurse into it.
  */
 static enum path_treatment treat_directory(struct dir_struct *dir,
+	struct untracked_cache_dir *untracked,
 	const char *dirname, int len, int exclude,
 	const struct path_simplify *simplify)
 {
@@ -1073,7 +1621,17 @@ static enum path_treatment treat_directory(struct dir_struct *dir,
 	if (!(dir->flags & DIR_HIDE_EMPTY_DIRECTORIES))
 		return exclude ? path_excluded : path_untracked;
 
-	return read_directory_recursive(dir, dirname, len, 1, simplify);
+	if (untracked) {
+		const char *name = dirname + len - 1;
+
+		while (name > dirname && name[-1] != '/')
+			name--;
+		untracked = lookup_untracked(untracked, name,
+					     dirname + len - 1 - name);
+		untracked->recurse = 1;
+		untracked->maybe_untracked = 1;
+	}
+	return read_directory_recursive(dir, dirname, len, untracked, 1, simplify);
 }
 
 /*
@@ -1189,6 +1747,7 @@ static int get_dtype(struct dirent *de, const char *path, int len)
 }
 
 static enum path_treatment treat_one_path(struct dir_struct *dir,
+					  struct untracked_cache_dir *untracked,
 					  struct strbuf *path,
 					  const struct path_simplify *simplify,
 					  int dtype, struct dirent *de)
@@ -1241,8 +1800,8 @@ static enum path_treatment treat_one_path(struct dir_struct *dir,
 		return path_none;
 	case DT_DIR:
 		strbuf_addch(path, '/');
-		return treat_directory(dir, path->buf, path->len, exclude,
-			simplify);
+		return treat_directory(dir, untracked, path->buf, path->len,
+			exclude, simplify);
 	case DT_REG:
 	case DT_LNK:
 		return exclude ? path_excluded : path_untracked;
@@ -1250,6 +1809,7 @@ static enum path_treatment treat_one_path(struct dir_struct *dir,
 }
 
 static enum path_treatment treat_path(struct dir_struct *dir,
+				      struct untracked_cache_dir *untracked,
 				      struct dirent *de,
 				      struct strbuf *path,
 				      int baselen,
@@ -1265,7 +1825,136 @@ static enum path_treatment treat_path(struct dir_struct *dir,
 		return path_none;
 
 	dtype = DTYPE(de);
-	return treat_one_path(dir, path, simplify, dtype, de);
+	return treat_one_path(dir, untracked, path, simplify, dtype, de);
+}
+
+/*
+ * Emit what the untracked cache remembers of "untracked", without
+ * reading the directory itself; its subdirectories are still checked
+ * with read_directory_recursive().
+ */
+static enum path_treatment replay_untracked(struct dir_struct *dir,
+					    struct untracked_cache_dir *untracked,
+					    struct strbuf *path, int baselen,
+					    int check_only,
+					    const struct path_simplify *simplify)
+{
+	enum path_treatment subdir_state, dir_state = path_none;
+	int i;
+
+	dir->untracked->dir_replayed++;
+	for (i = 0; i < untracked->untracked_nr; i++) {
+		if (check_only)
+			return path_untracked;
+		strbuf_setlen(path, baselen);
+		strbuf_addstr(path, untracked->untracked[i]);
+		dir_add_name(dir, path->buf, path->len);
+		dir_state = path_untracked;
+	}
+	for (i = 0; i < untracked->dirs_nr; i++) {
+		struct untracked_cache_dir *sub = untracked->dirs[i];
+
+		if (!sub->recurse)
+			continue;
+		strbuf_setlen(path, baselen);
+		strbuf_addstr(path, sub->name);
+		strbuf_addch(path, '/');
+		if (!sub->maybe_untracked && dir_state < path_recurse)
+			dir_state = path_recurse;
+		subdir_state = read_directory_recursive(dir, path->buf,
+			path->len, sub, check_only || sub->maybe_untracked,
+			simplify);
+		if (subdir_state > dir_state)
+			dir_state = subdir_state;
+		if (sub->maybe_untracked && subdir_state == path_untracked &&
+		    !check_only)
+			dir_add_name(dir, path->buf, path->len);
+		if (check_only && dir_state == path_untracked)
+			break;
+	}
+	return dir_state;
+}
+
+/*
+ * Whether what the untracked cache has for a directory can be used
+ * without reading it again. "st" is the stat data of the directory,
+ * or NULL to go by what the fsmonitor reported alone.
+ */
+static int untracked_dir_valid(struct untracked_cache_dir *untracked,
+			       struct stat *st, int check_only)
+{
+	if (!untracked->valid)
+		return 0;
+	/* only part of it may have been looked at */
+	if (untracked->check_only && !check_only)
+		return 0;
+	if (!st)
+		return the_index.fsmonitor_trusted;
+	if (match_stat_data(&untracked->stat_data, st))
+		return 0;
+	/* a change in the same second as the index was written */
+	if (the_index.timestamp.sec &&
+	    untracked->stat_data.sd_mtime.sec >= the_index.timestamp.sec)
+		return 0;
+	return 1;
+}
+
+/*
+ * Forget what the untracked cache has for "untracked", before it is
+ * read again.
+ */
+static void reset_untracked(struct dir_struct *dir,
+			    struct untracked_cache_dir *untracked,
+			    struct stat *st, int check_only)
+{
+	int i;
+
+	for (i = 0; i < untracked->untracked_nr; i++)
+		free(untracked->untracked[i]);
+	untracked->untracked_nr = 0;
+	for (i = 0; i < untracked->dirs_nr; i++)
+		untracked->dirs[i]->recurse = 0;
+	fill_stat_data(&untracked->stat_data, st);
+	untracked->check_only = !!check_only;
+	untracked->valid = 0;
+	dir->untracked->dir_read++;
+	the_index.cache_changed = 1;
+}
+
+/*
+ * Record the name "path" (relative to its directory at "baselen")
+ * that was found to be untracked, unless it is a directory whose own
+ * node will tell.
+ */
+static void add_untracked(struct untracked_cache_dir *untracked,
+			  struct strbuf *path, int baselen)
+{
+	const char *name = path->buf + baselen;
+	int len = path->len - baselen;
+
+	if (len && name[len - 1] == '/') {
+		int pos = untracked_dir_pos(untracked, name, len - 1);
+		if (pos >= 0 && untracked->dirs[pos]->recurse &&
+		    untracked->dirs[pos]->maybe_untracked)
+			return;
+	}
+	ALLOC_GROW(untracked->untracked, untracked->untracked_nr + 1,
+		   untracked->untracked_alloc);
+	untracked->untracked[untracked->untracked_nr++] = xstrdup(name);
+}
+
+/* Drop the subdirectories that were not seen when reading "untracked" */
+static void prune_untracked(struct untracked_cache_dir *untracked)
+{
+	int i, j;
+
+	for (i = j = 0; i < untracked->dirs_nr; i++) {
+		if (untracked->dirs[i]->recurse)
+			untracked->dirs[j++] = untracked->dirs[i];
+		else
+			free_untracked(untracked->dirs[i]);
+	}
+	untracked->dirs_nr = j;
 }
 
 /*
@@ -1277,10 +1966,15 @@ static enum path_treatment treat_path(struct dir_struct *dir,
  * Also, we ignore the name ".git" (even if it is not a directory).
  * That likely will not change.
  *
+ * When "untracked" is given, it is the node of the untracked cache
+ * for this directory: if it is still valid, it is replayed instead,
+ * and otherwise it is filled from what is read.
+ *
  * Returns the most significant path_treatment value encountered in the scan.
  */
 static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 				    const char *base, int baselen,
+				    struct untracked_cache_dir *untracked,
 				    int check_only,
 				    const struct path_simplify *simplify)
 {
@@ -1291,24 +1985,57 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 
 	strbuf_add(&path, base, baselen);
 
+	if (untracked) {
+		struct stat st;
+
+		prep_exclude(dir, path.buf, baselen);
+		check_gitignore(dir, untracked, baselen);
+		if (untracked_dir_valid(untracked, NULL, check_only)) {
+			dir_state = replay_untracked(dir, untracked, &path,
+						     baselen, check_only,
+						     simplify);
+			goto out;
+		} else if (lstat(path.len ? path.buf : ".", &st)) {
+			untracked = NULL;
+		} else if (untracked_dir_valid(untracked, &st, check_only)) {
+			dir_state = replay_untracked(dir, untracked, &path,
+						     baselen, check_only,
+						     simplify);
+			goto out;
+		} else
+			reset_untracked(dir, untracked, &st, check_only);
+	}
+
 	fdir = opendir(path.len ? path.buf : ".");
 	if (!fdir)
 		goto out;
 
 	while ((de = readdir(fdir)) != NULL) {
 		/* check how the file or directory should be treated */
-		state = treat_path(dir, de, &path, baselen, simplify);
+		state = treat_path(dir, untracked, de, &path, baselen, simplify);
 		if (state > dir_state)
 			dir_state = state;
 
 		/* recurse into subdir if instructed by treat_path */
 		if (state == path_recurse) {
+			struct untracked_cache_dir *sub = NULL;
+
+			if (untracked) {
+				sub = lookup_untracked(untracked,
+						       path.buf + baselen,
+						       path.len - baselen - 1);
+				sub->recurse = 1;
+				sub->maybe_untracked = 0;
+			}
 			subdir_state = read_directory_recursive(dir, path.buf,
-				path.len, check_only, simplify);
+				path.len, sub, check_only, simplify);
 			if (subdir_state > dir_state)
 				dir_state = subdir_state;
 		}
 
+		if (untracked && state == path_untracked)
+			add_untracked(untracked, &path, baselen);
+
 		if (check_only) {
 			/* abort early if maximum state has been reached */
 			if (dir_state == path_untracked)
@@ -1339,6 +2066,10 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 		}
 	}
 	closedir(fdir);
+	if (untracked) {
+		prune_untracked(untracked);
+		untracked->valid = 1;
+	}
  out:
 	strbuf_release(&path);
 
@@ -1409,7 +2140,7 @@ static int treat_leading_path(struct dir_struct *dir,
 			break;
 		if (simplify_away(sb.buf, sb.len, simplify))
 			break;
-		if (treat_one_path(dir, &sb, simplify,
+		if (treat_one_path(dir, NULL, &sb, simplify,
 				   DT_DIR, NULL) == path_none)
 			break; /* do not recurse into it */
 		if (len <= baselen) {
@@ -1422,9 +2153,74 @@ static int treat_leading_path(struct dir_struct *dir,
 	return rc;
 }
 
+/*
+ * Flags with which the untracked cache can not be built or used:
+ * what it records are the untracked names only.
+ */
+#define UNTRACKED_CACHE_BAD_FLAGS (DIR_SHOW_IGNORED | DIR_SHOW_IGNORED_TOO | \
+				   DIR_COLLECT_IGNORED | DIR_COLLECT_KILLED_ONLY)
+
+/*
+ * Returns the root of the untracked cache of the index if it can be
+ * used for this traversal, after creating or dropping it as
+ * core.untrackedCache says.
+ */
+static struct untracked_cache_dir *validate_untracked_cache(struct dir_struct *dir,
+							   int base_len,
+							   const struct pathspec *pathspec)
+{
+	struct untracked_cache *uc;
+	unsigned char sha1[20];
+	git_SHA_CTX ctx;
+	int i;
+
+	if (!core_untracked_cache) {
+		if (the_index.untracked) {
+			free_untracked_cache(the_index.untracked);
+			the_index.untracked = NULL;
+			the_index.cache_changed = 1;
+		}
+		return NULL;
+	}
+	if (dir->flags & UNTRACKED_CACHE_BAD_FLAGS)
+		return NULL;
+	if (!the_index.untracked) {
+		if (core_untracked_cache < 0)
+			return NULL;
+		uc = xcalloc(1, sizeof(*uc));
+		uc->dir_flags = dir->flags;
+		the_index.untracked = uc;
+		the_index.cache_changed = 1;
+	}
+	uc = the_index.untracked;
+
+	/* only whole-tree traversals with the standard excludes */
+	if (base_len || (pathspec && pathspec->nr) ||
+	    dir->flags != uc->dir_flags ||
+	    !dir->exclude_per_dir ||
+	    strcmp(dir->exclude_per_dir, ".gitignore") ||
+	    dir->exclude_list_group[EXC_CMDL].nr)
+		return NULL;
+
+	git_SHA1_Init(&ctx);
+	for (i = 0; i < dir->exclude_list_group[EXC_FILE].nr; i++)
+		hash_exclude_list(&ctx, &dir->exclude_list_group[EXC_FILE].el[i]);
+	git_SHA1_Final(sha1, &ctx);
+	if (!uc->root || hashcmp(sha1, uc->exclude_sha1)) {
+		free_untracked(uc->root);
+		uc->root = xcalloc(1, sizeof(*uc->root) + 1);
+		hashcpy(uc->exclude_sha1, sha1);
+		the_index.cache_changed = 1;
+	}
+	uc->dir_read = uc->dir_replayed = uc->gitignore_invalidated = 0;
+	dir->untracked = uc;
+	return uc->root;
+}
+
 int read_directory(struct dir_struct *dir, const char *path, int len, const struct pathspec *pathspec)
 {
 	struct path_simplify *simplify;
+	struct untracked_cache_dir *untracked;
 
 	/*
 	 * Check out create_simplify()
@@ -1448,9 +2244,19 @@ int read_directory(struct dir_struct *dir, const char *path, int len, const stru
 	 * create_simplify().
 	 */
 	simplify = create_simplify(pathspec ? pathspec->_raw : NULL);
+	untracked = validate_untracked_cache(dir, len, pathspec);
 	if (!len || treat_leading_path(dir, path, len, simplify))
-		read_directory_recursive(dir, path, len, 0, simplify);
+		read_directory_recursive(dir, path, len, untracked, 0, simplify);
 	free_simplify(simplify);
+	if (dir->untracked) {
+		struct untracked_cache *uc = dir->untracked;
+		trace_printf_key("GIT_TRACE_UNTRACKED_STATS",
+				 "untracked cache: read %d, replayed %d, "
+				 "gitignore invalidated %d\n",
+				 uc->dir_read, uc->dir_replayed,
+				 uc->gitignore_invalidated);
+		dir->untracked = NULL;
+	}
 	qsort(dir->entries, dir->nr, sizeof(struct dir_entry *), cmp_name);
 	qsort(dir->ignored, dir->ignored_nr, sizeof(struct dir_entry *), cmp_name);
 	return dir->nr;
@@ -52,6 +52,20 @@ struct exclude_list {
 		 */
 		int srcpos;
 	} **excludes;
+
+	/*
+	 * With use_cone_patterns, the patterns are only of the forms of
+	 * the "cone" mode of sparse checkouts (see use_cone_patterns()),
+	 * and paths are matched by looking their directories up in these
+	 * sets instead: the directories included with all they contain,
+	 * and those of which only the files are (and the directories
+	 * leading to others).
+	 */
+	unsigned use_cone_patterns : 1,
+		 cone_root_files : 1,
+		 full_cone : 1;
+	struct hashmap recursive_hashmap;
+	struct hashmap parent_hashmap;
 };
 
 /*
@@ -71,6 +85,48 @@ struct exclude_list_group {
 	struct exclude_list *el;
 };
 
+/*
+ * The untracked cache remembers, for each directory read_directory()
+ * has seen, what it found there the last time: the untracked names,
+ * and the subdirectories it had to look into. As long as the stat data
+ * of the directory is the same (no entry was added, removed or renamed
+ * in it), the .gitignore files that apply to it have the same patterns
+ * and no index entry in it was added or removed, the directory does
+ * not need to be read again.
+ */
+struct untracked_cache_dir {
+	struct untracked_cache_dir **dirs;
+	char **untracked;
+	struct stat_data stat_data;
+	unsigned int untracked_nr, untracked_alloc;
+	unsigned int dirs_nr, dirs_alloc;
+	/* patterns of the .gitignore file in this directory */
+	unsigned char exclude_sha1[20];
+	/*
+	 * "valid" says the lists can be used; "check_only" that this is a
+	 * directory unknown to the index, that was only looked into to
+	 * see if it has any untracked file (and so may have been read
+	 * partially); "recurse" that it was seen during this traversal;
+	 * "maybe_untracked" that its parent shows it as "name/" if it
+	 * turns out to have untracked files.
+	 */
+	unsigned int valid : 1;
+	unsigned int check_only : 1;
+	unsigned int recurse : 1;
+	unsigned int maybe_untracked : 1;
+	char name[FLEX_ARRAY];
+};
+
+struct untracked_cache {
+	/* the dir_struct flags it was built for */
+	unsigned int dir_flags;
+	/* patterns of .git/info/exclude and core.excludesfile */
+	unsigned char exclude_sha1[20];
+	struct untracked_cache_dir *root;
+	/* statistics of the last traversal */
+	int dir_read, dir_replayed, gitignore_invalidated;
+};
+
 struct dir_struct {
 	int nr, alloc;
 	int ignored_nr, ignored_alloc;
@@ -118,6 +174,9 @@ struct dir_struct {
 	struct exclude_stack *exclude_stack;
 	struct exclude *exclude;
 	char basebuf[PATH_MAX];
+
+	/* set by read_directory() when the index has an untracked cache */
+	struct untracked_cache *untracked;
 };
 
 /*
@@ -168,6 +227,8 @@ extern void parse_exclude_pattern(const char **string, int *patternlen, int *fla
 extern void add_exclude(const char *string, const char *base,
 			int baselen, struct exclude_list *el, int srcpos);
 extern void clear_exclude_list(struct exclude_list *el);
+extern int use_cone_patterns(struct exclude_list *el);
+extern void hash_exclude_list(git_SHA_CTX *ctx, const struct exclude_list *el);
 extern void clear_directory(struct dir_struct *dir);
 extern int file_exists(const char *);
 
@@ -205,6 +266,12 @@ extern int git_fnmatch(const struct pathspec_item *item,
 		       const char *pattern, const char *string,
 		       int prefix);
 
+extern struct untracked_cache *read_untracked_extension(const void *data, unsigned long sz);
+extern void write_untracked_extension(struct strbuf *out, struct untracked_cache *uc);
+extern void free_untracked_cache(struct untracked_cache *uc);
+extern void untracked_cache_invalidate_path(struct index_state *istate, const char *path);
+extern void untracked_cache_invalidate_all(struct index_state *istate);
+
 static inline int ce_path_match(const struct cache_entry *ce,
 				const struct pathspec *pathspec,
 				char *seen)
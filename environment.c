@@ -56,13 +56,17 @@ enum push_default_type push_default = PUSH_DEFAULT_UNSPECIFIED;
 #define OBJECT_CREATION_MODE OBJECT_CREATION_USES_HARDLINKS
 #endif
 enum object_creation_mode object_creation_mode = OBJECT_CREATION_MODE;
+enum ref_storage ref_storage = REF_STORAGE_FILES;
+enum object_codec object_codec = OBJECT_CODEC_ZLIB;
 char *notes_ref_name;
 int grafts_replace_parents = 1;
 int core_apply_sparse_checkout;
+int core_sparse_checkout_cone;
 int merge_log_config = -1;
 int precomposed_unicode = -1; /* see probe_utf8_pathname_composition() */
 struct startup_info *startup_info;
 unsigned long pack_size_limit_cfg;
+int pack_write_threads;
 
 /*
  * The character that begins a commented line in user-editable file
@@ -73,6 +77,22 @@ char comment_line_char = '#';
 /* Parallel index stat data preload? */
 int core_preload_index = 0;
 
+/* Parse commits from objects/info/commit-graph when available? */
+int core_commit_graph;
+
+/* Look packed objects up in objects/pack/multi-pack-index when available? */
+int core_multi_pack_index;
+
+/* Keep (1), drop (0) or leave alone (-1) the untracked cache of the index */
+int core_untracked_cache = -1;
+
+/* Write a split (1), full (0) or same-as-read (-1) index */
+int core_split_index = -1;
+int split_index_max_percent_change = 20;
+
+/* Expand a sparse index as it is read, unless the command knows better */
+int command_requires_full_index = 1;
+
 /* This is set by setup_git_dir_gently() and/or git_default_config() */
 char *git_work_tree_cfg;
 static char *work_tree;
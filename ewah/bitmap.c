@@ -23,6 +23,20 @@
 #define MASK(x) ((eword_t)1 << (x % BITS_IN_WORD))
 #define BLOCK(x) (x / BITS_IN_WORD)
 
+static void bitmap_grow(struct bitmap *self, size_t word_alloc)
+{
+	size_t old_size = self->word_alloc;
+
+	if (word_alloc <= old_size)
+		return;
+
+	self->word_alloc = word_alloc;
+	self->words = ewah_realloc(self->words,
+		self->word_alloc * sizeof(eword_t));
+	memset(self->words + old_size, 0x0,
+		(self->word_alloc - old_size) * sizeof(eword_t));
+}
+
 struct bitmap *bitmap_new(void)
 {
 	struct bitmap *bitmap = ewah_malloc(sizeof(struct bitmap));
@@ -92,24 +106,12 @@ struct ewah_bitmap *bitmap_to_ewah(struct bitmap *bitmap)
 
 struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah)
 {
-	struct bitmap *bitmap = bitmap_new();
-	struct ewah_iterator it;
-	eword_t blowup;
-	size_t i = 0;
-
-	ewah_iterator_init(&it, ewah);
-
-	while (ewah_iterator_next(&blowup, &it)) {
-		if (i >= bitmap->word_alloc) {
-			bitmap->word_alloc *= 1.5;
-			bitmap->words = ewah_realloc(
-				bitmap->words, bitmap->word_alloc * sizeof(eword_t));
-		}
+	struct bitmap *bitmap = ewah_malloc(sizeof(struct bitmap));
 
-		bitmap->words[i++] = blowup;
-	}
+	bitmap->word_alloc = (ewah->bit_size / BITS_IN_WORD) + 1;
+	bitmap->words = ewah_calloc(bitmap->word_alloc, sizeof(eword_t));
 
-	bitmap->word_alloc = i;
+	bitmap_or_ewah(bitmap, ewah);
 	return bitmap;
 }
 
@@ -124,26 +126,54 @@ void bitmap_and_not(struct bitmap *self, struct bitmap *other)
 		self->words[i] &= ~other->words[i];
 }
 
-void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other)
+void bitmap_and_not_ewah(struct bitmap *self, struct ewah_bitmap *other)
 {
-	size_t original_size = self->word_alloc;
-	size_t other_final = (other->bit_size / BITS_IN_WORD) + 1;
-	size_t i = 0;
-	struct ewah_iterator it;
-	eword_t word;
-
-	if (self->word_alloc < other_final) {
-		self->word_alloc = other_final;
-		self->words = ewah_realloc(self->words,
-			self->word_alloc * sizeof(eword_t));
-		memset(self->words + original_size, 0x0,
-			(self->word_alloc - original_size) * sizeof(eword_t));
+	struct ewah_run_iterator it;
+	size_t i, pos, end;
+
+	ewah_run_iterator_init(&it, other);
+
+	while (ewah_run_iterator_next(&it) && it.word_pos < self->word_alloc) {
+		pos = it.word_pos;
+		end = pos + it.run_len;
+		if (end > self->word_alloc)
+			end = self->word_alloc;
+
+		if (it.run_bit)
+			memset(self->words + pos, 0x0, (end - pos) * sizeof(eword_t));
+
+		pos = end;
+		end = pos + it.literal_nr;
+		if (end > self->word_alloc)
+			end = self->word_alloc;
+
+		for (i = 0; pos + i < end; ++i)
+			self->words[pos + i] &= ~it.literals[i];
 	}
+}
 
-	ewah_iterator_init(&it, other);
+void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other)
+{
+	struct ewah_run_iterator it;
+	eword_t *words;
+	size_t i;
+
+	bitmap_grow(self, (other->bit_size / BITS_IN_WORD) + 1);
+
+	ewah_run_iterator_init(&it, other);
 
-	while (ewah_iterator_next(&word, &it))
-		self->words[i++] |= word;
+	while (ewah_run_iterator_next(&it)) {
+		bitmap_grow(self, it.word_pos + it.run_len + it.literal_nr);
+		words = self->words + it.word_pos;
+
+		/* runs of zeroes leave "self" as it is */
+		if (it.run_bit)
+			memset(words, 0xff, it.run_len * sizeof(eword_t));
+
+		words += it.run_len;
+		for (i = 0; i < it.literal_nr; ++i)
+			words[i] |= it.literals[i];
+	}
 }
 
 void bitmap_each_bit(struct bitmap *self, ewah_callback callback, void *data)
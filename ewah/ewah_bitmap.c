@@ -381,6 +381,41 @@ void ewah_iterator_init(struct ewah_iterator *it, struct ewah_bitmap *parent)
 		read_new_rlw(it);
 }
 
+void ewah_run_iterator_init(struct ewah_run_iterator *it, struct ewah_bitmap *parent)
+{
+	it->buffer = parent->buffer;
+	it->buffer_size = parent->buffer_size;
+	it->pointer = 0;
+
+	it->word_pos = 0;
+	it->run_len = 0;
+	it->run_bit = 0;
+	it->literals = NULL;
+	it->literal_nr = 0;
+}
+
+int ewah_run_iterator_next(struct ewah_run_iterator *it)
+{
+	const eword_t *word;
+
+	if (it->pointer >= it->buffer_size)
+		return 0;
+
+	it->word_pos += it->run_len + it->literal_nr;
+
+	word = &it->buffer[it->pointer];
+	it->run_len = rlw_get_running_len(word);
+	it->run_bit = rlw_get_run_bit(word);
+	it->literal_nr = rlw_get_literal_words(word);
+	it->literals = word + 1;
+
+	if (it->literal_nr > it->buffer_size - it->pointer - 1)
+		it->literal_nr = it->buffer_size - it->pointer - 1;
+	it->pointer += 1 + it->literal_nr;
+
+	return 1;
+}
+
 void ewah_not(struct ewah_bitmap *self)
 {
 	size_t pointer = 0;
@@ -173,6 +173,46 @@ void ewah_iterator_init(struct ewah_iterator *it, struct ewah_bitmap *parent);
  */
 int ewah_iterator_next(eword_t *next, struct ewah_iterator *it);
 
+struct ewah_run_iterator {
+	const eword_t *buffer;
+	size_t buffer_size;
+	size_t pointer;
+
+	/* filled in by ewah_run_iterator_next() */
+	size_t word_pos;
+	size_t run_len;
+	int run_bit;
+	const eword_t *literals;
+	size_t literal_nr;
+};
+
+/**
+ * Initialize an iterator over the marker words of the bitmap. Unlike
+ * `ewah_iterator`, it does not expand runs: each step yields a run of
+ * `run_len` words that are all zero or all one (`run_bit`), followed by
+ * `literal_nr` literal words, starting at word `word_pos` of the
+ * uncompressed bitmap.
+ *
+ * This lets an operation skip or fill a whole run at once, and work on
+ * the literal words in a tight loop.
+ *
+ * E.g.
+ *
+ *		ewah_run_iterator_init(&it, bitmap);
+ *		while (ewah_run_iterator_next(&it)) {
+ *			// words [it.word_pos, it.word_pos + it.run_len)
+ *			// are all it.run_bit, followed by it.literals[]
+ *		}
+ */
+void ewah_run_iterator_init(struct ewah_run_iterator *it, struct ewah_bitmap *parent);
+
+/**
+ * Move to the next marker word.
+ *
+ * Return: true if there was one, false at the end of the bitmap
+ */
+int ewah_run_iterator_next(struct ewah_run_iterator *it);
+
 void ewah_or(
 	struct ewah_bitmap *ewah_i,
 	struct ewah_bitmap *ewah_j,
@@ -224,6 +264,12 @@ struct ewah_bitmap * bitmap_to_ewah(struct bitmap *bitmap);
 struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah);
 
 void bitmap_and_not(struct bitmap *self, struct bitmap *other);
+
+/*
+ * In-place operations with a compressed bitmap. They work a run of
+ * words at a time and never expand `other`.
+ */
+void bitmap_and_not_ewah(struct bitmap *self, struct ewah_bitmap *other);
 void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other);
 void bitmap_or(struct bitmap *self, const struct bitmap *other);
 
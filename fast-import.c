@@ -1054,7 +1054,7 @@ static int store_object(
 		delta = NULL;
 
 	memset(&s, 0, sizeof(s));
-	git_deflate_init(&s, pack_compression_level);
+	git_deflate_init_codec(&s, pack_compression_level, object_codec);
 	if (delta) {
 		s.next_in = delta;
 		s.avail_in = deltalen;
@@ -1082,7 +1082,8 @@ static int store_object(
 			delta = NULL;
 
 			memset(&s, 0, sizeof(s));
-			git_deflate_init(&s, pack_compression_level);
+			git_deflate_init_codec(&s, pack_compression_level,
+					       object_codec);
 			s.next_in = (void *)dat->buf;
 			s.avail_in = dat->len;
 			s.avail_out = git_deflate_bound(&s, s.avail_in);
@@ -1182,7 +1183,7 @@ static void stream_blob(uintmax_t len, unsigned char *sha1out, uintmax_t mark)
 	crc32_begin(pack_file);
 
 	memset(&s, 0, sizeof(s));
-	git_deflate_init(&s, pack_compression_level);
+	git_deflate_init_codec(&s, pack_compression_level, object_codec);
 
 	hdrlen = encode_in_pack_object_header(OBJ_BLOB, len, out_buf);
 	if (out_sz <= hdrlen)
@@ -23,6 +23,7 @@ static int no_done;
 static int fetch_fsck_objects = -1;
 static int transfer_fsck_objects = -1;
 static int agent_supported;
+static int use_object_codec;
 static struct lock_file shallow_lock;
 static const char *alternate_shallow_file;
 
@@ -294,6 +295,8 @@ static int find_common(struct fetch_pack_args *args,
 			if (args->no_progress)   strbuf_addstr(&c, " no-progress");
 			if (args->include_tag)   strbuf_addstr(&c, " include-tag");
 			if (prefer_ofs_delta)   strbuf_addstr(&c, " ofs-delta");
+			if (use_object_codec)   strbuf_addf(&c, " object-codec=%s",
+							    object_codec_name(object_codec));
 			if (agent_supported)    strbuf_addf(&c, " agent=%s",
 							    git_user_agent_sanitized());
 			packet_buf_write(&req_buf, "want %s%s\n", remote_hex, c.buf);
@@ -779,8 +782,8 @@ static struct ref *do_fetch_pack(struct fetch_pack_args *args,
 {
 	struct ref *ref = copy_ref_list(orig_ref);
 	unsigned char sha1[20];
-	const char *agent_feature;
-	int agent_len;
+	const char *agent_feature, *codec_feature;
+	int agent_len, codec_len;
 
 	sort_ref_list(&ref, ref_compare_name);
 	qsort(sought, nr_sought, sizeof(*sought), cmp_ref_by_name);
@@ -836,6 +839,19 @@ static struct ref *do_fetch_pack(struct fetch_pack_args *args,
 			fprintf(stderr, "Server version is %.*s\n",
 				agent_len, agent_feature);
 	}
+	/*
+	 * Objects in a codec other than zlib are only good for us if we
+	 * store them the same way, and they can be kept as they come.
+	 */
+	if (object_codec != OBJECT_CODEC_ZLIB &&
+	    (codec_feature = server_feature_value("object-codec", &codec_len)) &&
+	    codec_len == strlen(object_codec_name(object_codec)) &&
+	    !strncmp(codec_feature, object_codec_name(object_codec), codec_len)) {
+		if (args->verbose)
+			fprintf(stderr, "Server supports object-codec=%s\n",
+				object_codec_name(object_codec));
+		use_object_codec = 1;
+	}
 
 	if (everything_local(args, &ref, sought, nr_sought)) {
 		packet_flush(fd[1]);
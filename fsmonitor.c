@@ -0,0 +1,272 @@
+#include "cache.h"
+#include "dir.h"
+#include "ewah/ewok.h"
+#include "run-command.h"
+#include "fsmonitor.h"
+
+#define FSMONITOR_VERSION 1
+
+static const char *core_fsmonitor;
+
+static int fsmonitor_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "core.fsmonitor"))
+		return git_config_string(&core_fsmonitor, var, value);
+	return 0;
+}
+
+/*
+ * The index may be read before the command has read its
+ * configuration (e.g. to look for .gitmodules), so the hook is
+ * looked up on its own.
+ */
+static const char *fsmonitor_hook(void)
+{
+	static int config_read;
+
+	if (!config_read) {
+		git_config(fsmonitor_config, NULL);
+		config_read = 1;
+	}
+	return core_fsmonitor;
+}
+
+/*
+ * The "FSMN" extension is a 32-bit version, the 64-bit time (in
+ * nanoseconds) the hook was last asked about, and the EWAH bitmap of
+ * the entries that were not known to be up to date then, preceded by
+ * its 32-bit size.
+ */
+int read_fsmonitor_extension(struct index_state *istate,
+			     const void *data, unsigned long sz)
+{
+	const unsigned char *p = data;
+	struct ewah_bitmap *dirty;
+	uint32_t ewah_size;
+
+	if (sz < 16 || get_be32(p) != FSMONITOR_VERSION)
+		goto bad;
+	ewah_size = get_be32(p + 12);
+	if (ewah_size > sz - 16)
+		goto bad;
+	dirty = ewah_new();
+	if (ewah_read_mmap(dirty, (void *)(p + 16), ewah_size) != ewah_size) {
+		ewah_free(dirty);
+		goto bad;
+	}
+	istate->fsmonitor_last_update =
+		((uint64_t)get_be32(p + 4) << 32) | get_be32(p + 8);
+	istate->fsmonitor_dirty = dirty;
+	return 0;
+
+bad:
+	warning("ignoring invalid fsmonitor data in the index");
+	return 0;
+}
+
+static int fsmonitor_write_ewah(void *sb, const void *buf, size_t len)
+{
+	strbuf_add(sb, buf, len);
+	return len;
+}
+
+void write_fsmonitor_extension(struct strbuf *sb, struct index_state *istate)
+{
+	struct ewah_bitmap *dirty = ewah_new();
+	uint32_t v;
+	size_t fixup;
+	int i, nr = 0;
+
+	v = htonl(FSMONITOR_VERSION);
+	strbuf_add(sb, &v, 4);
+	v = htonl((uint32_t)(istate->fsmonitor_last_update >> 32));
+	strbuf_add(sb, &v, 4);
+	v = htonl((uint32_t)istate->fsmonitor_last_update);
+	strbuf_add(sb, &v, 4);
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+
+		/* positions are those of the entries that are written */
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		if (!(ce->ce_flags & CE_FSMONITOR_VALID))
+			ewah_set(dirty, nr);
+		nr++;
+	}
+	fixup = sb->len;
+	strbuf_add(sb, &v, 4);
+	ewah_serialize_to(dirty, fsmonitor_write_ewah, sb);
+	v = htonl(sb->len - fixup - 4);
+	memcpy(sb->buf + fixup, &v, 4);
+	ewah_free(dirty);
+}
+
+static uint64_t fsmonitor_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+}
+
+/*
+ * Run the hook: it is given the protocol version and the time of the
+ * last query, and answers with the NUL-terminated paths that may have
+ * changed since, or with "/" when it can not tell.
+ */
+static int query_fsmonitor(uint64_t last_update, struct strbuf *out)
+{
+	struct child_process cp;
+	const char *argv[4];
+	char version[16], since[32];
+
+	snprintf(version, sizeof(version), "%d", FSMONITOR_VERSION);
+	snprintf(since, sizeof(since), "%"PRIuMAX, (uintmax_t)last_update);
+	argv[0] = core_fsmonitor;
+	argv[1] = version;
+	argv[2] = since;
+	argv[3] = NULL;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.argv = argv;
+	cp.use_shell = 1;
+	cp.no_stdin = 1;
+	cp.out = -1;
+	cp.dir = get_git_work_tree();
+	if (start_command(&cp))
+		return error("could not run fsmonitor hook '%s'", core_fsmonitor);
+	if (strbuf_read(out, cp.out, 1024) < 0) {
+		close(cp.out);
+		finish_command(&cp);
+		return error("could not read from fsmonitor hook '%s'",
+			     core_fsmonitor);
+	}
+	close(cp.out);
+	return finish_command(&cp);
+}
+
+static void fsmonitor_refresh_path(struct index_state *istate,
+				   const char *name, int len)
+{
+	struct strbuf dir = STRBUF_INIT;
+	int pos;
+
+	while (len && name[len - 1] == '/')
+		len--;
+	pos = index_name_pos(istate, name, len);
+	if (pos >= 0)
+		istate->cache[pos]->ce_flags &= ~CE_FSMONITOR_VALID;
+
+	/*
+	 * Everything below a directory.  Siblings like "d.c" sort
+	 * between "d" and "d/", so look "d/" up on its own.
+	 */
+	strbuf_add(&dir, name, len);
+	strbuf_addch(&dir, '/');
+	pos = index_name_pos(istate, dir.buf, dir.len);
+	if (pos < 0)
+		pos = -pos - 1;
+	for (; pos < istate->cache_nr; pos++) {
+		struct cache_entry *ce = istate->cache[pos];
+
+		if (strncmp(ce->name, dir.buf, dir.len))
+			break;
+		ce->ce_flags &= ~CE_FSMONITOR_VALID;
+	}
+	strbuf_release(&dir);
+	untracked_cache_invalidate_path(istate, name);
+}
+
+static void fsmonitor_invalidate_all(struct index_state *istate)
+{
+	int i;
+
+	for (i = 0; i < istate->cache_nr; i++)
+		istate->cache[i]->ce_flags &= ~CE_FSMONITOR_VALID;
+	untracked_cache_invalidate_all(istate);
+}
+
+static void fsmonitor_mark_dirty(size_t pos, void *data)
+{
+	struct index_state *istate = data;
+
+	/* a bitmap for another index marks everything */
+	if (pos >= istate->cache_nr) {
+		int i;
+		for (i = 0; i < istate->cache_nr; i++)
+			istate->cache[i]->ce_flags &= ~CE_FSMONITOR_VALID;
+		return;
+	}
+	istate->cache[pos]->ce_flags &= ~CE_FSMONITOR_VALID;
+}
+
+static void apply_fsmonitor_dirty(struct index_state *istate)
+{
+	int i;
+
+	for (i = 0; i < istate->cache_nr; i++)
+		istate->cache[i]->ce_flags |= CE_FSMONITOR_VALID;
+	ewah_each_bit(istate->fsmonitor_dirty, fsmonitor_mark_dirty, istate);
+}
+
+void tweak_fsmonitor(struct index_state *istate)
+{
+	struct strbuf changed = STRBUF_INIT;
+	const char *hook = fsmonitor_hook();
+	uint64_t now;
+	int i;
+
+	if (!hook || !*hook || !get_git_work_tree()) {
+		if (istate->fsmonitor_last_update) {
+			for (i = 0; i < istate->cache_nr; i++)
+				istate->cache[i]->ce_flags &= ~CE_FSMONITOR_VALID;
+			istate->fsmonitor_last_update = 0;
+			istate->cache_changed = 1;
+		}
+		goto out;
+	}
+
+	/* from now on, any change will be reported */
+	now = fsmonitor_now();
+	if (!istate->fsmonitor_last_update) {
+		/*
+		 * Nothing is known about what changed before: the untracked
+		 * cache may have been built by stat data alone.
+		 */
+		fsmonitor_invalidate_all(istate);
+		istate->fsmonitor_last_update = now;
+		istate->cache_changed = 1;
+		goto out;
+	}
+
+	if (query_fsmonitor(istate->fsmonitor_last_update, &changed) ||
+	    (changed.len && changed.buf[0] == '/')) {
+		fsmonitor_invalidate_all(istate);
+	} else {
+		const char *p = changed.buf, *end = changed.buf + changed.len;
+
+		if (istate->fsmonitor_dirty)
+			apply_fsmonitor_dirty(istate);
+		while (p < end) {
+			const char *eos = memchr(p, '\0', end - p);
+			int len = eos ? eos - p : end - p;
+
+			/* the strbuf keeps the last one NUL-terminated */
+			if (len)
+				fsmonitor_refresh_path(istate, p, len);
+			p += len + 1;
+		}
+		istate->fsmonitor_trusted = 1;
+	}
+	if (changed.len)
+		istate->cache_changed = 1;
+	istate->fsmonitor_last_update = now;
+
+out:
+	if (istate->fsmonitor_dirty) {
+		ewah_free(istate->fsmonitor_dirty);
+		istate->fsmonitor_dirty = NULL;
+	}
+	strbuf_release(&changed);
+}
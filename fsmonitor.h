@@ -0,0 +1,38 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+/*
+ * core.fsmonitor names a hook that tells which paths of the working
+ * tree may have changed since a given time. The index remembers, in
+ * the "FSMN" extension, when the hook was last asked and which of its
+ * entries were known to be up to date then; entries the hook does not
+ * report as changed since are taken to be up to date without lstat(),
+ * and so are the directories of the untracked cache.
+ */
+
+extern int read_fsmonitor_extension(struct index_state *istate,
+				    const void *data, unsigned long sz);
+extern void write_fsmonitor_extension(struct strbuf *sb,
+				      struct index_state *istate);
+
+/*
+ * Called once the index has been read: adds or drops the fsmonitor
+ * data as core.fsmonitor says, and asks the hook what changed.
+ */
+extern void tweak_fsmonitor(struct index_state *istate);
+
+/*
+ * An entry was found up to date by lstat(); the hook will report it
+ * when it changes.
+ */
+static inline void mark_fsmonitor_valid(struct index_state *istate,
+					struct cache_entry *ce)
+{
+	if (istate->fsmonitor_last_update &&
+	    !(ce->ce_flags & CE_FSMONITOR_VALID)) {
+		ce->ce_flags |= CE_FSMONITOR_VALID;
+		istate->cache_changed = 1;
+	}
+}
+
+#endif
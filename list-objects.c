@@ -81,8 +81,14 @@ static void process_tree(struct rev_info *revs,
 		die("bad tree object");
 	if (obj->flags & (UNINTERESTING | SEEN))
 		return;
-	if (parse_tree(tree) < 0)
-		die("bad tree object %s", sha1_to_hex(obj->sha1));
+	if (parse_tree(tree) < 0) {
+		if (!revs->do_not_die_on_missing_tree)
+			die("bad tree object %s", sha1_to_hex(obj->sha1));
+		/* let the caller see the tree it could not read */
+		obj->flags |= SEEN;
+		show(obj, path, name, cb_data);
+		return;
+	}
 	obj->flags |= SEEN;
 	show(obj, path, name, cb_data);
 	me.up = path;
@@ -0,0 +1,731 @@
+#include "cache.h"
+#include "csum-file.h"
+#include "dir.h"
+#include "progress.h"
+#include "midx.h"
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_HASH_VERSION 1 /* SHA-1 */
+
+#define MIDX_CHUNKID_PACKNAMES 0x504e414d /* "PNAM" */
+#define MIDX_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define MIDX_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define MIDX_CHUNKID_OBJECTOFFSETS 0x4f4f4646 /* "OOFF" */
+#define MIDX_CHUNKID_LARGEOFFSETS 0x4c4f4646 /* "LOFF" */
+
+#define MIDX_HEADER_SIZE 12
+#define MIDX_CHUNKLOOKUP_WIDTH 12
+#define MIDX_FANOUT_SIZE (4 * 256)
+#define MIDX_OFFSET_WIDTH 8
+#define MIDX_LARGE_OFFSET_NEEDED 0x80000000
+
+#define MIDX_MAX_CHUNKS 5
+
+struct multi_pack_index {
+	unsigned char *data;
+	size_t data_len;
+
+	uint32_t num_packs;
+	uint32_t num_objects;
+
+	const unsigned char *chunk_pack_names;
+	const unsigned char *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_object_offsets;
+	const unsigned char *chunk_large_offsets;
+	size_t num_large_offsets;
+
+	/* names of the .idx files, in pack-int-id order */
+	const char **pack_names;
+	/* the packed_git for each pack-int-id, NULL if not (yet) known */
+	struct packed_git **packs;
+};
+
+static struct multi_pack_index *midx;
+static int midx_prepared;
+
+static char *get_midx_filename(const char *object_dir)
+{
+	return mkpathdup("%s/pack/multi-pack-index", object_dir);
+}
+
+static void free_midx(struct multi_pack_index *m)
+{
+	munmap(m->data, m->data_len);
+	free(m->pack_names);
+	free(m->packs);
+	free(m);
+}
+
+static struct multi_pack_index *load_midx(const char *object_dir)
+{
+	struct multi_pack_index *m;
+	unsigned char *data, *chunk_lookup;
+	const char *name, *names_end = NULL;
+	char *midx_name;
+	size_t data_len;
+	struct stat st;
+	uint64_t last_offset = 0;
+	uint32_t i;
+	int fd, num_chunks;
+
+	midx_name = get_midx_filename(object_dir);
+	fd = git_open_noatime(midx_name);
+	if (fd < 0) {
+		free(midx_name);
+		return NULL;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		free(midx_name);
+		return NULL;
+	}
+	data_len = xsize_t(st.st_size);
+	if (data_len < MIDX_HEADER_SIZE + MIDX_CHUNKLOOKUP_WIDTH + 20) {
+		close(fd);
+		error("multi-pack-index file %s is too small", midx_name);
+		free(midx_name);
+		return NULL;
+	}
+	free(midx_name);
+	data = xmmap(NULL, data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (get_be32(data) != MIDX_SIGNATURE) {
+		error("multi-pack-index signature %X does not match signature %X",
+		      get_be32(data), MIDX_SIGNATURE);
+		munmap(data, data_len);
+		return NULL;
+	}
+	if (data[4] != MIDX_VERSION || data[5] != MIDX_HASH_VERSION) {
+		error("multi-pack-index version %d.%d not understood",
+		      data[4], data[5]);
+		munmap(data, data_len);
+		return NULL;
+	}
+
+	m = xcalloc(1, sizeof(*m));
+	m->data = data;
+	m->data_len = data_len;
+	num_chunks = data[6];
+	m->num_packs = get_be32(data + 8);
+
+	if (MIDX_HEADER_SIZE + (num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH + 20 > data_len) {
+		error("multi-pack-index chunk lookup table is truncated");
+		goto cleanup_fail;
+	}
+
+	chunk_lookup = data + MIDX_HEADER_SIZE;
+	for (i = 0; i < num_chunks; i++) {
+		uint32_t chunk_id = get_be32(chunk_lookup);
+		uint64_t chunk_offset = ((uint64_t)get_be32(chunk_lookup + 4) << 32) |
+					get_be32(chunk_lookup + 8);
+		uint64_t next_offset = ((uint64_t)get_be32(chunk_lookup + 16) << 32) |
+				       get_be32(chunk_lookup + 20);
+		const unsigned char *chunk = data + chunk_offset;
+
+		chunk_lookup += MIDX_CHUNKLOOKUP_WIDTH;
+
+		if (chunk_offset < last_offset || next_offset < chunk_offset ||
+		    next_offset > data_len - 20) {
+			error("improper chunk offset in multi-pack-index");
+			goto cleanup_fail;
+		}
+		last_offset = chunk_offset;
+
+		switch (chunk_id) {
+		case MIDX_CHUNKID_PACKNAMES:
+			m->chunk_pack_names = chunk;
+			names_end = (const char *)data + next_offset;
+			break;
+		case MIDX_CHUNKID_OIDFANOUT:
+			if (next_offset - chunk_offset == MIDX_FANOUT_SIZE)
+				m->chunk_oid_fanout = chunk;
+			break;
+		case MIDX_CHUNKID_OIDLOOKUP:
+			m->chunk_oid_lookup = chunk;
+			m->num_objects = (next_offset - chunk_offset) / 20;
+			break;
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			m->chunk_object_offsets = chunk;
+			if ((next_offset - chunk_offset) / MIDX_OFFSET_WIDTH !=
+			    m->num_objects)
+				m->chunk_object_offsets = NULL;
+			break;
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			m->chunk_large_offsets = chunk;
+			m->num_large_offsets = (next_offset - chunk_offset) / 8;
+			break;
+		}
+	}
+
+	if (!m->chunk_pack_names || !m->chunk_oid_fanout ||
+	    !m->chunk_oid_lookup || !m->chunk_object_offsets) {
+		error("multi-pack-index is missing required chunks");
+		goto cleanup_fail;
+	}
+	if (get_be32(m->chunk_oid_fanout + 4 * 255) != m->num_objects) {
+		error("multi-pack-index fanout does not match its object count");
+		goto cleanup_fail;
+	}
+
+	m->pack_names = xcalloc(m->num_packs ? m->num_packs : 1,
+				sizeof(*m->pack_names));
+	m->packs = xcalloc(m->num_packs ? m->num_packs : 1, sizeof(*m->packs));
+	name = (const char *)m->chunk_pack_names;
+	for (i = 0; i < m->num_packs; i++) {
+		const char *end = memchr(name, '\0', names_end - name);
+		if (!end) {
+			error("multi-pack-index pack names are truncated");
+			goto cleanup_fail;
+		}
+		if (i && strcmp(m->pack_names[i - 1], name) >= 0) {
+			error("multi-pack-index pack names are out of order: '%s' before '%s'",
+			      m->pack_names[i - 1], name);
+			goto cleanup_fail;
+		}
+		m->pack_names[i] = name;
+		name = end + 1;
+	}
+	return m;
+
+cleanup_fail:
+	free_midx(m);
+	return NULL;
+}
+
+static int midx_pack_pos(struct multi_pack_index *m, const char *idx_name)
+{
+	uint32_t lo = 0, hi = m->num_packs;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = strcmp(m->pack_names[mi], idx_name);
+		if (!cmp)
+			return mi;
+		if (cmp > 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -1;
+}
+
+/*
+ * Return the name of the .idx file of a pack, without the leading
+ * directories, in "buf".
+ */
+static void pack_idx_basename(struct strbuf *buf, const char *pack_name)
+{
+	const char *base = strrchr(pack_name, '/');
+
+	base = base ? base + 1 : pack_name;
+	strbuf_reset(buf);
+	strbuf_addstr(buf, base);
+	if (buf->len > 5 && !strcmp(buf->buf + buf->len - 5, ".pack"))
+		strbuf_setlen(buf, buf->len - 5);
+	strbuf_addstr(buf, ".idx");
+}
+
+static void prepare_midx(void)
+{
+	struct strbuf idx_name = STRBUF_INIT;
+	struct packed_git *p;
+
+	if (midx_prepared)
+		return;
+	midx_prepared = 1;
+	if (!core_multi_pack_index)
+		return;
+
+	midx = load_midx(get_object_directory());
+	if (!midx)
+		return;
+
+	/*
+	 * Tie each local pack we know about to its pack-int-id. A pack
+	 * that is covered by the index never needs a lookup of its own.
+	 */
+	for (p = packed_git; p; p = p->next) {
+		int pos;
+
+		if (!p->pack_local)
+			continue;
+		pack_idx_basename(&idx_name, p->pack_name);
+		pos = midx_pack_pos(midx, idx_name.buf);
+		if (pos < 0)
+			continue;
+		midx->packs[pos] = p;
+		p->multi_pack_index = 1;
+	}
+	strbuf_release(&idx_name);
+}
+
+void close_midx(void)
+{
+	struct packed_git *p;
+
+	if (!midx)
+		return;
+	for (p = packed_git; p; p = p->next)
+		p->multi_pack_index = 0;
+	free_midx(midx);
+	midx = NULL;
+	midx_prepared = 0;
+}
+
+static int bsearch_midx(struct multi_pack_index *m, const unsigned char *sha1,
+			uint32_t *pos)
+{
+	uint32_t lo, hi;
+
+	hi = get_be32(m->chunk_oid_fanout + 4 * sha1[0]);
+	lo = sha1[0] ? get_be32(m->chunk_oid_fanout + 4 * (sha1[0] - 1)) : 0;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(m->chunk_oid_lookup + 20 * mi, sha1);
+		if (!cmp) {
+			*pos = mi;
+			return 1;
+		}
+		if (cmp > 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return 0;
+}
+
+static uint32_t nth_midxed_pack_int_id(struct multi_pack_index *m, uint32_t pos)
+{
+	return get_be32(m->chunk_object_offsets + MIDX_OFFSET_WIDTH * pos);
+}
+
+static off_t nth_midxed_offset(struct multi_pack_index *m, uint32_t pos)
+{
+	const unsigned char *offset_data;
+	uint32_t offset32;
+
+	offset_data = m->chunk_object_offsets + MIDX_OFFSET_WIDTH * pos;
+	offset32 = get_be32(offset_data + 4);
+
+	if (offset32 & MIDX_LARGE_OFFSET_NEEDED) {
+		offset32 &= ~MIDX_LARGE_OFFSET_NEEDED;
+		if (offset32 >= m->num_large_offsets)
+			die("multi-pack-index large offset out of bounds");
+		return (((uint64_t)get_be32(m->chunk_large_offsets + 8 * offset32)) << 32) |
+			get_be32(m->chunk_large_offsets + 8 * offset32 + 4);
+	}
+	return offset32;
+}
+
+int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e)
+{
+	struct packed_git *p;
+	uint32_t pos, pack_int_id;
+
+	prepare_midx();
+	if (!midx)
+		return -1;
+	if (!bsearch_midx(midx, sha1, &pos))
+		return 0;
+
+	pack_int_id = nth_midxed_pack_int_id(midx, pos);
+	if (pack_int_id >= midx->num_packs)
+		die("bad pack-int-id %"PRIu32" in multi-pack-index", pack_int_id);
+	p = midx->packs[pack_int_id];
+	if (!p)
+		/* the pack went away since the index was written */
+		return -1;
+
+	e->offset = nth_midxed_offset(midx, pos);
+	e->p = p;
+	hashcpy(e->sha1, sha1);
+	return 1;
+}
+
+/*
+ * Writing
+ */
+
+struct midx_pack {
+	char *idx_name;
+	struct packed_git *p;
+	time_t mtime;
+	/* pack-int-id in the index we are replacing, or -1 */
+	int old_id;
+};
+
+struct midx_entry {
+	unsigned char sha1[20];
+	uint32_t pack_int_id;
+	time_t pack_mtime;
+	off_t offset;
+};
+
+static int midx_pack_compare(const void *a_, const void *b_)
+{
+	const struct midx_pack *a = a_, *b = b_;
+	return strcmp(a->idx_name, b->idx_name);
+}
+
+static int midx_entry_compare(const void *a_, const void *b_)
+{
+	const struct midx_entry *a = a_, *b = b_;
+	int cmp = hashcmp(a->sha1, b->sha1);
+
+	if (cmp)
+		return cmp;
+	/* prefer the copy in the youngest pack, like find_pack_entry() */
+	if (a->pack_mtime > b->pack_mtime)
+		return -1;
+	if (a->pack_mtime < b->pack_mtime)
+		return 1;
+	return a->pack_int_id < b->pack_int_id ? -1 :
+		a->pack_int_id > b->pack_int_id;
+}
+
+static void collect_packs(const char *object_dir, struct midx_pack **packs_p,
+			  uint32_t *nr_p, struct multi_pack_index *old)
+{
+	struct midx_pack *packs = NULL;
+	uint32_t nr = 0, alloc = 0;
+	struct strbuf path = STRBUF_INIT;
+	size_t dirlen;
+	struct dirent *de;
+	DIR *dir;
+
+	strbuf_addf(&path, "%s/pack/", object_dir);
+	dirlen = path.len;
+	dir = opendir(path.buf);
+	if (!dir) {
+		if (errno != ENOENT)
+			error("unable to open object pack directory: %s: %s",
+			      path.buf, strerror(errno));
+		strbuf_release(&path);
+		*packs_p = NULL;
+		*nr_p = 0;
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		struct packed_git *p;
+		int old_id;
+
+		if (!has_extension(de->d_name, ".idx"))
+			continue;
+		strbuf_setlen(&path, dirlen);
+		strbuf_addstr(&path, de->d_name);
+		p = add_packed_git(path.buf, path.len, 1);
+		if (!p)
+			continue;
+		old_id = old ? midx_pack_pos(old, de->d_name) : -1;
+		/*
+		 * A pack we cannot read the index of must not be listed,
+		 * or readers would stop looking at it on its own.
+		 */
+		if (old_id < 0 && open_pack_index(p)) {
+			warning("failed to open pack-index '%s'", p->pack_name);
+			free(p);
+			continue;
+		}
+
+		ALLOC_GROW(packs, nr + 1, alloc);
+		packs[nr].idx_name = xstrdup(de->d_name);
+		packs[nr].p = p;
+		packs[nr].mtime = p->mtime;
+		packs[nr].old_id = old_id;
+		nr++;
+	}
+	closedir(dir);
+	strbuf_release(&path);
+
+	qsort(packs, nr, sizeof(*packs), midx_pack_compare);
+	*packs_p = packs;
+	*nr_p = nr;
+}
+
+static void write_chunk_lookup_entry(struct sha1file *f, uint32_t id,
+				     uint64_t offset)
+{
+	uint32_t entry[3];
+
+	entry[0] = htonl(id);
+	entry[1] = htonl((uint32_t)(offset >> 32));
+	entry[2] = htonl((uint32_t)offset);
+	sha1write(f, entry, sizeof(entry));
+}
+
+int write_midx_file(const char *object_dir, int show_progress)
+{
+	static struct lock_file lock;
+	struct multi_pack_index *old;
+	struct midx_pack *packs;
+	struct midx_entry *entries = NULL;
+	struct progress *progress = NULL;
+	struct sha1file *f;
+	uint32_t nr_packs, nr_entries = 0, alloc_entries = 0;
+	uint32_t nr_large_offsets = 0, i, j, *old_to_new = NULL;
+	uint32_t chunk_ids[MIDX_MAX_CHUNKS + 1];
+	uint64_t chunk_offsets[MIDX_MAX_CHUNKS + 1];
+	size_t pack_names_len = 0;
+	unsigned char header[MIDX_HEADER_SIZE], checksum[20];
+	char *midx_name;
+	int fd, num_chunks;
+
+	old = load_midx(object_dir);
+	collect_packs(object_dir, &packs, &nr_packs, old);
+
+	if (old) {
+		old_to_new = xmalloc((old->num_packs ? old->num_packs : 1) *
+				     sizeof(*old_to_new));
+		for (i = 0; i < old->num_packs; i++)
+			old_to_new[i] = (uint32_t)-1;
+		for (i = 0; i < nr_packs; i++)
+			if (packs[i].old_id >= 0)
+				old_to_new[packs[i].old_id] = i;
+	}
+
+	if (show_progress)
+		progress = start_progress("Indexing objects", nr_packs);
+
+	/* Carry over what the old index already knows... */
+	if (old) {
+		for (i = 0; i < old->num_objects; i++) {
+			uint32_t id = old_to_new[nth_midxed_pack_int_id(old, i)];
+			struct midx_entry *e;
+
+			if (id == (uint32_t)-1)
+				continue;
+			ALLOC_GROW(entries, nr_entries + 1, alloc_entries);
+			e = &entries[nr_entries++];
+			hashcpy(e->sha1, old->chunk_oid_lookup + 20 * i);
+			e->pack_int_id = id;
+			e->pack_mtime = packs[id].mtime;
+			e->offset = nth_midxed_offset(old, i);
+		}
+	}
+
+	/* ...and read the .idx of the packs it does not cover. */
+	for (i = 0; i < nr_packs; i++) {
+		struct packed_git *p = packs[i].p;
+
+		display_progress(progress, i + 1);
+		if (packs[i].old_id >= 0)
+			continue;
+		ALLOC_GROW(entries, nr_entries + p->num_objects, alloc_entries);
+		for (j = 0; j < p->num_objects; j++) {
+			struct midx_entry *e = &entries[nr_entries++];
+			hashcpy(e->sha1, nth_packed_object_sha1(p, j));
+			e->pack_int_id = i;
+			e->pack_mtime = packs[i].mtime;
+			e->offset = nth_packed_object_offset(p, j);
+		}
+		close_pack_index(p);
+	}
+	stop_progress(&progress);
+
+	qsort(entries, nr_entries, sizeof(*entries), midx_entry_compare);
+	for (i = j = 0; i < nr_entries; i++) {
+		if (j && !hashcmp(entries[j - 1].sha1, entries[i].sha1))
+			continue;
+		entries[j++] = entries[i];
+	}
+	nr_entries = j;
+
+	for (i = 0; i < nr_entries; i++)
+		if (entries[i].offset > 0x7fffffff)
+			nr_large_offsets++;
+	for (i = 0; i < nr_packs; i++)
+		pack_names_len += strlen(packs[i].idx_name) + 1;
+	/* keep the chunks that follow 4-byte aligned */
+	pack_names_len = (pack_names_len + 3) & ~3;
+
+	midx_name = get_midx_filename(object_dir);
+	if (safe_create_leading_directories(midx_name))
+		die_errno("unable to create leading directories of %s",
+			  midx_name);
+	fd = hold_lock_file_for_update(&lock, midx_name, LOCK_DIE_ON_ERROR);
+	f = sha1fd(fd, lock.filename);
+
+	num_chunks = 0;
+	chunk_ids[num_chunks] = MIDX_CHUNKID_PACKNAMES;
+	chunk_offsets[num_chunks++] = pack_names_len;
+	chunk_ids[num_chunks] = MIDX_CHUNKID_OIDFANOUT;
+	chunk_offsets[num_chunks++] = MIDX_FANOUT_SIZE;
+	chunk_ids[num_chunks] = MIDX_CHUNKID_OIDLOOKUP;
+	chunk_offsets[num_chunks++] = 20 * (uint64_t)nr_entries;
+	chunk_ids[num_chunks] = MIDX_CHUNKID_OBJECTOFFSETS;
+	chunk_offsets[num_chunks++] = MIDX_OFFSET_WIDTH * (uint64_t)nr_entries;
+	if (nr_large_offsets) {
+		chunk_ids[num_chunks] = MIDX_CHUNKID_LARGEOFFSETS;
+		chunk_offsets[num_chunks++] = 8 * (uint64_t)nr_large_offsets;
+	}
+	chunk_ids[num_chunks] = 0;
+	chunk_offsets[num_chunks] = 0;
+
+	/* turn the chunk sizes into offsets */
+	{
+		uint64_t offset = MIDX_HEADER_SIZE +
+				  (num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH;
+		for (i = 0; i <= num_chunks; i++) {
+			uint64_t size = chunk_offsets[i];
+			chunk_offsets[i] = offset;
+			offset += size;
+		}
+	}
+
+	put_be32(header, MIDX_SIGNATURE);
+	header[4] = MIDX_VERSION;
+	header[5] = MIDX_HASH_VERSION;
+	header[6] = num_chunks;
+	header[7] = 0; /* no base multi-pack-index */
+	put_be32(header + 8, nr_packs);
+	sha1write(f, header, sizeof(header));
+
+	for (i = 0; i <= num_chunks; i++)
+		write_chunk_lookup_entry(f, chunk_ids[i], chunk_offsets[i]);
+
+	for (i = j = 0; i < nr_packs; i++) {
+		sha1write(f, packs[i].idx_name, strlen(packs[i].idx_name) + 1);
+		j += strlen(packs[i].idx_name) + 1;
+	}
+	for (; j < pack_names_len; j++)
+		sha1write(f, "", 1);
+
+	for (i = j = 0; i < 256; i++) {
+		uint32_t n;
+		while (j < nr_entries && entries[j].sha1[0] == i)
+			j++;
+		n = htonl(j);
+		sha1write(f, &n, 4);
+	}
+
+	for (i = 0; i < nr_entries; i++)
+		sha1write(f, entries[i].sha1, 20);
+
+	for (i = j = 0; i < nr_entries; i++) {
+		uint32_t data[2];
+		data[0] = htonl(entries[i].pack_int_id);
+		if (entries[i].offset > 0x7fffffff)
+			data[1] = htonl(MIDX_LARGE_OFFSET_NEEDED | j++);
+		else
+			data[1] = htonl((uint32_t)entries[i].offset);
+		sha1write(f, data, sizeof(data));
+	}
+
+	for (i = 0; i < nr_entries; i++) {
+		uint32_t data[2];
+		if (entries[i].offset <= 0x7fffffff)
+			continue;
+		data[0] = htonl((uint32_t)(entries[i].offset >> 32));
+		data[1] = htonl((uint32_t)entries[i].offset);
+		sha1write(f, data, sizeof(data));
+	}
+
+	/* the lock owns the descriptor, so write the trailer ourselves */
+	sha1close(f, checksum, 0);
+	write_or_die(fd, checksum, 20);
+	fsync_or_die(fd, lock.filename);
+	if (old)
+		free_midx(old);
+	close_midx();
+	if (commit_lock_file(&lock))
+		die_errno("unable to write multi-pack-index file '%s'", midx_name);
+
+	for (i = 0; i < nr_packs; i++) {
+		free(packs[i].idx_name);
+		free(packs[i].p);
+	}
+	free(packs);
+	free(entries);
+	free(old_to_new);
+	free(midx_name);
+	return 0;
+}
+
+/*
+ * Verification
+ */
+
+int verify_midx_file(const char *object_dir)
+{
+	struct multi_pack_index *m = load_midx(object_dir);
+	struct strbuf path = STRBUF_INIT;
+	struct packed_git **packs;
+	int errors = 0;
+	uint32_t i;
+
+	if (!m)
+		return 0;
+
+	packs = xcalloc(m->num_packs ? m->num_packs : 1, sizeof(*packs));
+	for (i = 0; i < m->num_packs; i++) {
+		strbuf_reset(&path);
+		strbuf_addf(&path, "%s/pack/%s", object_dir, m->pack_names[i]);
+		packs[i] = add_packed_git(path.buf, path.len, 1);
+		if (!packs[i] || open_pack_index(packs[i])) {
+			error("failed to load pack '%s' from multi-pack-index",
+			      m->pack_names[i]);
+			errors++;
+		}
+	}
+
+	for (i = 0; i < m->num_objects; i++) {
+		const unsigned char *sha1 = m->chunk_oid_lookup + 20 * i;
+		uint32_t id = nth_midxed_pack_int_id(m, i);
+		off_t offset;
+
+		if (i && hashcmp(sha1 - 20, sha1) >= 0) {
+			error("multi-pack-index oid lookup out of order: %s then %s",
+			      sha1_to_hex(sha1 - 20), sha1_to_hex(sha1));
+			errors++;
+			continue;
+		}
+		if (id >= m->num_packs) {
+			error("bad pack-int-id %"PRIu32" for %s", id,
+			      sha1_to_hex(sha1));
+			errors++;
+			continue;
+		}
+		if (!packs[id] || !packs[id]->index_data)
+			continue;
+		offset = find_pack_entry_one(sha1, packs[id]);
+		if (offset != nth_midxed_offset(m, i)) {
+			error("incorrect offset for %s in multi-pack-index: %"PRIuMAX" != %"PRIuMAX,
+			      sha1_to_hex(sha1),
+			      (uintmax_t)nth_midxed_offset(m, i),
+			      (uintmax_t)offset);
+			errors++;
+		}
+	}
+
+	/* a covered pack must not have objects the index does not know */
+	for (i = 0; i < m->num_packs; i++) {
+		uint32_t j, pos;
+
+		if (!packs[i] || !packs[i]->index_data)
+			continue;
+		for (j = 0; j < packs[i]->num_objects; j++) {
+			const unsigned char *sha1 = nth_packed_object_sha1(packs[i], j);
+			if (!bsearch_midx(m, sha1, &pos)) {
+				error("object %s from pack '%s' is missing from multi-pack-index",
+				      sha1_to_hex(sha1), m->pack_names[i]);
+				errors++;
+			}
+		}
+	}
+
+	for (i = 0; i < m->num_packs; i++) {
+		if (!packs[i])
+			continue;
+		close_pack_index(packs[i]);
+		free(packs[i]);
+	}
+	free(packs);
+	strbuf_release(&path);
+	free_midx(m);
+	return errors;
+}
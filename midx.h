@@ -0,0 +1,31 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+/*
+ * Look up "sha1" in the multi-pack index of the local object
+ * directory. Returns 1 and fills "e" if one of the packs it covers
+ * has the object, 0 if none of these packs has it (the caller may then
+ * skip every pack marked with "multi_pack_index"), and -1 if there is
+ * no usable multi-pack index entry and all packs must be searched.
+ */
+extern int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e);
+
+/*
+ * Write (or rewrite) the multi-pack index for "object_dir". Entries
+ * for packs already covered by the current index are carried over
+ * without opening their .idx files; only new packs are read.
+ */
+extern int write_midx_file(const char *object_dir, int show_progress);
+
+/*
+ * Check every entry of the multi-pack index of "object_dir" against
+ * the .idx of the pack it points to. Returns the number of errors.
+ */
+extern int verify_midx_file(const char *object_dir);
+
+/*
+ * Release the mapped multi-pack index, if any.
+ */
+extern void close_midx(void);
+
+#endif
@@ -10,6 +10,8 @@
 #include "pack-bitmap.h"
 #include "sha1-lookup.h"
 #include "pack-objects.h"
+#include "tree-walk.h"
+#include "thread-utils.h"
 
 struct bitmapped_commit {
 	struct commit *commit;
@@ -35,6 +37,7 @@ struct bitmap_writer {
 
 	struct progress *progress;
 	int show_progress;
+	int nr_threads;
 	unsigned char pack_checksum[20];
 };
 
@@ -45,6 +48,11 @@ void bitmap_writer_show_progress(int show)
 	writer.show_progress = show;
 }
 
+void bitmap_writer_set_threads(int nr_threads)
+{
+	writer.nr_threads = nr_threads;
+}
+
 /**
  * Build the initial type index for the packfile
  */
@@ -204,57 +212,421 @@ should_include(struct commit *commit, void *_data)
 	return 1;
 }
 
-static void compute_xor_offsets(void)
+/*
+ * Pick, among the few bitmaps preceding "next", the one to XOR it
+ * against for the smallest result. This only reads the other bitmaps,
+ * so it may run for several entries at once; it does not use the ewah
+ * pool, which is not thread-safe.
+ */
+static void compute_xor_offset(int next)
 {
 	static const int MAX_XOR_OFFSET_SEARCH = 10;
 
-	int i, next = 0;
+	struct bitmapped_commit *stored = &writer.selected[next];
+	int i, best_offset = 0;
+	struct ewah_bitmap *best_bitmap = stored->bitmap;
+	struct ewah_bitmap *test_xor;
+
+	for (i = 1; i <= MAX_XOR_OFFSET_SEARCH; ++i) {
+		int curr = next - i;
+
+		if (curr < 0)
+			break;
+
+		test_xor = ewah_new();
+		ewah_xor(writer.selected[curr].bitmap, stored->bitmap, test_xor);
+
+		if (test_xor->buffer_size < best_bitmap->buffer_size) {
+			if (best_bitmap != stored->bitmap)
+				ewah_free(best_bitmap);
+
+			best_bitmap = test_xor;
+			best_offset = i;
+		} else {
+			ewah_free(test_xor);
+		}
+	}
 
-	while (next < writer.selected_nr) {
-		struct bitmapped_commit *stored = &writer.selected[next];
+	stored->xor_offset = best_offset;
+	stored->write_as = best_bitmap;
+}
 
-		int best_offset = 0;
-		struct ewah_bitmap *best_bitmap = stored->bitmap;
-		struct ewah_bitmap *test_xor;
+#ifndef NO_PTHREADS
+struct xor_thread_data {
+	pthread_t thread;
+	int from, to;
+};
 
-		for (i = 1; i <= MAX_XOR_OFFSET_SEARCH; ++i) {
-			int curr = next - i;
+static void *compute_xor_offsets_thread(void *data)
+{
+	struct xor_thread_data *me = data;
+	int i;
 
-			if (curr < 0)
-				break;
+	for (i = me->from; i < me->to; i++)
+		compute_xor_offset(i);
+	return NULL;
+}
+#endif
 
-			test_xor = ewah_pool_new();
-			ewah_xor(writer.selected[curr].bitmap, stored->bitmap, test_xor);
+static void compute_xor_offsets(void)
+{
+	int i;
 
-			if (test_xor->buffer_size < best_bitmap->buffer_size) {
-				if (best_bitmap != stored->bitmap)
-					ewah_pool_free(best_bitmap);
+#ifndef NO_PTHREADS
+	if (writer.nr_threads > 1 && writer.selected_nr > writer.nr_threads) {
+		struct xor_thread_data *p;
+		int nr = writer.nr_threads, from = 0;
+
+		p = xcalloc(nr, sizeof(*p));
+		for (i = 0; i < nr; i++) {
+			p[i].from = from;
+			p[i].to = from + (writer.selected_nr - from) / (nr - i);
+			from = p[i].to;
+			if (pthread_create(&p[i].thread, NULL,
+					   compute_xor_offsets_thread, &p[i]))
+				die("unable to create thread: %s", strerror(errno));
+		}
+		for (i = 0; i < nr; i++)
+			pthread_join(p[i].thread, NULL);
+		free(p);
+		return;
+	}
+#endif
 
-				best_bitmap = test_xor;
-				best_offset = i;
-			} else {
-				ewah_pool_free(test_xor);
+	for (i = 0; i < writer.selected_nr; i++)
+		compute_xor_offset(i);
+}
+
+struct introduced_objects {
+	uint32_t *pos;
+	uint32_t nr;
+};
+
+static struct commit **build_commits;
+static struct introduced_objects *introduced;
+static unsigned int build_commits_nr;
+static uint32_t *commit_index; /* pack position -> index + 1 in build_commits */
+
+#ifndef NO_PTHREADS
+/*
+ * Building bitmaps on several threads.
+ *
+ * Nearly all the time of the serial walk goes into reading and
+ * walking trees, and that walk goes through the object flags and the
+ * object hash, neither of which may be touched from several threads.
+ * So the threaded build works in two steps:
+ *
+ *  1. Every commit that the selected commits reach is compared with
+ *     its parents, on all threads, to find the trees and blobs it
+ *     introduces: the entries of its tree that are not the same as
+ *     the entry at the same path in one of its parents' trees. No
+ *     object flags are used; trees are read under a lock.
+ *
+ *  2. The selected commits are then processed in the same order as in
+ *     the serial walk, but walking only commits: the bitmap of a
+ *     commit is the union of each commit it reaches and of the objects
+ *     that commit introduces.
+ *
+ * Any object reachable from a commit is introduced by that commit or
+ * by one of its ancestors, so both steps compute the same sets, and the
+ * output does not depend on the number of threads.
+ */
+static pthread_mutex_t build_mutex;
+static unsigned int build_next;
+
+struct build_thread_data {
+	pthread_t thread;
+	struct bitmap *seen;
+	uint32_t *list;
+	unsigned int list_nr, list_alloc;
+};
+
+static void *read_tree_locked(const unsigned char *sha1, unsigned long *size)
+{
+	enum object_type type;
+	void *buf;
+
+	pthread_mutex_lock(&build_mutex);
+	buf = read_sha1_file(sha1, &type, size);
+	pthread_mutex_unlock(&build_mutex);
+	if (!buf || type != OBJ_TREE)
+		die("unable to read tree %s", sha1_to_hex(sha1));
+	return buf;
+}
+
+static void add_introduced(struct build_thread_data *me, uint32_t pos)
+{
+	bitmap_set(me->seen, pos);
+	ALLOC_GROW(me->list, me->list_nr + 1, me->list_alloc);
+	me->list[me->list_nr++] = pos;
+}
+
+/*
+ * Add the tree "sha1" and the objects below it that are not found at
+ * the same path in any of the "parents" trees.
+ */
+static void introduce_tree(struct build_thread_data *me, const unsigned char *sha1,
+			   const unsigned char **parents, int parents_nr)
+{
+	uint32_t pos = find_object_pos(sha1);
+	struct tree_desc desc, *pdesc;
+	const unsigned char **sub_parents;
+	struct name_entry entry;
+	unsigned long size;
+	void *buf, **pbuf;
+	int i;
+
+	if (bitmap_get(me->seen, pos))
+		return;
+	add_introduced(me, pos);
+
+	buf = read_tree_locked(sha1, &size);
+	init_tree_desc(&desc, buf, size);
+	pbuf = xcalloc(parents_nr + 1, sizeof(*pbuf));
+	pdesc = xcalloc(parents_nr + 1, sizeof(*pdesc));
+	sub_parents = xcalloc(parents_nr + 1, sizeof(*sub_parents));
+	for (i = 0; i < parents_nr; i++) {
+		pbuf[i] = read_tree_locked(parents[i], &size);
+		init_tree_desc(&pdesc[i], pbuf[i], size);
+	}
+
+	while (tree_entry(&desc, &entry)) {
+		int len = tree_entry_len(&entry);
+		int shared = 0, sub_nr = 0;
+
+		if (S_ISGITLINK(entry.mode))
+			continue;
+
+		for (i = 0; i < parents_nr; i++) {
+			struct name_entry *pe = &pdesc[i].entry;
+			int cmp = 1;
+
+			while (pdesc[i].size) {
+				cmp = base_name_compare(pe->path, tree_entry_len(pe),
+							pe->mode, entry.path, len,
+							entry.mode);
+				if (cmp >= 0)
+					break;
+				update_tree_entry(&pdesc[i]);
 			}
+			if (!pdesc[i].size || cmp)
+				continue;
+			if (!hashcmp(pe->sha1, entry.sha1))
+				shared = 1;
+			else if (S_ISDIR(pe->mode) && S_ISDIR(entry.mode))
+				sub_parents[sub_nr++] = pe->sha1;
+		}
+		if (shared)
+			continue;
+
+		if (S_ISDIR(entry.mode))
+			introduce_tree(me, entry.sha1, sub_parents, sub_nr);
+		else {
+			pos = find_object_pos(entry.sha1);
+			if (!bitmap_get(me->seen, pos))
+				add_introduced(me, pos);
+		}
+	}
+
+	for (i = 0; i < parents_nr; i++)
+		free(pbuf[i]);
+	free(pbuf);
+	free(pdesc);
+	free(sub_parents);
+	free(buf);
+}
+
+static void find_introduced_objects(struct build_thread_data *me, unsigned int n)
+{
+	struct commit *commit = build_commits[n];
+	const unsigned char *root = commit->tree->object.sha1;
+	const unsigned char **parents;
+	struct commit_list *p;
+	int parents_nr = 0;
+	unsigned int i;
+
+	parents = xcalloc(commit_list_count(commit->parents) + 1,
+			  sizeof(*parents));
+	for (p = commit->parents; p; p = p->next) {
+		const unsigned char *sha1 = p->item->tree->object.sha1;
+		if (!hashcmp(sha1, root))
+			break;
+		parents[parents_nr++] = sha1;
+	}
+
+	/* a commit with the same tree as a parent introduces nothing */
+	me->list_nr = 0;
+	if (!p)
+		introduce_tree(me, root, parents, parents_nr);
+	free(parents);
+
+	introduced[n].nr = me->list_nr;
+	introduced[n].pos = xmalloc(sizeof(uint32_t) * (me->list_nr + 1));
+	memcpy(introduced[n].pos, me->list, sizeof(uint32_t) * me->list_nr);
+	for (i = 0; i < me->list_nr; i++)
+		bitmap_clear(me->seen, me->list[i]);
+}
+
+static void *introduced_objects_thread(void *data)
+{
+	struct build_thread_data *me = data;
+
+	for (;;) {
+		unsigned int n;
+
+		pthread_mutex_lock(&build_mutex);
+		n = build_next++;
+		if (n < build_commits_nr)
+			display_progress(writer.progress, n + 1);
+		pthread_mutex_unlock(&build_mutex);
+		if (n >= build_commits_nr)
+			break;
+
+		find_introduced_objects(me, n);
+	}
+	return NULL;
+}
+
+/*
+ * Collect and parse every commit the selected commits reach, as the
+ * worker threads cannot parse anything themselves.
+ */
+static void collect_build_commits(void)
+{
+	struct commit **stack = NULL;
+	unsigned int stack_nr = 0, stack_alloc = 0, alloc = 0;
+	int i;
+
+	commit_index = xcalloc(writer.to_pack->nr_objects, sizeof(uint32_t));
+	for (i = 0; i < writer.selected_nr; i++) {
+		ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+		stack[stack_nr++] = writer.selected[i].commit;
+	}
+	while (stack_nr) {
+		struct commit *commit = stack[--stack_nr];
+		uint32_t pos = find_object_pos(commit->object.sha1);
+		struct commit_list *p;
+
+		if (commit_index[pos])
+			continue;
+		parse_commit_or_die(commit);
+		ALLOC_GROW(build_commits, build_commits_nr + 1, alloc);
+		build_commits[build_commits_nr++] = commit;
+		commit_index[pos] = build_commits_nr;
+
+		for (p = commit->parents; p; p = p->next) {
+			ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+			stack[stack_nr++] = p->item;
 		}
+	}
+	free(stack);
+}
+
+static void find_all_introduced_objects(void)
+{
+	struct build_thread_data *p;
+	struct progress *progress = NULL;
+	int i, nr = writer.nr_threads;
 
-		stored->xor_offset = best_offset;
-		stored->write_as = best_bitmap;
+	collect_build_commits();
+	introduced = xcalloc(build_commits_nr + 1, sizeof(*introduced));
 
-		next++;
+	if (writer.show_progress)
+		writer.progress = start_progress("Finding new objects of commits",
+						 build_commits_nr);
+
+	pthread_mutex_init(&build_mutex, NULL);
+	build_next = 0;
+	p = xcalloc(nr, sizeof(*p));
+	for (i = 0; i < nr; i++) {
+		p[i].seen = bitmap_new();
+		if (pthread_create(&p[i].thread, NULL,
+				   introduced_objects_thread, &p[i]))
+			die("unable to create thread: %s", strerror(errno));
 	}
+	for (i = 0; i < nr; i++) {
+		pthread_join(p[i].thread, NULL);
+		bitmap_free(p[i].seen);
+		free(p[i].list);
+	}
+	free(p);
+	pthread_mutex_destroy(&build_mutex);
+
+	progress = writer.progress;
+	stop_progress(&progress);
+	writer.progress = NULL;
 }
 
+#endif
+
+static void free_introduced_objects(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < build_commits_nr; i++)
+		free(introduced[i].pos);
+	free(introduced);
+	free(build_commits);
+	free(commit_index);
+	introduced = NULL;
+	build_commits = NULL;
+	commit_index = NULL;
+	build_commits_nr = 0;
+}
+
+/*
+ * Add to "base" everything "commit" reaches, using the objects
+ * introduced by each commit instead of walking trees.
+ */
+static void fill_bitmap_from_commits(struct bitmap *base, struct commit *commit)
+{
+	struct commit **stack = NULL;
+	unsigned int stack_nr = 0, stack_alloc = 0;
+
+	ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+	stack[stack_nr++] = commit;
+
+	while (stack_nr) {
+		struct introduced_objects *objs;
+		struct commit_list *p;
+		uint32_t pos, i;
+
+		commit = stack[--stack_nr];
+		pos = find_object_pos(commit->object.sha1);
+		if (!add_to_include_set(base, commit))
+			continue;
+
+		objs = &introduced[commit_index[pos] - 1];
+		for (i = 0; i < objs->nr; i++)
+			bitmap_set(base, objs->pos[i]);
+
+		for (p = commit->parents; p; p = p->next) {
+			ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+			stack[stack_nr++] = p->item;
+		}
+	}
+	free(stack);
+}
 void bitmap_writer_build(struct packing_data *to_pack)
 {
 	static const double REUSE_BITMAP_THRESHOLD = 0.2;
 
-	int i, reuse_after, need_reset;
+	int i, reuse_after, need_reset, threaded = 0;
 	struct bitmap *base = bitmap_new();
 	struct rev_info revs;
 
 	writer.bitmaps = kh_init_sha1();
 	writer.to_pack = to_pack;
 
+#ifndef NO_PTHREADS
+	if (!writer.nr_threads)
+		writer.nr_threads = online_cpus();
+	if (writer.nr_threads > 1 && writer.selected_nr > 1) {
+		find_all_introduced_objects();
+		threaded = 1;
+	}
+#endif
+
 	if (writer.show_progress)
 		writer.progress = start_progress("Building bitmaps", writer.selected_nr);
 
@@ -289,17 +661,21 @@ void bitmap_writer_build(struct packing_data *to_pack)
 			    reset_all_seen();
 			}
 
-			add_pending_object(&revs, object, "");
-			revs.include_check_data = base;
+			if (threaded)
+				fill_bitmap_from_commits(base, stored->commit);
+			else {
+				add_pending_object(&revs, object, "");
+				revs.include_check_data = base;
 
-			if (prepare_revision_walk(&revs))
-				die("revision walk setup failed");
+				if (prepare_revision_walk(&revs))
+					die("revision walk setup failed");
 
-			traverse_commit_list(&revs, show_commit, show_object, base);
+				traverse_commit_list(&revs, show_commit, show_object, base);
 
-			revs.pending.nr = 0;
-			revs.pending.alloc = 0;
-			revs.pending.objects = NULL;
+				revs.pending.nr = 0;
+				revs.pending.alloc = 0;
+				revs.pending.objects = NULL;
+			}
 
 			stored->bitmap = bitmap_to_ewah(base);
 			need_reset = 0;
@@ -320,6 +696,8 @@ void bitmap_writer_build(struct packing_data *to_pack)
 
 	bitmap_free(base);
 	stop_progress(&writer.progress);
+	if (threaded)
+		free_introduced_objects();
 
 	compute_xor_offsets();
 }
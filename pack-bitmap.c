@@ -5,6 +5,7 @@
 #include "revision.h"
 #include "progress.h"
 #include "list-objects.h"
+#include "refs.h"
 #include "pack.h"
 #include "pack-bitmap.h"
 #include "pack-revindex.h"
@@ -427,7 +428,17 @@ static void show_object(struct object *object, const struct name_path *path,
 	bitmap_pos = bitmap_position(object->sha1);
 
 	if (bitmap_pos < 0) {
-		char *name = path_name(path, last);
+		char *name;
+
+		/*
+		 * Objects outside of the bitmapped pack are only vouched for
+		 * by the walk; as in "rev-list --objects", make sure that the
+		 * blobs it did not read really exist.
+		 */
+		if (object->type == OBJ_BLOB && !has_sha1_file(object->sha1))
+			die("missing blob object '%s'", sha1_to_hex(object->sha1));
+
+		name = path_name(path, last);
 		bitmap_pos = ext_index_add_object(object, name);
 		free(name);
 	}
@@ -598,51 +609,217 @@ static void show_extended_objects(struct bitmap *objects,
 	}
 }
 
+typedef void (*type_word_fn)(eword_t word, size_t pos, void *data);
+
+/*
+ * Call "fn" with each word of "objects" masked by "type_filter", and
+ * the bit position of its first bit. The type bitmap is walked run by
+ * run: a run of zeroes holds no object of this type and is skipped
+ * without looking at "objects".
+ */
+static void for_each_word_of_type(struct bitmap *objects,
+				  struct ewah_bitmap *type_filter,
+				  type_word_fn fn, void *data)
+{
+	struct ewah_run_iterator it;
+	size_t i, k;
+
+	ewah_run_iterator_init(&it, type_filter);
+
+	while (ewah_run_iterator_next(&it) && it.word_pos < objects->word_alloc) {
+		i = it.word_pos;
+
+		if (!it.run_bit)
+			i += it.run_len;
+		else
+			for (k = 0; k < it.run_len && i < objects->word_alloc; k++, i++)
+				fn(objects->words[i], i * BITS_IN_WORD, data);
+
+		for (k = 0; k < it.literal_nr && i < objects->word_alloc; k++, i++)
+			fn(objects->words[i] & it.literals[k], i * BITS_IN_WORD, data);
+	}
+}
+
+struct show_data {
+	enum object_type object_type;
+	show_reachable_fn show_reach;
+};
+
+static void show_objects_for_word(eword_t word, size_t pos, void *data)
+{
+	struct show_data *show = data;
+	uint32_t offset;
+
+	for (offset = 0; offset < BITS_IN_WORD; ++offset) {
+		const unsigned char *sha1;
+		uint32_t nr, hash = 0;
+
+		if ((word >> offset) == 0)
+			break;
+
+		offset += ewah_bit_ctz64(word >> offset);
+
+		if (pos + offset < bitmap_git.reuse_objects)
+			continue;
+
+		nr = revindex_nr(bitmap_git.reverse_index, pos + offset);
+		sha1 = nth_packed_object_sha1(bitmap_git.pack, nr);
+
+		if (bitmap_git.hashes)
+			hash = ntohl(bitmap_git.hashes[nr]);
+
+		show->show_reach(sha1, show->object_type, 0, hash,
+				 bitmap_git.pack,
+				 revindex_offset(bitmap_git.reverse_index,
+						 pos + offset));
+	}
+}
+
 static void show_objects_for_type(
 	struct bitmap *objects,
 	struct ewah_bitmap *type_filter,
 	enum object_type object_type,
 	show_reachable_fn show_reach)
 {
-	size_t pos = 0, i = 0;
-	uint32_t offset;
-
-	struct ewah_iterator it;
-	eword_t filter;
+	struct show_data show;
 
 	if (bitmap_git.reuse_objects == bitmap_git.pack->num_objects)
 		return;
 
-	ewah_iterator_init(&it, type_filter);
+	show.object_type = object_type;
+	show.show_reach = show_reach;
+	for_each_word_of_type(objects, type_filter, show_objects_for_word, &show);
+}
 
-	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
-		eword_t word = objects->words[i] & filter;
+static struct ewah_bitmap *bitmap_for_commit(struct object *object)
+{
+	khiter_t pos;
 
-		for (offset = 0; offset < BITS_IN_WORD; ++offset) {
-			const unsigned char *sha1;
-			struct revindex_entry *entry;
-			uint32_t hash = 0;
+	if (object->type != OBJ_COMMIT)
+		return NULL;
 
-			if ((word >> offset) == 0)
-				break;
+	pos = kh_get_sha1(bitmap_git.bitmaps, object->sha1);
+	if (pos >= kh_end(bitmap_git.bitmaps))
+		return NULL;
 
-			offset += ewah_bit_ctz64(word >> offset);
+	return lookup_stored_bitmap(kh_value(bitmap_git.bitmaps, pos));
+}
 
-			if (pos + offset < bitmap_git.reuse_objects)
-				continue;
+static int all_bitmapped(struct object_list *roots)
+{
+	for (; roots; roots = roots->next)
+		if (!bitmap_for_commit(roots->item))
+			return 0;
+
+	return 1;
+}
+
+static void add_reachable_commit(struct bitmap *base, struct commit *commit)
+{
+	struct commit **stack = NULL;
+	unsigned int stack_nr = 0, stack_alloc = 0;
 
-			entry = &bitmap_git.reverse_index->revindex[pos + offset];
-			sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+	ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+	stack[stack_nr++] = commit;
 
-			if (bitmap_git.hashes)
-				hash = ntohl(bitmap_git.hashes[entry->nr]);
+	while (stack_nr) {
+		struct ewah_bitmap *stored;
+		struct commit_list *p;
+		int pos;
 
-			show_reach(sha1, object_type, 0, hash, bitmap_git.pack, entry->offset);
+		commit = stack[--stack_nr];
+		pos = bitmap_position(commit->object.sha1);
+		if (pos < 0)
+			pos = ext_index_add_object((struct object *)commit, NULL);
+		if (bitmap_get(base, pos))
+			continue;
+
+		stored = bitmap_for_commit((struct object *)commit);
+		if (stored) {
+			bitmap_or_ewah(base, stored);
+			continue;
 		}
 
-		pos += BITS_IN_WORD;
-		i++;
+		bitmap_set(base, pos);
+		if (parse_commit(commit))
+			continue;
+
+		for (p = commit->parents; p; p = p->next) {
+			ALLOC_GROW(stack, stack_nr + 1, stack_alloc);
+			stack[stack_nr++] = p->item;
+		}
 	}
+
+	free(stack);
+}
+
+struct bitmap *bitmap_for_reachable_commit(struct commit *commit)
+{
+	struct bitmap *base;
+
+	if (prepare_bitmap_git() < 0)
+		return NULL;
+
+	base = bitmap_new();
+	add_reachable_commit(base, commit);
+	return base;
+}
+
+static int add_reachable_ref(const char *refname, const unsigned char *sha1,
+			     int flags, void *data)
+{
+	struct bitmap *base = data;
+	khiter_t hash_pos;
+	struct object *obj;
+	int pos;
+
+	/* most refs point at a commit that has a bitmap */
+	hash_pos = kh_get_sha1(bitmap_git.bitmaps, sha1);
+	if (hash_pos < kh_end(bitmap_git.bitmaps)) {
+		struct stored_bitmap *st = kh_value(bitmap_git.bitmaps, hash_pos);
+		bitmap_or_ewah(base, lookup_stored_bitmap(st));
+		return 0;
+	}
+
+	obj = parse_object(sha1);
+	while (obj && obj->type == OBJ_TAG) {
+		pos = bitmap_position(obj->sha1);
+		if (pos < 0)
+			pos = ext_index_add_object(obj, NULL);
+		bitmap_set(base, pos);
+		obj = parse_object(((struct tag *)obj)->tagged->sha1);
+	}
+	if (!obj)
+		return 0;
+
+	if (obj->type == OBJ_COMMIT)
+		add_reachable_commit(base, (struct commit *)obj);
+	else {
+		pos = bitmap_position(obj->sha1);
+		if (pos < 0)
+			pos = ext_index_add_object(obj, NULL);
+		bitmap_set(base, pos);
+	}
+	return 0;
+}
+
+struct bitmap *bitmap_for_reachable_refs(void)
+{
+	struct bitmap *base;
+
+	if (prepare_bitmap_git() < 0)
+		return NULL;
+
+	base = bitmap_new();
+	head_ref(add_reachable_ref, base);
+	for_each_ref(add_reachable_ref, base);
+	return base;
+}
+
+int bitmap_has_object(struct bitmap *reachable, const unsigned char *sha1)
+{
+	int pos = bitmap_position(sha1);
+	return pos >= 0 && bitmap_get(reachable, pos);
 }
 
 static int in_bitmapped_pack(struct object_list *roots)
@@ -726,6 +903,22 @@ int prepare_bitmap_walk(struct rev_info *revs)
 	revs->pending.alloc = 0;
 	revs->pending.objects = NULL;
 
+	/*
+	 * When every want and every have has a bitmap, no walk is needed
+	 * and the haves can be taken out of the result straight from their
+	 * compressed bitmaps.
+	 */
+	if (haves && all_bitmapped(wants) && all_bitmapped(haves)) {
+		wants_bitmap = find_objects(revs, wants, NULL);
+
+		for (; haves; haves = haves->next)
+			bitmap_and_not_ewah(wants_bitmap,
+					    bitmap_for_commit(haves->item));
+
+		bitmap_git.result = wants_bitmap;
+		return 0;
+	}
+
 	if (haves) {
 		haves_bitmap = find_objects(revs, haves, NULL);
 		reset_revision_walk();
@@ -776,10 +969,10 @@ int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
 #ifdef GIT_BITMAP_DEBUG
 	{
 		const unsigned char *sha1;
-		struct revindex_entry *entry;
+		uint32_t nr;
 
-		entry = &bitmap_git.reverse_index->revindex[reuse_objects];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+		nr = revindex_nr(bitmap_git.reverse_index, reuse_objects);
+		sha1 = nth_packed_object_sha1(bitmap_git.pack, nr);
 
 		fprintf(stderr, "Failed to reuse at %d (%016llx)\n",
 			reuse_objects, result->words[i]);
@@ -803,7 +996,7 @@ int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
 		return -1;
 
 	bitmap_git.reuse_objects = *entries = reuse_objects;
-	*up_to = bitmap_git.reverse_index->revindex[reuse_objects].offset;
+	*up_to = revindex_offset(bitmap_git.reverse_index, reuse_objects);
 	*packfile = bitmap_git.pack;
 
 	return 0;
@@ -828,40 +1021,39 @@ void traverse_bitmap_commit_list(show_reachable_fn show_reachable)
 	bitmap_git.result = NULL;
 }
 
-static uint32_t count_object_type(struct bitmap *objects,
-				  enum object_type type)
+static struct ewah_bitmap *bitmap_for_type(enum object_type type)
 {
-	struct eindex *eindex = &bitmap_git.ext_index;
-
-	uint32_t i = 0, count = 0;
-	struct ewah_iterator it;
-	eword_t filter;
-
 	switch (type) {
 	case OBJ_COMMIT:
-		ewah_iterator_init(&it, bitmap_git.commits);
-		break;
-
+		return bitmap_git.commits;
 	case OBJ_TREE:
-		ewah_iterator_init(&it, bitmap_git.trees);
-		break;
-
+		return bitmap_git.trees;
 	case OBJ_BLOB:
-		ewah_iterator_init(&it, bitmap_git.blobs);
-		break;
-
+		return bitmap_git.blobs;
 	case OBJ_TAG:
-		ewah_iterator_init(&it, bitmap_git.tags);
-		break;
-
+		return bitmap_git.tags;
 	default:
-		return 0;
+		return NULL;
 	}
+}
 
-	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
-		eword_t word = objects->words[i++] & filter;
-		count += ewah_bit_popcount64(word);
-	}
+static void count_objects_for_word(eword_t word, size_t pos, void *data)
+{
+	uint32_t *count = data;
+	*count += ewah_bit_popcount64(word);
+}
+
+static uint32_t count_object_type(struct bitmap *objects,
+				  enum object_type type)
+{
+	struct eindex *eindex = &bitmap_git.ext_index;
+	struct ewah_bitmap *type_filter = bitmap_for_type(type);
+	uint32_t i, count = 0;
+
+	if (!type_filter)
+		return 0;
+
+	for_each_word_of_type(objects, type_filter, count_objects_for_word, &count);
 
 	for (i = 0; i < eindex->count; ++i) {
 		if (eindex->objects[i]->type == type &&
@@ -872,6 +1064,68 @@ static uint32_t count_object_type(struct bitmap *objects,
 	return count;
 }
 
+static void disk_usage_for_word(eword_t word, size_t pos, void *data)
+{
+	off_t *total = data;
+	uint32_t offset;
+
+	for (offset = 0; offset < BITS_IN_WORD; ++offset) {
+		if ((word >> offset) == 0)
+			break;
+
+		offset += ewah_bit_ctz64(word >> offset);
+
+		*total += revindex_offset(bitmap_git.reverse_index, pos + offset + 1) -
+			  revindex_offset(bitmap_git.reverse_index, pos + offset);
+	}
+}
+
+static off_t disk_usage_for_type(struct bitmap *objects,
+				 enum object_type type)
+{
+	struct eindex *eindex = &bitmap_git.ext_index;
+	off_t total = 0;
+	uint32_t i;
+
+	for_each_word_of_type(objects, bitmap_for_type(type),
+			      disk_usage_for_word, &total);
+
+	for (i = 0; i < eindex->count; ++i) {
+		struct object_info oi = {NULL};
+		unsigned long size;
+
+		if (eindex->objects[i]->type != type ||
+		    !bitmap_get(objects, bitmap_git.pack->num_objects + i))
+			continue;
+
+		oi.disk_sizep = &size;
+		if (sha1_object_info_extended(eindex->objects[i]->sha1, &oi, 0) < 0)
+			die("unable to get disk usage of %s",
+			    sha1_to_hex(eindex->objects[i]->sha1));
+		total += size;
+	}
+
+	return total;
+}
+
+off_t get_disk_usage_from_bitmap(struct rev_info *revs)
+{
+	struct bitmap *result = bitmap_git.result;
+	off_t total;
+
+	assert(result);
+
+	total = disk_usage_for_type(result, OBJ_COMMIT);
+	if (revs->tree_objects)
+		total += disk_usage_for_type(result, OBJ_TREE);
+	if (revs->blob_objects)
+		total += disk_usage_for_type(result, OBJ_BLOB);
+	if (revs->tag_objects)
+		total += disk_usage_for_type(result, OBJ_TAG);
+
+	return total;
+}
+
 void count_bitmap_commit_list(uint32_t *commits, uint32_t *trees,
 			      uint32_t *blobs, uint32_t *tags)
 {
@@ -1032,11 +1286,10 @@ int rebuild_existing_bitmaps(struct packing_data *mapping,
 
 	for (i = 0; i < num_objects; ++i) {
 		const unsigned char *sha1;
-		struct revindex_entry *entry;
 		struct object_entry *oe;
 
-		entry = &bitmap_git.reverse_index->revindex[i];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+		sha1 = nth_packed_object_sha1(bitmap_git.pack,
+					      revindex_nr(bitmap_git.reverse_index, i));
 		oe = packlist_find(mapping, sha1, NULL);
 
 		if (oe)
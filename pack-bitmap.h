@@ -42,6 +42,28 @@ typedef int (*show_reachable_fn)(
 
 int prepare_bitmap_git(void);
 void count_bitmap_commit_list(uint32_t *commits, uint32_t *trees, uint32_t *blobs, uint32_t *tags);
+off_t get_disk_usage_from_bitmap(struct rev_info *revs);
+
+/*
+ * Return the set of objects reachable from "commit", built from the
+ * stored bitmaps of the bitmapped pack; only the commits that are not
+ * covered by one are walked. Returns NULL if there is no usable pack
+ * bitmap. Free the result with bitmap_free().
+ */
+struct bitmap *bitmap_for_reachable_commit(struct commit *commit);
+
+/*
+ * Same as bitmap_for_reachable_commit(), for everything reachable from
+ * HEAD and the refs of the repository. Objects that the refs point to
+ * but that are not commits are included, but not what they reach.
+ */
+struct bitmap *bitmap_for_reachable_refs(void);
+
+/*
+ * Check whether "sha1" is in a set returned by
+ * bitmap_for_reachable_commit().
+ */
+int bitmap_has_object(struct bitmap *reachable, const unsigned char *sha1);
 void traverse_bitmap_commit_list(show_reachable_fn show_reachable);
 void test_bitmap_walk(struct rev_info *revs);
 char *pack_bitmap_filename(struct packed_git *p);
@@ -50,6 +72,7 @@ int reuse_partial_packfile_from_bitmap(struct packed_git **packfile, uint32_t *e
 int rebuild_existing_bitmaps(struct packing_data *mapping, khash_sha1 *reused_bitmaps, int show_progress);
 
 void bitmap_writer_show_progress(int show);
+void bitmap_writer_set_threads(int nr_threads);
 void bitmap_writer_set_checksum(unsigned char *sha1);
 void bitmap_writer_build_type_index(struct pack_idx_entry **index, uint32_t index_nr);
 void bitmap_writer_reuse_bitmaps(struct packing_data *to_pack);
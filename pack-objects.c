@@ -95,12 +95,17 @@ struct object_entry *packlist_alloc(struct packing_data *pdata,
 		pdata->nr_alloc = (pdata->nr_alloc  + 1024) * 3 / 2;
 		pdata->objects = xrealloc(pdata->objects,
 					  pdata->nr_alloc * sizeof(*new_entry));
+		if (pdata->tree_depth)
+			pdata->tree_depth = xrealloc(pdata->tree_depth,
+						     pdata->nr_alloc * sizeof(*pdata->tree_depth));
 	}
 
 	new_entry = pdata->objects + pdata->nr_objects++;
 
 	memset(new_entry, 0, sizeof(*new_entry));
 	hashcpy(new_entry->idx.sha1, sha1);
+	if (pdata->tree_depth)
+		pdata->tree_depth[pdata->nr_objects - 1] = 0;
 
 	if (pdata->index_size * 3 <= pdata->nr_objects * 4)
 		rehash_objects(pdata);
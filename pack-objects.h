@@ -27,6 +27,7 @@ struct object_entry {
 	unsigned no_try_delta:1;
 	unsigned tagged:1; /* near the very tip of refs */
 	unsigned filled:1; /* assigned write-order */
+	unsigned foreign_codec:1; /* in_pack data in a codec we can't send */
 };
 
 struct packing_data {
@@ -35,6 +36,12 @@ struct packing_data {
 
 	int32_t *index;
 	uint32_t index_size;
+
+	/*
+	 * How deep each tree sits below the root of a commit, indexed
+	 * like objects[]; only kept when delta islands are in use.
+	 */
+	unsigned int *tree_depth;
 };
 
 struct object_entry *packlist_alloc(struct packing_data *pdata,
@@ -45,6 +52,24 @@ struct object_entry *packlist_find(struct packing_data *pdata,
 				   const unsigned char *sha1,
 				   uint32_t *index_pos);
 
+static inline unsigned int oe_tree_depth(struct packing_data *pack,
+					 struct object_entry *e)
+{
+	if (!pack->tree_depth)
+		return 0;
+	return pack->tree_depth[e - pack->objects];
+}
+
+static inline void oe_set_tree_depth(struct packing_data *pack,
+				     struct object_entry *e,
+				     unsigned int tree_depth)
+{
+	if (!pack->tree_depth)
+		pack->tree_depth = xcalloc(pack->nr_alloc,
+					   sizeof(*pack->tree_depth));
+	pack->tree_depth[e - pack->objects] = tree_depth;
+}
+
 static inline uint32_t pack_name_hash(const char *name)
 {
 	uint32_t c, hash = 0;
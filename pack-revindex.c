@@ -1,5 +1,6 @@
 #include "cache.h"
 #include "pack-revindex.h"
+#include "pack.h"
 
 /*
  * Pack index for existing packs give us easy access to the offsets into
@@ -14,6 +15,11 @@
  * ordered by offset, so if you know the offset of an object, next offset
  * is where its packed representation ends and the index_nr can be used to
  * get the object sha1 from the main index.
+ *
+ * When the pack has a ".rev" file, the same list is read from it instead
+ * (see Documentation/technical/pack-format.txt): the file only stores the
+ * index_nr of each object in pack order, and the offsets come from the
+ * pack index.
  */
 
 static struct pack_revindex *pack_revindex;
@@ -196,6 +202,63 @@ static void create_pack_revindex(struct pack_revindex *rix)
 	sort_revindex(rix->revindex, num_ent, p->pack_size);
 }
 
+/*
+ * Map the ".rev" file written next to the ".idx" by index-pack and
+ * pack-objects, if there is one that matches the pack. Its table is
+ * already in pack order, so nothing needs to be sorted.
+ */
+static int load_pack_revindex(struct pack_revindex *rix)
+{
+	struct packed_git *p = rix->p;
+	const unsigned char *idx_checksum;
+	unsigned char *data;
+	struct stat st;
+	size_t len, expect;
+	char *rev_name;
+	int fd;
+
+	len = strlen(p->pack_name);
+	if (len < 5 || strcmp(p->pack_name + len - 5, ".pack"))
+		return -1;
+	rev_name = xmalloc(len);
+	memcpy(rev_name, p->pack_name, len - 5);
+	strcpy(rev_name + len - 5, ".rev");
+
+	fd = git_open_noatime(rev_name);
+	free(rev_name);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	len = xsize_t(st.st_size);
+	expect = RIDX_HEADER_SIZE + 4 * (size_t)p->num_objects + 2 * 20;
+	if (len != expect) {
+		close(fd);
+		return error("reverse-index file for %s has wrong size",
+			     p->pack_name);
+	}
+	data = xmmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	idx_checksum = (const unsigned char *)p->index_data +
+		       p->index_size - 40;
+	if (get_be32(data) != RIDX_SIGNATURE ||
+	    get_be32(data + 4) != RIDX_VERSION ||
+	    get_be32(data + 8) != RIDX_HASH_VERSION ||
+	    hashcmp(data + len - 40, idx_checksum)) {
+		munmap(data, len);
+		return error("reverse-index file for %s does not match the pack",
+			     p->pack_name);
+	}
+
+	rix->map = data;
+	rix->map_len = len;
+	rix->positions = data + RIDX_HEADER_SIZE;
+	return 0;
+}
+
 struct pack_revindex *revindex_for_pack(struct packed_git *p)
 {
 	int num;
@@ -209,23 +272,43 @@ struct pack_revindex *revindex_for_pack(struct packed_git *p)
 		die("internal error: pack revindex fubar");
 
 	rix = &pack_revindex[num];
-	if (!rix->revindex)
+	if (!rix->revindex && !rix->positions &&
+	    load_pack_revindex(rix))
 		create_pack_revindex(rix);
 
 	return rix;
 }
 
+uint32_t revindex_nr(const struct pack_revindex *pridx, uint32_t pos)
+{
+	if (pridx->positions)
+		return get_be32(pridx->positions + 4 * pos);
+	return pridx->revindex[pos].nr;
+}
+
+off_t revindex_offset(const struct pack_revindex *pridx, uint32_t pos)
+{
+	struct packed_git *p = pridx->p;
+
+	if (!pridx->positions)
+		return pridx->revindex[pos].offset;
+	/* one past the last object is where the pack trailer starts */
+	if (pos == p->num_objects)
+		return p->pack_size - 20;
+	return nth_packed_object_offset(p, revindex_nr(pridx, pos));
+}
+
 int find_revindex_position(struct pack_revindex *pridx, off_t ofs)
 {
 	int lo = 0;
 	int hi = pridx->p->num_objects + 1;
-	struct revindex_entry *revindex = pridx->revindex;
 
 	do {
 		unsigned mi = lo + (hi - lo) / 2;
-		if (revindex[mi].offset == ofs) {
+		off_t mi_ofs = revindex_offset(pridx, mi);
+		if (mi_ofs == ofs) {
 			return mi;
-		} else if (ofs < revindex[mi].offset)
+		} else if (ofs < mi_ofs)
 			hi = mi;
 		else
 			lo = mi + 1;
@@ -235,13 +318,14 @@ int find_revindex_position(struct pack_revindex *pridx, off_t ofs)
 	return -1;
 }
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs)
+struct pack_revindex *find_pack_revindex(struct packed_git *p, off_t ofs,
+					 uint32_t *pos)
 {
 	struct pack_revindex *pridx = revindex_for_pack(p);
-	int pos = find_revindex_position(pridx, ofs);
+	int ret = find_revindex_position(pridx, ofs);
 
-	if (pos < 0)
+	if (ret < 0)
 		return NULL;
-
-	return pridx->revindex + pos;
+	*pos = ret;
+	return pridx;
 }
@@ -8,12 +8,30 @@ struct revindex_entry {
 
 struct pack_revindex {
 	struct packed_git *p;
+	/* computed in-core, when the pack has no usable .rev file */
 	struct revindex_entry *revindex;
+	/* otherwise the mapped .rev file and its table of index positions */
+	void *map;
+	size_t map_len;
+	const unsigned char *positions;
 };
 
 struct pack_revindex *revindex_for_pack(struct packed_git *p);
 int find_revindex_position(struct pack_revindex *pridx, off_t ofs);
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs);
+/*
+ * The position in the pack index, and the offset in the pack, of the
+ * "pos"-th object in pack order. revindex_offset() also accepts
+ * pos == num_objects, for which it returns the start of the trailer.
+ */
+uint32_t revindex_nr(const struct pack_revindex *pridx, uint32_t pos);
+off_t revindex_offset(const struct pack_revindex *pridx, uint32_t pos);
+
+/*
+ * Find the object starting at "ofs" in "p" and store its position in
+ * pack order in "pos". Returns NULL if no object starts there.
+ */
+struct pack_revindex *find_pack_revindex(struct packed_git *p, off_t ofs,
+					 uint32_t *pos);
 
 #endif
@@ -176,6 +176,67 @@ const char *write_idx_file(const char *index_name, struct pack_idx_entry **objec
 	return index_name;
 }
 
+struct rev_entry {
+	off_t offset;
+	uint32_t nr;
+};
+
+static int rev_entry_compare(const void *a_, const void *b_)
+{
+	const struct rev_entry *a = a_, *b = b_;
+
+	if (a->offset < b->offset)
+		return -1;
+	return a->offset > b->offset;
+}
+
+/*
+ * Write the reverse index of a pack, i.e. the position in the .idx of
+ * each object, in pack order. "objects" must already be sorted the way
+ * write_idx_file() leaves them.
+ */
+const char *write_rev_file(const char *rev_name, struct pack_idx_entry **objects,
+			   uint32_t nr_objects, const unsigned char *pack_sha1)
+{
+	struct sha1file *f;
+	struct rev_entry *rev;
+	unsigned char header[RIDX_HEADER_SIZE];
+	uint32_t i;
+	int fd;
+
+	if (!rev_name) {
+		static char tmp_file[PATH_MAX];
+		fd = odb_mkstemp(tmp_file, sizeof(tmp_file), "pack/tmp_rev_XXXXXX");
+		rev_name = xstrdup(tmp_file);
+	} else {
+		unlink(rev_name);
+		fd = open(rev_name, O_CREAT|O_EXCL|O_WRONLY, 0600);
+	}
+	if (fd < 0)
+		die_errno("unable to create '%s'", rev_name);
+	f = sha1fd(fd, rev_name);
+
+	rev = xmalloc(sizeof(*rev) * (nr_objects ? nr_objects : 1));
+	for (i = 0; i < nr_objects; i++) {
+		rev[i].offset = objects[i]->offset;
+		rev[i].nr = i;
+	}
+	qsort(rev, nr_objects, sizeof(*rev), rev_entry_compare);
+
+	put_be32(header, RIDX_SIGNATURE);
+	put_be32(header + 4, RIDX_VERSION);
+	put_be32(header + 8, RIDX_HASH_VERSION);
+	sha1write(f, header, sizeof(header));
+	for (i = 0; i < nr_objects; i++) {
+		uint32_t nr = htonl(rev[i].nr);
+		sha1write(f, &nr, 4);
+	}
+	sha1write(f, pack_sha1, 20);
+	sha1close(f, NULL, CSUM_FSYNC);
+	free(rev);
+	return rev_name;
+}
+
 off_t write_pack_header(struct sha1file *f, uint32_t nr_entries)
 {
 	struct pack_header hdr;
@@ -343,7 +404,7 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 			 struct pack_idx_option *pack_idx_opts,
 			 unsigned char sha1[])
 {
-	const char *idx_tmp_name;
+	const char *idx_tmp_name, *rev_tmp_name = NULL;
 	int basename_len = name_buffer->len;
 
 	if (adjust_shared_perm(pack_tmp_name))
@@ -354,6 +415,13 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 	if (adjust_shared_perm(idx_tmp_name))
 		die_errno("unable to make temporary index file readable");
 
+	if (pack_idx_opts->flags & WRITE_REV) {
+		rev_tmp_name = write_rev_file(NULL, written_list, nr_written,
+					      sha1);
+		if (adjust_shared_perm(rev_tmp_name))
+			die_errno("unable to make temporary reverse-index file readable");
+	}
+
 	strbuf_addf(name_buffer, "%s.pack", sha1_to_hex(sha1));
 	free_pack_by_name(name_buffer->buf);
 
@@ -362,6 +430,14 @@ void finish_tmp_packfile(struct strbuf *name_buffer,
 
 	strbuf_setlen(name_buffer, basename_len);
 
+	if (rev_tmp_name) {
+		strbuf_addf(name_buffer, "%s.rev", sha1_to_hex(sha1));
+		if (rename(rev_tmp_name, name_buffer->buf))
+			die_errno("unable to rename temporary reverse-index file");
+		strbuf_setlen(name_buffer, basename_len);
+		free((void *)rev_tmp_name);
+	}
+
 	strbuf_addf(name_buffer, "%s.idx", sha1_to_hex(sha1));
 	if (rename(idx_tmp_name, name_buffer->buf))
 		die_errno("unable to rename temporary index file");
@@ -35,11 +35,22 @@ struct pack_header {
  */
 #define PACK_IDX_SIGNATURE 0xff744f63	/* "\377tOc" */
 
+/*
+ * Pack reverse index (".rev") header: signature, version and hash
+ * version, each 4 bytes, followed by the index positions of the objects
+ * in pack order, the pack checksum and the checksum of the file.
+ */
+#define RIDX_SIGNATURE 0x52494458	/* "RIDX" */
+#define RIDX_VERSION 1
+#define RIDX_HASH_VERSION 1
+#define RIDX_HEADER_SIZE 12
+
 struct pack_idx_option {
 	unsigned flags;
 	/* flag bits */
 #define WRITE_IDX_VERIFY 01 /* verify only, do not write the idx file */
 #define WRITE_IDX_STRICT 02
+#define WRITE_REV 04 /* also write a .rev file next to the idx */
 
 	uint32_t version;
 	uint32_t off32_limit;
@@ -77,6 +88,7 @@ struct progress;
 typedef int (*verify_fn)(const unsigned char*, enum object_type, unsigned long, void*, int*);
 
 extern const char *write_idx_file(const char *index_name, struct pack_idx_entry **objects, int nr_objects, const struct pack_idx_option *, const unsigned char *sha1);
+extern const char *write_rev_file(const char *rev_name, struct pack_idx_entry **objects, uint32_t nr_objects, const unsigned char *pack_sha1);
 extern int check_pack_crc(struct packed_git *p, struct pack_window **w_curs, off_t offset, off_t len, unsigned int nr);
 extern int verify_pack_index(struct packed_git *);
 extern int verify_pack(struct packed_git *, verify_fn fn, struct progress *, uint32_t);
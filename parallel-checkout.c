@@ -0,0 +1,246 @@
+#include "cache.h"
+#include "convert.h"
+#include "hashmap.h"
+#include "pkt-line.h"
+#include "progress.h"
+#include "run-command.h"
+#include "sigchain.h"
+#include "thread-utils.h"
+#include "parallel-checkout.h"
+
+struct checkout_item {
+	struct hashmap_entry ent;
+	struct cache_entry *ce;
+	int status;
+};
+
+static struct {
+	int enabled;
+	struct checkout_item **items;
+	int nr, alloc;
+	/* with core.ignorecase, the queued names */
+	struct hashmap names;
+} parallel_checkout;
+
+static int checkout_workers = 1;
+static int checkout_threshold = 100;
+
+static int parallel_checkout_config(const char *var, const char *value,
+				    void *cb)
+{
+	if (!strcmp(var, "checkout.workers")) {
+		checkout_workers = git_config_int(var, value);
+		if (checkout_workers < 0)
+			return error("checkout.workers cannot be negative: %d",
+				     checkout_workers);
+		return 0;
+	}
+	if (!strcmp(var, "checkout.thresholdforparallelism")) {
+		checkout_threshold = git_config_int(var, value);
+		return 0;
+	}
+	return 0;
+}
+
+static int item_name_cmp(const struct checkout_item *a,
+			 const struct checkout_item *b, const void *unused)
+{
+	return ce_namelen(a->ce) != ce_namelen(b->ce) ||
+		strncasecmp(a->ce->name, b->ce->name, ce_namelen(a->ce));
+}
+
+void init_parallel_checkout(void)
+{
+	static int config_read;
+
+	if (!config_read) {
+		git_config(parallel_checkout_config, NULL);
+		if (!checkout_workers)
+#ifndef NO_PTHREADS
+			checkout_workers = online_cpus();
+#else
+			checkout_workers = 1;
+#endif
+		config_read = 1;
+	}
+	parallel_checkout.enabled = checkout_workers > 1;
+	if (parallel_checkout.enabled && ignore_case)
+		hashmap_init(&parallel_checkout.names,
+			     (hashmap_cmp_fn)item_name_cmp, 0);
+}
+
+int enqueue_checkout(struct cache_entry *ce)
+{
+	struct checkout_item *item;
+	struct stream_filter *filter;
+
+	if (!parallel_checkout.enabled || !S_ISREG(ce->ce_mode))
+		return -1;
+	/* the workers only write the blob as it is */
+	filter = get_stream_filter(ce->name, ce->sha1);
+	if (!filter)
+		return -1;
+	if (!is_null_stream_filter(filter)) {
+		free_stream_filter(filter);
+		return -1;
+	}
+	free_stream_filter(filter);
+
+	item = xcalloc(1, sizeof(*item));
+	item->ce = ce;
+	item->status = CHECKOUT_PENDING;
+	if (ignore_case) {
+		/*
+		 * Of two paths that fold to the same one, the later is
+		 * written after the workers are done, as it would be
+		 * without them.
+		 */
+		hashmap_entry_init(item, memihash(ce->name, ce_namelen(ce)));
+		if (hashmap_get(&parallel_checkout.names, item, NULL))
+			item->status = CHECKOUT_COLLIDED;
+		else
+			hashmap_add(&parallel_checkout.names, item);
+	}
+	ALLOC_GROW(parallel_checkout.items, parallel_checkout.nr + 1,
+		   parallel_checkout.alloc);
+	parallel_checkout.items[parallel_checkout.nr++] = item;
+	return 0;
+}
+
+int parallel_checkout_queued(void)
+{
+	return parallel_checkout.nr;
+}
+
+static int send_items(int fd, int start, int end)
+{
+	struct strbuf buf = STRBUF_INIT;
+	int i, ret;
+
+	for (i = start; i < end; i++) {
+		const struct cache_entry *ce = parallel_checkout.items[i]->ce;
+
+		if (parallel_checkout.items[i]->status != CHECKOUT_PENDING)
+			continue;
+		packet_buf_write(&buf, "%d %o %s %s", i, ce->ce_mode,
+				 sha1_to_hex(ce->sha1), ce->name);
+	}
+	packet_buf_flush(&buf);
+	ret = write_in_full(fd, buf.buf, buf.len) == buf.len ? 0 : -1;
+	strbuf_release(&buf);
+	return ret;
+}
+
+static void handle_result(const struct checkout *state,
+			  const struct checkout_result *res,
+			  struct progress *progress, unsigned *progress_cnt)
+{
+	struct checkout_item *item;
+
+	if (res->id < 0 || res->id >= parallel_checkout.nr ||
+	    parallel_checkout.items[res->id]->status != CHECKOUT_PENDING)
+		die("bad result from checkout worker: %d", res->id);
+	item = parallel_checkout.items[res->id];
+	item->status = res->status;
+	if (item->status != CHECKOUT_WRITTEN)
+		return;
+	if (state->refresh_cache)
+		fill_stat_cache_info(item->ce, (struct stat *)&res->st);
+	display_progress(progress, ++*progress_cnt);
+}
+
+/*
+ * Each worker gets a run of consecutive entries, which tend to be in
+ * the same directories; the entries of a worker that fails are left
+ * for the caller to write.
+ */
+static void run_workers(int nr_workers, const struct checkout *state,
+			struct progress *progress, unsigned *progress_cnt)
+{
+	static const char *argv[] = { "checkout--worker", NULL };
+	struct child_process *workers;
+	struct pollfd *pfd;
+	int i, active = 0, nr = parallel_checkout.nr;
+
+	workers = xcalloc(nr_workers, sizeof(*workers));
+	pfd = xcalloc(nr_workers, sizeof(*pfd));
+	sigchain_push(SIGPIPE, SIG_IGN);
+	for (i = 0; i < nr_workers; i++) {
+		struct child_process *cp = &workers[i];
+
+		pfd[i].fd = -1;
+		cp->argv = argv;
+		cp->git_cmd = 1;
+		cp->in = -1;
+		cp->out = -1;
+		if (start_command(cp)) {
+			cp->argv = NULL;
+			continue;
+		}
+		if (send_items(cp->in, (long)nr * i / nr_workers,
+			       (long)nr * (i + 1) / nr_workers))
+			error("could not send entries to checkout worker");
+		close(cp->in);
+		pfd[i].fd = cp->out;
+		pfd[i].events = POLLIN;
+		active++;
+	}
+
+	while (active) {
+		if (poll(pfd, nr_workers, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll failed");
+		}
+		for (i = 0; i < nr_workers; i++) {
+			struct checkout_result res;
+
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+			if (read_in_full(pfd[i].fd, &res, sizeof(res)) != sizeof(res)) {
+				/* done, or gone */
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				active--;
+				continue;
+			}
+			handle_result(state, &res, progress, progress_cnt);
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		if (workers[i].argv)
+			finish_command(&workers[i]);
+	sigchain_pop(SIGPIPE);
+	free(workers);
+	free(pfd);
+}
+
+int run_parallel_checkout(const struct checkout *state,
+			  struct progress *progress, unsigned *progress_cnt)
+{
+	int i, errs = 0, nr = parallel_checkout.nr;
+
+	parallel_checkout.enabled = 0;
+	if (nr && nr >= checkout_threshold)
+		run_workers(checkout_workers < nr ? checkout_workers : nr,
+			    state, progress, progress_cnt);
+
+	/* what the workers did not write, in index order */
+	for (i = 0; i < nr; i++) {
+		struct checkout_item *item = parallel_checkout.items[i];
+
+		if (item->status != CHECKOUT_WRITTEN) {
+			errs |= checkout_entry(item->ce, state, NULL);
+			display_progress(progress, ++*progress_cnt);
+		}
+	}
+
+	if (ignore_case && parallel_checkout.names.tablesize)
+		hashmap_free(&parallel_checkout.names, 0);
+	for (i = 0; i < nr; i++)
+		free(parallel_checkout.items[i]);
+	free(parallel_checkout.items);
+	memset(&parallel_checkout, 0, sizeof(parallel_checkout));
+	return errs;
+}
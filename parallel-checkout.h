@@ -0,0 +1,48 @@
+#ifndef PARALLEL_CHECKOUT_H
+#define PARALLEL_CHECKOUT_H
+
+struct progress;
+
+/*
+ * With checkout.workers > 1, checkout_entry() prepares the path of a
+ * regular file that needs no conversion and queues it instead of
+ * writing it; run_parallel_checkout() then has "git checkout--worker"
+ * processes inflate and write the queued files, each their share, and
+ * writes itself, in index order, those they could not (for instance
+ * because two paths collide on a case-insensitive file system).
+ */
+extern void init_parallel_checkout(void);
+
+/* Returns 0 if "ce" was queued, -1 if the caller is to write it */
+extern int enqueue_checkout(struct cache_entry *ce);
+
+/* How many entries are queued */
+extern int parallel_checkout_queued(void);
+
+/*
+ * Write the queued entries and stop queueing; each entry written
+ * bumps *progress_cnt and shows it in "progress", if any.
+ */
+extern int run_parallel_checkout(const struct checkout *state,
+				 struct progress *progress,
+				 unsigned *progress_cnt);
+
+/*
+ * A worker reads "<id> <octal mode> <hex SHA-1> <path>" packets up to
+ * a flush packet, then writes the files and sends back the result of
+ * each, as it is, in the order it writes them.
+ */
+enum checkout_status {
+	CHECKOUT_PENDING,
+	CHECKOUT_WRITTEN,
+	CHECKOUT_COLLIDED,	/* the path was there already */
+	CHECKOUT_FAILED
+};
+
+struct checkout_result {
+	int id;
+	int status;
+	struct stat st;
+};
+
+#endif
@@ -0,0 +1,255 @@
+#include "cache.h"
+#include "thread-utils.h"
+#include "parallel-deflate.h"
+
+#ifndef NO_PTHREADS
+
+#define BLOCK_SIZE (128 * 1024)
+#define DICT_SIZE (32 * 1024)
+
+enum block_state {
+	BLOCK_EMPTY,
+	BLOCK_FILLED,
+	BLOCK_BUSY,
+	BLOCK_DONE
+};
+
+struct deflate_block {
+	/* the dictionary, and then the input of this block */
+	unsigned char *buf;
+	unsigned long dict_len, in_len;
+	unsigned char *out;
+	unsigned long out_len, out_alloc;
+	uLong adler;
+	unsigned last:1;
+	enum block_state state;
+};
+
+struct deflate_pool {
+	int level;
+	struct deflate_block *blocks;
+	int nr_blocks;
+
+	/*
+	 * Blocks are numbered in input order; block n lives in
+	 * blocks[n % nr_blocks].
+	 */
+	unsigned long filled;	/* number of blocks given input */
+	unsigned long next;	/* next block for a thread to take */
+	int stop;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+};
+
+static void deflate_block(int level, struct deflate_block *b)
+{
+	git_zstream stream;
+	unsigned long maxsize;
+	int status;
+
+	memset(&stream, 0, sizeof(stream));
+	git_deflate_init_raw(&stream, level);
+	if (b->dict_len)
+		deflateSetDictionary(&stream.z, b->buf, b->dict_len);
+
+	/* with room to spare for the sync marker */
+	maxsize = git_deflate_bound(&stream, b->in_len) + 64;
+	if (b->out_alloc < maxsize) {
+		free(b->out);
+		b->out = xmalloc(maxsize);
+		b->out_alloc = maxsize;
+	}
+
+	stream.next_in = b->buf + b->dict_len;
+	stream.avail_in = b->in_len;
+	stream.next_out = b->out;
+	stream.avail_out = maxsize;
+
+	/*
+	 * All but the last block end on a sync flush, so that the
+	 * raw deflate data of the blocks can simply be concatenated.
+	 */
+	status = git_deflate(&stream, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (b->last ? status != Z_STREAM_END : status != Z_OK)
+		die("unable to deflate block (%d)", status);
+	b->out_len = stream.total_out;
+	/* the stream of all but the last block is left unfinished */
+	git_deflate_abort(&stream);
+
+	b->adler = adler32(adler32(0L, Z_NULL, 0),
+			   b->buf + b->dict_len, b->in_len);
+}
+
+static void *deflate_thread(void *data)
+{
+	struct deflate_pool *pool = data;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		struct deflate_block *b;
+
+		while (pool->next == pool->filled && !pool->stop)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (pool->stop)
+			break;
+
+		b = &pool->blocks[pool->next++ % pool->nr_blocks];
+		b->state = BLOCK_BUSY;
+		pthread_mutex_unlock(&pool->mutex);
+
+		deflate_block(pool->level, b);
+
+		pthread_mutex_lock(&pool->mutex);
+		b->state = BLOCK_DONE;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+static void zlib_header(int level, unsigned char *hdr)
+{
+	unsigned header = (Z_DEFLATED + ((15 - 8) << 4)) << 8;
+	unsigned level_flags;
+
+	/* Say what deflate() itself would say for this level */
+	if (level == Z_DEFAULT_COMPRESSION)
+		level = 6;
+	if (level < 2)
+		level_flags = 0;
+	else if (level < 6)
+		level_flags = 1;
+	else if (level == 6)
+		level_flags = 2;
+	else
+		level_flags = 3;
+	header |= level_flags << 6;
+	header += 31 - (header % 31);
+
+	hdr[0] = header >> 8;
+	hdr[1] = header & 0xff;
+}
+
+/*
+ * Give the next block its input, primed with the tail of the input of
+ * the block before it; that one has not been filled again yet, even
+ * if it was written out already.
+ */
+static void fill_block(struct deflate_pool *pool, struct deflate_block *b,
+		       size_t len, int last,
+		       parallel_deflate_read_fn read_fn, void *data)
+{
+	b->dict_len = 0;
+	if (pool->filled) {
+		struct deflate_block *prev =
+			&pool->blocks[(pool->filled - 1) % pool->nr_blocks];
+		unsigned long prev_len = prev->dict_len + prev->in_len;
+
+		b->dict_len = prev_len < DICT_SIZE ? prev_len : DICT_SIZE;
+		memcpy(b->buf, prev->buf + prev_len - b->dict_len, b->dict_len);
+	}
+	read_fn(data, b->buf + b->dict_len, len);
+	b->in_len = len;
+	b->last = last;
+
+	pthread_mutex_lock(&pool->mutex);
+	b->state = BLOCK_FILLED;
+	pool->filled++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+int parallel_deflate(int level, int nr_threads, size_t size,
+		     parallel_deflate_read_fn read_fn,
+		     parallel_deflate_write_fn write_fn, void *data)
+{
+	struct deflate_pool pool;
+	pthread_t *threads;
+	unsigned long written = 0;
+	uLong adler = adler32(0L, Z_NULL, 0);
+	unsigned char hdr[4];
+	int input_done = 0, ret = 0, i;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.level = level;
+	pool.nr_blocks = 2 * nr_threads;
+	pool.blocks = xcalloc(pool.nr_blocks, sizeof(*pool.blocks));
+	for (i = 0; i < pool.nr_blocks; i++)
+		pool.blocks[i].buf = xmalloc(DICT_SIZE + BLOCK_SIZE);
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.work_cond, NULL);
+	pthread_cond_init(&pool.done_cond, NULL);
+
+	threads = xcalloc(nr_threads, sizeof(*threads));
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, deflate_thread, &pool))
+			die("unable to create deflate thread");
+
+	zlib_header(level, hdr);
+	ret = write_fn(data, hdr, 2);
+
+	while (!ret && (!input_done || written < pool.filled)) {
+		struct deflate_block *b;
+
+		/* keep the threads busy */
+		while (!input_done && pool.filled - written < pool.nr_blocks) {
+			size_t len = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+
+			size -= len;
+			input_done = !size;
+			fill_block(&pool, &pool.blocks[pool.filled % pool.nr_blocks],
+				   len, input_done, read_fn, data);
+		}
+
+		/* and write out the oldest block once it is compressed */
+		b = &pool.blocks[written % pool.nr_blocks];
+		pthread_mutex_lock(&pool.mutex);
+		while (b->state != BLOCK_DONE)
+			pthread_cond_wait(&pool.done_cond, &pool.mutex);
+		b->state = BLOCK_EMPTY;
+		pthread_mutex_unlock(&pool.mutex);
+
+		adler = adler32_combine(adler, b->adler, b->in_len);
+		ret = write_fn(data, b->out, b->out_len);
+		written++;
+	}
+
+	if (!ret) {
+		hdr[0] = adler >> 24;
+		hdr[1] = adler >> 16;
+		hdr[2] = adler >> 8;
+		hdr[3] = adler;
+		ret = write_fn(data, hdr, 4);
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.mutex);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	pthread_cond_destroy(&pool.done_cond);
+	pthread_cond_destroy(&pool.work_cond);
+	pthread_mutex_destroy(&pool.mutex);
+	for (i = 0; i < pool.nr_blocks; i++) {
+		free(pool.blocks[i].buf);
+		free(pool.blocks[i].out);
+	}
+	free(pool.blocks);
+	return ret;
+}
+
+#else
+
+int parallel_deflate(int level, int nr_threads, size_t size,
+		     parallel_deflate_read_fn read_fn,
+		     parallel_deflate_write_fn write_fn, void *data)
+{
+	die("BUG: parallel_deflate() without pthreads");
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef PARALLEL_DEFLATE_H
+#define PARALLEL_DEFLATE_H
+
+/*
+ * Read exactly `len` bytes of the input into `buf`, dying on error.
+ */
+typedef void (*parallel_deflate_read_fn)(void *data, void *buf, size_t len);
+
+/*
+ * Take the next `len` bytes of the compressed stream.  A negative
+ * return value stops the compression, and is returned to the caller
+ * of parallel_deflate().
+ */
+typedef int (*parallel_deflate_write_fn)(void *data, const void *buf, size_t len);
+
+/*
+ * Compress `size` bytes given by `read_fn` into a zlib stream handed
+ * to `write_fn` in order, the way pigz does: the input is cut into
+ * blocks deflated independently on `nr_threads` threads, each primed
+ * with the tail of the block before it so that little compression is
+ * lost.  Returns 0, or what `write_fn` returned to stop it.
+ *
+ * The stream differs from what a single git_deflate() would produce,
+ * but inflates to the same data.  Without pthreads there is no such
+ * thing; callers keep to their own serial loop then.
+ */
+int parallel_deflate(int level, int nr_threads, size_t size,
+		     parallel_deflate_read_fn read_fn,
+		     parallel_deflate_write_fn write_fn, void *data);
+
+#endif
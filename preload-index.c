@@ -52,7 +52,9 @@ static void *preload_thread(void *_data)
 			continue;
 		if (S_ISGITLINK(ce->ce_mode))
 			continue;
-		if (ce_uptodate(ce))
+		if (ce_uptodate(ce) || ce_skip_worktree(ce))
+			continue;
+		if (ce->ce_flags & CE_FSMONITOR_VALID)
 			continue;
 		if (!ce_path_match(ce, &p->pathspec, NULL))
 			continue;
@@ -14,6 +14,10 @@
 #include "resolve-undo.h"
 #include "strbuf.h"
 #include "varint.h"
+#include "fsmonitor.h"
+#include "split-index.h"
+#include "sparse-index.h"
+#include "thread-utils.h"
 
 static struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
 					       unsigned int options);
@@ -34,6 +38,13 @@ static struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
 #define CACHE_EXT(s) ( (s[0]<<24)|(s[1]<<16)|(s[2]<<8)|(s[3]) )
 #define CACHE_EXT_TREE 0x54524545	/* "TREE" */
 #define CACHE_EXT_RESOLVE_UNDO 0x52455543 /* "REUC" */
+#define CACHE_EXT_UNTRACKED 0x554E5452	  /* "UNTR" */
+#define CACHE_EXT_FSMONITOR 0x46534D4E	  /* "FSMN" */
+#define CACHE_EXT_LINK 0x6c696e6b	  /* "link" */
+#define CACHE_EXT_ENDOFINDEXENTRIES 0x454F4945	/* "EOIE" */
+#define CACHE_EXT_INDEXENTRYOFFSETTABLE 0x49454F54 /* "IEOT" */
+#define CACHE_EXT_SPARSE_DIRECTORIES 0x73646972	  /* "sdir" */
+#define CACHE_EXT_SPARSE_CHECKOUT 0x5350434b	  /* "SPCK" */
 
 struct index_state the_index;
 
@@ -479,6 +490,7 @@ int remove_index_entry_at(struct index_state *istate, int pos)
 	struct cache_entry *ce = istate->cache[pos];
 
 	record_resolve_undo(istate, ce);
+	untracked_cache_invalidate_path(istate, ce->name);
 	remove_name_hash(istate, ce);
 	free(ce);
 	istate->cache_changed = 1;
@@ -503,6 +515,7 @@ void remove_marked_cache_entries(struct index_state *istate)
 
 	for (i = j = 0; i < istate->cache_nr; i++) {
 		if (ce_array[i]->ce_flags & CE_REMOVE) {
+			untracked_cache_invalidate_path(istate, ce_array[i]->name);
 			remove_name_hash(istate, ce_array[i]);
 			free(ce_array[i]);
 		}
@@ -937,6 +950,7 @@ static int add_index_entry_with_check(struct index_state *istate, struct cache_e
 	int new_only = option & ADD_CACHE_NEW_ONLY;
 
 	cache_tree_invalidate_path(istate->cache_tree, ce->name);
+	untracked_cache_invalidate_path(istate, ce->name);
 	pos = index_name_stage_pos(istate, ce->name, ce_namelen(ce), ce_stage(ce));
 
 	/* existing match? Just replace it. */
@@ -1000,6 +1014,8 @@ int add_index_entry(struct index_state *istate, struct cache_entry *ce, int opti
 			(istate->cache_nr - pos - 1) * sizeof(ce));
 	set_index_entry(istate, pos, ce);
 	istate->cache_changed = 1;
+	/* its skip-worktree bit was not set from the sparse-checkout patterns */
+	hashclr(istate->sparse_checkout_sha1);
 	return 0;
 }
 
@@ -1043,6 +1059,11 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 		ce_mark_uptodate(ce);
 		return ce;
 	}
+	/* the fsmonitor would have reported a change to it */
+	if (!ignore_valid && (ce->ce_flags & CE_FSMONITOR_VALID)) {
+		ce_mark_uptodate(ce);
+		return ce;
+	}
 
 	if (lstat(ce->name, &st) < 0) {
 		if (ignore_missing && errno == ENOENT)
@@ -1072,8 +1093,10 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 			 * because CE_UPTODATE flag is in-core only;
 			 * we are not going to write this change out.
 			 */
-			if (!S_ISGITLINK(ce->ce_mode))
+			if (!S_ISGITLINK(ce->ce_mode)) {
 				ce_mark_uptodate(ce);
+				mark_fsmonitor_valid(istate, ce);
+			}
 			return ce;
 		}
 	}
@@ -1097,6 +1120,7 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 	if (!ignore_valid && assume_unchanged &&
 	    !(ce->ce_flags & CE_VALID))
 		updated->ce_flags &= ~CE_VALID;
+	mark_fsmonitor_valid(istate, updated);
 
 	return updated;
 }
@@ -1331,6 +1355,28 @@ static int read_index_extension(struct index_state *istate,
 	case CACHE_EXT_RESOLVE_UNDO:
 		istate->resolve_undo = resolve_undo_read(data, sz);
 		break;
+	case CACHE_EXT_UNTRACKED:
+		istate->untracked = read_untracked_extension(data, sz);
+		break;
+	case CACHE_EXT_FSMONITOR:
+		read_fsmonitor_extension(istate, data, sz);
+		break;
+	case CACHE_EXT_LINK:
+		if (read_link_extension(istate, data, sz))
+			return -1;
+		break;
+	case CACHE_EXT_SPARSE_DIRECTORIES:
+		/* no content, only that there are such entries */
+		istate->sparse_index = 1;
+		break;
+	case CACHE_EXT_SPARSE_CHECKOUT:
+		if (sz == 20)
+			hashcpy(istate->sparse_checkout_sha1, data);
+		break;
+	case CACHE_EXT_INDEXENTRYOFFSETTABLE:
+	case CACHE_EXT_ENDOFINDEXENTRIES:
+		/* already used, if at all, to read the entries */
+		break;
 	default:
 		if (*ext < 'A' || 'Z' < *ext)
 			return error("index uses %.4s extension, which we do not understand",
@@ -1377,15 +1423,22 @@ static struct cache_entry *cache_entry_from_ondisk(struct ondisk_cache_entry *on
  * on-disk format of the index, each on-disk cache entry stores the
  * number of bytes to be stripped from the end of the previous name,
  * and the bytes to append to the result, to come up with its name.
+ *
+ * The first entry of a block of the entry offset table strips all of
+ * the previous name, which a thread that starts there does not know.
  */
-static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
+static unsigned long expand_name_field(struct strbuf *name, const char *cp_,
+				       int block_start)
 {
 	const unsigned char *ep, *cp = (const unsigned char *)cp_;
 	size_t len = decode_varint(&cp);
 
-	if (name->len < len)
+	if (block_start)
+		strbuf_reset(name);
+	else if (name->len < len)
 		die("malformed name field in the index");
-	strbuf_remove(name, name->len - len, len);
+	else
+		strbuf_remove(name, name->len - len, len);
 	for (ep = cp; *ep; ep++)
 		; /* find the end */
 	strbuf_add(name, cp, ep - cp);
@@ -1394,7 +1447,8 @@ static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
 
 static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 					    unsigned long *ent_size,
-					    struct strbuf *previous_name)
+					    struct strbuf *previous_name,
+					    int block_start)
 {
 	struct cache_entry *ce;
 	size_t len;
@@ -1428,7 +1482,7 @@ static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 		*ent_size = ondisk_ce_size(ce);
 	} else {
 		unsigned long consumed;
-		consumed = expand_name_field(previous_name, name);
+		consumed = expand_name_field(previous_name, name, block_start);
 		ce = cache_entry_from_ondisk(ondisk, flags,
 					     previous_name->buf,
 					     previous_name->len);
@@ -1438,19 +1492,282 @@ static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 	return ce;
 }
 
+/*
+ * Read "nr" entries from "offset" in the mapped index into the cache,
+ * from position "pos" on, and return the number of bytes they took.
+ */
+static unsigned long load_cache_entry_block(struct index_state *istate,
+					    const char *mmap, int pos, int nr,
+					    unsigned long offset)
+{
+	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	unsigned long start_offset = offset;
+	int i;
+
+	previous_name = (istate->version == 4) ? &previous_name_buf : NULL;
+	for (i = 0; i < nr; i++) {
+		struct ondisk_cache_entry *disk_ce;
+		struct cache_entry *ce;
+		unsigned long consumed;
+
+		disk_ce = (struct ondisk_cache_entry *)(mmap + offset);
+		ce = create_from_disk(disk_ce, &consumed, previous_name,
+				      !i && start_offset > sizeof(struct cache_header));
+		set_index_entry(istate, pos + i, ce);
+		offset += consumed;
+	}
+	strbuf_release(&previous_name_buf);
+	return offset - start_offset;
+}
+
+/*
+ * index.threads: how many threads read the index, 0 (the default)
+ * for as many as there are CPUs, 1 to read it serially and not write
+ * the tables that let several threads do it. Like core.fsmonitor, it
+ * is looked up on its own as the index may be read before the
+ * configuration.
+ */
+static int index_threads;
+
+static int index_threads_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "index.threads")) {
+		int is_bool, v = git_config_bool_or_int(var, value, &is_bool);
+
+		if (is_bool)
+			v = v ? 0 : 1;
+		else if (v < 0)
+			return error("index.threads cannot be negative: %d", v);
+		index_threads = v;
+	}
+	return 0;
+}
+
+static int get_index_threads(void)
+{
+#ifdef NO_PTHREADS
+	return 1;
+#else
+	static int config_read;
+
+	if (!config_read) {
+		git_config(index_threads_config, NULL);
+		config_read = 1;
+	}
+	return index_threads;
+#endif
+}
+
+/*
+ * Entries are grouped in blocks of this many in the offset table,
+ * which is only written for indexes of at least INDEX_THREAD_COST
+ * entries: below that, starting threads costs more than it saves.
+ */
+#define INDEX_BLOCK_ENTRIES 1000
+#define INDEX_THREAD_COST 10000
+
+/*
+ * The "EOIE" extension, written last, has the offset of the first
+ * extension and the SHA-1 of the headers of the extensions before it,
+ * so that they can be read while the entries are.
+ */
+#define EOIE_SIZE (4 + 20)
+#define EOIE_SIZE_WITH_HEADER (4 + 4 + EOIE_SIZE)
+
+/*
+ * The "IEOT" extension, written first, is the offset and the number
+ * of entries of each block of entries.
+ */
+#define IEOT_VERSION 1
+
+#ifndef NO_PTHREADS
+
+static unsigned long read_eoie_extension(const char *mmap, size_t mmap_size)
+{
+	const char *eoie, *p;
+	unsigned long offset, src_offset, eoie_offset;
+	unsigned char sha1[20];
+	git_SHA_CTX c;
+
+	if (mmap_size < sizeof(struct cache_header) + EOIE_SIZE_WITH_HEADER + 20)
+		return 0;
+	eoie_offset = mmap_size - 20 - EOIE_SIZE_WITH_HEADER;
+	eoie = mmap + eoie_offset;
+	if (CACHE_EXT(eoie) != CACHE_EXT_ENDOFINDEXENTRIES ||
+	    get_be32(eoie + 4) != EOIE_SIZE)
+		return 0;
+	p = eoie + 8;
+	offset = get_be32(p);
+	if (offset < sizeof(struct cache_header) || offset > eoie_offset)
+		return 0;
+
+	/* the extensions must end right where EOIE starts */
+	git_SHA1_Init(&c);
+	for (src_offset = offset; src_offset + 8 <= eoie_offset; ) {
+		git_SHA1_Update(&c, mmap + src_offset, 8);
+		src_offset += 8 + (unsigned long)get_be32(mmap + src_offset + 4);
+	}
+	if (src_offset != eoie_offset)
+		return 0;
+	git_SHA1_Final(sha1, &c);
+	if (hashcmp(sha1, (const unsigned char *)p + 4))
+		return 0;
+	return offset;
+}
+
+struct index_entry_offset {
+	unsigned long offset;
+	int nr;
+};
+
+struct index_entry_offset_table {
+	int nr;
+	struct index_entry_offset entries[FLEX_ARRAY];
+};
+
+static struct index_entry_offset_table *read_ieot_extension(
+		struct index_state *istate, const char *mmap,
+		unsigned long offset)
+{
+	struct index_entry_offset_table *ieot;
+	const char *p = mmap + offset;
+	uint32_t extsize;
+	int i, nr, total = 0;
+
+	if (CACHE_EXT(p) != CACHE_EXT_INDEXENTRYOFFSETTABLE)
+		return NULL;
+	extsize = get_be32(p + 4);
+	if (extsize < 4 || (extsize - 4) % 8 || get_be32(p + 8) != IEOT_VERSION)
+		return NULL;
+	nr = (extsize - 4) / 8;
+	p += 12;
+	ieot = xmalloc(sizeof(*ieot) + nr * sizeof(ieot->entries[0]));
+	ieot->nr = nr;
+	for (i = 0; i < nr; i++) {
+		ieot->entries[i].offset = get_be32(p);
+		ieot->entries[i].nr = get_be32(p + 4);
+		p += 8;
+		/* blocks must follow each other and hold all the entries */
+		if (ieot->entries[i].offset >= offset ||
+		    (i ? ieot->entries[i].offset <= ieot->entries[i - 1].offset
+		       : ieot->entries[i].offset != sizeof(struct cache_header)) ||
+		    ieot->entries[i].nr <= 0 ||
+		    ieot->entries[i].nr > istate->cache_nr - total) {
+			free(ieot);
+			return NULL;
+		}
+		total += ieot->entries[i].nr;
+	}
+	if (total != istate->cache_nr) {
+		free(ieot);
+		return NULL;
+	}
+	return ieot;
+}
+
+struct load_extensions_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	const char *mmap;
+	size_t mmap_size;
+	unsigned long offset;
+	int error;
+};
+
+static void *load_index_extensions(void *_data)
+{
+	struct load_extensions_data *p = _data;
+	unsigned long src_offset = p->offset;
+
+	while (src_offset <= p->mmap_size - 20 - 8) {
+		uint32_t extsize = get_be32(p->mmap + src_offset + 4);
+
+		if (read_index_extension(p->istate, p->mmap + src_offset,
+					 (char *)p->mmap + src_offset + 8,
+					 extsize) < 0) {
+			p->error = 1;
+			break;
+		}
+		src_offset += 8 + extsize;
+	}
+	return NULL;
+}
+
+struct load_entries_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	const char *mmap;
+	struct index_entry_offset *blocks;
+	int nr_blocks, pos;
+};
+
+static void *load_cache_entries_thread(void *_data)
+{
+	struct load_entries_data *p = _data;
+	int i, pos = p->pos;
+
+	for (i = 0; i < p->nr_blocks; i++) {
+		load_cache_entry_block(p->istate, p->mmap, pos,
+				       p->blocks[i].nr, p->blocks[i].offset);
+		pos += p->blocks[i].nr;
+	}
+	return NULL;
+}
+
+/* Each thread reads consecutive blocks, about as many as the others */
+static void load_cache_entries_threaded(struct index_state *istate,
+					const char *mmap, int nr_threads,
+					struct index_entry_offset_table *ieot)
+{
+	struct load_entries_data *data;
+	int i, block = 0, pos = 0;
+
+	if (nr_threads > ieot->nr)
+		nr_threads = ieot->nr;
+	data = xcalloc(nr_threads, sizeof(*data));
+	for (i = 0; i < nr_threads; i++) {
+		struct load_entries_data *p = &data[i];
+		int j;
+
+		p->istate = istate;
+		p->mmap = mmap;
+		p->blocks = ieot->entries + block;
+		p->nr_blocks = (ieot->nr - block) / (nr_threads - i);
+		p->pos = pos;
+		for (j = 0; j < p->nr_blocks; j++)
+			pos += p->blocks[j].nr;
+		block += p->nr_blocks;
+		if (pthread_create(&p->pthread, NULL,
+				   load_cache_entries_thread, p))
+			die("unable to create index load thread");
+	}
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_join(data[i].pthread, NULL))
+			die("unable to join index load thread");
+	free(data);
+}
+
+#endif
+
 /* remember to discard_cache() before reading a different cache! */
-int read_index_from(struct index_state *istate, const char *path)
+/*
+ * Read the index file "path" as it is; "sha1", if given, receives its
+ * trailing checksum.
+ */
+static int do_read_index(struct index_state *istate, const char *path,
+			 unsigned char *sha1)
 {
-	int fd, i;
+	int fd;
 	struct stat st;
 	unsigned long src_offset;
 	struct cache_header *hdr;
 	void *mmap;
 	size_t mmap_size;
-	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
-
-	if (istate->initialized)
-		return istate->cache_nr;
+	int nr_threads;
+#ifndef NO_PTHREADS
+	struct load_extensions_data extensions;
+	struct index_entry_offset_table *ieot = NULL;
+#endif
 
 	istate->timestamp.sec = 0;
 	istate->timestamp.nsec = 0;
@@ -1476,6 +1793,8 @@ int read_index_from(struct index_state *istate, const char *path)
 	hdr = mmap;
 	if (verify_hdr(hdr, mmap_size) < 0)
 		goto unmap;
+	if (sha1)
+		hashcpy(sha1, (unsigned char *)mmap + mmap_size - 20);
 
 	istate->version = ntohl(hdr->hdr_version);
 	istate->cache_nr = ntohl(hdr->hdr_entries);
@@ -1483,27 +1802,51 @@ int read_index_from(struct index_state *istate, const char *path)
 	istate->cache = xcalloc(istate->cache_alloc, sizeof(*istate->cache));
 	istate->initialized = 1;
 
-	if (istate->version == 4)
-		previous_name = &previous_name_buf;
-	else
-		previous_name = NULL;
-
 	src_offset = sizeof(*hdr);
-	for (i = 0; i < istate->cache_nr; i++) {
-		struct ondisk_cache_entry *disk_ce;
-		struct cache_entry *ce;
-		unsigned long consumed;
+	nr_threads = get_index_threads();
+	if (!nr_threads)
+		nr_threads = online_cpus();
 
-		disk_ce = (struct ondisk_cache_entry *)((char *)mmap + src_offset);
-		ce = create_from_disk(disk_ce, &consumed, previous_name);
-		set_index_entry(istate, i, ce);
-
-		src_offset += consumed;
+#ifndef NO_PTHREADS
+	/*
+	 * With the offset of the extensions, a thread reads them while
+	 * the entries are read, by other threads if there is an offset
+	 * table, or by this one.
+	 */
+	memset(&extensions, 0, sizeof(extensions));
+	if (nr_threads > 1)
+		extensions.offset = read_eoie_extension(mmap, mmap_size);
+	if (extensions.offset) {
+		extensions.istate = istate;
+		extensions.mmap = mmap;
+		extensions.mmap_size = mmap_size;
+		if (pthread_create(&extensions.pthread, NULL,
+				   load_index_extensions, &extensions))
+			die("unable to create index load thread");
+		nr_threads--;
+		ieot = read_ieot_extension(istate, mmap, extensions.offset);
 	}
-	strbuf_release(&previous_name_buf);
+	if (ieot && nr_threads > 1)
+		load_cache_entries_threaded(istate, mmap, nr_threads, ieot);
+	else
+#endif
+		src_offset += load_cache_entry_block(istate, mmap, 0,
+						     istate->cache_nr, src_offset);
 	istate->timestamp.sec = st.st_mtime;
 	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 
+#ifndef NO_PTHREADS
+	free(ieot);
+	if (extensions.offset) {
+		if (pthread_join(extensions.pthread, NULL))
+			die("unable to join index load thread");
+		if (extensions.error)
+			goto unmap;
+		munmap(mmap, mmap_size);
+		return istate->cache_nr;
+	}
+#endif
+
 	while (src_offset <= mmap_size - 20 - 8) {
 		/* After an array of active_nr index entries,
 		 * there can be arbitrary number of extended
@@ -1530,6 +1873,43 @@ unmap:
 	die("index file corrupt");
 }
 
+int read_index_from(struct index_state *istate, const char *path)
+{
+	struct split_index *split_index;
+	unsigned char sha1[20];
+	const char *base_path;
+	int ret;
+
+	if (istate->initialized)
+		return istate->cache_nr;
+
+	ret = do_read_index(istate, path, NULL);
+	split_index = istate->split_index;
+	if (split_index && !is_null_sha1(split_index->base_sha1)) {
+		if (split_index->base)
+			discard_index(split_index->base);
+		else
+			split_index->base = xcalloc(1, sizeof(*split_index->base));
+		base_path = git_path("sharedindex.%s",
+				     sha1_to_hex(split_index->base_sha1));
+		if (do_read_index(split_index->base, base_path, sha1) <= 0 &&
+		    !split_index->base->initialized)
+			die("broken index, expect %s", base_path);
+		if (hashcmp(split_index->base_sha1, sha1))
+			die("broken index, expect %s in %s, got %s",
+			    sha1_to_hex(split_index->base_sha1), base_path,
+			    sha1_to_hex(sha1));
+		merge_base_index(istate);
+		ret = istate->cache_nr;
+	}
+	tweak_fsmonitor(istate);
+	if (istate->sparse_index && command_requires_full_index) {
+		ensure_full_index(istate);
+		ret = istate->cache_nr;
+	}
+	return ret;
+}
+
 int is_index_unborn(struct index_state *istate)
 {
 	return (!istate->cache_nr && !istate->timestamp.sec);
@@ -1548,6 +1928,13 @@ int discard_index(struct index_state *istate)
 	istate->timestamp.nsec = 0;
 	free_name_hash(istate);
 	cache_tree_free(&(istate->cache_tree));
+	free_untracked_cache(istate->untracked);
+	istate->untracked = NULL;
+	istate->fsmonitor_last_update = 0;
+	istate->fsmonitor_trusted = 0;
+	discard_split_index(istate);
+	istate->sparse_index = 0;
+	hashclr(istate->sparse_checkout_sha1);
 	istate->initialized = 0;
 	free(istate->cache);
 	istate->cache = NULL;
@@ -1603,16 +1990,25 @@ static int ce_write(git_SHA_CTX *context, int fd, void *data, unsigned int len)
 	return 0;
 }
 
-static int write_index_ext_header(git_SHA_CTX *context, int fd,
+/*
+ * "eoie_context", if not NULL, collects the extension headers for the
+ * EOIE extension.
+ */
+static int write_index_ext_header(git_SHA_CTX *context,
+				  git_SHA_CTX *eoie_context, int fd,
 				  unsigned int ext, unsigned int sz)
 {
 	ext = htonl(ext);
 	sz = htonl(sz);
+	if (eoie_context) {
+		git_SHA1_Update(eoie_context, &ext, 4);
+		git_SHA1_Update(eoie_context, &sz, 4);
+	}
 	return ((ce_write(context, fd, &ext, 4) < 0) ||
 		(ce_write(context, fd, &sz, 4) < 0)) ? -1 : 0;
 }
 
-static int ce_flush(git_SHA_CTX *context, int fd)
+static int ce_flush(git_SHA_CTX *context, int fd, unsigned char *sha1)
 {
 	unsigned int left = write_buffer_len;
 
@@ -1630,6 +2026,8 @@ static int ce_flush(git_SHA_CTX *context, int fd)
 
 	/* Append the SHA1 signature at the end */
 	git_SHA1_Final(write_buffer + left, context);
+	if (sha1)
+		hashcpy(sha1, write_buffer + left);
 	left += 20;
 	return (write_in_full(fd, write_buffer, left) != left) ? -1 : 0;
 }
@@ -1785,15 +2183,22 @@ void update_index_if_able(struct index_state *istate, struct lock_file *lockfile
 		rollback_lock_file(lockfile);
 }
 
-int write_index(struct index_state *istate, int newfd)
+/*
+ * Write "cache" as the entries of "istate"; the extensions are left
+ * out for a shared index.
+ */
+static int do_write_index(struct index_state *istate, int newfd,
+			  struct cache_entry **cache, int entries,
+			  int strip_extensions, unsigned char *sha1)
 {
 	git_SHA_CTX c;
 	struct cache_header hdr;
-	int i, err, removed, extended, hdr_version;
-	struct cache_entry **cache = istate->cache;
-	int entries = istate->cache_nr;
+	int i, err, removed, extended, hdr_version, nr_written;
 	struct stat st;
 	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	struct strbuf ieot = STRBUF_INIT;
+	git_SHA_CTX eoie, *eoie_c = NULL;
+	off_t offset = 0;
 
 	for (i = removed = extended = 0; i < entries; i++) {
 		if (cache[i]->ce_flags & CE_REMOVE)
@@ -1824,11 +2229,34 @@ int write_index(struct index_state *istate, int newfd)
 	if (ce_write(&c, newfd, &hdr, sizeof(hdr)) < 0)
 		return -1;
 
+	/*
+	 * Let large indexes be read by several threads; the offsets
+	 * recorded are those in the file, which must be written from
+	 * its start.
+	 */
+	if (entries - removed >= INDEX_THREAD_COST && get_index_threads() != 1 &&
+	    lseek(newfd, 0, SEEK_CUR) == 0) {
+		git_SHA1_Init(&eoie);
+		eoie_c = &eoie;
+	}
+
 	previous_name = (hdr_version == 4) ? &previous_name_buf : NULL;
-	for (i = 0; i < entries; i++) {
+	for (i = nr_written = 0; i < entries; i++) {
 		struct cache_entry *ce = cache[i];
 		if (ce->ce_flags & CE_REMOVE)
 			continue;
+		if (eoie_c && !(nr_written % INDEX_BLOCK_ENTRIES)) {
+			uint32_t v = htonl(write_buffer_len + lseek(newfd, 0, SEEK_CUR));
+
+			strbuf_add(&ieot, &v, 4);
+			v = htonl(entries - removed - nr_written < INDEX_BLOCK_ENTRIES ?
+				  entries - removed - nr_written : INDEX_BLOCK_ENTRIES);
+			strbuf_add(&ieot, &v, 4);
+			/* make the first entry of the block strip the whole name */
+			if (previous_name && previous_name->len)
+				previous_name->buf[0] = '\0';
+		}
+		nr_written++;
 		if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce))
 			ce_smudge_racily_clean_entry(ce);
 		if (is_null_sha1(ce->sha1)) {
@@ -1848,11 +2276,48 @@ int write_index(struct index_state *istate, int newfd)
 	strbuf_release(&previous_name_buf);
 
 	/* Write extension data here */
+	if (eoie_c) {
+		uint32_t v = htonl(IEOT_VERSION);
+
+		offset = write_buffer_len + lseek(newfd, 0, SEEK_CUR);
+		err = write_index_ext_header(&c, eoie_c, newfd,
+					     CACHE_EXT_INDEXENTRYOFFSETTABLE,
+					     4 + ieot.len) < 0
+			|| ce_write(&c, newfd, &v, 4) < 0
+			|| ce_write(&c, newfd, ieot.buf, ieot.len) < 0;
+		strbuf_release(&ieot);
+		if (err)
+			return -1;
+	}
+	if (strip_extensions)
+		goto flush;
+	if (istate->split_index) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_link_extension(&sb, istate);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_LINK,
+					     sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+	if (istate->sparse_index) {
+		if (write_index_ext_header(&c, eoie_c, newfd,
+					   CACHE_EXT_SPARSE_DIRECTORIES, 0) < 0)
+			return -1;
+	}
+	if (!is_null_sha1(istate->sparse_checkout_sha1)) {
+		if (write_index_ext_header(&c, eoie_c, newfd,
+					   CACHE_EXT_SPARSE_CHECKOUT, 20) < 0 ||
+		    ce_write(&c, newfd, istate->sparse_checkout_sha1, 20) < 0)
+			return -1;
+	}
 	if (istate->cache_tree) {
 		struct strbuf sb = STRBUF_INIT;
 
 		cache_tree_write(&sb, istate->cache_tree);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_TREE, sb.len) < 0
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_TREE, sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
@@ -1862,21 +2327,162 @@ int write_index(struct index_state *istate, int newfd)
 		struct strbuf sb = STRBUF_INIT;
 
 		resolve_undo_write(&sb, istate->resolve_undo);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_RESOLVE_UNDO,
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_RESOLVE_UNDO,
 					     sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
+	if (istate->untracked) {
+		struct strbuf sb = STRBUF_INIT;
 
-	if (ce_flush(&c, newfd) || fstat(newfd, &st))
+		write_untracked_extension(&sb, istate->untracked);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_UNTRACKED,
+					     sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+	if (istate->fsmonitor_last_update) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_fsmonitor_extension(&sb, istate);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_FSMONITOR,
+					     sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+
+flush:
+	if (eoie_c) {
+		unsigned char eoie_sha1[20];
+		uint32_t v = htonl(offset);
+
+		git_SHA1_Final(eoie_sha1, eoie_c);
+		if (write_index_ext_header(&c, NULL, newfd,
+					   CACHE_EXT_ENDOFINDEXENTRIES,
+					   EOIE_SIZE) < 0 ||
+		    ce_write(&c, newfd, &v, 4) < 0 ||
+		    ce_write(&c, newfd, eoie_sha1, 20) < 0)
+			return -1;
+	}
+	if (ce_flush(&c, newfd, sha1) || fstat(newfd, &st))
 		return -1;
 	istate->timestamp.sec = (unsigned int)st.st_mtime;
 	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 	return 0;
 }
 
+/* Shared indexes nobody used for that long are removed */
+#define SHARED_INDEX_EXPIRE (14 * 24 * 60 * 60)
+
+static void clean_shared_index_files(const char *current_hex)
+{
+	struct dirent *de;
+	DIR *dir = opendir(get_git_dir());
+	time_t expire = time(NULL) - SHARED_INDEX_EXPIRE;
+
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		const char *path;
+		struct stat st;
+
+		if (!starts_with(de->d_name, "sharedindex.") ||
+		    !strcmp(de->d_name + strlen("sharedindex."), current_hex))
+			continue;
+		path = git_path("%s", de->d_name);
+		if (!stat(path, &st) && st.st_mtime < expire)
+			unlink_or_warn(path);
+	}
+	closedir(dir);
+}
+
+static int write_shared_index(struct index_state *istate)
+{
+	char tmp[PATH_MAX];
+	unsigned char sha1[20];
+	int fd, ret;
+
+	strlcpy(tmp, git_path("sharedindex_XXXXXX"), sizeof(tmp));
+	fd = git_mkstemp_mode(tmp, 0444);
+	if (fd < 0)
+		return error("unable to create shared index: %s",
+			     strerror(errno));
+	ret = do_write_index(istate, fd, istate->cache, istate->cache_nr,
+			     1, sha1);
+	if (close(fd))
+		ret = -1;
+	if (!ret)
+		adjust_shared_perm(tmp);
+	if (!ret && rename(tmp, git_path("sharedindex.%s", sha1_to_hex(sha1))))
+		ret = error("unable to rename %s: %s", tmp, strerror(errno));
+	if (ret) {
+		unlink_or_warn(tmp);
+		return ret;
+	}
+	set_split_index_base(istate, sha1);
+	clean_shared_index_files(sha1_to_hex(sha1));
+	return 0;
+}
+
+static int write_split_index(struct index_state *istate, int newfd)
+{
+	struct split_index *si = init_split_index(istate);
+	struct cache_entry **delta = NULL;
+	int delta_nr = 0, changes, ret;
+
+	/*
+	 * Rewrite the shared index when too many of our entries are not
+	 * in it (or are gone from it).  Measure against the entries we
+	 * have, not against the shared index, so that an empty one is
+	 * replaced once entries are added, and then left alone.
+	 */
+	changes = si->base ?
+		prepare_to_write_split_index(istate, &delta, &delta_nr) : -1;
+	if (changes < 0 ||
+	    (uint64_t)changes * 100 >
+	    (uint64_t)istate->cache_nr * split_index_max_percent_change) {
+		free(delta);
+		ret = write_shared_index(istate);
+		if (ret)
+			return ret;
+		prepare_to_write_split_index(istate, &delta, &delta_nr);
+	}
+	ret = do_write_index(istate, newfd, delta, delta_nr, 0, NULL);
+	finish_writing_split_index(istate);
+	free(delta);
+	/* keep it from expiring while an index uses it */
+	if (!ret)
+		utime(git_path("sharedindex.%s", sha1_to_hex(si->base_sha1)),
+		      NULL);
+	return ret;
+}
+
+int write_index(struct index_state *istate, int newfd)
+{
+	if (!core_split_index || (core_split_index < 0 && !istate->split_index)) {
+		int was_full = !istate->sparse_index, ret;
+
+		discard_split_index(istate);
+		if (convert_to_sparse(istate))
+			return -1;
+		ret = do_write_index(istate, newfd, istate->cache,
+				     istate->cache_nr, 0, NULL);
+		/* the caller goes on with the index it had */
+		if (was_full)
+			ensure_full_index(istate);
+		return ret;
+	}
+	/* the shared index is never sparse */
+	ensure_full_index(istate);
+	return write_split_index(istate, newfd);
+}
+
 /*
  * Read the index file that is potentially unmerged into given
  * index_state, dropping any unmerged entries.  Returns true if
@@ -1,5 +1,6 @@
 #include "cache.h"
 #include "refs.h"
+#include "reftable.h"
 #include "object.h"
 #include "tag.h"
 #include "dir.h"
@@ -825,9 +826,43 @@ static int is_refname_available(const char *refname, const char *oldrefname,
 	return 1;
 }
 
+enum packed_peeled { PEELED_NONE, PEELED_TAGS, PEELED_FULLY };
+
 struct packed_ref_cache {
+	/*
+	 * All of the packed references; NULL while they are looked up
+	 * in the mapped file instead, until a caller needs them all.
+	 */
 	struct ref_entry *root;
 
+	/* The ref_cache this is the packed references of */
+	struct ref_cache *ref_cache;
+
+	/*
+	 * A packed-refs file that says it is sorted is mapped, and its
+	 * references looked up by bisection: "buf" is the start of its
+	 * first reference line, past the header, and "eof" its end.
+	 * NULL if the file is not mapped (any more).
+	 */
+	char *map;
+	size_t map_size;
+	const char *buf, *eof;
+
+	/* What the header of the file says is peeled */
+	enum packed_peeled peeled;
+
+	/*
+	 * The stack of reftables the references are looked up in instead
+	 * of packed-refs, if the repository has one; see reftable.h.
+	 */
+	struct reftable_stack *stack;
+
+	/*
+	 * The reference last looked up in the mapped file, valid until
+	 * the next lookup.
+	 */
+	struct ref_entry *lookup;
+
 	/*
 	 * Count of references to the data structure in this instance,
 	 * including the pointer from ref_cache::packed if any.  The
@@ -880,10 +915,27 @@ static void acquire_packed_ref_cache(struct packed_ref_cache *packed_refs)
  * Decrease the reference count of *packed_refs.  If it goes to zero,
  * free *packed_refs and return true; otherwise return false.
  */
+static void unmap_packed_refs(struct packed_ref_cache *packed_refs)
+{
+	if (packed_refs->map) {
+		munmap(packed_refs->map, packed_refs->map_size);
+		packed_refs->map = NULL;
+		packed_refs->buf = packed_refs->eof = NULL;
+	}
+	if (packed_refs->lookup) {
+		free_ref_entry(packed_refs->lookup);
+		packed_refs->lookup = NULL;
+	}
+}
+
 static int release_packed_ref_cache(struct packed_ref_cache *packed_refs)
 {
 	if (!--packed_refs->referrers) {
-		free_ref_entry(packed_refs->root);
+		if (packed_refs->root)
+			free_ref_entry(packed_refs->root);
+		unmap_packed_refs(packed_refs);
+		if (packed_refs->stack)
+			reftable_stack_free(packed_refs->stack);
 		stat_validity_clear(&packed_refs->validity);
 		free(packed_refs);
 		return 1;
@@ -955,7 +1007,7 @@ static struct ref_cache *get_ref_cache(const char *submodule)
  * traits will be added later.  The trailing space is required.
  */
 static const char PACKED_REFS_HEADER[] =
-	"# pack-refs with: peeled fully-peeled \n";
+	"# pack-refs with: peeled fully-peeled sorted \n";
 
 /*
  * Parse one line from a packed-refs file.  Write the SHA1 to sha1.
@@ -991,7 +1043,8 @@ static const char *parse_ref_line(char *line, unsigned char *sha1)
 }
 
 /*
- * Read f, which is a packed-refs file, into dir.
+ * Read the lines from p to eof of a packed-refs file into dir; peeled
+ * is what its header says, if the header is not among the lines.
  *
  * A comment line of the form "# pack-refs with: " may contain zero or
  * more traits. We interpret the traits as follows:
@@ -1016,18 +1069,31 @@ static const char *parse_ref_line(char *line, unsigned char *sha1)
  *      trait should typically be written alongside "peeled" for
  *      compatibility with older clients, but we do not require it
  *      (i.e., "peeled" is a no-op if "fully-peeled" is set).
+ *
+ *   sorted:
+ *
+ *      The references are in strcmp() order of their names, so that
+ *      one can be found without reading the others.
  */
-static void read_packed_refs(FILE *f, struct ref_dir *dir)
+static void read_packed_refs(const char *p, const char *eof,
+			     enum packed_peeled peeled, struct ref_dir *dir)
 {
 	struct ref_entry *last = NULL;
-	char refline[PATH_MAX];
-	enum { PEELED_NONE, PEELED_TAGS, PEELED_FULLY } peeled = PEELED_NONE;
+	struct strbuf line = STRBUF_INIT;
 
-	while (fgets(refline, sizeof(refline), f)) {
+	while (p < eof) {
+		const char *eol = memchr(p, '\n', eof - p);
+		char *refline;
 		unsigned char sha1[20];
 		const char *refname;
 		static const char header[] = "# pack-refs with:";
 
+		eol = eol ? eol + 1 : eof;
+		strbuf_reset(&line);
+		strbuf_add(&line, p, eol - p);
+		refline = line.buf;
+		p = eol;
+
 		if (!strncmp(refline, header, sizeof(header)-1)) {
 			const char *traits = refline + sizeof(header) - 1;
 			if (strstr(traits, " fully-peeled "))
@@ -1061,6 +1127,82 @@ static void read_packed_refs(FILE *f, struct ref_dir *dir)
 			last->flag |= REF_KNOWS_PEELED;
 		}
 	}
+	strbuf_release(&line);
+}
+
+/*
+ * Map the packed-refs file open at fd, if it is sorted; otherwise
+ * read it whole.
+ */
+static void load_packed_refs(struct packed_ref_cache *packed_refs, int fd)
+{
+	static const char header[] = "# pack-refs with:";
+	struct stat st;
+	const char *eol;
+	size_t size;
+
+	if (fstat(fd, &st) || !st.st_size)
+		return;
+	size = xsize_t(st.st_size);
+	packed_refs->map = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	packed_refs->map_size = size;
+	packed_refs->buf = packed_refs->map;
+	packed_refs->eof = packed_refs->map + size;
+
+	eol = memchr(packed_refs->buf, '\n', size);
+	if (eol && starts_with(packed_refs->buf, header)) {
+		struct strbuf traits = STRBUF_INIT;
+
+		strbuf_add(&traits, packed_refs->buf + strlen(header),
+			   eol - packed_refs->buf - strlen(header));
+		if (strstr(traits.buf, " fully-peeled "))
+			packed_refs->peeled = PEELED_FULLY;
+		else if (strstr(traits.buf, " peeled "))
+			packed_refs->peeled = PEELED_TAGS;
+		packed_refs->buf = eol + 1;
+		if (strstr(traits.buf, " sorted ") &&
+		    packed_refs->eof[-1] == '\n') {
+			strbuf_release(&traits);
+			return;
+		}
+		strbuf_release(&traits);
+	}
+
+	/* not sorted: read it all now, as it always was */
+	packed_refs->root = create_dir_entry(packed_refs->ref_cache, "", 0, 0);
+	read_packed_refs(packed_refs->buf, packed_refs->eof,
+			 packed_refs->peeled, get_ref_dir(packed_refs->root));
+	unmap_packed_refs(packed_refs);
+}
+
+/*
+ * Whether the references of the main repository are to be kept in a
+ * stack of reftables: they are if it has one, or is configured to.
+ */
+static int use_reftable(void)
+{
+	return ref_storage == REF_STORAGE_REFTABLE ||
+		file_exists(git_path("reftable/tables.list"));
+}
+
+static struct ref_entry *create_reftable_entry(const struct reftable_record *rec)
+{
+	struct ref_entry *entry;
+
+	entry = create_ref_entry(rec->refname.buf, rec->sha1, REF_ISPACKED, 1);
+	if (rec->value == REFTABLE_PEELED) {
+		hashcpy(entry->u.value.peeled, rec->peeled);
+		entry->flag |= REF_KNOWS_PEELED;
+	} else if (rec->value == REFTABLE_NOT_PEELABLE) {
+		entry->flag |= REF_KNOWS_PEELED;
+	}
+	return entry;
+}
+
+static int add_reftable_entry(const struct reftable_record *rec, void *cb_data)
+{
+	add_ref(cb_data, create_reftable_entry(rec));
+	return 0;
 }
 
 /*
@@ -1069,38 +1211,259 @@ static void read_packed_refs(FILE *f, struct ref_dir *dir)
  */
 static struct packed_ref_cache *get_packed_ref_cache(struct ref_cache *refs)
 {
-	const char *packed_refs_file;
+	const char *packed_refs_file, *tables_list;
 
-	if (*refs->name)
+	if (*refs->name) {
 		packed_refs_file = git_path_submodule(refs->name, "packed-refs");
-	else
+		tables_list = git_path_submodule(refs->name, "reftable/tables.list");
+	} else {
 		packed_refs_file = git_path("packed-refs");
+		tables_list = git_path("reftable/tables.list");
+	}
 
 	if (refs->packed &&
-	    !stat_validity_check(&refs->packed->validity, packed_refs_file))
+	    (!stat_validity_check(&refs->packed->validity,
+				  refs->packed->stack ? tables_list : packed_refs_file) ||
+	     (!refs->packed->stack && ref_storage == REF_STORAGE_REFTABLE &&
+	      file_exists(tables_list))))
 		clear_packed_ref_cache(refs);
 
 	if (!refs->packed) {
-		FILE *f;
+		struct strbuf dir = STRBUF_INIT;
+		int fd;
 
 		refs->packed = xcalloc(1, sizeof(*refs->packed));
 		acquire_packed_ref_cache(refs->packed);
-		refs->packed->root = create_dir_entry(refs, "", 0, 0);
-		f = fopen(packed_refs_file, "r");
-		if (f) {
-			stat_validity_update(&refs->packed->validity, fileno(f));
-			read_packed_refs(f, get_ref_dir(refs->packed->root));
-			fclose(f);
+		refs->packed->ref_cache = refs;
+		strbuf_add(&dir, tables_list, strrchr(tables_list, '/') - tables_list);
+		refs->packed->stack = reftable_stack_open(dir.buf,
+							  &refs->packed->validity);
+		strbuf_release(&dir);
+		if (refs->packed->stack)
+			return refs->packed;
+		fd = open(packed_refs_file, O_RDONLY);
+		if (fd >= 0) {
+			stat_validity_update(&refs->packed->validity, fd);
+			load_packed_refs(refs->packed, fd);
+			close(fd);
 		}
+		if (!refs->packed->root && !refs->packed->map)
+			refs->packed->root = create_dir_entry(refs, "", 0, 0);
 	}
 	return refs->packed;
 }
 
+/*
+ * All of the packed references, read from the stack of reftables or
+ * the mapped file (which is then let go of) the first time they are
+ * needed.
+ */
 static struct ref_dir *get_packed_ref_dir(struct packed_ref_cache *packed_ref_cache)
 {
+	if (!packed_ref_cache->root) {
+		packed_ref_cache->root =
+			create_dir_entry(packed_ref_cache->ref_cache, "", 0, 0);
+		if (packed_ref_cache->stack) {
+			reftable_stack_for_each(packed_ref_cache->stack, "",
+						add_reftable_entry,
+						get_ref_dir(packed_ref_cache->root));
+			return get_ref_dir(packed_ref_cache->root);
+		}
+		read_packed_refs(packed_ref_cache->buf, packed_ref_cache->eof,
+				 packed_ref_cache->peeled,
+				 get_ref_dir(packed_ref_cache->root));
+		unmap_packed_refs(packed_ref_cache);
+	}
 	return get_ref_dir(packed_ref_cache->root);
 }
 
+/*
+ * The start of the record (a reference line and its peeled line, if
+ * any) of the mapped packed-refs that p is in; no further back than
+ * buf, which starts a record.
+ */
+static const char *find_start_of_record(const char *buf, const char *p)
+{
+	while (p > buf && (p[-1] != '\n' || p[0] == '^'))
+		p--;
+	return p;
+}
+
+/* The start of the record after the one at rec */
+static const char *find_end_of_record(const char *rec, const char *eof)
+{
+	do {
+		rec = memchr(rec, '\n', eof - rec) + 1;
+	} while (rec < eof && *rec == '^');
+	return rec;
+}
+
+/* Compare the name of the reference of the record at rec with refname */
+static int cmp_packed_record(struct packed_ref_cache *packed_refs,
+			     const char *rec, const char *refname)
+{
+	const char *r = rec + 41;
+
+	if (packed_refs->eof - rec < 43 || rec[40] != ' ' ||
+	    memchr(rec, '\n', 42))
+		die("corrupt packed-refs file at offset %lu",
+		    (unsigned long)(rec - packed_refs->map));
+	for (; *r != '\n'; r++, refname++) {
+		if (!*refname)
+			return 1;
+		if (*r != *refname)
+			return (unsigned char)*r - (unsigned char)*refname;
+	}
+	return *refname ? -1 : 0;
+}
+
+/*
+ * Bisect the mapped packed-refs for refname: return its record, or
+ * NULL and in *pos the first record that sorts after it.
+ */
+static const char *find_packed_record(struct packed_ref_cache *packed_refs,
+				      const char *refname, const char **pos)
+{
+	const char *lo = packed_refs->buf, *hi = packed_refs->eof;
+
+	while (lo < hi) {
+		const char *rec = find_start_of_record(lo, lo + (hi - lo) / 2);
+		int cmp = cmp_packed_record(packed_refs, rec, refname);
+
+		if (cmp < 0)
+			lo = find_end_of_record(rec, hi);
+		else if (cmp > 0)
+			hi = rec;
+		else
+			return rec;
+	}
+	if (pos)
+		*pos = lo;
+	return NULL;
+}
+
+/*
+ * Find the records of the mapped packed-refs whose names start with
+ * prefix, which ends with '/': they are from *start to *end.
+ */
+static void find_packed_records(struct packed_ref_cache *packed_refs,
+				const char *prefix,
+				const char **start, const char **end)
+{
+	struct strbuf after = STRBUF_INIT;
+	const char *rec;
+
+	/* nothing in the directory sorts before it, nor after "prefix0" */
+	find_packed_record(packed_refs, prefix, start);
+	strbuf_addstr(&after, prefix);
+	after.buf[after.len - 1] = '/' + 1;
+	rec = find_packed_record(packed_refs, after.buf, end);
+	if (rec)
+		*end = rec;
+	strbuf_release(&after);
+}
+
+/*
+ * Read the packed references whose names start with prefix, which
+ * ends with '/', from the stack of reftables or the mapped file into
+ * dir.
+ */
+static void read_packed_refs_part(struct packed_ref_cache *packed_refs,
+				  const char *prefix, struct ref_dir *dir)
+{
+	const char *start, *end;
+
+	if (packed_refs->stack) {
+		reftable_stack_for_each(packed_refs->stack, prefix,
+					add_reftable_entry, dir);
+		return;
+	}
+	find_packed_records(packed_refs, prefix, &start, &end);
+	read_packed_refs(start, end, packed_refs->peeled, dir);
+}
+
+/*
+ * Return the ref_entry of refname among the packed references of
+ * refs, or NULL.  One looked up in the stack of reftables or the
+ * mapped file is only valid until the next lookup.
+ */
+static struct ref_entry *find_packed_ref(struct ref_cache *refs,
+					 const char *refname)
+{
+	struct packed_ref_cache *packed_refs = get_packed_ref_cache(refs);
+	const char *rec;
+
+	if (packed_refs->root)
+		return find_ref(get_packed_ref_dir(packed_refs), refname);
+
+	if (packed_refs->lookup) {
+		free_ref_entry(packed_refs->lookup);
+		packed_refs->lookup = NULL;
+	}
+	if (packed_refs->stack) {
+		struct reftable_record found = REFTABLE_RECORD_INIT;
+
+		if (!reftable_stack_read_ref(packed_refs->stack, refname, &found))
+			packed_refs->lookup = create_reftable_entry(&found);
+		strbuf_release(&found.refname);
+		return packed_refs->lookup;
+	}
+
+	rec = find_packed_record(packed_refs, refname, NULL);
+	if (!rec)
+		return NULL;
+	packed_refs->lookup = create_dir_entry(refs, "", 0, 0);
+	read_packed_refs(rec, find_end_of_record(rec, packed_refs->eof),
+			 packed_refs->peeled, get_ref_dir(packed_refs->lookup));
+	return find_ref(get_ref_dir(packed_refs->lookup), refname);
+}
+
+/*
+ * Like is_refname_available() on the packed references of refs, but
+ * looking up only the names that could conflict when they are not all
+ * read.
+ */
+static int is_refname_available_packed(const char *refname,
+				       const char *oldrefname,
+				       struct ref_cache *refs)
+{
+	struct packed_ref_cache *packed_refs = get_packed_ref_cache(refs);
+	struct strbuf name = STRBUF_INIT;
+	const char *slash, *conflict = NULL;
+	int available;
+
+	if (packed_refs->root)
+		return is_refname_available(refname, oldrefname,
+					    get_packed_ref_dir(packed_refs));
+
+	/* a reference named by the leading components of refname */
+	for (slash = strchr(refname, '/'); slash && !conflict;
+	     slash = strchr(slash + 1, '/')) {
+		strbuf_reset(&name);
+		strbuf_add(&name, refname, slash - refname);
+		if ((!oldrefname || strcmp(oldrefname, name.buf)) &&
+		    find_packed_ref(refs, name.buf))
+			conflict = name.buf;
+	}
+
+	/* or one in the directory refname would be */
+	if (!conflict) {
+		struct ref_entry *dir = create_dir_entry(refs, "", 0, 0);
+
+		strbuf_reset(&name);
+		strbuf_addf(&name, "%s/", refname);
+		read_packed_refs_part(packed_refs, name.buf, get_ref_dir(dir));
+		available = is_refname_available(refname, oldrefname,
+						 get_ref_dir(dir));
+		free_ref_entry(dir);
+		strbuf_release(&name);
+		return available;
+	}
+	error("'%s' exists; cannot create '%s'", conflict, refname);
+	strbuf_release(&name);
+	return 0;
+}
+
 static struct ref_dir *get_packed_refs(struct ref_cache *refs)
 {
 	return get_packed_ref_dir(get_packed_ref_cache(refs));
@@ -1216,9 +1579,8 @@ static int resolve_gitlink_packed_ref(struct ref_cache *refs,
 				      const char *refname, unsigned char *sha1)
 {
 	struct ref_entry *ref;
-	struct ref_dir *dir = get_packed_refs(refs);
 
-	ref = find_ref(dir, refname);
+	ref = find_packed_ref(refs, refname);
 	if (ref == NULL)
 		return -1;
 
@@ -1289,7 +1651,7 @@ int resolve_gitlink_ref(const char *path, const char *refname, unsigned char *sh
  */
 static struct ref_entry *get_packed_ref(const char *refname)
 {
-	return find_ref(get_packed_refs(&ref_cache), refname);
+	return find_packed_ref(&ref_cache, refname);
 }
 
 /*
@@ -1654,8 +2016,10 @@ static int do_for_each_entry(struct ref_cache *refs, const char *base,
 			     each_ref_entry_fn fn, void *cb_data)
 {
 	struct packed_ref_cache *packed_ref_cache;
+	struct ref_entry *packed_part = NULL;
 	struct ref_dir *loose_dir;
 	struct ref_dir *packed_dir;
+	const char *slash;
 	int retval = 0;
 
 	/*
@@ -1675,7 +2039,20 @@ static int do_for_each_entry(struct ref_cache *refs, const char *base,
 
 	packed_ref_cache = get_packed_ref_cache(refs);
 	acquire_packed_ref_cache(packed_ref_cache);
-	packed_dir = get_packed_ref_dir(packed_ref_cache);
+	slash = base ? strrchr(base, '/') : NULL;
+	if (!packed_ref_cache->root && slash) {
+		/* read only the directory of base */
+		struct strbuf dirname = STRBUF_INIT;
+
+		strbuf_add(&dirname, base, slash + 1 - base);
+		packed_part = create_dir_entry(refs, "", 0, 0);
+		read_packed_refs_part(packed_ref_cache, dirname.buf,
+				      get_ref_dir(packed_part));
+		strbuf_release(&dirname);
+		packed_dir = get_ref_dir(packed_part);
+	} else {
+		packed_dir = get_packed_ref_dir(packed_ref_cache);
+	}
 	if (base && *base) {
 		packed_dir = find_containing_dir(packed_dir, base, 0);
 	}
@@ -1695,6 +2072,8 @@ static int do_for_each_entry(struct ref_cache *refs, const char *base,
 				loose_dir, 0, fn, cb_data);
 	}
 
+	if (packed_part)
+		free_ref_entry(packed_part);
 	release_packed_ref_cache(packed_ref_cache);
 	return retval;
 }
@@ -2074,7 +2453,7 @@ static struct ref_lock *lock_ref_sha1_basic(const char *refname,
 	 * name is a proper prefix of our refname.
 	 */
 	if (missing &&
-	     !is_refname_available(refname, NULL, get_packed_refs(&ref_cache))) {
+	     !is_refname_available_packed(refname, NULL, &ref_cache)) {
 		last_errno = ENOTDIR;
 		goto error_return;
 	}
@@ -2188,12 +2567,67 @@ static int write_packed_entry_fn(struct ref_entry *entry, void *cb_data)
 	return 0;
 }
 
+/*
+ * Records to write to a reftable, built by add_reftable_record_fn().
+ */
+struct reftable_records {
+	struct reftable_record *recs;
+	int nr, alloc;
+};
+
+/*
+ * An each_ref_entry_fn that adds the entry to a reftable_records.
+ */
+static int add_reftable_record_fn(struct ref_entry *entry, void *cb_data)
+{
+	struct reftable_records *records = cb_data;
+	struct reftable_record *rec;
+	enum peel_status peel_status = peel_entry(entry, 0);
+
+	if (peel_status != PEEL_PEELED && peel_status != PEEL_NON_TAG)
+		error("internal error: %s is not a valid packed reference!",
+		      entry->name);
+	ALLOC_GROW(records->recs, records->nr + 1, records->alloc);
+	rec = &records->recs[records->nr++];
+	strbuf_init(&rec->refname, 0);
+	strbuf_addstr(&rec->refname, entry->name);
+	hashcpy(rec->sha1, entry->u.value.sha1);
+	if (peel_status == PEEL_PEELED) {
+		rec->value = REFTABLE_PEELED;
+		hashcpy(rec->peeled, entry->u.value.peeled);
+	} else if (peel_status == PEEL_NON_TAG) {
+		rec->value = REFTABLE_NOT_PEELABLE;
+	} else {
+		rec->value = REFTABLE_VALUE;
+	}
+	return 0;
+}
+
+static void clear_reftable_records(struct reftable_records *records)
+{
+	int i;
+
+	for (i = 0; i < records->nr; i++)
+		strbuf_release(&records->recs[i].refname);
+	free(records->recs);
+	records->recs = NULL;
+	records->nr = records->alloc = 0;
+}
+
 int lock_packed_refs(int flags)
 {
 	struct packed_ref_cache *packed_ref_cache;
+	struct lock_file *lock = &packlock;
 
-	if (hold_lock_file_for_update(&packlock, git_path("packed-refs"), flags) < 0)
+	if (use_reftable()) {
+		/* the stack of reftables takes the place of packed-refs */
+		lock = reftable_lock(git_path("reftable"), flags);
+		if (!lock)
+			return -1;
+	} else if (hold_lock_file_for_update(&packlock, git_path("packed-refs"),
+					     flags) < 0) {
 		return -1;
+	}
 	/*
 	 * Get the current packed-refs while holding the lock.  If the
 	 * packed-refs file has been modified since we last read it,
@@ -2201,12 +2635,42 @@ int lock_packed_refs(int flags)
 	 * the packed-refs file.
 	 */
 	packed_ref_cache = get_packed_ref_cache(&ref_cache);
-	packed_ref_cache->lock = &packlock;
+	/*
+	 * Unless tables are only added on top of the stack, it is
+	 * about to be rewritten from the whole of it, and renamed over.
+	 */
+	if (!packed_ref_cache->stack)
+		get_packed_ref_dir(packed_ref_cache);
+	packed_ref_cache->lock = lock;
 	/* Increment the reference count to prevent it from being freed: */
 	acquire_packed_ref_cache(packed_ref_cache);
 	return 0;
 }
 
+/*
+ * Write all of the packed references as the only table of the stack
+ * of reftables, which replaces packed-refs from then on.
+ */
+static int commit_packed_reftable(struct packed_ref_cache *packed_ref_cache)
+{
+	struct reftable_records records = { NULL, 0, 0 };
+	struct ref_dir *dir = get_packed_ref_dir(packed_ref_cache);
+	int error = 0;
+
+	sort_ref_dir(dir);
+	do_for_each_entry_in_dir(dir, 0, add_reftable_record_fn, &records);
+	reftable_add_table(records.recs, records.nr, 1);
+	clear_reftable_records(&records);
+	if (reftable_commit())
+		error = -1;
+	else
+		unlink_or_warn(git_path("packed-refs"));
+	packed_ref_cache->lock = NULL;
+	release_packed_ref_cache(packed_ref_cache);
+	clear_packed_ref_cache(&ref_cache);
+	return error;
+}
+
 int commit_packed_refs(void)
 {
 	struct packed_ref_cache *packed_ref_cache =
@@ -2215,6 +2679,8 @@ int commit_packed_refs(void)
 
 	if (!packed_ref_cache->lock)
 		die("internal error: packed-refs not locked");
+	if (packed_ref_cache->lock != &packlock)
+		return commit_packed_reftable(packed_ref_cache);
 	write_or_die(packed_ref_cache->lock->fd,
 		     PACKED_REFS_HEADER, strlen(PACKED_REFS_HEADER));
 
@@ -2235,10 +2701,44 @@ void rollback_packed_refs(void)
 
 	if (!packed_ref_cache->lock)
 		die("internal error: packed-refs not locked");
-	rollback_lock_file(packed_ref_cache->lock);
+	if (packed_ref_cache->lock != &packlock)
+		reftable_rollback();
+	else
+		rollback_lock_file(packed_ref_cache->lock);
+	packed_ref_cache->lock = NULL;
+	release_packed_ref_cache(packed_ref_cache);
+	clear_packed_ref_cache(&ref_cache);
+}
+
+/*
+ * With the stack of reftables locked by lock_packed_refs(), put the
+ * "nr" records "recs", sorted by name, in a table on top of it and
+ * unlock it.  A stack that does not exist yet is started from all of
+ * the packed references, with the records applied.
+ */
+static int commit_reftable_records(const struct reftable_record *recs, int nr)
+{
+	struct packed_ref_cache *packed_ref_cache =
+		get_packed_ref_cache(&ref_cache);
+	int i, error = 0;
+
+	if (!packed_ref_cache->stack) {
+		struct ref_dir *packed = get_packed_ref_dir(packed_ref_cache);
+
+		for (i = 0; i < nr; i++) {
+			remove_entry(packed, recs[i].refname.buf);
+			if (recs[i].value != REFTABLE_DELETION)
+				add_ref(packed, create_reftable_entry(&recs[i]));
+		}
+		return commit_packed_refs();
+	}
+	reftable_add_table(recs, nr, 0);
+	if (reftable_commit())
+		error = -1;
 	packed_ref_cache->lock = NULL;
 	release_packed_ref_cache(packed_ref_cache);
 	clear_packed_ref_cache(&ref_cache);
+	return error;
 }
 
 struct ref_to_prune {
@@ -2431,6 +2931,42 @@ static int curate_packed_ref_fn(struct ref_entry *entry, void *cb_data)
 	return 0;
 }
 
+/*
+ * Delete the refnames of the locked stack of reftables by adding
+ * a table of their deletions on top of it.
+ */
+static int delete_from_reftable(const char **refnames, int n)
+{
+	struct string_list names = STRING_LIST_INIT_NODUP;
+	struct reftable_record *recs;
+	int i, nr = 0, ret;
+
+	for (i = 0; i < n; i++)
+		if (find_packed_ref(&ref_cache, refnames[i]))
+			string_list_insert(&names, refnames[i]);
+	if (!names.nr) {
+		/*
+		 * All packed entries disappeared while we were
+		 * acquiring the lock.
+		 */
+		rollback_packed_refs();
+		return 0;
+	}
+
+	recs = xcalloc(names.nr, sizeof(*recs));
+	for (nr = 0; nr < names.nr; nr++) {
+		strbuf_init(&recs[nr].refname, 0);
+		strbuf_addstr(&recs[nr].refname, names.items[nr].string);
+		recs[nr].value = REFTABLE_DELETION;
+	}
+	ret = commit_reftable_records(recs, nr);
+	for (i = 0; i < nr; i++)
+		strbuf_release(&recs[i].refname);
+	free(recs);
+	string_list_clear(&names, 0);
+	return ret;
+}
+
 static int repack_without_refs(const char **refnames, int n)
 {
 	struct ref_dir *packed;
@@ -2451,6 +2987,8 @@ static int repack_without_refs(const char **refnames, int n)
 		unable_to_lock_error(git_path("packed-refs"), errno);
 		return error("cannot delete '%s' from packed refs", refnames[i]);
 	}
+	if (get_packed_ref_cache(&ref_cache)->stack)
+		return delete_from_reftable(refnames, n);
 	packed = get_packed_refs(&ref_cache);
 
 	/* Remove refnames from the cache */
@@ -2592,7 +3130,7 @@ int rename_ref(const char *oldrefname, const char *newrefname, const char *logms
 	if (!symref)
 		return error("refname %s not found", oldrefname);
 
-	if (!is_refname_available(newrefname, oldrefname, get_packed_refs(&ref_cache)))
+	if (!is_refname_available_packed(newrefname, oldrefname, &ref_cache))
 		return 1;
 
 	if (!is_refname_available(newrefname, oldrefname, get_loose_refs(&ref_cache)))
@@ -2798,18 +3336,78 @@ static int is_branch(const char *refname)
 	return !strcmp(refname, "HEAD") || starts_with(refname, "refs/heads/");
 }
 
-int write_ref_sha1(struct ref_lock *lock,
-	const unsigned char *sha1, const char *logmsg)
+/* Whether the locked reference is to be set in the stack of reftables */
+static int ref_lock_in_reftable(struct ref_lock *lock)
 {
-	static char term = '\n';
-	struct object *o;
+	return starts_with(lock->ref_name, "refs/") && use_reftable();
+}
 
-	if (!lock)
+/* Fill in rec to set refname to sha1, with what it peels to */
+static void init_reftable_record(struct reftable_record *rec,
+				 const char *refname,
+				 const unsigned char *sha1)
+{
+	strbuf_init(&rec->refname, 0);
+	strbuf_addstr(&rec->refname, refname);
+	hashcpy(rec->sha1, sha1);
+	switch (peel_object(sha1, rec->peeled)) {
+	case PEEL_PEELED:
+		rec->value = REFTABLE_PEELED;
+		break;
+	case PEEL_NON_TAG:
+		rec->value = REFTABLE_NOT_PEELABLE;
+		break;
+	default:
+		rec->value = REFTABLE_VALUE;
+		break;
+	}
+}
+
+/*
+ * Lock the stack of reftables and put the "nr" records "recs", sorted
+ * by name, on top of it.
+ */
+static int add_reftable_records(const struct reftable_record *recs, int nr)
+{
+	if (lock_packed_refs(0)) {
+		unable_to_lock_error(git_path("reftable/tables.list"), errno);
 		return -1;
-	if (!lock->force_write && !hashcmp(lock->old_sha1, sha1)) {
-		unlock_ref(lock);
-		return 0;
 	}
+	return commit_reftable_records(recs, nr);
+}
+
+/*
+ * Set the locked reference in the stack of reftables rather than in
+ * its loose file, removing that if there is one; the lock is then
+ * rolled back by unlock_ref().
+ */
+static int commit_ref_to_reftable(struct ref_lock *lock,
+				  const unsigned char *sha1)
+{
+	struct reftable_record rec;
+	int ret;
+
+	init_reftable_record(&rec, lock->ref_name, sha1);
+	ret = add_reftable_records(&rec, 1);
+	strbuf_release(&rec.refname);
+	if (ret)
+		return ret;
+	ret = delete_ref_loose(lock, 0);
+	clear_loose_ref_cache(&ref_cache);
+	return ret;
+}
+
+/*
+ * Write sha1 to the lock file of the locked reference, once it is
+ * known to be a value the reference can take.  The lock is released
+ * on error.
+ */
+static int write_ref_to_lockfile(struct ref_lock *lock,
+				 const unsigned char *sha1)
+{
+	static char term = '\n';
+	struct object *o;
+
 	o = parse_object(sha1);
 	if (!o) {
 		error("Trying to write ref %s with nonexistent object %s",
@@ -2830,13 +3428,18 @@ int write_ref_sha1(struct ref_lock *lock,
 		unlock_ref(lock);
 		return -1;
 	}
+	return 0;
+}
+
+/* Log the update of the locked reference to sha1 */
+static int log_ref_update(struct ref_lock *lock, const unsigned char *sha1,
+			  const char *logmsg)
+{
 	clear_loose_ref_cache(&ref_cache);
 	if (log_ref_write(lock->ref_name, lock->old_sha1, sha1, logmsg) < 0 ||
 	    (strcmp(lock->ref_name, lock->orig_ref_name) &&
-	     log_ref_write(lock->orig_ref_name, lock->old_sha1, sha1, logmsg) < 0)) {
-		unlock_ref(lock);
+	     log_ref_write(lock->orig_ref_name, lock->old_sha1, sha1, logmsg) < 0))
 		return -1;
-	}
 	if (strcmp(lock->orig_ref_name, "HEAD") != 0) {
 		/*
 		 * Special hack: If a branch is updated directly and HEAD
@@ -2858,7 +3461,26 @@ int write_ref_sha1(struct ref_lock *lock,
 		    !strcmp(head_ref, lock->ref_name))
 			log_ref_write("HEAD", lock->old_sha1, sha1, logmsg);
 	}
-	if (commit_ref(lock)) {
+	return 0;
+}
+
+int write_ref_sha1(struct ref_lock *lock,
+	const unsigned char *sha1, const char *logmsg)
+{
+	if (!lock)
+		return -1;
+	if (!lock->force_write && !hashcmp(lock->old_sha1, sha1)) {
+		unlock_ref(lock);
+		return 0;
+	}
+	if (write_ref_to_lockfile(lock, sha1))
+		return -1;
+	if (log_ref_update(lock, sha1, logmsg)) {
+		unlock_ref(lock);
+		return -1;
+	}
+	if (ref_lock_in_reftable(lock) ?
+	    commit_ref_to_reftable(lock, sha1) : commit_ref(lock)) {
 		error("Couldn't set %s", lock->ref_name);
 		unlock_ref(lock);
 		return -1;
@@ -3251,19 +3873,24 @@ static struct ref_lock *update_ref_lock(const char *refname,
 	return lock;
 }
 
+static int update_ref_write_error(const char *refname,
+				  enum action_on_err onerr)
+{
+	const char *str = "Cannot update the ref '%s'.";
+	switch (onerr) {
+	case MSG_ON_ERR: error(str, refname); break;
+	case DIE_ON_ERR: die(str, refname); break;
+	case QUIET_ON_ERR: break;
+	}
+	return 1;
+}
+
 static int update_ref_write(const char *action, const char *refname,
 			    const unsigned char *sha1, struct ref_lock *lock,
 			    enum action_on_err onerr)
 {
-	if (write_ref_sha1(lock, sha1, action) < 0) {
-		const char *str = "Cannot update the ref '%s'.";
-		switch (onerr) {
-		case MSG_ON_ERR: error(str, refname); break;
-		case DIE_ON_ERR: die(str, refname); break;
-		case QUIET_ON_ERR: break;
-		}
-		return 1;
-	}
+	if (write_ref_sha1(lock, sha1, action) < 0)
+		return update_ref_write_error(refname, onerr);
 	return 0;
 }
 
@@ -3278,11 +3905,107 @@ int update_ref(const char *action, const char *refname,
 	return update_ref_write(action, refname, sha1, lock, onerr);
 }
 
+/*
+ * Information needed for a single ref update.  A null new_sha1 deletes
+ * the ref.  With have_old, old_sha1 is checked while locking the ref,
+ * a null one ensuring that the ref does not exist before the update.
+ */
+struct ref_update {
+	unsigned char new_sha1[20];
+	unsigned char old_sha1[20];
+	int flags; /* REF_NODEREF? */
+	int have_old; /* 1 if old_sha1 is valid, 0 otherwise */
+	struct ref_lock *lock;
+	int type;
+	const char refname[FLEX_ARRAY];
+};
+
+struct ref_transaction {
+	struct ref_update **updates;
+	int nr, alloc;
+};
+
+struct ref_transaction *ref_transaction_begin(void)
+{
+	return xcalloc(1, sizeof(struct ref_transaction));
+}
+
+void ref_transaction_free(struct ref_transaction *transaction)
+{
+	int i;
+
+	if (!transaction)
+		return;
+	for (i = 0; i < transaction->nr; i++) {
+		if (transaction->updates[i]->lock)
+			unlock_ref(transaction->updates[i]->lock);
+		free(transaction->updates[i]);
+	}
+	free(transaction->updates);
+	free(transaction);
+}
+
+static struct ref_update *add_update(struct ref_transaction *transaction,
+				     const char *refname)
+{
+	size_t len = strlen(refname);
+	struct ref_update *update = xcalloc(1, sizeof(*update) + len + 1);
+
+	memcpy((char *)update->refname, refname, len); /* includes NUL */
+	ALLOC_GROW(transaction->updates, transaction->nr + 1, transaction->alloc);
+	transaction->updates[transaction->nr++] = update;
+	return update;
+}
+
+void ref_transaction_update(struct ref_transaction *transaction,
+			    const char *refname,
+			    const unsigned char *new_sha1,
+			    const unsigned char *old_sha1,
+			    int flags, int have_old)
+{
+	struct ref_update *update = add_update(transaction, refname);
+
+	hashcpy(update->new_sha1, new_sha1);
+	update->flags = flags;
+	update->have_old = have_old;
+	if (have_old)
+		hashcpy(update->old_sha1, old_sha1);
+}
+
+void ref_transaction_create(struct ref_transaction *transaction,
+			    const char *refname,
+			    const unsigned char *new_sha1,
+			    int flags)
+{
+	struct ref_update *update = add_update(transaction, refname);
+
+	assert(!is_null_sha1(new_sha1));
+	hashcpy(update->new_sha1, new_sha1);
+	hashclr(update->old_sha1);
+	update->flags = flags;
+	update->have_old = 1;
+}
+
+void ref_transaction_delete(struct ref_transaction *transaction,
+			    const char *refname,
+			    const unsigned char *old_sha1,
+			    int flags, int have_old)
+{
+	struct ref_update *update = add_update(transaction, refname);
+
+	update->flags = flags;
+	update->have_old = have_old;
+	if (have_old) {
+		assert(!is_null_sha1(old_sha1));
+		hashcpy(update->old_sha1, old_sha1);
+	}
+}
+
 static int ref_update_compare(const void *r1, const void *r2)
 {
 	const struct ref_update * const *u1 = r1;
 	const struct ref_update * const *u2 = r2;
-	return strcmp((*u1)->ref_name, (*u2)->ref_name);
+	return strcmp((*u1)->refname, (*u2)->refname);
 }
 
 static int ref_update_reject_duplicates(struct ref_update **updates, int n,
@@ -3290,14 +4013,14 @@ static int ref_update_reject_duplicates(struct ref_update **updates, int n,
 {
 	int i;
 	for (i = 1; i < n; i++)
-		if (!strcmp(updates[i - 1]->ref_name, updates[i]->ref_name)) {
+		if (!strcmp(updates[i - 1]->refname, updates[i]->refname)) {
 			const char *str =
 				"Multiple updates for ref '%s' not allowed.";
 			switch (onerr) {
 			case MSG_ON_ERR:
-				error(str, updates[i]->ref_name); break;
+				error(str, updates[i]->refname); break;
 			case DIE_ON_ERR:
-				die(str, updates[i]->ref_name); break;
+				die(str, updates[i]->refname); break;
 			case QUIET_ON_ERR:
 				break;
 			}
@@ -3306,26 +4029,60 @@ static int ref_update_reject_duplicates(struct ref_update **updates, int n,
 	return 0;
 }
 
-int update_refs(const char *action, const struct ref_update **updates_orig,
-		int n, enum action_on_err onerr)
+static int reftable_record_compare(const void *r1, const void *r2)
+{
+	const struct reftable_record *a = r1, *b = r2;
+	return strcmp(a->refname.buf, b->refname.buf);
+}
+
+/*
+ * Set the locked refs of the updates under refs/ in a single table on
+ * top of the stack of reftables; their locks are left to be released.
+ */
+static int commit_updates_to_reftable(struct ref_update **updates, int n)
+{
+	struct reftable_record *recs = xcalloc(n, sizeof(*recs));
+	int i, nr = 0, ret;
+
+	for (i = 0; i < n; i++) {
+		struct ref_lock *lock = updates[i]->lock;
+
+		if (!lock || !starts_with(lock->ref_name, "refs/"))
+			continue;
+		if (!is_null_sha1(updates[i]->new_sha1)) {
+			init_reftable_record(&recs[nr++], lock->ref_name,
+					     updates[i]->new_sha1);
+		} else if (!(updates[i]->type & REF_ISSYMREF) &&
+			   get_packed_ref(lock->ref_name)) {
+			strbuf_init(&recs[nr].refname, 0);
+			strbuf_addstr(&recs[nr++].refname, lock->ref_name);
+		}
+	}
+	/* the refs they point at, rather than those given, are locked */
+	qsort(recs, nr, sizeof(*recs), reftable_record_compare);
+	ret = nr ? add_reftable_records(recs, nr) : 0;
+	for (i = 0; i < nr; i++)
+		strbuf_release(&recs[i].refname);
+	free(recs);
+	return ret;
+}
+
+int ref_transaction_commit(struct ref_transaction *transaction,
+			   const char *msg, enum action_on_err onerr)
 {
 	int ret = 0, delnum = 0, i;
-	struct ref_update **updates;
-	int *types;
-	struct ref_lock **locks;
+	int n = transaction->nr;
+	struct ref_update **updates = transaction->updates;
 	const char **delnames;
+	int reftable = use_reftable();
 
-	if (!updates_orig || !n)
+	if (!n)
 		return 0;
 
 	/* Allocate work space */
-	updates = xmalloc(sizeof(*updates) * n);
-	types = xmalloc(sizeof(*types) * n);
-	locks = xcalloc(n, sizeof(*locks));
 	delnames = xmalloc(sizeof(*delnames) * n);
 
-	/* Copy, sort, and reject duplicate refs */
-	memcpy(updates, updates_orig, sizeof(*updates) * n);
+	/* Sort, and reject duplicate refs */
 	qsort(updates, n, sizeof(*updates), ref_update_compare);
 	ret = ref_update_reject_duplicates(updates, n, onerr);
 	if (ret)
@@ -3333,47 +4090,86 @@ int update_refs(const char *action, const struct ref_update **updates_orig,
 
 	/* Acquire all locks while verifying old values */
 	for (i = 0; i < n; i++) {
-		locks[i] = update_ref_lock(updates[i]->ref_name,
-					   (updates[i]->have_old ?
-					    updates[i]->old_sha1 : NULL),
-					   updates[i]->flags,
-					   &types[i], onerr);
-		if (!locks[i]) {
+		updates[i]->lock = update_ref_lock(updates[i]->refname,
+						   (updates[i]->have_old ?
+						    updates[i]->old_sha1 : NULL),
+						   updates[i]->flags,
+						   &updates[i]->type, onerr);
+		if (!updates[i]->lock) {
 			ret = 1;
 			goto cleanup;
 		}
 	}
 
-	/* Perform updates first so live commits remain referenced */
+	/*
+	 * Write the new values to the lock files, checking each, so
+	 * that no ref is changed unless all of them can be.
+	 */
+	for (i = 0; i < n; i++) {
+		struct ref_lock *lock = updates[i]->lock;
+
+		if (is_null_sha1(updates[i]->new_sha1))
+			continue;
+		if (!lock->force_write &&
+		    !hashcmp(lock->old_sha1, updates[i]->new_sha1)) {
+			unlock_ref(lock);
+			updates[i]->lock = NULL;
+			continue;
+		}
+		if (write_ref_to_lockfile(lock, updates[i]->new_sha1)) {
+			updates[i]->lock = NULL; /* freed on error */
+			ret = update_ref_write_error(updates[i]->refname, onerr);
+			goto cleanup;
+		}
+	}
+
 	for (i = 0; i < n; i++)
-		if (!is_null_sha1(updates[i]->new_sha1)) {
-			ret = update_ref_write(action,
-					       updates[i]->ref_name,
-					       updates[i]->new_sha1,
-					       locks[i], onerr);
-			locks[i] = NULL; /* freed by update_ref_write */
-			if (ret)
-				goto cleanup;
+		if (updates[i]->lock && !is_null_sha1(updates[i]->new_sha1) &&
+		    log_ref_update(updates[i]->lock, updates[i]->new_sha1, msg)) {
+			ret = update_ref_write_error(updates[i]->refname, onerr);
+			goto cleanup;
 		}
 
+	/* With reftables, all of them are set at once */
+	if (reftable && commit_updates_to_reftable(updates, n)) {
+		ret = update_ref_write_error(updates[0]->refname, onerr);
+		goto cleanup;
+	}
+
+	/* Perform updates first so live commits remain referenced */
+	for (i = 0; i < n; i++) {
+		struct ref_lock *lock = updates[i]->lock;
+
+		if (!lock || is_null_sha1(updates[i]->new_sha1))
+			continue;
+		if (reftable && starts_with(lock->ref_name, "refs/") ?
+		    delete_ref_loose(lock, 0) : commit_ref(lock)) {
+			ret = update_ref_write_error(updates[i]->refname, onerr);
+			goto cleanup;
+		}
+		unlock_ref(lock);
+		updates[i]->lock = NULL;
+	}
+
 	/* Perform deletes now that updates are safely completed */
 	for (i = 0; i < n; i++)
-		if (locks[i]) {
-			delnames[delnum++] = locks[i]->ref_name;
-			ret |= delete_ref_loose(locks[i], types[i]);
+		if (updates[i]->lock) {
+			delnames[delnum++] = updates[i]->lock->ref_name;
+			ret |= delete_ref_loose(updates[i]->lock,
+						updates[i]->type);
 		}
-	ret |= repack_without_refs(delnames, delnum);
+	if (!reftable)
+		ret |= repack_without_refs(delnames, delnum);
 	for (i = 0; i < delnum; i++)
 		unlink_or_warn(git_path("logs/%s", delnames[i]));
 	clear_loose_ref_cache(&ref_cache);
 
 cleanup:
 	for (i = 0; i < n; i++)
-		if (locks[i])
-			unlock_ref(locks[i]);
-	free(updates);
-	free(types);
-	free(locks);
+		if (updates[i]->lock) {
+			unlock_ref(updates[i]->lock);
+			updates[i]->lock = NULL;
+		}
 	free(delnames);
 	return ret;
 }
@@ -10,19 +10,24 @@ struct ref_lock {
 	int force_write;
 };
 
-/**
- * Information needed for a single ref update.  Set new_sha1 to the
- * new value or to zero to delete the ref.  To check the old value
- * while locking the ref, set have_old to 1 and set old_sha1 to the
- * value or to zero to ensure the ref does not exist before update.
- */
-struct ref_update {
-	const char *ref_name;
-	unsigned char new_sha1[20];
-	unsigned char old_sha1[20];
-	int flags; /* REF_NODEREF? */
-	int have_old; /* 1 if old_sha1 is valid, 0 otherwise */
-};
+/*
+ * A ref_transaction queues changes to several refs, to be made all
+ * together or not at all:
+ *
+ * - Start it with ref_transaction_begin().
+ *
+ * - Queue changes with ref_transaction_update(), ref_transaction_create()
+ *   and ref_transaction_delete().
+ *
+ * - ref_transaction_commit() locks all of the refs, checks their old
+ *   values and writes their new values to the lock files before it
+ *   changes any of them, and rewrites the packed refs once for all of
+ *   the deletions.
+ *
+ * - Free it with ref_transaction_free(), whether it was committed or
+ *   not.
+ */
+struct ref_transaction;
 
 /*
  * Bit values set in the flags argument passed to each_ref_fn():
@@ -220,11 +225,47 @@ int update_ref(const char *action, const char *refname,
 		const unsigned char *sha1, const unsigned char *oldval,
 		int flags, enum action_on_err onerr);
 
-/**
- * Lock all refs and then perform all modifications.
+struct ref_transaction *ref_transaction_begin(void);
+
+/*
+ * Queue setting refname to new_sha1, or deleting it if new_sha1 is
+ * null.  With have_old, the ref must be at old_sha1 when the
+ * transaction is committed, or not exist if old_sha1 is null.  flags
+ * can be REF_NODEREF.
+ */
+void ref_transaction_update(struct ref_transaction *transaction,
+			    const char *refname,
+			    const unsigned char *new_sha1,
+			    const unsigned char *old_sha1,
+			    int flags, int have_old);
+
+/*
+ * Queue creating refname at new_sha1, which must not be null; the ref
+ * must not exist when the transaction is committed.
+ */
+void ref_transaction_create(struct ref_transaction *transaction,
+			    const char *refname,
+			    const unsigned char *new_sha1,
+			    int flags);
+
+/*
+ * Queue deleting refname.  With have_old, it must be at old_sha1,
+ * which must not be null, when the transaction is committed.
  */
-int update_refs(const char *action, const struct ref_update **updates,
-		int n, enum action_on_err onerr);
+void ref_transaction_delete(struct ref_transaction *transaction,
+			    const char *refname,
+			    const unsigned char *old_sha1,
+			    int flags, int have_old);
+
+/*
+ * Make all of the queued changes, logging them with msg, or none of
+ * them if a ref cannot be locked or set to its new value.  Returns 0
+ * on success.
+ */
+int ref_transaction_commit(struct ref_transaction *transaction,
+			   const char *msg, enum action_on_err onerr);
+
+void ref_transaction_free(struct ref_transaction *transaction);
 
 extern int parse_hide_refs_config(const char *var, const char *value, const char *);
 extern int ref_is_hidden(const char *);
@@ -0,0 +1,935 @@
+#include "cache.h"
+#include "csum-file.h"
+#include "string-list.h"
+#include "varint.h"
+#include "reftable.h"
+
+#define REFTABLE_SIGNATURE "REFT"
+#define REFTABLE_VERSION 1
+#define REFTABLE_HEADER_SIZE 8
+#define REFTABLE_FOOTER_SIZE (REFTABLE_HEADER_SIZE + 12)
+#define REFTABLE_TRAILER_SIZE 20
+
+#define REFTABLE_BLOCK_SIZE 4096
+#define REFTABLE_RESTART_INTERVAL 16
+#define BLOCK_HEADER_SIZE 4
+#define BLOCK_REFS 'r'
+#define BLOCK_INDEX 'i'
+
+/* A table grows the stack too deep unless it is half the size below it */
+#define REFTABLE_COMPACTION_FACTOR 2
+
+static void put_be24(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 16;
+	p[1] = v >> 8;
+	p[2] = v;
+}
+
+static uint32_t get_be24(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v & 0xffffffff);
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static void strbuf_add_varint(struct strbuf *sb, uintmax_t value)
+{
+	unsigned char buf[16];
+
+	strbuf_add(sb, buf, encode_varint(value, buf));
+}
+
+/* One mapped table */
+struct reftable {
+	char *path;
+	unsigned char *map;
+	size_t size;
+	size_t ref_end;		/* end of the reference blocks */
+	size_t index_offset;	/* of the index block, or 0 */
+	size_t footer_offset;
+	uint32_t nr;
+};
+
+static void NORETURN corrupt_table(const struct reftable *t)
+{
+	die("corrupt reftable %s", t->path);
+}
+
+static struct reftable *open_table(const char *path)
+{
+	struct reftable *t;
+	struct stat st;
+	const unsigned char *footer;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	t = xcalloc(1, sizeof(*t));
+	t->path = xstrdup(path);
+	t->size = xsize_t(st.st_size);
+	if (t->size < REFTABLE_HEADER_SIZE + REFTABLE_FOOTER_SIZE +
+		      REFTABLE_TRAILER_SIZE)
+		corrupt_table(t);
+	t->map = xmmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (memcmp(t->map, REFTABLE_SIGNATURE, 4))
+		die("%s is not a reftable", path);
+	if (t->map[4] != REFTABLE_VERSION)
+		die("reftable %s has unknown version %d", path, t->map[4]);
+	t->footer_offset = t->size - REFTABLE_TRAILER_SIZE - REFTABLE_FOOTER_SIZE;
+	footer = t->map + t->footer_offset;
+	if (memcmp(footer, t->map, REFTABLE_HEADER_SIZE))
+		corrupt_table(t);
+	t->index_offset = get_be64(footer + REFTABLE_HEADER_SIZE);
+	t->nr = get_be32(footer + REFTABLE_HEADER_SIZE + 8);
+	if (t->index_offset > t->footer_offset ||
+	    (t->index_offset && t->index_offset < REFTABLE_HEADER_SIZE))
+		corrupt_table(t);
+	t->ref_end = t->index_offset ? t->index_offset : t->footer_offset;
+	return t;
+}
+
+static void close_table(struct reftable *t)
+{
+	munmap(t->map, t->size);
+	free(t->path);
+	free(t);
+}
+
+/*
+ * A block is a one-byte type, a 3-byte length (of the whole block),
+ * the records, the 3-byte offsets in the block of the records whose
+ * name is not prefix-compressed ("restarts"), and a 2-byte count of
+ * those.
+ */
+struct block {
+	const unsigned char *start;
+	const unsigned char *records;
+	const unsigned char *restarts;	/* also the end of the records */
+	unsigned restart_nr;
+	size_t len;
+};
+
+static void read_block(const struct reftable *t, size_t offset, size_t end,
+		       int type, struct block *b)
+{
+	const unsigned char *p = t->map + offset;
+
+	if (offset + BLOCK_HEADER_SIZE + 2 > end || p[0] != type)
+		corrupt_table(t);
+	b->len = get_be24(p + 1);
+	if (b->len < BLOCK_HEADER_SIZE + 2 || b->len > end - offset)
+		corrupt_table(t);
+	b->restart_nr = get_be16(p + b->len - 2);
+	if (BLOCK_HEADER_SIZE + 3 * b->restart_nr + 2 > b->len)
+		corrupt_table(t);
+	b->start = p;
+	b->records = p + BLOCK_HEADER_SIZE;
+	b->restarts = p + b->len - 2 - 3 * b->restart_nr;
+}
+
+static const unsigned char *restart_record(const struct block *b, unsigned i)
+{
+	return b->start + get_be24(b->restarts + 3 * i);
+}
+
+/*
+ * Decode the record at p of block b, whose name is compressed against
+ * the previous one, in name.  What follows the name is its value:
+ * the object names of a reference record, or the offset of the block
+ * the name is the last of for an index record.  Returns the next
+ * record.
+ */
+static const unsigned char *decode_record(const struct reftable *t,
+					  const struct block *b,
+					  const unsigned char *p,
+					  struct strbuf *name, int *type,
+					  unsigned char *sha1,
+					  unsigned char *peeled,
+					  uint64_t *offset)
+{
+	uintmax_t prefix_len, suffix_len;
+	size_t value_len = 0;
+
+	prefix_len = decode_varint(&p);
+	if (p >= b->restarts)
+		corrupt_table(t);
+	suffix_len = decode_varint(&p);
+	*type = suffix_len & 3;
+	suffix_len >>= 2;
+	if (p > b->restarts || prefix_len > name->len ||
+	    suffix_len > b->restarts - p)
+		corrupt_table(t);
+	strbuf_setlen(name, prefix_len);
+	strbuf_add(name, p, suffix_len);
+	p += suffix_len;
+
+	if (b->start[0] == BLOCK_INDEX) {
+		if (p >= b->restarts)
+			corrupt_table(t);
+		*offset = decode_varint(&p);
+		if (p > b->restarts)
+			corrupt_table(t);
+		return p;
+	}
+
+	if (*type != REFTABLE_DELETION)
+		value_len = *type == REFTABLE_PEELED ? 40 : 20;
+	if (value_len > b->restarts - p)
+		corrupt_table(t);
+	if (value_len)
+		hashcpy(sha1, p);
+	if (value_len == 40)
+		hashcpy(peeled, p + 20);
+	else
+		hashclr(peeled);
+	return p + value_len;
+}
+
+/*
+ * The first restart of block b whose name is not before "name", or
+ * restart_nr; with "name" decoded for its record.
+ */
+static unsigned bisect_restarts(const struct reftable *t,
+				const struct block *b, const char *target)
+{
+	struct strbuf name = STRBUF_INIT;
+	unsigned char sha1[20], peeled[20];
+	uint64_t offset;
+	unsigned lo = 0, hi = b->restart_nr;
+	int type;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		strbuf_reset(&name);
+		decode_record(t, b, restart_record(b, mid), &name, &type,
+			      sha1, peeled, &offset);
+		if (strcmp(name.buf, target) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	strbuf_release(&name);
+	return lo;
+}
+
+/*
+ * Find in the index the offset of the reference block where "target"
+ * is or would be; returns -1 if it would be after all of them.
+ */
+static int index_lookup(const struct reftable *t, const char *target,
+			size_t *offset)
+{
+	struct strbuf name = STRBUF_INIT;
+	unsigned char sha1[20], peeled[20];
+	const unsigned char *p;
+	struct block b;
+	unsigned restart;
+	int type, ret = -1;
+
+	read_block(t, t->index_offset, t->footer_offset, BLOCK_INDEX, &b);
+	restart = bisect_restarts(t, &b, target);
+	p = restart ? restart_record(&b, restart - 1) : b.records;
+	while (p < b.restarts) {
+		uint64_t block_offset;
+
+		p = decode_record(t, &b, p, &name, &type, sha1, peeled,
+				  &block_offset);
+		if (strcmp(name.buf, target) >= 0) {
+			if (block_offset < REFTABLE_HEADER_SIZE ||
+			    block_offset >= t->ref_end)
+				corrupt_table(t);
+			*offset = block_offset;
+			ret = 0;
+			break;
+		}
+	}
+	strbuf_release(&name);
+	return ret;
+}
+
+/* An iterator over the references of a table, from a given name on */
+struct table_iter {
+	const struct reftable *t;
+	struct block block;
+	size_t block_offset;
+	const unsigned char *next;	/* the record after rec */
+	struct reftable_record rec;	/* the current record */
+	int done;
+};
+
+static void iter_init(struct table_iter *it, const struct reftable *t)
+{
+	memset(it, 0, sizeof(*it));
+	it->t = t;
+	strbuf_init(&it->rec.refname, 0);
+}
+
+static void iter_release(struct table_iter *it)
+{
+	strbuf_release(&it->rec.refname);
+}
+
+static void iter_load_block(struct table_iter *it, size_t offset)
+{
+	if (offset >= it->t->ref_end) {
+		it->done = 1;
+		return;
+	}
+	read_block(it->t, offset, it->t->ref_end, BLOCK_REFS, &it->block);
+	it->block_offset = offset;
+	it->next = it->block.records;
+	strbuf_reset(&it->rec.refname);
+}
+
+static void iter_advance(struct table_iter *it)
+{
+	int type;
+	uint64_t offset;
+
+	while (!it->done && it->next >= it->block.restarts)
+		iter_load_block(it, it->block_offset + it->block.len);
+	if (it->done)
+		return;
+	it->next = decode_record(it->t, &it->block, it->next,
+				 &it->rec.refname, &type, it->rec.sha1,
+				 it->rec.peeled, &offset);
+	it->rec.value = type;
+}
+
+/* Make the first reference not before "target" the current one */
+static void iter_seek(struct table_iter *it, const char *target)
+{
+	size_t offset = REFTABLE_HEADER_SIZE;
+	unsigned restart;
+
+	if (it->t->index_offset && index_lookup(it->t, target, &offset)) {
+		it->done = 1;
+		return;
+	}
+	iter_load_block(it, offset);
+	if (it->done)
+		return;
+	restart = bisect_restarts(it->t, &it->block, target);
+	if (restart)
+		it->next = restart_record(&it->block, restart - 1);
+	do {
+		iter_advance(it);
+	} while (!it->done && strcmp(it->rec.refname.buf, target) < 0);
+}
+
+static void copy_record(struct reftable_record *dst,
+			const struct reftable_record *src)
+{
+	strbuf_reset(&dst->refname);
+	strbuf_addbuf(&dst->refname, &src->refname);
+	dst->value = src->value;
+	hashcpy(dst->sha1, src->sha1);
+	hashcpy(dst->peeled, src->peeled);
+}
+
+/*
+ * Take the next reference of the "nr" tables merged, newest last, into
+ * "rec": of those with the smallest name, the one of the newest table.
+ * Returns 1 at the end.
+ */
+static int merged_next(struct table_iter *its, int nr,
+		       struct reftable_record *rec, int keep_deletions)
+{
+	for (;;) {
+		int i, best = -1;
+
+		for (i = 0; i < nr; i++) {
+			if (its[i].done)
+				continue;
+			if (best < 0 || strcmp(its[i].rec.refname.buf,
+					       its[best].rec.refname.buf) <= 0)
+				best = i;
+		}
+		if (best < 0)
+			return 1;
+		copy_record(rec, &its[best].rec);
+		for (i = 0; i < nr; i++)
+			if (!its[i].done &&
+			    !strcmp(its[i].rec.refname.buf, rec->refname.buf))
+				iter_advance(&its[i]);
+		if (keep_deletions || rec->value != REFTABLE_DELETION)
+			return 0;
+	}
+}
+
+struct reftable_stack {
+	struct reftable **tables;	/* oldest first */
+	int nr;
+};
+
+static void free_tables(struct reftable_stack *stack)
+{
+	int i;
+
+	for (i = 0; i < stack->nr; i++)
+		close_table(stack->tables[i]);
+	free(stack->tables);
+	free(stack);
+}
+
+/* NULL if a table is gone, by a concurrent compaction */
+static struct reftable_stack *read_tables(const char *dir, const char *list)
+{
+	struct reftable_stack *stack = xcalloc(1, sizeof(*stack));
+	struct strbuf path = STRBUF_INIT;
+	int alloc = 0;
+
+	while (*list) {
+		const char *eol = strchrnul(list, '\n');
+		struct reftable *t;
+
+		if (eol == list) {
+			list++;
+			continue;
+		}
+		strbuf_reset(&path);
+		strbuf_addf(&path, "%s/%.*s", dir, (int)(eol - list), list);
+		t = open_table(path.buf);
+		if (!t) {
+			if (errno != ENOENT)
+				die_errno("unable to open %s", path.buf);
+			free_tables(stack);
+			stack = NULL;
+			break;
+		}
+		ALLOC_GROW(stack->tables, stack->nr + 1, alloc);
+		stack->tables[stack->nr++] = t;
+		list = *eol ? eol + 1 : eol;
+	}
+	strbuf_release(&path);
+	return stack;
+}
+
+struct reftable_stack *reftable_stack_open(const char *dir,
+					   struct stat_validity *validity)
+{
+	struct strbuf path = STRBUF_INIT, list = STRBUF_INIT;
+	struct reftable_stack *stack = NULL;
+	int tries;
+
+	strbuf_addf(&path, "%s/tables.list", dir);
+	for (tries = 0; !stack && tries < 8; tries++) {
+		int fd = open(path.buf, O_RDONLY);
+
+		if (fd < 0) {
+			if (errno != ENOENT)
+				die_errno("unable to open %s", path.buf);
+			break;
+		}
+		stat_validity_update(validity, fd);
+		strbuf_reset(&list);
+		if (strbuf_read(&list, fd, 0) < 0)
+			die_errno("unable to read %s", path.buf);
+		close(fd);
+		stack = read_tables(dir, list.buf);
+	}
+	if (!stack && tries == 8)
+		die("the tables listed in %s keep disappearing", path.buf);
+	strbuf_release(&path);
+	strbuf_release(&list);
+	return stack;
+}
+
+void reftable_stack_free(struct reftable_stack *stack)
+{
+	free_tables(stack);
+}
+
+int reftable_stack_read_ref(struct reftable_stack *stack, const char *refname,
+			    struct reftable_record *rec)
+{
+	int i;
+
+	for (i = stack->nr - 1; i >= 0; i--) {
+		struct table_iter it;
+		int found;
+
+		iter_init(&it, stack->tables[i]);
+		iter_seek(&it, refname);
+		found = !it.done && !strcmp(it.rec.refname.buf, refname);
+		if (found && it.rec.value == REFTABLE_DELETION)
+			found = -1;
+		else if (found)
+			copy_record(rec, &it.rec);
+		iter_release(&it);
+		if (found)
+			return found < 0;
+	}
+	return 1;
+}
+
+int reftable_stack_for_each(struct reftable_stack *stack, const char *prefix,
+			    reftable_each_fn fn, void *cb_data)
+{
+	struct table_iter *its = xcalloc(stack->nr, sizeof(*its));
+	struct reftable_record rec = REFTABLE_RECORD_INIT;
+	int i, ret = 0;
+
+	for (i = 0; i < stack->nr; i++) {
+		iter_init(&its[i], stack->tables[i]);
+		iter_seek(&its[i], prefix);
+	}
+	while (!ret && !merged_next(its, stack->nr, &rec, 0) &&
+	       starts_with(rec.refname.buf, prefix))
+		ret = fn(&rec, cb_data);
+	for (i = 0; i < stack->nr; i++)
+		iter_release(&its[i]);
+	free(its);
+	strbuf_release(&rec.refname);
+	return ret;
+}
+
+struct block_writer {
+	struct strbuf buf;
+	uint32_t *restarts;
+	int restart_nr, restart_alloc;
+	int since_restart;
+	struct strbuf last;
+};
+
+static void block_start(struct block_writer *bw, int type)
+{
+	strbuf_reset(&bw->buf);
+	strbuf_addch(&bw->buf, type);
+	strbuf_addf(&bw->buf, "%c%c%c", 0, 0, 0);
+	bw->restart_nr = 0;
+	bw->since_restart = 0;
+	strbuf_reset(&bw->last);
+}
+
+/*
+ * Add a record to the block; if a limit is given and the record would
+ * take the (non-empty) block over it, add nothing and return -1.
+ */
+static int block_add(struct block_writer *bw, const char *name, int type,
+		     const struct strbuf *value, size_t limit)
+{
+	struct strbuf rec = STRBUF_INIT;
+	int restart = !bw->restart_nr ||
+		bw->since_restart == REFTABLE_RESTART_INTERVAL;
+	size_t prefix = 0, len = strlen(name);
+
+	if (!restart)
+		while (prefix < len && prefix < bw->last.len &&
+		       name[prefix] == bw->last.buf[prefix])
+			prefix++;
+	strbuf_add_varint(&rec, prefix);
+	strbuf_add_varint(&rec, (len - prefix) << 2 | type);
+	strbuf_add(&rec, name + prefix, len - prefix);
+	strbuf_addbuf(&rec, value);
+
+	if (limit && bw->restart_nr &&
+	    bw->buf.len + rec.len + 3 * (bw->restart_nr + restart) + 2 > limit) {
+		strbuf_release(&rec);
+		return -1;
+	}
+	if (restart) {
+		ALLOC_GROW(bw->restarts, bw->restart_nr + 1, bw->restart_alloc);
+		bw->restarts[bw->restart_nr++] = bw->buf.len;
+		bw->since_restart = 0;
+	}
+	bw->since_restart++;
+	strbuf_addbuf(&bw->buf, &rec);
+	strbuf_reset(&bw->last);
+	strbuf_add(&bw->last, name, len);
+	strbuf_release(&rec);
+	return 0;
+}
+
+static void block_finish(struct block_writer *bw)
+{
+	unsigned char buf[3];
+	int i;
+
+	if (bw->restart_nr > 0xffff)
+		die("too many records in a reftable block");
+	for (i = 0; i < bw->restart_nr; i++) {
+		put_be24(buf, bw->restarts[i]);
+		strbuf_add(&bw->buf, buf, 3);
+	}
+	strbuf_addch(&bw->buf, bw->restart_nr >> 8);
+	strbuf_addch(&bw->buf, bw->restart_nr & 0xff);
+	if (bw->buf.len >= 1 << 24)
+		die("reftable block too large");
+	put_be24((unsigned char *)bw->buf.buf + 1, bw->buf.len);
+}
+
+struct index_entry {
+	char *name;
+	uint64_t offset;
+};
+
+struct table_writer {
+	struct strbuf path;
+	struct sha1file *f;
+	uint64_t offset;
+	struct block_writer block;
+	struct index_entry *index;
+	int index_nr, index_alloc;
+	uint32_t nr;
+};
+
+static void writer_start(struct table_writer *w, const char *dir)
+{
+	unsigned char header[REFTABLE_HEADER_SIZE];
+	int fd;
+
+	memset(w, 0, sizeof(*w));
+	strbuf_init(&w->path, 0);
+	strbuf_init(&w->block.buf, 0);
+	strbuf_init(&w->block.last, 0);
+	strbuf_addf(&w->path, "%s/tmp_reftable_XXXXXX", dir);
+	fd = xmkstemp_mode(w->path.buf, 0444);
+	w->f = sha1fd(fd, w->path.buf);
+
+	memcpy(header, REFTABLE_SIGNATURE, 4);
+	header[4] = REFTABLE_VERSION;
+	put_be24(header + 5, REFTABLE_BLOCK_SIZE);
+	sha1write(w->f, header, sizeof(header));
+	w->offset = sizeof(header);
+	block_start(&w->block, BLOCK_REFS);
+}
+
+static void writer_flush_block(struct table_writer *w)
+{
+	struct index_entry *e;
+
+	block_finish(&w->block);
+	sha1write(w->f, w->block.buf.buf, w->block.buf.len);
+	ALLOC_GROW(w->index, w->index_nr + 1, w->index_alloc);
+	e = &w->index[w->index_nr++];
+	e->name = strbuf_detach(&w->block.last, NULL);
+	e->offset = w->offset;
+	w->offset += w->block.buf.len;
+	block_start(&w->block, BLOCK_REFS);
+}
+
+static void writer_add(struct table_writer *w, const struct reftable_record *rec)
+{
+	struct strbuf value = STRBUF_INIT;
+
+	if (w->nr && strcmp(rec->refname.buf, w->block.restart_nr ?
+			    w->block.last.buf : w->index[w->index_nr - 1].name) <= 0)
+		die("BUG: reftable records out of order at %s", rec->refname.buf);
+	if (rec->value != REFTABLE_DELETION)
+		strbuf_add(&value, rec->sha1, 20);
+	if (rec->value == REFTABLE_PEELED)
+		strbuf_add(&value, rec->peeled, 20);
+
+	if (block_add(&w->block, rec->refname.buf, rec->value, &value,
+		      REFTABLE_BLOCK_SIZE)) {
+		writer_flush_block(w);
+		block_add(&w->block, rec->refname.buf, rec->value, &value, 0);
+	}
+	w->nr++;
+	strbuf_release(&value);
+}
+
+static void writer_release(struct table_writer *w)
+{
+	int i;
+
+	for (i = 0; i < w->index_nr; i++)
+		free(w->index[i].name);
+	free(w->index);
+	free(w->block.restarts);
+	strbuf_release(&w->block.buf);
+	strbuf_release(&w->block.last);
+	strbuf_release(&w->path);
+}
+
+/* Finish the table and move it to its name in dir, which is returned */
+static char *writer_finish(struct table_writer *w, const char *dir)
+{
+	unsigned char footer[REFTABLE_FOOTER_SIZE], sha1[20];
+	uint64_t index_offset = 0;
+	struct strbuf name = STRBUF_INIT, path = STRBUF_INIT;
+	int i;
+
+	if (w->block.restart_nr)
+		writer_flush_block(w);
+	if (w->index_nr > 1) {
+		block_start(&w->block, BLOCK_INDEX);
+		for (i = 0; i < w->index_nr; i++) {
+			struct strbuf value = STRBUF_INIT;
+
+			strbuf_add_varint(&value, w->index[i].offset);
+			block_add(&w->block, w->index[i].name, 0, &value, 0);
+			strbuf_release(&value);
+		}
+		block_finish(&w->block);
+		sha1write(w->f, w->block.buf.buf, w->block.buf.len);
+		index_offset = w->offset;
+	}
+
+	memcpy(footer, REFTABLE_SIGNATURE, 4);
+	footer[4] = REFTABLE_VERSION;
+	put_be24(footer + 5, REFTABLE_BLOCK_SIZE);
+	put_be64(footer + REFTABLE_HEADER_SIZE, index_offset);
+	put_be32(footer + REFTABLE_HEADER_SIZE + 8, w->nr);
+	sha1write(w->f, footer, sizeof(footer));
+	sha1close(w->f, sha1, CSUM_CLOSE);
+
+	strbuf_addf(&name, "%s.ref", sha1_to_hex(sha1));
+	strbuf_addf(&path, "%s/%s", dir, name.buf);
+	if (rename(w->path.buf, path.buf))
+		die_errno("unable to rename %s to %s", w->path.buf, path.buf);
+	adjust_shared_perm(path.buf);
+	strbuf_release(&path);
+	writer_release(w);
+	return strbuf_detach(&name, NULL);
+}
+
+/* Give up on the table */
+static void writer_abort(struct table_writer *w)
+{
+	sha1close(w->f, NULL, CSUM_CLOSE);
+	unlink_or_warn(w->path.buf);
+	writer_release(w);
+}
+
+/* The stack being changed under its lock */
+static struct lock_file tables_lock;
+static struct {
+	char *dir;
+	struct string_list old;		/* as it was when locked */
+	struct string_list tables;	/* as it is to be written */
+	struct string_list added;	/* written while it was locked */
+	struct string_list dropped;	/* to delete once it is written */
+	int locked;
+} locked_stack = {
+	NULL,
+	STRING_LIST_INIT_DUP,
+	STRING_LIST_INIT_DUP,
+	STRING_LIST_INIT_DUP,
+	STRING_LIST_INIT_DUP
+};
+
+struct lock_file *reftable_lock(const char *dir, int flags)
+{
+	struct strbuf path = STRBUF_INIT, list = STRBUF_INIT;
+	const char *p;
+
+	if (locked_stack.locked)
+		die("BUG: reftable stack locked twice");
+	strbuf_addf(&path, "%s/tables.list", dir);
+	if (safe_create_leading_directories(path.buf) ||
+	    hold_lock_file_for_update(&tables_lock, path.buf, flags) < 0) {
+		strbuf_release(&path);
+		return NULL;
+	}
+	if (strbuf_read_file(&list, path.buf, 0) < 0 && errno != ENOENT)
+		die_errno("unable to read %s", path.buf);
+	for (p = list.buf; *p; ) {
+		const char *eol = strchrnul(p, '\n');
+
+		if (eol != p) {
+			char *name = xstrndup(p, eol - p);
+			string_list_append(&locked_stack.old, name);
+			string_list_append_nodup(&locked_stack.tables, name);
+		}
+		p = *eol ? eol + 1 : eol;
+	}
+	locked_stack.dir = xstrdup(dir);
+	locked_stack.locked = 1;
+	strbuf_release(&list);
+	strbuf_release(&path);
+	return &tables_lock;
+}
+
+int reftable_add_table(const struct reftable_record *recs, int nr, int replace)
+{
+	struct table_writer w;
+	char *name;
+	int i;
+
+	if (!locked_stack.locked)
+		die("BUG: reftable stack not locked");
+	if (replace) {
+		for (i = 0; i < locked_stack.tables.nr; i++)
+			string_list_append(&locked_stack.dropped,
+					   locked_stack.tables.items[i].string);
+		string_list_clear(&locked_stack.tables, 0);
+	}
+	if (!nr)
+		return 0;
+
+	writer_start(&w, locked_stack.dir);
+	for (i = 0; i < nr; i++)
+		writer_add(&w, &recs[i]);
+	name = writer_finish(&w, locked_stack.dir);
+	string_list_append(&locked_stack.added, name);
+	string_list_append_nodup(&locked_stack.tables, name);
+	return 0;
+}
+
+static off_t table_size(const char *name)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct stat st;
+
+	strbuf_addf(&path, "%s/%s", locked_stack.dir, name);
+	if (stat(path.buf, &st))
+		die_errno("unable to stat %s", path.buf);
+	strbuf_release(&path);
+	return st.st_size;
+}
+
+/*
+ * Merge the tables at the top of the locked stack that are not at
+ * least twice as large as all those above them, so that the stack
+ * stays a logarithmic number of tables deep.  Deletions are dropped
+ * when the bottom table is merged.
+ */
+static void compact_stack(void)
+{
+	struct string_list *tables = &locked_stack.tables;
+	struct reftable_record rec = REFTABLE_RECORD_INIT;
+	struct strbuf path = STRBUF_INIT;
+	struct table_writer w;
+	struct table_iter *its;
+	struct reftable **merged;
+	int i, first, nr;
+	off_t total;
+	char *name;
+
+	if (tables->nr < 2)
+		return;
+	first = tables->nr - 1;
+	total = table_size(tables->items[first].string);
+	while (first > 0 &&
+	       table_size(tables->items[first - 1].string) <
+	       REFTABLE_COMPACTION_FACTOR * total)
+		total += table_size(tables->items[--first].string);
+	nr = tables->nr - first;
+	if (nr < 2)
+		return;
+
+	merged = xcalloc(nr, sizeof(*merged));
+	its = xcalloc(nr, sizeof(*its));
+	for (i = 0; i < nr; i++) {
+		strbuf_reset(&path);
+		strbuf_addf(&path, "%s/%s", locked_stack.dir,
+			    tables->items[first + i].string);
+		merged[i] = open_table(path.buf);
+		if (!merged[i])
+			die_errno("unable to open %s", path.buf);
+		iter_init(&its[i], merged[i]);
+		iter_seek(&its[i], "");
+	}
+	writer_start(&w, locked_stack.dir);
+	while (!merged_next(its, nr, &rec, first > 0))
+		writer_add(&w, &rec);
+	for (i = 0; i < nr; i++) {
+		iter_release(&its[i]);
+		close_table(merged[i]);
+	}
+	free(its);
+	free(merged);
+
+	if (w.nr || first) {
+		name = writer_finish(&w, locked_stack.dir);
+	} else {
+		/* everything was deleted: no table at all */
+		writer_abort(&w);
+		name = NULL;
+	}
+	for (i = first; i < tables->nr; i++)
+		string_list_append(&locked_stack.dropped,
+				   tables->items[i].string);
+	tables->nr = first;
+	if (name) {
+		string_list_append(&locked_stack.added, name);
+		string_list_append_nodup(tables, name);
+	}
+	strbuf_release(&rec.refname);
+	strbuf_release(&path);
+}
+
+static void unlink_tables(struct string_list *names,
+			  const struct string_list *keep)
+{
+	struct strbuf path = STRBUF_INIT;
+	int i;
+
+	for (i = 0; i < names->nr; i++) {
+		if (unsorted_string_list_has_string((struct string_list *)keep,
+						    names->items[i].string))
+			continue;
+		strbuf_reset(&path);
+		strbuf_addf(&path, "%s/%s", locked_stack.dir,
+			    names->items[i].string);
+		unlink_or_warn(path.buf);
+	}
+	strbuf_release(&path);
+}
+
+static void unlock_stack(void)
+{
+	string_list_clear(&locked_stack.old, 0);
+	string_list_clear(&locked_stack.tables, 0);
+	string_list_clear(&locked_stack.added, 0);
+	string_list_clear(&locked_stack.dropped, 0);
+	free(locked_stack.dir);
+	locked_stack.dir = NULL;
+	locked_stack.locked = 0;
+}
+
+int reftable_commit(void)
+{
+	struct strbuf list = STRBUF_INIT;
+	int i;
+
+	if (!locked_stack.locked)
+		die("BUG: reftable stack not locked");
+	compact_stack();
+	for (i = 0; i < locked_stack.tables.nr; i++)
+		strbuf_addf(&list, "%s\n", locked_stack.tables.items[i].string);
+	if (write_in_full(tables_lock.fd, list.buf, list.len) != list.len ||
+	    commit_lock_file(&tables_lock)) {
+		strbuf_release(&list);
+		error("unable to write %s/tables.list", locked_stack.dir);
+		reftable_rollback();
+		return -1;
+	}
+	strbuf_release(&list);
+	/* those gone from the stack; readers that still map them keep them */
+	unlink_tables(&locked_stack.dropped, &locked_stack.tables);
+	unlock_stack();
+	return 0;
+}
+
+void reftable_rollback(void)
+{
+	if (!locked_stack.locked)
+		die("BUG: reftable stack not locked");
+	rollback_lock_file(&tables_lock);
+	/*
+	 * Tables are named after their contents, so one written now
+	 * may be the very same file the stack already lists.
+	 */
+	unlink_tables(&locked_stack.added, &locked_stack.old);
+	unlock_stack();
+}
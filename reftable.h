@@ -0,0 +1,86 @@
+#ifndef REFTABLE_H
+#define REFTABLE_H
+
+/*
+ * A reftable is an immutable file of references sorted by name, in
+ * blocks of prefix-compressed records followed by an index of the
+ * blocks, so that one reference is found without reading the others.
+ *
+ * The references of a repository stored this way are a stack of such
+ * tables, named oldest first in the "tables.list" file of the stack's
+ * directory.  What a table says of a reference overrides what the
+ * tables under it say, including that it was deleted, so that
+ * updating a few references is writing a small table on top.  The
+ * stack is compacted as it grows to keep it a few tables deep.
+ *
+ * See Documentation/technical/reftable.txt for the file format.
+ */
+
+enum reftable_value {
+	REFTABLE_DELETION = 0,
+	REFTABLE_VALUE = 1,		/* whether it peels is not known */
+	REFTABLE_NOT_PEELABLE = 2,
+	REFTABLE_PEELED = 3
+};
+
+struct reftable_record {
+	struct strbuf refname;
+	enum reftable_value value;
+	unsigned char sha1[20];
+	unsigned char peeled[20];
+};
+
+#define REFTABLE_RECORD_INIT { STRBUF_INIT, REFTABLE_DELETION }
+
+struct reftable_stack;
+
+/*
+ * Open the stack of tables in "dir" and record in "validity" the
+ * tables.list it was read from.  Returns NULL if there is no stack.
+ */
+extern struct reftable_stack *reftable_stack_open(const char *dir,
+						  struct stat_validity *validity);
+extern void reftable_stack_free(struct reftable_stack *stack);
+
+/*
+ * Look "refname" up in the stack.  Returns 0 and fills "rec" if it is
+ * there, 1 if it is not (or was deleted).
+ */
+extern int reftable_stack_read_ref(struct reftable_stack *stack,
+				   const char *refname,
+				   struct reftable_record *rec);
+
+typedef int reftable_each_fn(const struct reftable_record *rec, void *cb_data);
+
+/*
+ * Call "fn" in order for each reference of the stack whose name starts
+ * with "prefix", stopping at and returning the first nonzero return.
+ */
+extern int reftable_stack_for_each(struct reftable_stack *stack,
+				   const char *prefix,
+				   reftable_each_fn fn, void *cb_data);
+
+/*
+ * Lock the stack in "dir", which is created if need be, to add tables
+ * to it; "flags" are those of hold_lock_file_for_update().  Returns
+ * the lock, or NULL.  Only one stack can be locked at a time.
+ */
+extern struct lock_file *reftable_lock(const char *dir, int flags);
+
+/*
+ * Write the "nr" records "recs", sorted by name, as a table on top of
+ * the locked stack or, with "replace", as the only table in it.
+ */
+extern int reftable_add_table(const struct reftable_record *recs, int nr,
+			      int replace);
+
+/*
+ * Write out the list of tables of the locked stack, compacting its top
+ * if it got too deep, and unlock it.  Returns 0 or an error.
+ */
+extern int reftable_commit(void);
+
+/* Unlock the stack, leaving it as it was */
+extern void reftable_rollback(void);
+
+#endif
@@ -112,6 +112,7 @@ struct ref {
 		REF_STATUS_REJECT_SHALLOW,
 		REF_STATUS_UPTODATE,
 		REF_STATUS_REMOTE_REJECT,
+		REF_STATUS_ATOMIC_PUSH_FAILED,
 		REF_STATUS_EXPECTING_REPORT
 	} status;
 	char *remote_status;
@@ -190,6 +190,48 @@ static void advertise_shallow_grafts_buf(struct strbuf *sb)
 	for_each_commit_graft(advertise_shallow_grafts_cb, sb);
 }
 
+/*
+ * An atomic push is all or nothing: if any ref would be rejected,
+ * mark all the others as failed rather than send any of them.
+ * Returns the number of rejected refs.
+ */
+static int check_atomic_push(struct send_pack_args *args,
+			     struct ref *remote_refs,
+			     int allow_deleting_refs)
+{
+	struct ref *ref;
+	int rejected = 0;
+
+	for (ref = remote_refs; ref; ref = ref->next) {
+		if (!ref->peer_ref && !args->send_mirror)
+			continue;
+		switch (ref->status) {
+		case REF_STATUS_REJECT_NONFASTFORWARD:
+		case REF_STATUS_REJECT_ALREADY_EXISTS:
+		case REF_STATUS_REJECT_FETCH_FIRST:
+		case REF_STATUS_REJECT_NEEDS_FORCE:
+		case REF_STATUS_REJECT_STALE:
+			rejected++;
+			break;
+		default:
+			if (ref->deletion && !allow_deleting_refs) {
+				ref->status = REF_STATUS_REJECT_NODELETE;
+				rejected++;
+			}
+		}
+	}
+	if (!rejected)
+		return 0;
+
+	for (ref = remote_refs; ref; ref = ref->next) {
+		if (!ref->peer_ref && !args->send_mirror)
+			continue;
+		if (ref->status == REF_STATUS_NONE)
+			ref->status = REF_STATUS_ATOMIC_PUSH_FAILED;
+	}
+	return rejected;
+}
+
 int send_pack(struct send_pack_args *args,
 	      int fd[], struct child_process *conn,
 	      struct ref *remote_refs,
@@ -205,6 +247,8 @@ int send_pack(struct send_pack_args *args,
 	int use_sideband = 0;
 	int quiet_supported = 0;
 	int agent_supported = 0;
+	int atomic_supported = 0;
+	int atomic_failed = 0;
 	unsigned cmds_sent = 0;
 	int ret;
 	struct async demux;
@@ -224,6 +268,11 @@ int send_pack(struct send_pack_args *args,
 		agent_supported = 1;
 	if (server_supports("no-thin"))
 		args->use_thin_pack = 0;
+	if (server_supports("atomic"))
+		atomic_supported = 1;
+
+	if (args->atomic && !atomic_supported)
+		die("the receiving end does not support --atomic push");
 
 	if (!remote_refs) {
 		fprintf(stderr, "No refs in common and none specified; doing nothing.\n"
@@ -238,9 +287,14 @@ int send_pack(struct send_pack_args *args,
 	 * Finally, tell the other end!
 	 */
 	new_refs = 0;
+	if (args->atomic &&
+	    check_atomic_push(args, remote_refs, allow_deleting_refs))
+		atomic_failed = 1;
 	for (ref = remote_refs; ref; ref = ref->next) {
 		if (!ref->peer_ref && !args->send_mirror)
 			continue;
+		if (atomic_failed)
+			continue;
 
 		/* Check for statuses set by set_ref_status_for_push() */
 		switch (ref->status) {
@@ -271,13 +325,15 @@ int send_pack(struct send_pack_args *args,
 			int quiet = quiet_supported && (args->quiet || !args->progress);
 
 			if (!cmds_sent && (status_report || use_sideband ||
-					   quiet || agent_supported)) {
+					   quiet || args->atomic ||
+					   agent_supported)) {
 				packet_buf_write(&req_buf,
-						 "%s %s %s%c%s%s%s%s%s",
+						 "%s %s %s%c%s%s%s%s%s%s",
 						 old_hex, new_hex, ref->name, 0,
 						 status_report ? " report-status" : "",
 						 use_sideband ? " side-band-64k" : "",
 						 quiet ? " quiet" : "",
+						 args->atomic ? " atomic" : "",
 						 agent_supported ? " agent=" : "",
 						 agent_supported ? git_user_agent_sanitized() : ""
 						);
@@ -5,6 +5,13 @@
 static int inside_git_dir = -1;
 static int inside_work_tree = -1;
 
+/*
+ * The extensions.* seen by check_repository_format_version(); they
+ * only count in a repository of version 1 or later.
+ */
+static struct string_list unknown_extensions = STRING_LIST_INIT_DUP;
+static enum object_codec extension_object_codec;
+
 /*
  * The input parameter must contain an absolute path, and it must already be
  * normalized.
@@ -318,17 +325,38 @@ static int check_repository_format_gently(const char *gitdir, int *nongit_ok)
 	 * is a good one.
 	 */
 	snprintf(repo_config, PATH_MAX, "%s/config", gitdir);
+	string_list_clear(&unknown_extensions, 0);
+	extension_object_codec = OBJECT_CODEC_ZLIB;
 	git_config_early(check_repository_format_version, NULL, repo_config);
-	if (GIT_REPO_VERSION < repository_format_version) {
+	if (GIT_REPO_VERSION_READ < repository_format_version) {
 		if (!nongit_ok)
 			die ("Expected git repo version <= %d, found %d",
-			     GIT_REPO_VERSION, repository_format_version);
+			     GIT_REPO_VERSION_READ, repository_format_version);
 		warning("Expected git repo version <= %d, found %d",
-			GIT_REPO_VERSION, repository_format_version);
+			GIT_REPO_VERSION_READ, repository_format_version);
 		warning("Please upgrade Git");
 		*nongit_ok = -1;
 		return -1;
 	}
+
+	if (repository_format_version < 1) {
+		object_codec = OBJECT_CODEC_ZLIB;
+		return 0;
+	}
+
+	if (unknown_extensions.nr) {
+		int i;
+
+		if (!nongit_ok)
+			die("unknown repository extension found: %s",
+			    unknown_extensions.items[0].string);
+		for (i = 0; i < unknown_extensions.nr; i++)
+			warning("unknown repository extension: %s",
+				unknown_extensions.items[i].string);
+		*nongit_ok = -1;
+		return -1;
+	}
+	object_codec = extension_object_codec;
 	return 0;
 }
 
@@ -803,6 +831,27 @@ int check_repository_format_version(const char *var, const char *value, void *cb
 		free(git_work_tree_cfg);
 		git_work_tree_cfg = xstrdup(value);
 		inside_work_tree = -1;
+	} else if (starts_with(var, "extensions.")) {
+		const char *ext = var + strlen("extensions.");
+		int codec;
+
+		/*
+		 * An extension we cannot honor, be it one we do not know
+		 * or a codec this build cannot read, makes the repository
+		 * one we must not touch.
+		 */
+		if (strcmp(ext, "objectcodec"))
+			string_list_append(&unknown_extensions, ext);
+		else if (value && (codec = object_codec_by_name(value)) >= 0 &&
+			 object_codec_supported(codec))
+			extension_object_codec = codec;
+		else {
+			struct strbuf sb = STRBUF_INIT;
+
+			strbuf_addf(&sb, "%s=%s", ext, value ? value : "");
+			string_list_append(&unknown_extensions, sb.buf);
+			strbuf_release(&sb);
+		}
 	}
 	return 0;
 }
@@ -21,7 +21,9 @@
 #include "sha1-lookup.h"
 #include "bulk-checkin.h"
 #include "streaming.h"
+#include "midx.h"
 #include "dir.h"
+#include "thread-utils.h"
 
 #ifndef O_NOATIME
 #if defined(__linux__) && (defined(__i386__) || defined(__PPC__))
@@ -68,6 +70,107 @@ static struct cached_object empty_tree = {
  */
 static struct packed_git *last_found_pack;
 
+#ifndef NO_PTHREADS
+/*
+ * The pack windows, the delta base cache and the list of packs are
+ * shared by all readers; while threads read objects, they take turns
+ * with this lock, which is released only around inflating and
+ * applying deltas to buffers the reader owns.  It is recursive
+ * because reading an object may read others, and xmalloc() may call
+ * back into release_pack_memory().
+ */
+static int obj_read_use_lock;
+static pthread_mutex_t obj_read_mutex;
+/* how deep the holder of the lock is in it */
+static int obj_read_lock_depth;
+
+static const char obj_read_lock_trace_key[] = "GIT_TRACE_OBJ_READ_LOCK";
+/* how often obj_read_pause() let other readers in, or could not */
+static unsigned long obj_read_paused, obj_read_kept;
+
+void enable_obj_read_lock(void)
+{
+	if (obj_read_use_lock)
+		return;
+	init_recursive_mutex(&obj_read_mutex);
+	obj_read_use_lock = 1;
+	obj_read_paused = obj_read_kept = 0;
+}
+
+void disable_obj_read_lock(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	obj_read_use_lock = 0;
+	pthread_mutex_destroy(&obj_read_mutex);
+	trace_printf_key(obj_read_lock_trace_key,
+			 "object read lock: released %lu times, "
+			 "kept %lu times\n", obj_read_paused, obj_read_kept);
+}
+
+void obj_read_lock(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	pthread_mutex_lock(&obj_read_mutex);
+	obj_read_lock_depth++;
+}
+
+void obj_read_unlock(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	obj_read_lock_depth--;
+	pthread_mutex_unlock(&obj_read_mutex);
+}
+
+/*
+ * Let other readers in while we inflate or apply a delta to buffers
+ * we own, until obj_read_resume().  This only works if nothing up
+ * the stack holds the lock as well, which is what the counts traced
+ * by disable_obj_read_lock() tell.
+ */
+static void obj_read_pause(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	if (obj_read_lock_depth > 1)
+		obj_read_kept++;
+	else
+		obj_read_paused++;
+	obj_read_unlock();
+}
+
+static void obj_read_resume(void)
+{
+	obj_read_lock();
+}
+#else
+void enable_obj_read_lock(void)
+{
+}
+
+void disable_obj_read_lock(void)
+{
+}
+
+void obj_read_lock(void)
+{
+}
+
+void obj_read_unlock(void)
+{
+}
+
+static void obj_read_pause(void)
+{
+}
+
+static void obj_read_resume(void)
+{
+}
+#endif
+
 static struct cached_object *find_cached_object(const unsigned char *sha1)
 {
 	int i;
@@ -810,6 +913,8 @@ void free_pack_by_name(const char *pack_name)
 			}
 			close_pack_index(p);
 			free(p->bad_object_sha1);
+			if (p->multi_pack_index)
+				close_midx();
 			*pp = p->next;
 			if (last_found_pack == p)
 				last_found_pack = NULL;
@@ -1048,7 +1153,9 @@ static struct packed_git *alloc_packed_git(int extra)
 
 static void try_to_free_pack_memory(size_t size)
 {
+	obj_read_lock();
 	release_pack_memory(size);
+	obj_read_unlock();
 }
 
 struct packed_git *add_packed_git(const char *path, int path_len, int local)
@@ -1210,7 +1317,8 @@ static void prepare_packed_git_one(char *objdir, int local)
 			continue;
 		}
 
-		if (is_dot_or_dotdot(de->d_name))
+		if (is_dot_or_dotdot(de->d_name) ||
+		    !strcmp(de->d_name, "multi-pack-index"))
 			continue;
 
 		strcpy(path + len, de->d_name);
@@ -1236,6 +1344,7 @@ static void prepare_packed_git_one(char *objdir, int local)
 		if (has_extension(de->d_name, ".idx") ||
 		    has_extension(de->d_name, ".pack") ||
 		    has_extension(de->d_name, ".bitmap") ||
+		    has_extension(de->d_name, ".rev") ||
 		    has_extension(de->d_name, ".keep"))
 			string_list_append(&garbage, path);
 		else
@@ -1641,7 +1750,10 @@ unsigned long get_size_from_delta(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		/* the window stays mapped while w_curs holds it */
+		obj_read_pause();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_resume();
 		curpos += stream.next_in - in;
 	} while ((st == Z_OK || st == Z_BUF_ERROR) &&
 		 stream.total_out < sizeof(delta_head));
@@ -1718,18 +1830,19 @@ static const unsigned char *get_delta_base_sha1(struct packed_git *p,
 		unsigned char *base = use_pack(p, w_curs, curpos, NULL);
 		return base;
 	} else if (type == OBJ_OFS_DELTA) {
-		struct revindex_entry *revidx;
+		struct pack_revindex *revidx;
+		uint32_t pos;
 		off_t base_offset = get_delta_base(p, w_curs, &curpos,
 						   type, delta_obj_offset);
 
 		if (!base_offset)
 			return NULL;
 
-		revidx = find_pack_revindex(p, base_offset);
+		revidx = find_pack_revindex(p, base_offset, &pos);
 		if (!revidx)
 			return NULL;
 
-		return nth_packed_object_sha1(p, revidx->nr);
+		return nth_packed_object_sha1(p, revindex_nr(revidx, pos));
 	} else
 		return NULL;
 }
@@ -1763,12 +1876,13 @@ int unpack_object_header(struct packed_git *p,
 static int retry_bad_packed_offset(struct packed_git *p, off_t obj_offset)
 {
 	int type;
-	struct revindex_entry *revidx;
+	struct pack_revindex *revidx;
+	uint32_t pos;
 	const unsigned char *sha1;
-	revidx = find_pack_revindex(p, obj_offset);
+	revidx = find_pack_revindex(p, obj_offset, &pos);
 	if (!revidx)
 		return OBJ_BAD;
-	sha1 = nth_packed_object_sha1(p, revidx->nr);
+	sha1 = nth_packed_object_sha1(p, revindex_nr(revidx, pos));
 	mark_bad_packed_object(p, sha1);
 	type = sha1_object_info(sha1, NULL);
 	if (type <= OBJ_NONE)
@@ -1879,8 +1993,9 @@ static int packed_object_info(struct packed_git *p, off_t obj_offset,
 	}
 
 	if (oi->disk_sizep) {
-		struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-		*oi->disk_sizep = revidx[1].offset - obj_offset;
+		uint32_t pos;
+		struct pack_revindex *revidx = find_pack_revindex(p, obj_offset, &pos);
+		*oi->disk_sizep = revindex_offset(revidx, pos + 1) - obj_offset;
 	}
 
 	if (oi->typep) {
@@ -1930,7 +2045,10 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		/* the window stays mapped while w_curs holds it */
+		obj_read_pause();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_resume();
 		if (!stream.avail_out)
 			break; /* the payload is larger than it should be */
 		curpos += stream.next_in - in;
@@ -1944,136 +2062,269 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	return buffer;
 }
 
-#define MAX_DELTA_CACHE (256)
-
-static size_t delta_base_cached;
-
-static struct delta_base_cache_lru_list {
+/*
+ * The delta base cache keeps the bases of deltas we recently applied,
+ * keyed by their pack and offset, so that the next delta against the
+ * same base (or an object deeper in the same chain) does not have to
+ * unpack the chain again.
+ *
+ * Entries start on the "probation" list and move to the "protected"
+ * list when they are used again; we evict from the probation list
+ * first, so that a stream of bases used once (e.g. the blobs of a
+ * single "log -p") does not push out the trees and commits everybody
+ * keeps coming back to.  Each list is in least recently used order.
+ *
+ * It is one structure under the object read lock: a reader takes the
+ * lock anyway to use the pack windows, and only drops it to inflate
+ * and to apply deltas, so locking shards of the cache separately
+ * would not let more readers in.
+ */
+struct delta_base_cache_lru_list {
 	struct delta_base_cache_lru_list *prev;
 	struct delta_base_cache_lru_list *next;
-} delta_base_cache_lru = { &delta_base_cache_lru, &delta_base_cache_lru };
+};
 
-static struct delta_base_cache_entry {
-	struct delta_base_cache_lru_list lru;
-	void *data;
+struct delta_base_cache_key {
 	struct packed_git *p;
 	off_t base_offset;
+};
+
+struct delta_base_cache_entry {
+	struct hashmap_entry ent;
+	struct delta_base_cache_key key;
+	struct delta_base_cache_lru_list lru;
+	void *data;
 	unsigned long size;
 	enum object_type type;
-} delta_base_cache[MAX_DELTA_CACHE];
+	unsigned protected:1;
+};
+
+#define DELTA_BASE_CACHE_ENTRY(l) ((struct delta_base_cache_entry *) \
+	((char *)(l) - offsetof(struct delta_base_cache_entry, lru)))
+
+static struct hashmap delta_base_cache;
+static size_t delta_base_cached;
+static size_t delta_base_protected;
+
+static struct delta_base_cache_lru_list delta_base_probation = {
+	&delta_base_probation, &delta_base_probation
+};
+static struct delta_base_cache_lru_list delta_base_protection = {
+	&delta_base_protection, &delta_base_protection
+};
+
+static const char delta_base_cache_trace_key[] = "GIT_TRACE_DELTA_BASE_CACHE";
+
+static struct delta_base_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long rejected;
+} delta_base_cache_stats;
+
+static void report_delta_base_cache_stats(void)
+{
+	struct delta_base_cache_stats *s = &delta_base_cache_stats;
+
+	trace_printf_key(delta_base_cache_trace_key,
+			 "delta base cache: %lu hits, %lu misses, "
+			 "%lu evictions, %lu not admitted, "
+			 "%"SZ_FMT" bytes in %u entries\n",
+			 s->hits, s->misses, s->evictions, s->rejected,
+			 sz_fmt(delta_base_cached), delta_base_cache.size);
+}
+
+static int delta_base_cache_cmp(const struct delta_base_cache_entry *e1,
+				const struct delta_base_cache_entry *e2,
+				const void *unused)
+{
+	return e1->key.p != e2->key.p ||
+		e1->key.base_offset != e2->key.base_offset;
+}
 
-static unsigned long pack_entry_hash(struct packed_git *p, off_t base_offset)
+static void init_delta_base_cache(void)
 {
-	unsigned long hash;
+	static int initialized;
 
-	hash = (unsigned long)p + (unsigned long)base_offset;
-	hash += (hash >> 8) + (hash >> 16);
-	return hash % MAX_DELTA_CACHE;
+	if (initialized)
+		return;
+	hashmap_init(&delta_base_cache,
+		     (hashmap_cmp_fn)delta_base_cache_cmp, 0);
+	if (trace_want(delta_base_cache_trace_key))
+		atexit(report_delta_base_cache_stats);
+	initialized = 1;
+}
+
+/* What an entry costs against core.deltaBaseCacheLimit */
+static size_t delta_base_cost(unsigned long size)
+{
+	return size + sizeof(struct delta_base_cache_entry);
+}
+
+static unsigned int pack_entry_hash(struct packed_git *p, off_t base_offset)
+{
+	struct delta_base_cache_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.p = p;
+	key.base_offset = base_offset;
+	return memhash(&key, sizeof(key));
 }
 
 static struct delta_base_cache_entry *
 get_delta_base_cache_entry(struct packed_git *p, off_t base_offset)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	return delta_base_cache + hash;
+	struct delta_base_cache_entry key;
+
+	init_delta_base_cache();
+	hashmap_entry_init(&key, pack_entry_hash(p, base_offset));
+	key.key.p = p;
+	key.key.base_offset = base_offset;
+	return hashmap_get(&delta_base_cache, &key, NULL);
 }
 
-static int eq_delta_base_cache_entry(struct delta_base_cache_entry *ent,
-				     struct packed_git *p, off_t base_offset)
+static int in_delta_base_cache(struct packed_git *p, off_t base_offset)
 {
-	return (ent->data && ent->p == p && ent->base_offset == base_offset);
+	return !!get_delta_base_cache_entry(p, base_offset);
 }
 
-static int in_delta_base_cache(struct packed_git *p, off_t base_offset)
+static void lru_unlink(struct delta_base_cache_lru_list *l)
 {
-	struct delta_base_cache_entry *ent;
-	ent = get_delta_base_cache_entry(p, base_offset);
-	return eq_delta_base_cache_entry(ent, p, base_offset);
+	l->next->prev = l->prev;
+	l->prev->next = l->next;
 }
 
-static void clear_delta_base_cache_entry(struct delta_base_cache_entry *ent)
+static void lru_append(struct delta_base_cache_lru_list *list,
+		       struct delta_base_cache_lru_list *l)
 {
-	ent->data = NULL;
-	ent->lru.next->prev = ent->lru.prev;
-	ent->lru.prev->next = ent->lru.next;
-	delta_base_cached -= ent->size;
+	l->next = list;
+	l->prev = list->prev;
+	list->prev->next = l;
+	list->prev = l;
 }
 
+static void protect_delta_base_cache_entry(struct delta_base_cache_entry *ent)
+{
+	lru_unlink(&ent->lru);
+	lru_append(&delta_base_protection, &ent->lru);
+	if (!ent->protected) {
+		ent->protected = 1;
+		delta_base_protected += delta_base_cost(ent->size);
+	}
+
+	/* Keep room on probation for new bases to prove themselves */
+	while (delta_base_protected > delta_base_cache_limit / 4 * 3) {
+		struct delta_base_cache_entry *f =
+			DELTA_BASE_CACHE_ENTRY(delta_base_protection.next);
+		if (f == ent)
+			break;
+		lru_unlink(&f->lru);
+		lru_append(&delta_base_probation, &f->lru);
+		f->protected = 0;
+		delta_base_protected -= delta_base_cost(f->size);
+	}
+}
+
+/*
+ * Remove the entry from the cache, leaving its data to the caller, who
+ * now owns it.
+ */
+static void detach_delta_base_cache_entry(struct delta_base_cache_entry *ent)
+{
+	hashmap_remove(&delta_base_cache, ent, NULL);
+	lru_unlink(&ent->lru);
+	delta_base_cached -= delta_base_cost(ent->size);
+	if (ent->protected)
+		delta_base_protected -= delta_base_cost(ent->size);
+	free(ent);
+}
+
+static inline void release_delta_base_cache(struct delta_base_cache_entry *ent)
+{
+	free(ent->data);
+	detach_delta_base_cache_entry(ent);
+}
+
+static void *unpack_entry_1(struct packed_git *p, off_t obj_offset,
+			    enum object_type *final_type,
+			    unsigned long *final_size);
+
 static void *cache_or_unpack_entry(struct packed_git *p, off_t base_offset,
-	unsigned long *base_size, enum object_type *type, int keep_cache)
+	unsigned long *base_size, enum object_type *type)
 {
 	struct delta_base_cache_entry *ent;
-	void *ret;
 
 	ent = get_delta_base_cache_entry(p, base_offset);
+	if (!ent)
+		/* not unpack_entry(): we hold the lock already */
+		return unpack_entry_1(p, base_offset, type, base_size);
 
-	if (!eq_delta_base_cache_entry(ent, p, base_offset))
-		return unpack_entry(p, base_offset, type, base_size);
-
-	ret = ent->data;
-
-	if (!keep_cache)
-		clear_delta_base_cache_entry(ent);
-	else
-		ret = xmemdupz(ent->data, ent->size);
+	delta_base_cache_stats.hits++;
+	protect_delta_base_cache_entry(ent);
 	*type = ent->type;
 	*base_size = ent->size;
-	return ret;
-}
-
-static inline void release_delta_base_cache(struct delta_base_cache_entry *ent)
-{
-	if (ent->data) {
-		free(ent->data);
-		ent->data = NULL;
-		ent->lru.next->prev = ent->lru.prev;
-		ent->lru.prev->next = ent->lru.next;
-		delta_base_cached -= ent->size;
-	}
+	return xmemdupz(ent->data, ent->size);
 }
 
 void clear_delta_base_cache(void)
 {
-	unsigned long p;
-	for (p = 0; p < MAX_DELTA_CACHE; p++)
-		release_delta_base_cache(&delta_base_cache[p]);
+	struct delta_base_cache_lru_list *lists[2], *l;
+	int i;
+
+	lists[0] = &delta_base_probation;
+	lists[1] = &delta_base_protection;
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		while ((l = lists[i]->next) != lists[i])
+			release_delta_base_cache(DELTA_BASE_CACHE_ENTRY(l));
 }
 
+/*
+ * Hand the base over to the cache, which frees it if it does not keep
+ * it.  A base that was already found in the cache once comes back
+ * "reused", and is protected.
+ */
 static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
-	void *base, unsigned long base_size, enum object_type type)
+	void *base, unsigned long base_size, enum object_type type,
+	int reused)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	struct delta_base_cache_entry *ent = delta_base_cache + hash;
-	struct delta_base_cache_lru_list *lru;
-
-	release_delta_base_cache(ent);
-	delta_base_cached += base_size;
+	struct delta_base_cache_entry *ent;
+	size_t cost = delta_base_cost(base_size);
 
-	for (lru = delta_base_cache_lru.next;
-	     delta_base_cached > delta_base_cache_limit
-	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
-		struct delta_base_cache_entry *f = (void *)lru;
-		if (f->type == OBJ_BLOB)
-			release_delta_base_cache(f);
+	if (cost > delta_base_cache_limit ||
+	    get_delta_base_cache_entry(p, base_offset)) {
+		/*
+		 * Too large to be worth evicting everything else for,
+		 * or another thread already cached the same base.
+		 */
+		delta_base_cache_stats.rejected++;
+		free(base);
+		return;
 	}
-	for (lru = delta_base_cache_lru.next;
-	     delta_base_cached > delta_base_cache_limit
-	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
-		struct delta_base_cache_entry *f = (void *)lru;
-		release_delta_base_cache(f);
+
+	while (delta_base_cached + cost > delta_base_cache_limit) {
+		struct delta_base_cache_lru_list *victim;
+
+		if (delta_base_probation.next != &delta_base_probation)
+			victim = delta_base_probation.next;
+		else
+			victim = delta_base_protection.next;
+		release_delta_base_cache(DELTA_BASE_CACHE_ENTRY(victim));
+		delta_base_cache_stats.evictions++;
 	}
 
-	ent->p = p;
-	ent->base_offset = base_offset;
+	ent = xmalloc(sizeof(*ent));
+	hashmap_entry_init(ent, pack_entry_hash(p, base_offset));
+	ent->key.p = p;
+	ent->key.base_offset = base_offset;
 	ent->type = type;
 	ent->data = base;
 	ent->size = base_size;
-	ent->lru.next = &delta_base_cache_lru;
-	ent->lru.prev = delta_base_cache_lru.prev;
-	delta_base_cache_lru.prev->next = &ent->lru;
-	delta_base_cache_lru.prev = &ent->lru;
+	ent->protected = 0;
+	hashmap_add(&delta_base_cache, ent);
+	delta_base_cached += cost;
+	lru_append(&delta_base_probation, &ent->lru);
+	if (reused)
+		protect_delta_base_cache_entry(ent);
 }
 
 static void *read_object(const unsigned char *sha1, enum object_type *type,
@@ -2113,8 +2364,9 @@ struct unpack_entry_stack_ent {
 	unsigned long size;
 };
 
-void *unpack_entry(struct packed_git *p, off_t obj_offset,
-		   enum object_type *final_type, unsigned long *final_size)
+static void *unpack_entry_1(struct packed_git *p, off_t obj_offset,
+			    enum object_type *final_type,
+			    unsigned long *final_size)
 {
 	struct pack_window *w_curs = NULL;
 	off_t curpos = obj_offset;
@@ -2136,21 +2388,25 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		struct delta_base_cache_entry *ent;
 
 		ent = get_delta_base_cache_entry(p, curpos);
-		if (eq_delta_base_cache_entry(ent, p, curpos)) {
+		if (ent) {
+			delta_base_cache_stats.hits++;
 			type = ent->type;
 			data = ent->data;
 			size = ent->size;
-			clear_delta_base_cache_entry(ent);
+			detach_delta_base_cache_entry(ent);
 			base_from_cache = 1;
 			break;
 		}
+		delta_base_cache_stats.misses++;
 
 		if (do_check_packed_object_crc && p->index_version > 1) {
-			struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-			unsigned long len = revidx[1].offset - obj_offset;
-			if (check_pack_crc(p, &w_curs, obj_offset, len, revidx->nr)) {
+			uint32_t pos;
+			struct pack_revindex *revidx = find_pack_revindex(p, obj_offset, &pos);
+			unsigned long len = revindex_offset(revidx, pos + 1) - obj_offset;
+			uint32_t nr = revindex_nr(revidx, pos);
+			if (check_pack_crc(p, &w_curs, obj_offset, len, nr)) {
 				const unsigned char *sha1 =
-					nth_packed_object_sha1(p, revidx->nr);
+					nth_packed_object_sha1(p, nr);
 				error("bad packed object CRC for %s",
 				      sha1_to_hex(sha1));
 				mark_bad_packed_object(p, sha1);
@@ -2219,14 +2475,13 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 	while (delta_stack_nr) {
 		void *delta_data;
 		void *base = data;
+		void *external_base = NULL;
+		off_t base_offset = obj_offset;
 		unsigned long delta_size, base_size = size;
 		int i;
 
 		data = NULL;
 
-		if (base)
-			add_delta_base_cache(p, obj_offset, base, base_size, type);
-
 		if (!base) {
 			/*
 			 * We're probably in deep shit, but let's try to fetch
@@ -2234,17 +2489,19 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			 * This is costly but should happen only in the presence
 			 * of a corrupted pack, and is better than failing outright.
 			 */
-			struct revindex_entry *revidx;
+			struct pack_revindex *revidx;
+			uint32_t pos;
 			const unsigned char *base_sha1;
-			revidx = find_pack_revindex(p, obj_offset);
+			revidx = find_pack_revindex(p, obj_offset, &pos);
 			if (revidx) {
-				base_sha1 = nth_packed_object_sha1(p, revidx->nr);
+				base_sha1 = nth_packed_object_sha1(p, revindex_nr(revidx, pos));
 				error("failed to read delta base object %s"
 				      " at offset %"PRIuMAX" from %s",
 				      sha1_to_hex(base_sha1), (uintmax_t)obj_offset,
 				      p->pack_name);
 				mark_bad_packed_object(p, base_sha1);
 				base = read_object(base_sha1, &type, &base_size);
+				external_base = base;
 			}
 		}
 
@@ -2262,26 +2519,39 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			error("failed to unpack compressed delta "
 			      "at offset %"PRIuMAX" from %s",
 			      (uintmax_t)curpos, p->pack_name);
-			data = NULL;
-			continue;
-		}
+		} else {
+			obj_read_pause();
+			data = patch_delta(base, base_size,
+					   delta_data, delta_size,
+					   &size);
+			obj_read_resume();
+
+			/*
+			 * We could not apply the delta; warn the user, but
+			 * keep going. Our failure will be noticed either in
+			 * the next iteration of the loop, or if this is the
+			 * final delta, in the caller when we return NULL.
+			 * Those code paths will take care of making a more
+			 * explicit warning and retrying with another copy
+			 * of the object.
+			 */
+			if (!data)
+				error("failed to apply delta");
 
-		data = patch_delta(base, base_size,
-				   delta_data, delta_size,
-				   &size);
+			free(delta_data);
+		}
 
 		/*
-		 * We could not apply the delta; warn the user, but keep going.
-		 * Our failure will be noticed either in the next iteration of
-		 * the loop, or if this is the final delta, in the caller when
-		 * we return NULL. Those code paths will take care of making
-		 * a more explicit warning and retrying with another copy of
-		 * the object.
+		 * Cache the base only once we are done with it: another
+		 * reader may evict it from the cache while we patch
+		 * without the lock.
 		 */
-		if (!data)
-			error("failed to apply delta");
-
-		free(delta_data);
+		if (external_base)
+			free(external_base);
+		else
+			add_delta_base_cache(p, base_offset, base, base_size,
+					     type, base_from_cache);
+		base_from_cache = 0;
 	}
 
 	*final_type = type;
@@ -2295,6 +2565,17 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 	return data;
 }
 
+void *unpack_entry(struct packed_git *p, off_t obj_offset,
+		   enum object_type *final_type, unsigned long *final_size)
+{
+	void *data;
+
+	obj_read_lock();
+	data = unpack_entry_1(p, obj_offset, final_type, final_size);
+	obj_read_unlock();
+	return data;
+}
+
 const unsigned char *nth_packed_object_sha1(struct packed_git *p,
 					    uint32_t n)
 {
@@ -2451,6 +2732,30 @@ static int fill_pack_entry(const unsigned char *sha1,
 	return 1;
 }
 
+/*
+ * Like fill_midx_entry(), but an entry in a pack that is bad or gone
+ * counts as no usable answer (-1), as fill_pack_entry() would see it.
+ */
+static int fill_midx_pack_entry(const unsigned char *sha1,
+				struct pack_entry *e)
+{
+	int ret = fill_midx_entry(sha1, e);
+
+	if (ret <= 0)
+		return ret;
+	if (e->p->num_bad_objects) {
+		unsigned i;
+		for (i = 0; i < e->p->num_bad_objects; i++)
+			if (!hashcmp(sha1, e->p->bad_object_sha1 + 20 * i))
+				return -1;
+	}
+	if (!is_pack_valid(e->p)) {
+		warning("packfile %s cannot be accessed", e->p->pack_name);
+		return -1;
+	}
+	return 1;
+}
+
 /*
  * Iff a pack file contains the object named by sha1, return true and
  * store its location to e.
@@ -2458,17 +2763,31 @@ static int fill_pack_entry(const unsigned char *sha1,
 static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e)
 {
 	struct packed_git *p;
+	int midx_ret;
 
 	prepare_packed_git();
 	if (!packed_git)
 		return 0;
 
-	if (last_found_pack && fill_pack_entry(sha1, e, last_found_pack))
+	/*
+	 * One lookup answers for every pack the multi-pack index covers;
+	 * unless it could not give a usable answer, only the packs it
+	 * does not cover are left to search one by one.
+	 */
+	midx_ret = fill_midx_pack_entry(sha1, e);
+	if (midx_ret > 0)
+		return 1;
+
+	if (last_found_pack &&
+	    !(midx_ret == 0 && last_found_pack->multi_pack_index) &&
+	    fill_pack_entry(sha1, e, last_found_pack))
 		return 1;
 
 	for (p = packed_git; p; p = p->next) {
 		if (p == last_found_pack)
 			continue; /* we already checked this one */
+		if (midx_ret == 0 && p->multi_pack_index)
+			continue;
 
 		if (fill_pack_entry(sha1, e, p)) {
 			last_found_pack = p;
@@ -2539,7 +2858,8 @@ static int sha1_loose_object_info(const unsigned char *sha1,
 	return 0;
 }
 
-int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+static int do_sha1_object_info_extended(const unsigned char *sha1,
+					struct object_info *oi, unsigned flags)
 {
 	struct cached_object *co;
 	struct pack_entry e;
@@ -2576,7 +2896,7 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	rtype = packed_object_info(e.p, e.offset, oi);
 	if (rtype < 0) {
 		mark_bad_packed_object(e.p, real);
-		return sha1_object_info_extended(real, oi, 0);
+		return do_sha1_object_info_extended(real, oi, 0);
 	} else if (in_delta_base_cache(e.p, e.offset)) {
 		oi->whence = OI_DBCACHED;
 	} else {
@@ -2590,6 +2910,16 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	return 0;
 }
 
+int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+{
+	int ret;
+
+	obj_read_lock();
+	ret = do_sha1_object_info_extended(sha1, oi, flags);
+	obj_read_unlock();
+	return ret;
+}
+
 /* returns enum object_type or negative */
 int sha1_object_info(const unsigned char *sha1, unsigned long *sizep)
 {
@@ -2611,7 +2941,7 @@ static void *read_packed_sha1(const unsigned char *sha1,
 
 	if (!find_pack_entry(sha1, &e))
 		return NULL;
-	data = cache_or_unpack_entry(e.p, e.offset, size, type, 1);
+	data = cache_or_unpack_entry(e.p, e.offset, size, type);
 	if (!data) {
 		/*
 		 * We're probably in deep shit, but let's try to fetch
@@ -2664,8 +2994,10 @@ static void *read_object(const unsigned char *sha1, enum object_type *type,
 		return buf;
 	map = map_sha1_file(sha1, &mapsize);
 	if (map) {
+		obj_read_pause();
 		buf = unpack_sha1_file(map, mapsize, type, size, sha1);
 		munmap(map, mapsize);
+		obj_read_resume();
 		return buf;
 	}
 	reprepare_packed_git();
@@ -2684,12 +3016,16 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 {
 	void *data;
 	const struct packed_git *p;
-	const unsigned char *repl = lookup_replace_object_extended(sha1, flag);
+	const unsigned char *repl;
 
+	obj_read_lock();
+	repl = lookup_replace_object_extended(sha1, flag);
 	errno = 0;
 	data = read_object(repl, type, size);
-	if (data)
+	if (data) {
+		obj_read_unlock();
 		return data;
+	}
 
 	if (errno && errno != ENOENT)
 		die_errno("failed to read object %s", sha1_to_hex(sha1));
@@ -2709,6 +3045,7 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 	if ((p = has_packed_and_bad(repl)) != NULL)
 		die("packed object %s (stored in %s) is corrupt",
 		    sha1_to_hex(repl), p->pack_name);
+	obj_read_unlock();
 
 	return NULL;
 }
@@ -2912,7 +3249,7 @@ static int write_loose_object(const unsigned char *sha1, char *hdr, int hdrlen,
 
 	/* Set it up */
 	memset(&stream, 0, sizeof(stream));
-	git_deflate_init(&stream, zlib_compression_level);
+	git_deflate_init_codec(&stream, zlib_compression_level, object_codec);
 	stream.next_out = compressed;
 	stream.avail_out = sizeof(compressed);
 	git_SHA1_Init(&c);
@@ -3015,13 +3352,15 @@ int has_sha1_pack(const unsigned char *sha1)
 int has_sha1_file(const unsigned char *sha1)
 {
 	struct pack_entry e;
+	int ret = 1;
 
-	if (find_pack_entry(sha1, &e))
-		return 1;
-	if (has_loose_object(sha1))
-		return 1;
-	reprepare_packed_git();
-	return find_pack_entry(sha1, &e);
+	obj_read_lock();
+	if (!find_pack_entry(sha1, &e) && !has_loose_object(sha1)) {
+		reprepare_packed_git();
+		ret = find_pack_entry(sha1, &e);
+	}
+	obj_read_unlock();
+	return ret;
 }
 
 static void check_tree(const void *buf, size_t size)
@@ -0,0 +1,300 @@
+#include "cache.h"
+#include "cache-tree.h"
+#include "tree.h"
+#include "tree-walk.h"
+#include "pathspec.h"
+#include "sparse-index.h"
+
+static int index_sparse = -1;
+
+static int index_sparse_config(const char *var, const char *value, void *cb)
+{
+	if (!strcmp(var, "index.sparse"))
+		index_sparse = git_config_bool(var, value);
+	return 0;
+}
+
+static int want_sparse_index(void)
+{
+	if (index_sparse < 0) {
+		index_sparse = 0;
+		git_config(index_sparse_config, NULL);
+	}
+	return index_sparse;
+}
+
+static struct cache_entry *make_sparse_dir_entry(const char *path, int len,
+						 const unsigned char *sha1)
+{
+	struct cache_entry *ce = xcalloc(1, cache_entry_size(len));
+
+	ce->ce_mode = S_IFDIR;
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = len;
+	memcpy(ce->name, path, len);
+	hashcpy(ce->sha1, sha1);
+	return ce;
+}
+
+static int can_collapse(struct cache_entry **cache, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		const struct cache_entry *ce = cache[i];
+
+		if (!ce_skip_worktree(ce) || ce_stage(ce) ||
+		    (ce->ce_flags & (CE_REMOVE | CE_INTENT_TO_ADD)))
+			return 0;
+	}
+	return 1;
+}
+
+static void free_subtrees(struct cache_tree *it)
+{
+	int i;
+
+	for (i = 0; i < it->subtree_nr; i++) {
+		cache_tree_free(&it->down[i]->cache_tree);
+		free(it->down[i]);
+	}
+	it->subtree_nr = 0;
+}
+
+/*
+ * Collapse what can be of the "nr" entries from "src", all in the
+ * directory "path" (of length "len", with its '/'), whose cache-tree
+ * is "it", moving them down to "dst"; returns how many are left.
+ */
+static int collapse_directory(struct index_state *istate, int dst, int src,
+			      int nr, struct strbuf *path,
+			      struct cache_tree *it)
+{
+	struct cache_entry **cache = istate->cache;
+	int end = src + nr, start = dst;
+	size_t len = path->len;
+
+	if (len && it && 0 <= it->entry_count &&
+	    it->entry_count == nr && has_sha1_file(it->sha1) &&
+	    can_collapse(cache + src, nr)) {
+		int i;
+
+		for (i = src; i < end; i++) {
+			remove_name_hash(istate, cache[i]);
+			free(cache[i]);
+		}
+		cache[dst] = make_sparse_dir_entry(path->buf, len, it->sha1);
+		add_name_hash(istate, cache[dst]);
+		it->entry_count = 1;
+		free_subtrees(it);
+		return 1;
+	}
+
+	while (src < end) {
+		struct cache_entry *ce = cache[src];
+		const char *slash = strchr(ce->name + len, '/');
+		struct cache_tree *sub;
+		int sub_nr;
+
+		if (!slash) {
+			cache[dst++] = cache[src++];
+			continue;
+		}
+		strbuf_add(path, ce->name + len, slash - (ce->name + len));
+		sub = cache_tree_find(it, path->buf + len);
+		strbuf_addch(path, '/');
+		if (sub && 0 <= sub->entry_count) {
+			sub_nr = sub->entry_count;
+		} else {
+			for (sub_nr = 1; src + sub_nr < end; sub_nr++)
+				if (strncmp(cache[src + sub_nr]->name, path->buf,
+					    path->len))
+					break;
+		}
+		dst += collapse_directory(istate, dst, src, sub_nr, path, sub);
+		src += sub_nr;
+		strbuf_setlen(path, len);
+	}
+	if (it && 0 <= it->entry_count)
+		it->entry_count = dst - start;
+	return dst - start;
+}
+
+int convert_to_sparse(struct index_state *istate)
+{
+	struct strbuf path = STRBUF_INIT;
+
+	if (istate->sparse_index || !istate->cache_nr ||
+	    !core_apply_sparse_checkout || !want_sparse_index())
+		return 0;
+	if (istate->split_index)
+		return 0;
+
+	/* the collapsed directories are those of the cache-tree */
+	if (!istate->cache_tree)
+		istate->cache_tree = cache_tree();
+	if (cache_tree_update(istate->cache_tree,
+			      (const struct cache_entry * const *)istate->cache,
+			      istate->cache_nr, WRITE_TREE_SILENT))
+		return 0;
+
+	istate->cache_nr = collapse_directory(istate, 0, 0, istate->cache_nr,
+					      &path, istate->cache_tree);
+	strbuf_release(&path);
+	istate->sparse_index = 1;
+	return 0;
+}
+
+struct expansion {
+	struct cache_entry **cache;
+	int nr, alloc;
+};
+
+static int add_path_to_index(const unsigned char *sha1,
+			     const char *base, int baselen,
+			     const char *path, unsigned int mode,
+			     int stage, void *context)
+{
+	struct expansion *ex = context;
+	struct cache_entry *ce;
+	int len;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+
+	len = strlen(path);
+	ce = xcalloc(1, cache_entry_size(baselen + len));
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(stage) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = baselen + len;
+	memcpy(ce->name, base, baselen);
+	memcpy(ce->name + baselen, path, len + 1);
+	hashcpy(ce->sha1, sha1);
+	ALLOC_GROW(ex->cache, ex->nr + 1, ex->alloc);
+	ex->cache[ex->nr++] = ce;
+	return 0;
+}
+
+/*
+ * The directory "path" of "tree" now has "nr" entries in place of one:
+ * count them in the valid nodes above it, and fill in its own.
+ */
+static void expand_cache_tree(struct cache_tree *it, const char *path,
+			      struct tree *tree, int nr)
+{
+	struct strbuf name = STRBUF_INIT;
+
+	while (it) {
+		const char *slash = strchr(path, '/');
+		struct cache_tree *sub;
+
+		if (0 <= it->entry_count)
+			it->entry_count += nr - 1;
+		strbuf_reset(&name);
+		strbuf_add(&name, path, slash - path);
+		sub = cache_tree_find(it, name.buf);
+		if (!slash[1]) {
+			if (sub && 0 <= sub->entry_count)
+				prime_cache_tree(&cache_tree_sub(it, name.buf)->cache_tree,
+						 tree);
+			break;
+		}
+		it = sub;
+		path = slash + 1;
+	}
+	strbuf_release(&name);
+}
+
+void ensure_full_index(struct index_state *istate)
+{
+	struct expansion ex;
+	struct pathspec ps;
+	int i;
+
+	if (!istate->sparse_index)
+		return;
+
+	memset(&ex, 0, sizeof(ex));
+	memset(&ps, 0, sizeof(ps));
+	ex.alloc = alloc_nr(istate->cache_nr);
+	ex.cache = xcalloc(ex.alloc, sizeof(*ex.cache));
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		struct tree *tree;
+		int nr = ex.nr;
+
+		if (!S_ISSPARSEDIR(ce->ce_mode)) {
+			ALLOC_GROW(ex.cache, ex.nr + 1, ex.alloc);
+			ex.cache[ex.nr++] = ce;
+			continue;
+		}
+		tree = lookup_tree(ce->sha1);
+		if (!tree || read_tree_recursive(tree, ce->name, ce_namelen(ce),
+						 0, &ps, add_path_to_index, &ex))
+			die("unable to expand sparse directory '%s'", ce->name);
+		expand_cache_tree(istate->cache_tree, ce->name, tree, ex.nr - nr);
+		remove_name_hash(istate, ce);
+		free(ce);
+		while (nr < ex.nr)
+			add_name_hash(istate, ex.cache[nr++]);
+	}
+
+	free(istate->cache);
+	istate->cache = ex.cache;
+	istate->cache_nr = ex.nr;
+	istate->cache_alloc = ex.alloc;
+	istate->sparse_index = 0;
+}
+
+/* Whether "tree" has the subtree "sha1" at "path" (which ends with '/') */
+static int tree_has_directory(struct tree *tree, const char *path,
+			      const unsigned char *sha1)
+{
+	while (tree) {
+		const char *slash = strchr(path, '/');
+		struct tree_desc desc;
+		struct name_entry entry;
+		int found = 0;
+
+		if (!slash || parse_tree(tree))
+			return 0;
+		init_tree_desc(&desc, tree->buffer, tree->size);
+		while (tree_entry(&desc, &entry)) {
+			if (tree_entry_len(&entry) == slash - path &&
+			    !memcmp(entry.path, path, slash - path)) {
+				found = S_ISDIR(entry.mode);
+				break;
+			}
+		}
+		if (!found)
+			return 0;
+		if (!slash[1])
+			return !hashcmp(entry.sha1, sha1);
+		tree = lookup_tree(entry.sha1);
+		path = slash + 1;
+	}
+	return 0;
+}
+
+int sparse_index_matches_tree(struct index_state *istate,
+			      const unsigned char *tree_sha1)
+{
+	struct tree *tree;
+	int i;
+
+	if (!istate->sparse_index)
+		return 0;
+	if (istate->cache_tree && 0 <= istate->cache_tree->entry_count &&
+	    !hashcmp(istate->cache_tree->sha1, tree_sha1))
+		return 1;
+
+	tree = lookup_tree(tree_sha1);
+	for (i = 0; i < istate->cache_nr; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+
+		if (S_ISSPARSEDIR(ce->ce_mode) &&
+		    !tree_has_directory(tree, ce->name, ce->sha1))
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+/*
+ * With index.sparse, in a sparse checkout, a directory whose entries
+ * are all skip-worktree is written as one entry, the tree of the
+ * directory (see S_ISSPARSEDIR), so that the index grows with the
+ * sparse checkout instead of the whole repository. The "sdir"
+ * extension marks such an index.
+ *
+ * A command that has not been taught about these entries gets the
+ * index expanded as it is read (command_requires_full_index).
+ */
+
+/*
+ * Collapse the directories that can be, if the index is to be
+ * sparse; this may write the tree objects that the cache-tree lacks.
+ * Returns 0 even if nothing was collapsed, -1 on error.
+ */
+extern int convert_to_sparse(struct index_state *istate);
+
+/* Replace the sparse directory entries by the entries of their trees */
+extern void ensure_full_index(struct index_state *istate);
+
+/*
+ * Whether each sparse directory entry is the same tree in "tree_sha1"
+ * (no if the index is not sparse).
+ */
+extern int sparse_index_matches_tree(struct index_state *istate,
+				     const unsigned char *tree_sha1);
+
+#endif
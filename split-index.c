@@ -0,0 +1,234 @@
+#include "cache.h"
+#include "split-index.h"
+#include "ewah/ewok.h"
+
+struct split_index *init_split_index(struct index_state *istate)
+{
+	if (!istate->split_index)
+		istate->split_index = xcalloc(1, sizeof(*istate->split_index));
+	return istate->split_index;
+}
+
+void discard_split_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+
+	if (!si)
+		return;
+	istate->split_index = NULL;
+	if (si->base) {
+		discard_index(si->base);
+		free(si->base);
+	}
+	if (si->delete_bitmap)
+		ewah_free(si->delete_bitmap);
+	free(si);
+}
+
+/*
+ * The "link" extension is the SHA-1 of the shared index, followed by
+ * the EWAH bitmap of its entries that were removed (nothing if none
+ * was).
+ */
+int read_link_extension(struct index_state *istate,
+			const void *data_, unsigned long sz)
+{
+	const unsigned char *data = data_;
+	struct split_index *si;
+	int ret;
+
+	if (sz < 20)
+		return error("corrupt link extension (too short)");
+	si = init_split_index(istate);
+	hashcpy(si->base_sha1, data);
+	data += 20;
+	sz -= 20;
+	if (!sz)
+		return 0;
+	if (si->delete_bitmap)
+		ewah_free(si->delete_bitmap);
+	si->delete_bitmap = ewah_new();
+	ret = ewah_read_mmap(si->delete_bitmap, (void *)data, sz);
+	if (ret != sz) {
+		ewah_free(si->delete_bitmap);
+		si->delete_bitmap = NULL;
+		return error("corrupt delete bitmap in link extension");
+	}
+	return 0;
+}
+
+static int write_strbuf(void *sb, const void *buf, size_t len)
+{
+	strbuf_add(sb, buf, len);
+	return len;
+}
+
+void write_link_extension(struct strbuf *sb, struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+
+	strbuf_add(sb, si->base_sha1, 20);
+	if (si->delete_bitmap)
+		ewah_serialize_to(si->delete_bitmap, write_strbuf, sb);
+}
+
+static struct cache_entry *dup_entry(const struct cache_entry *ce)
+{
+	unsigned int size = ce_size(ce);
+	struct cache_entry *new = xmalloc(size);
+
+	memcpy(new, ce, size);
+	return new;
+}
+
+static int compare_entries(const struct cache_entry *a,
+			   const struct cache_entry *b)
+{
+	return cache_name_stage_compare(a->name, ce_namelen(a), ce_stage(a),
+					b->name, ce_namelen(b), ce_stage(b));
+}
+
+void merge_base_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base = si->base;
+	struct cache_entry **delta = istate->cache;
+	unsigned int delta_nr = istate->cache_nr;
+	struct bitmap *deleted = NULL;
+	unsigned int i = 0, j = 0, nr = 0;
+
+	if (si->delete_bitmap)
+		deleted = ewah_to_bitmap(si->delete_bitmap);
+	istate->cache_alloc = alloc_nr(base->cache_nr + delta_nr);
+	istate->cache = xcalloc(istate->cache_alloc, sizeof(*istate->cache));
+
+	/* both are sorted; an entry of the index file replaces its base */
+	while (i < base->cache_nr || j < delta_nr) {
+		int cmp;
+
+		if (i < base->cache_nr && deleted && bitmap_get(deleted, i)) {
+			i++;
+			continue;
+		}
+		if (i >= base->cache_nr)
+			cmp = 1;
+		else if (j >= delta_nr)
+			cmp = -1;
+		else
+			cmp = compare_entries(base->cache[i], delta[j]);
+		if (cmp < 0) {
+			istate->cache[nr++] = dup_entry(base->cache[i++]);
+			continue;
+		}
+		if (!cmp)
+			i++;
+		istate->cache[nr++] = delta[j++];
+	}
+	istate->cache_nr = nr;
+	free(delta);
+	if (deleted)
+		bitmap_free(deleted);
+	if (si->delete_bitmap) {
+		ewah_free(si->delete_bitmap);
+		si->delete_bitmap = NULL;
+	}
+}
+
+/* The same as far as the index file is concerned */
+static int same_entry(const struct cache_entry *a, const struct cache_entry *b)
+{
+	const unsigned int ondisk_flags = CE_STAGEMASK | CE_VALID |
+		CE_EXTENDED_FLAGS;
+
+	return a->ce_mode == b->ce_mode &&
+		(a->ce_flags & ondisk_flags) == (b->ce_flags & ondisk_flags) &&
+		!hashcmp(a->sha1, b->sha1) &&
+		!memcmp(&a->ce_stat_data, &b->ce_stat_data,
+			sizeof(a->ce_stat_data)) &&
+		ce_namelen(a) == ce_namelen(b) &&
+		!memcmp(a->name, b->name, ce_namelen(a));
+}
+
+int prepare_to_write_split_index(struct index_state *istate,
+				 struct cache_entry ***delta_p, int *delta_nr)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base = si->base;
+	struct cache_entry **delta = NULL;
+	unsigned int i = 0, j = 0;
+	int nr = 0, alloc = 0, deleted = 0;
+
+	if (si->delete_bitmap)
+		ewah_free(si->delete_bitmap);
+	si->delete_bitmap = ewah_new();
+
+	while (i < base->cache_nr || j < istate->cache_nr) {
+		struct cache_entry *ce = NULL;
+		int cmp;
+
+		if (j < istate->cache_nr) {
+			ce = istate->cache[j];
+			if (ce->ce_flags & CE_REMOVE) {
+				j++;
+				continue;
+			}
+		}
+		if (i >= base->cache_nr)
+			cmp = 1;
+		else if (!ce)
+			cmp = -1;
+		else
+			cmp = compare_entries(base->cache[i], ce);
+
+		if (cmp < 0) {
+			ewah_set(si->delete_bitmap, i++);
+			deleted++;
+			continue;
+		}
+		if (!cmp && same_entry(base->cache[i], ce)) {
+			i++;
+			j++;
+			continue;
+		}
+		if (!cmp)
+			i++;
+		ALLOC_GROW(delta, nr + 1, alloc);
+		delta[nr++] = ce;
+		j++;
+	}
+	*delta_p = delta;
+	*delta_nr = nr;
+	return nr + deleted;
+}
+
+void finish_writing_split_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+
+	if (si->delete_bitmap) {
+		ewah_free(si->delete_bitmap);
+		si->delete_bitmap = NULL;
+	}
+}
+
+void set_split_index_base(struct index_state *istate, const unsigned char *sha1)
+{
+	struct split_index *si = init_split_index(istate);
+	struct index_state *base;
+	unsigned int i;
+
+	if (si->base)
+		discard_index(si->base);
+	else
+		si->base = xcalloc(1, sizeof(*si->base));
+	base = si->base;
+	base->cache_alloc = alloc_nr(istate->cache_nr);
+	base->cache = xcalloc(base->cache_alloc, sizeof(*base->cache));
+	for (i = 0; i < istate->cache_nr; i++) {
+		if (istate->cache[i]->ce_flags & CE_REMOVE)
+			continue;
+		base->cache[base->cache_nr++] = dup_entry(istate->cache[i]);
+	}
+	base->initialized = 1;
+	hashcpy(si->base_sha1, sha1);
+}
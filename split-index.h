@@ -0,0 +1,52 @@
+#ifndef SPLIT_INDEX_H
+#define SPLIT_INDEX_H
+
+struct ewah_bitmap;
+
+/*
+ * With a split index, most entries live in a shared index,
+ * $GIT_DIR/sharedindex.<SHA-1>, that is rewritten only now and then;
+ * the index file itself has the entries that were added or changed
+ * since, and in its "link" extension the SHA-1 of the shared index
+ * and which of its entries are gone.
+ */
+struct split_index {
+	unsigned char base_sha1[20];
+	/* the entries of the shared index, as written */
+	struct index_state *base;
+	/* positions in "base" of the entries that were removed */
+	struct ewah_bitmap *delete_bitmap;
+};
+
+extern struct split_index *init_split_index(struct index_state *istate);
+extern void discard_split_index(struct index_state *istate);
+
+extern int read_link_extension(struct index_state *istate,
+			       const void *data, unsigned long sz);
+extern void write_link_extension(struct strbuf *sb,
+				 struct index_state *istate);
+
+/*
+ * Replace the entries read from the index file by the merge of the
+ * shared index (split_index->base) with them.
+ */
+extern void merge_base_index(struct index_state *istate);
+
+/*
+ * Compute the entries that differ from the shared index, and the
+ * delete bitmap. Returns the number of changes against the shared
+ * index; "delta" is to be freed by the caller.
+ */
+extern int prepare_to_write_split_index(struct index_state *istate,
+					struct cache_entry ***delta,
+					int *delta_nr);
+extern void finish_writing_split_index(struct index_state *istate);
+
+/*
+ * Make "base" a copy of the current entries, which were just written
+ * as the shared index "sha1".
+ */
+extern void set_split_index_base(struct index_state *istate,
+				 const unsigned char *sha1);
+
+#endif
@@ -274,4 +274,48 @@ test_expect_success 'checkout with --ignore-skip-worktree-bits' '
 	git diff --exit-code HEAD
 '
 
+test_expect_success 'cone mode checks out what the patterns match' '
+	echo "/*" >.git/info/sparse-checkout &&
+	git checkout -f top &&
+	cat >cone-patterns <<-\EOF &&
+	/*
+	!/*/
+	/sub/
+	EOF
+	cp cone-patterns .git/info/sparse-checkout &&
+	read_tree_u_must_succeed -m -u HEAD &&
+	git ls-files -t >expected.cone &&
+	grep "^S subsub/added" expected.cone &&
+	echo "/*" >.git/info/sparse-checkout &&
+	read_tree_u_must_succeed -m -u HEAD &&
+	test_config core.sparseCheckoutCone true &&
+	cp cone-patterns .git/info/sparse-checkout &&
+	read_tree_u_must_succeed -m -u HEAD 2>err &&
+	test_must_be_empty err &&
+	git ls-files -t >result &&
+	test_cmp expected.cone result &&
+	test_path_is_missing subsub/added &&
+	test -f sub/added
+'
+
+test_expect_success 'cone mode falls back on other patterns' '
+	test_config core.sparseCheckoutCone true &&
+	echo sub >.git/info/sparse-checkout &&
+	read_tree_u_must_succeed -m -u HEAD 2>err &&
+	grep "not those of the cone mode" err &&
+	git ls-files -t >result &&
+	grep "^H sub/added" result &&
+	grep "^S init.t" result
+'
+
+test_expect_success 'skip-worktree bits changed by hand are set again' '
+	test_config core.sparseCheckoutCone true &&
+	cp cone-patterns .git/info/sparse-checkout &&
+	read_tree_u_must_succeed -m -u HEAD &&
+	git update-index --no-skip-worktree subsub/added &&
+	read_tree_u_must_succeed -m -u HEAD &&
+	git ls-files -t >result &&
+	test_cmp expected.cone result
+'
+
 test_done
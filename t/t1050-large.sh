@@ -139,6 +139,29 @@ test_expect_success 'repack' '
 	git repack -ad
 '
 
+test_expect_success 'add and repack large files deflated on threads' '
+	test_create_repo threaded &&
+	(
+		cd threaded &&
+		git config pack.writeThreads 3 &&
+		test-genrandom large 1200000 >large &&
+		cat large large >larger &&
+		git add large larger &&
+		git commit -q -m large &&
+		rm large larger &&
+		git checkout large larger &&
+		test-genrandom large 1200000 >expect &&
+		test_cmp expect large &&
+		cat expect expect >expect2 &&
+		test_cmp expect2 larger &&
+		git repack -adF &&
+		rm large larger &&
+		git checkout large larger &&
+		test_cmp expect large &&
+		test_cmp expect2 larger
+	)
+'
+
 test_expect_success 'pack-objects with large loose object' '
 	SHA1=`git hash-object huge` &&
 	test_create_repo loose &&
@@ -0,0 +1,124 @@
+#!/bin/sh
+
+test_description='sparse index
+
+Compare what commands see in a sparse checkout whose index collapses
+the directories outside of it (sparse-index) with the same sparse
+checkout using a full index (full-index).'
+
+. ./test-lib.sh
+
+run_both () {
+	(cd full-index && "$@" >../full-actual 2>&1) &&
+	(cd sparse-index && "$@" >../sparse-actual 2>&1) &&
+	test_cmp full-actual sparse-actual
+}
+
+test_expect_success 'setup' '
+	mkdir -p in/sub out/deep/er other &&
+	for f in in/a in/sub/b out/c out/deep/d out/deep/er/e other/f top
+	do
+		echo $f >$f || return 1
+	done &&
+	git add . &&
+	git commit -m initial &&
+	echo changed >out/deep/d &&
+	git commit -am "change out" &&
+	git clone -n . full-index &&
+	git clone -n . sparse-index &&
+	git -C sparse-index config index.sparse true &&
+	for repo in full-index sparse-index
+	do
+		git -C $repo config core.sparseCheckout true &&
+		cat >$repo/.git/info/sparse-checkout <<-\EOF &&
+		/in/
+		/top
+		EOF
+		git -C $repo checkout -q master || return 1
+	done
+'
+
+test_expect_success 'directories outside the sparse checkout are collapsed' '
+	(cd sparse-index && test-dump-sparse-index) >sparse-actual &&
+	head -n 1 sparse-actual >head &&
+	echo sparse >expect &&
+	test_cmp expect head &&
+	grep "^040000 $(git rev-parse HEAD:out) out/\$" sparse-actual &&
+	grep "^040000 $(git rev-parse HEAD:other) other/\$" sparse-actual &&
+	! grep "out/c" sparse-actual &&
+	(cd full-index && test-dump-sparse-index) >full-actual &&
+	head -n 1 full-actual >head &&
+	echo full >expect &&
+	test_cmp expect head
+'
+
+test_expect_success 'other commands see every entry' '
+	run_both git ls-files -s -v &&
+	run_both git diff HEAD~1 --stat
+'
+
+test_expect_success 'status' '
+	run_both git status --porcelain &&
+	run_both git status &&
+	(cd sparse-index && test-dump-sparse-index) >actual &&
+	grep "^040000 .* out/\$" actual
+'
+
+test_expect_success 'status with staged changes' '
+	for repo in full-index sparse-index
+	do
+		echo more >>$repo/in/a &&
+		echo new >$repo/in/new &&
+		git -C $repo add in || return 1
+	done &&
+	run_both git status --porcelain &&
+	run_both git status -s in &&
+	run_both git status -s out
+'
+
+test_expect_success 'status with files in a collapsed directory' '
+	for repo in full-index sparse-index
+	do
+		mkdir $repo/out &&
+		echo untracked >$repo/out/untracked &&
+		echo tracked >$repo/out/c || return 1
+	done &&
+	run_both git status --porcelain -uall &&
+	rm -r full-index/out sparse-index/out
+'
+
+test_expect_success 'commit and checkout keep it sparse' '
+	run_both git commit -q -m in &&
+	run_both git status --porcelain &&
+	run_both git checkout -q HEAD~2 &&
+	run_both git status --porcelain &&
+	run_both git ls-files -s &&
+	(cd sparse-index && test-dump-sparse-index) >actual &&
+	grep "^040000 $(git rev-parse HEAD~1:out) out/\$" actual &&
+	run_both git checkout -q master &&
+	(cd sparse-index && test-dump-sparse-index) >actual &&
+	grep "^040000 $(git rev-parse HEAD:out) out/\$" actual
+'
+
+test_expect_success 'status against a tree with other collapsed directories' '
+	run_both git reset -q --soft HEAD~2 &&
+	run_both git status --porcelain &&
+	run_both git reset -q --soft master
+'
+
+test_expect_success 'the cache-tree is complete once expanded' '
+	(cd sparse-index && test-dump-cache-tree) >actual &&
+	! grep "#(ref)" actual
+'
+
+test_expect_success 'without index.sparse, the index is full again' '
+	git -C sparse-index config index.sparse false &&
+	git -C sparse-index update-index --force-remove in/new &&
+	(cd sparse-index && test-dump-sparse-index) >actual &&
+	head -n 1 actual >head &&
+	echo full >expect &&
+	test_cmp expect head &&
+	grep "out/deep/er/e" actual
+'
+
+test_done
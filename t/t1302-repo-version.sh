@@ -67,4 +67,66 @@ test_expect_success 'gitdir required mode' '
 	)
 '
 
+test_expect_success 'extensions are ignored in version 0' '
+	test_create_repo v0-ext &&
+	(
+		cd v0-ext &&
+		git config extensions.unknownExtension true &&
+		git rev-parse --git-dir
+	)
+'
+
+test_expect_success 'unknown extensions are refused in version 1' '
+	test_create_repo v1-ext &&
+	(
+		cd v1-ext &&
+		git config core.repositoryformatversion 1 &&
+		git rev-parse --git-dir &&
+		git config extensions.unknownExtension true &&
+		test_must_fail git rev-parse --git-dir 2>err &&
+		grep "unknown repository extension.*unknownextension" err
+	)
+'
+
+test_expect_success 'unknown object codecs are refused' '
+	test_create_repo v1-bogus-codec &&
+	(
+		cd v1-bogus-codec &&
+		git config extensions.objectCodec bogus &&
+		git config core.repositoryformatversion 1 &&
+		test_must_fail git rev-parse --git-dir
+	)
+'
+
+test_expect_success !ZSTD 'zstd objects are refused without zstd support' '
+	test_create_repo v1-zstd &&
+	(
+		cd v1-zstd &&
+		git config extensions.objectCodec zstd &&
+		git config core.repositoryformatversion 1 &&
+		test_must_fail git rev-parse --git-dir
+	)
+'
+
+test_expect_success 'zlib objects are fine in version 1' '
+	test_create_repo v1-zlib &&
+	(
+		cd v1-zlib &&
+		git config extensions.objectCodec zlib &&
+		git config core.repositoryformatversion 1 &&
+		test_commit one &&
+		git fsck
+	)
+'
+
+test_expect_success 'reinitializing keeps the repository version' '
+	echo 1 >expect &&
+	(
+		cd v1-zlib &&
+		git init &&
+		git config core.repositoryformatversion >../actual
+	) &&
+	test_cmp expect actual
+'
+
 test_done
@@ -0,0 +1,94 @@
+#!/bin/sh
+
+test_description='references stored in a stack of reftables'
+. ./test-lib.sh
+
+test_expect_success setup '
+	git config core.refStorage reftable &&
+	test_commit A &&
+	git tag -a -m "annotated A" annotated &&
+	git checkout -b side &&
+	test_commit B &&
+	git checkout master &&
+	test_commit C
+'
+
+test_expect_success 'references are written to tables' '
+	test_path_is_file .git/reftable/tables.list &&
+	test_path_is_missing .git/refs/heads/master &&
+	test_path_is_missing .git/refs/heads/side &&
+	test_path_is_missing .git/refs/tags/A &&
+	test_path_is_missing .git/packed-refs &&
+	cat >expect <<-EOF &&
+	$(git rev-parse C) refs/heads/master
+	$(git rev-parse B) refs/heads/side
+	$(git rev-parse A) refs/tags/A
+	$(git rev-parse B) refs/tags/B
+	$(git rev-parse C) refs/tags/C
+	$(git rev-parse refs/tags/annotated) refs/tags/annotated
+	$(git rev-parse A) refs/tags/annotated^{}
+	EOF
+	git show-ref -d >actual &&
+	test_cmp expect actual &&
+	git rev-parse --verify side^{commit} &&
+	git fsck
+'
+
+test_expect_success 'deleted references stay deleted' '
+	git branch doomed &&
+	git branch -d doomed &&
+	test_must_fail git rev-parse --verify refs/heads/doomed &&
+	git update-ref -d refs/tags/B &&
+	test_must_fail git show-ref --verify refs/tags/B &&
+	git for-each-ref --format="%(refname)" refs/tags/ >actual &&
+	printf "refs/tags/%s\n" A C annotated >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'names conflicting with references in tables' '
+	git branch dir/ref &&
+	test_must_fail git branch dir &&
+	test_must_fail git branch side/ref &&
+	git branch -d dir/ref &&
+	git branch dir &&
+	git branch -d dir
+'
+
+test_expect_success 'the stack stays shallow' '
+	for i in $(test_seq 100)
+	do
+		git update-ref refs/heads/many/$i HEAD || return 1
+	done &&
+	test $(wc -l <.git/reftable/tables.list) -le 8 &&
+	test $(git for-each-ref refs/heads/many/ | wc -l) = 100 &&
+	git pack-refs --all &&
+	test_line_count = 1 .git/reftable/tables.list &&
+	test $(ls .git/reftable/*.ref | wc -l) = 1 &&
+	test $(git for-each-ref refs/heads/many/ | wc -l) = 100
+'
+
+test_expect_success 'packed-refs is moved to the stack' '
+	git init migrate &&
+	(
+		cd migrate &&
+		test_commit one &&
+		for i in $(test_seq 2000)
+		do
+			echo "$(git rev-parse one) refs/heads/packed/$i"
+		done | sort -k 2 >>.git/packed-refs &&
+		git config core.refStorage reftable &&
+		git branch new &&
+		test_path_is_missing .git/packed-refs &&
+		test_path_is_file .git/reftable/tables.list &&
+		git rev-parse --verify packed/1 &&
+		git rev-parse --verify packed/999 &&
+		git rev-parse --verify packed/2000 &&
+		git rev-parse --verify new &&
+		test $(git for-each-ref refs/heads/packed/ | wc -l) = 2000 &&
+		git update-ref -d refs/heads/packed/1500 &&
+		test_must_fail git rev-parse --verify packed/1500 &&
+		test $(git for-each-ref refs/heads/packed/ | wc -l) = 1999
+	)
+'
+
+test_done
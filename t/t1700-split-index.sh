@@ -0,0 +1,170 @@
+#!/bin/sh
+
+test_description='split index mode'
+
+. ./test-lib.sh
+
+shared_index () {
+	ls .git/sharedindex.* 2>/dev/null
+}
+
+test_expect_success 'setup' '
+	for i in 1 2 3 4 5 6 7 8 9 10
+	do
+		echo $i >file$i || return 1
+	done &&
+	git add file* &&
+	git commit -m initial &&
+	git ls-files -s >ls-files.expect &&
+	git config splitIndex.maxPercentChange 50 &&
+	cat >.git/info/exclude <<-\EOF
+	*expect
+	*actual
+	tree
+	EOF
+'
+
+test_expect_success 'enable split index' '
+	test -z "$(shared_index)" &&
+	git update-index --split-index &&
+	shared_index >shared.expect &&
+	test_line_count = 1 shared.expect &&
+	git ls-files -s >ls-files.actual &&
+	test_cmp ls-files.expect ls-files.actual
+'
+
+test_expect_success 'the index file only has what changed' '
+	test $(wc -c <.git/index) -lt $(wc -c <$(shared_index)) &&
+	echo changed >file1 &&
+	git update-index file1 &&
+	shared_index >shared.actual &&
+	test_cmp shared.expect shared.actual &&
+	git ls-files -s file1 >actual &&
+	echo "100644 $(git hash-object file1) 0	file1" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'added and removed entries' '
+	: >new &&
+	git update-index --add new &&
+	git update-index --force-remove file2 &&
+	git ls-files >actual &&
+	cat >expect <<-\EOF &&
+	file1
+	file10
+	file3
+	file4
+	file5
+	file6
+	file7
+	file8
+	file9
+	new
+	EOF
+	test_cmp expect actual &&
+	shared_index >shared.actual &&
+	test_cmp shared.expect shared.actual
+'
+
+test_expect_success 'too many changes rewrite the shared index' '
+	git -c splitIndex.maxPercentChange=100 update-index --add --remove \
+		file3 file4 file5 &&
+	shared_index >shared.actual &&
+	test_cmp shared.expect shared.actual &&
+	rm file3 file4 file5 &&
+	git -c splitIndex.maxPercentChange=10 update-index --remove \
+		file3 file4 file5 &&
+	shared_index >shared.actual &&
+	! test_cmp shared.expect shared.actual &&
+	git ls-files >actual &&
+	cat >expect <<-\EOF &&
+	file1
+	file10
+	file6
+	file7
+	file8
+	file9
+	new
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'porcelain commands keep working' '
+	git reset --hard &&
+	git ls-files -s >ls-files.actual &&
+	test_cmp ls-files.expect ls-files.actual &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual &&
+	echo more >file6 &&
+	git commit -a -m "change file6" &&
+	git diff --cached --exit-code &&
+	git checkout HEAD^ &&
+	git ls-files -s >ls-files.actual &&
+	test_cmp ls-files.expect ls-files.actual &&
+	git checkout - &&
+	test $(wc -c <.git/index) -lt $(wc -c <$(shared_index | tail -n 1))
+'
+
+test_expect_success 'disable split index' '
+	git update-index --no-split-index &&
+	test_must_fail grep -q link .git/index &&
+	git ls-files -s >ls-files.actual &&
+	git ls-tree -r HEAD >tree &&
+	test_line_count = $(wc -l <tree) ls-files.actual
+'
+
+test_expect_success 'core.splitIndex splits the index of any command' '
+	test_config core.splitIndex true &&
+	echo again >file7 &&
+	git add file7 &&
+	grep -q link .git/index &&
+	git diff --cached --name-only >actual &&
+	echo file7 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'core.splitIndex=false writes a full index' '
+	test_config core.splitIndex false &&
+	git reset --hard &&
+	test_must_fail grep -q link .git/index &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'an empty shared index is replaced once entries come' '
+	git init empty &&
+	(
+		cd empty &&
+		git update-index --split-index &&
+		shared_index >shared.empty &&
+		test_line_count = 1 shared.empty &&
+		for i in 1 2 3 4 5 6 7 8 9 10
+		do
+			echo $i >file$i || return 1
+		done &&
+		git update-index --add file* &&
+		shared_index >shared.actual &&
+		test_line_count = 2 shared.actual &&
+		shared=$(shared_index | grep -v -f shared.empty) &&
+		test $(wc -c <.git/index) -lt $(wc -c <$shared) &&
+		shared_index >shared.expect &&
+		echo changed >file1 &&
+		git update-index file1 &&
+		shared_index >shared.actual &&
+		test_cmp shared.expect shared.actual
+	)
+'
+
+test_expect_success '--split-index again writes a new shared index' '
+	(
+		cd empty &&
+		git update-index --split-index &&
+		shared_index >shared.actual &&
+		test_line_count = 3 shared.actual &&
+		git ls-files >actual &&
+		ls file* >expect &&
+		test_cmp expect actual
+	)
+'
+
+test_done
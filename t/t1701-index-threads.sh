@@ -0,0 +1,61 @@
+#!/bin/sh
+
+test_description='reading the index with several threads'
+
+. ./test-lib.sh
+
+# The entry offset table is only written for indexes of at least
+# 10000 entries.
+test_expect_success 'setup' '
+	blob=$(echo content | git hash-object -w --stdin) &&
+	awk -v blob=$blob "BEGIN {
+		for (i = 0; i < 12345; i++)
+			printf \"100644 %s\\tdir%d/file%d\\n\", blob, i % 37, i
+	}" >index-info &&
+	git update-index --index-info <index-info &&
+	git write-tree >tree &&
+	git -c index.threads=1 ls-files -s --debug >expect &&
+	test-dump-cache-tree >cache-tree.expect
+'
+
+test_expect_success 'a large index records where its entries are' '
+	grep -q IEOT .git/index &&
+	grep -q EOIE .git/index
+'
+
+for threads in 1 2 3 8
+do
+	test_expect_success "read with $threads threads" '
+		git -c index.threads=$threads ls-files -s --debug >actual &&
+		test_cmp expect actual &&
+		GIT_CONFIG_PARAMETERS="'\''index.threads=$threads'\''" \
+			test-dump-cache-tree >cache-tree.actual &&
+		test_cmp cache-tree.expect cache-tree.actual
+	'
+done
+
+test_expect_success 'index version 4 is read the same' '
+	git update-index --index-version 4 &&
+	grep -q IEOT .git/index &&
+	for threads in 1 2 3 8
+	do
+		git -c index.threads=$threads ls-files -s --debug >actual &&
+		test_cmp expect actual || return 1
+	done
+'
+
+test_expect_success 'index.threads=false writes no offset table' '
+	git -c index.threads=false update-index --index-version 2 &&
+	! grep -q IEOT .git/index &&
+	git ls-files -s --debug >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'small indexes have no offset table' '
+	git read-tree --empty &&
+	git update-index --add --cacheinfo 100644 $blob small &&
+	test -z "$(git ls-files --stage | sed -n 2p)" &&
+	! grep -q IEOT .git/index
+'
+
+test_done
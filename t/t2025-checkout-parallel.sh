@@ -0,0 +1,137 @@
+#!/bin/sh
+
+test_description='checkout with parallel workers'
+
+. ./test-lib.sh
+
+# The worker processes show up in the trace of the command
+workers_used () {
+	grep "checkout--worker" trace >/dev/null
+}
+
+test_expect_success 'setup' '
+	for d in a b c
+	do
+		mkdir $d &&
+		for i in 1 2 3 4 5 6 7 8 9 10
+		do
+			echo "$d $i" >$d/file$i || return 1
+		done
+	done &&
+	echo "#!/bin/sh" >a/script &&
+	chmod +x a/script &&
+	printf "one\ntwo\n" >c/crlf &&
+	echo "c/crlf text eol=crlf" >.gitattributes &&
+	git add . &&
+	test_ln_s_add file1 b/link &&
+	git commit -m initial &&
+	git checkout -b other &&
+	for i in 1 2 3 4 5
+	do
+		echo changed >>a/file$i &&
+		echo changed >>c/file$i || return 1
+	done &&
+	git rm -q b/file1 &&
+	git commit -a -m other &&
+	git checkout master &&
+	git config checkout.workers 3 &&
+	git config checkout.thresholdForParallelism 0 &&
+	cat >.git/info/exclude <<-\EOF
+	actual
+	expect
+	info
+	packet-trace
+	trace
+	EOF
+'
+
+test_expect_success 'clone with workers' '
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git -c checkout.workers=3 \
+		-c checkout.thresholdForParallelism=0 clone -q . clone &&
+	workers_used &&
+	git -c checkout.workers=1 clone -q . serial &&
+	rm -rf clone/.git serial/.git &&
+	diff -r serial clone &&
+	rm -rf clone serial
+'
+
+test_expect_success 'the stat data of the files is recorded' '
+	rm -rf a b &&
+	git checkout -f HEAD &&
+	git diff-files --exit-code &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'switch branches with workers' '
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git checkout other &&
+	workers_used &&
+	git diff-files --exit-code &&
+	test_path_is_missing b/file1 &&
+	echo changed >expect &&
+	tail -n 1 c/file3 >actual &&
+	test_cmp expect actual &&
+	git checkout master &&
+	git diff-files --exit-code
+'
+
+test_expect_success 'files that need conversion are still converted' '
+	rm c/crlf a/script &&
+	git checkout -f HEAD &&
+	printf "one\r\ntwo\r\n" >expect &&
+	test_cmp expect c/crlf &&
+	test -x a/script &&
+	test_when_finished "rm -f b/link" &&
+	test "$(git ls-files -s b/link | cut -c1-6)" = 120000
+'
+
+# "a/FILE1" sorts before "a/file1", so the latter must be written last,
+# by the main process once the workers are done.
+test_expect_success 'paths that fold to the same one are written in order' '
+	blob=$(echo upper | git hash-object -w --stdin) &&
+	printf "100644 %s 0\ta/FILE1\n" $blob >info &&
+	git update-index --index-info <info &&
+	git commit -m "case clash" &&
+	rm -rf a &&
+	rm -f packet-trace &&
+	GIT_TRACE_PACKET="$(pwd)/packet-trace" \
+		git -c core.ignorecase=true checkout -f HEAD &&
+	grep " a/FILE1$" packet-trace &&
+	! grep " a/file1$" packet-trace &&
+	git cat-file blob HEAD:a/file1 >expect &&
+	test_cmp expect a/file1 &&
+	rm -f packet-trace &&
+	git reset --hard HEAD^
+'
+
+test_lazy_prereq FUNNYNAMES '
+	>"newline
+"
+'
+
+test_expect_success FUNNYNAMES 'a path ending in a newline keeps it' '
+	blob=$(echo nl | git hash-object -w --stdin) &&
+	printf "100644 %s 0\tc/nl\n\0" $blob |
+	git update-index -z --index-info &&
+	git commit -m "newline" &&
+	rm -rf c &&
+	git checkout -f HEAD &&
+	test_path_is_missing c/nl &&
+	echo nl >expect &&
+	test_cmp expect "c/nl
+" &&
+	git reset --hard HEAD^
+'
+
+test_expect_success 'few entries are written without workers' '
+	rm -f trace &&
+	rm -rf a &&
+	GIT_TRACE="$(pwd)/trace" \
+		git -c checkout.thresholdForParallelism=100 checkout -f HEAD &&
+	! workers_used &&
+	git diff-files --exit-code
+'
+
+test_done
@@ -151,4 +151,61 @@ test_expect_success 'delete ref while another dangling packed ref' '
 	test_cmp /dev/null result
 '
 
+test_expect_success 'packed-refs is written sorted' '
+	for i in 1 2 3 4 5 6 7 8 9
+	do
+		git update-ref refs/sorted/b$i HEAD &&
+		git update-ref refs/sorted-$i HEAD &&
+		git update-ref refs/sorted/a/$i HEAD || return 1
+	done &&
+	git tag -a -m annotated sorted-tag &&
+	git pack-refs --all &&
+	head -n 1 .git/packed-refs | grep " sorted " &&
+	grep -v "^[#^]" .git/packed-refs | cut -d" " -f2 >names &&
+	LC_ALL=C sort names >sorted &&
+	test_cmp sorted names
+'
+
+test_expect_success 'refs are looked up in the sorted packed-refs' '
+	test_path_is_missing .git/refs/sorted/b5 &&
+	git rev-parse HEAD HEAD HEAD >expect &&
+	git rev-parse refs/sorted/b5 refs/sorted-9 refs/sorted/a/1 >actual &&
+	test_cmp expect actual &&
+	test_must_fail git rev-parse --verify -q refs/sorted/b &&
+	test_must_fail git rev-parse --verify -q refs/sorted/a/10 &&
+	git rev-parse sorted-tag^{commit} >actual &&
+	git rev-parse HEAD >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'iterating part of the sorted packed-refs' '
+	git for-each-ref --format="%(refname)" refs/sorted/a >actual &&
+	for i in 1 2 3 4 5 6 7 8 9
+	do
+		echo refs/sorted/a/$i || return 1
+	done >expect &&
+	test_cmp expect actual &&
+	git show-ref --tags -d sorted-tag >actual &&
+	test_line_count = 2 actual
+'
+
+test_expect_success 'names conflicting with the sorted packed-refs' '
+	test_must_fail git update-ref refs/sorted/a HEAD &&
+	test_must_fail git update-ref refs/sorted/b1/c HEAD &&
+	git update-ref refs/sorted/a0 HEAD &&
+	git update-ref refs/sorted/b1-c HEAD
+'
+
+test_expect_success 'packed-refs without the sorted trait is still read' '
+	{
+		echo "# pack-refs with: peeled fully-peeled " &&
+		grep -v "^[#^]" .git/packed-refs | sort -r
+	} >unsorted &&
+	grep "sorted/a/9" unsorted &&
+	mv unsorted .git/packed-refs &&
+	git rev-parse refs/sorted/a/9 >actual &&
+	git rev-parse HEAD >expect &&
+	test_cmp expect actual
+'
+
 test_done
@@ -400,6 +400,46 @@ test_expect_success 'verify resulting packs' '
 	git verify-pack test-11-*.pack
 '
 
+test_expect_success 'delta chains read back with a small delta base cache' '
+	git init dbc &&
+	(
+		cd dbc &&
+		for i in $(test_seq 20)
+		do
+			test_seq $((i * 100)) >file &&
+			git add file &&
+			test_tick &&
+			git commit -q -m $i || return 1
+		done &&
+		git repack -adf --depth=50 &&
+		git rev-list --objects --all | cut -c1-40 >objs &&
+		git cat-file --batch <objs >expect &&
+		git -c core.deltaBaseCacheLimit=4k cat-file --batch <objs >actual &&
+		test_cmp expect actual &&
+		GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" git log -p >/dev/null &&
+		grep "^delta base cache: [1-9][0-9]* hits" trace
+	)
+'
+
+test_expect_success PTHREADS 'threads inflate and apply deltas without the lock' '
+	(
+		cd dbc &&
+		GIT_TRACE_OBJ_READ_LOCK="$(pwd)/lock-trace" \
+			git pack-objects --threads=4 --no-reuse-delta \
+			--stdout <objs >/dev/null &&
+		grep "^object read lock: released [1-9][0-9]* times, kept 0 times" \
+			lock-trace
+	)
+'
+
+test_expect_success 'objects compressed ahead on threads are written the same' '
+	git -c pack.writeThreads=1 pack-objects --threads=1 --no-reuse-object \
+		--stdout <obj-list >serial.pack &&
+	git -c pack.writeThreads=4 pack-objects --threads=1 --no-reuse-object \
+		--stdout <obj-list >threaded.pack &&
+	test_cmp serial.pack threaded.pack
+'
+
 #
 # WARNING!
 #
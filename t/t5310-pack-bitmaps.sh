@@ -49,6 +49,23 @@ rev_list_tests() {
 		test_cmp expect actual
 	'
 
+	test_expect_success "counting objects via bitmap ($state)" '
+		git rev-list --count --objects other ^master >expect &&
+		git rev-list --use-bitmap-index --count --objects other ^master >actual &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "disk usage via bitmap ($state)" '
+		git rev-list --disk-usage --objects HEAD >expect &&
+		git rev-list --use-bitmap-index --disk-usage --objects HEAD >actual &&
+		test_cmp expect actual &&
+		git rev-list --disk-usage other >expect &&
+		git rev-list --use-bitmap-index --disk-usage other >actual &&
+		test_cmp expect actual &&
+		test_must_fail git rev-list --use-bitmap-index \
+			--count --disk-usage HEAD
+	'
+
 	test_expect_success "enumerate --objects ($state)" '
 		git rev-list --objects --use-bitmap-index HEAD >tmp &&
 		cut -d" " -f1 <tmp >tmp2 &&
@@ -59,6 +76,16 @@ rev_list_tests() {
 		test_cmp expect actual
 	'
 
+	test_expect_success "enumerate --objects with negative tips ($state)" '
+		git rev-list --objects --use-bitmap-index other ^master >tmp &&
+		cut -d" " -f1 <tmp >tmp2 &&
+		sort <tmp2 >actual &&
+		git rev-list --objects other ^master >tmp &&
+		cut -d" " -f1 <tmp >tmp2 &&
+		sort <tmp2 >expect &&
+		test_cmp expect actual
+	'
+
 	test_expect_success "bitmap --objects handles non-commit objects ($state)" '
 		git rev-list --objects --use-bitmap-index HEAD tagged-blob >actual &&
 		grep $blob actual
@@ -67,6 +94,15 @@ rev_list_tests() {
 
 rev_list_tests 'full bitmap'
 
+test_expect_success 'bitmap walk notices a missing blob' '
+	missing=$(echo missing | git hash-object -w --stdin) &&
+	tree=$(printf "100644 blob $missing\tmissing\n" | git mktree) &&
+	commit=$(echo missing | git commit-tree $tree -p HEAD) &&
+	rm -f .git/objects/$(echo $missing | sed "s|^..|&/|") &&
+	test_must_fail git rev-list --objects --use-bitmap-index \
+		$commit --not --all
+'
+
 test_expect_success 'clone from bitmapped repository' '
 	git clone --no-local --bare . clone.git &&
 	git rev-parse HEAD >expect &&
@@ -89,6 +125,21 @@ test_expect_success 'fetch (partial bitmap)' '
 	test_cmp expect actual
 '
 
+test_expect_success 'fetch negotiation is settled from bitmaps' '
+	test_commit negotiation &&
+	tree=$(git --git-dir=clone.git rev-parse HEAD^{tree}) &&
+	unknown=$(echo unknown | GIT_COMMITTER_DATE="1000000000 +0000" \
+		git --git-dir=clone.git commit-tree $tree) &&
+	git --git-dir=clone.git update-ref refs/heads/unknown $unknown &&
+	rm -f trace &&
+	GIT_TRACE_PACKET="$(pwd)/trace" \
+		git --git-dir=clone.git fetch origin master:master &&
+	grep "upload-pack> ACK .* ready" trace &&
+	git rev-parse HEAD >expect &&
+	git --git-dir=clone.git rev-parse HEAD >actual &&
+	test_cmp expect actual
+'
+
 test_expect_success 'incremental repack cannot create bitmaps' '
 	test_commit more-1 &&
 	test_must_fail git repack -d
@@ -112,6 +163,30 @@ test_expect_success 'fetch (full bitmap)' '
 	test_cmp expect actual
 '
 
+test_expect_success 'connectivity check uses bitmaps and notices missing objects' '
+	echo lost >lost &&
+	lost=$(git hash-object lost) &&
+	tree=$(printf "100644 blob %s\tlost\n" $lost | git mktree --missing) &&
+	broken=$(echo broken | git commit-tree $tree -p HEAD) &&
+	{
+		printf "# v2 git bundle\n%s refs/heads/broken\n\n" $broken &&
+		printf "%s\n" $broken $tree | git pack-objects --stdout
+	} >broken.bundle &&
+	test_must_fail git fetch broken.bundle refs/heads/broken:refs/heads/broken 2>err &&
+	grep "missing blob object $lost" err &&
+	test_must_fail git rev-parse --verify refs/heads/broken
+'
+
+test_expect_success 'bitmaps do not depend on the number of threads' '
+	rm -f .git/objects/pack/*.bitmap &&
+	git -c pack.threads=1 repack -adf --window=0 &&
+	cp .git/objects/pack/*.bitmap one.bitmap &&
+	rm -f .git/objects/pack/*.bitmap &&
+	git -c pack.threads=4 repack -adf --window=0 &&
+	cmp one.bitmap .git/objects/pack/*.bitmap &&
+	git rev-list --test-bitmap HEAD
+'
+
 test_lazy_prereq JGIT '
 	type jgit
 '
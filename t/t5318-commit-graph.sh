@@ -0,0 +1,134 @@
+#!/bin/sh
+
+test_description='commit graph'
+. ./test-lib.sh
+
+test_expect_success 'setup full repo' '
+	test_commit base &&
+	for i in $(test_seq 1 5)
+	do
+		test_commit left-$i || return 1
+	done &&
+	git checkout -b right base &&
+	for i in $(test_seq 1 5)
+	do
+		test_commit right-$i || return 1
+	done &&
+	git checkout -b third base &&
+	test_commit third-1 &&
+	git checkout -b fourth base &&
+	test_commit fourth-1 &&
+	git checkout master &&
+	git merge -m merge-two right &&
+	git tag merge-two &&
+	git merge -m octopus third fourth &&
+	git tag octopus &&
+	test_commit tip
+'
+
+test_expect_success 'write graph' '
+	git commit-graph write &&
+	test_path_is_file .git/objects/info/commit-graph
+'
+
+test_expect_success 'verify graph' '
+	git commit-graph verify
+'
+
+graph_git_two_modes() {
+	git -c core.commitGraph=true $1 >output &&
+	git -c core.commitGraph=false $1 >expect &&
+	test_cmp expect output
+}
+
+graph_git_behavior() {
+	MSG=$1
+	BRANCH=$2
+	COMPARE=$3
+	test_expect_success "check normal git operations: $MSG" '
+		graph_git_two_modes "log --oneline $BRANCH" &&
+		graph_git_two_modes "rev-list --topo-order $BRANCH" &&
+		graph_git_two_modes "rev-list --parents $BRANCH" &&
+		graph_git_two_modes "log --graph --oneline $BRANCH" &&
+		graph_git_two_modes "merge-base -a $BRANCH $COMPARE" &&
+		graph_git_two_modes "merge-base --independent $BRANCH $COMPARE" &&
+		graph_git_two_modes "tag --contains $COMPARE" &&
+		graph_git_two_modes "branch --contains $COMPARE"
+	'
+}
+
+graph_git_behavior 'graph exists' master right
+graph_git_behavior 'octopus merge' octopus left-2
+graph_git_behavior 'ancestor' right-5 right-1
+
+test_expect_success 'is-ancestor agrees with the graph' '
+	git -c core.commitGraph=true merge-base --is-ancestor left-1 tip &&
+	test_must_fail git -c core.commitGraph=true \
+		merge-base --is-ancestor tip left-1 &&
+	test_must_fail git -c core.commitGraph=true \
+		merge-base --is-ancestor third-1 merge-two
+'
+
+test_expect_success 'commits newer than the graph are parsed normally' '
+	test_commit after-graph &&
+	graph_git_two_modes "rev-list --topo-order --parents HEAD" &&
+	graph_git_two_modes "tag --contains tip"
+'
+
+test_expect_success 'graph is ignored with grafts' '
+	git rev-parse right-3 >.git/info/grafts &&
+	test_when_finished "rm -f .git/info/grafts" &&
+	graph_git_two_modes "rev-list --parents right" &&
+	test_must_fail git commit-graph write
+'
+
+test_expect_success 'gc writes graph with gc.commitGraph' '
+	rm -f .git/objects/info/commit-graph &&
+	git -c gc.commitGraph=true gc &&
+	test_path_is_file .git/objects/info/commit-graph &&
+	git commit-graph verify &&
+	graph_git_two_modes "rev-list --topo-order --parents --all"
+'
+
+# The graph written by gc above has 4 chunks, as the octopus merge
+# needs extra edges; the oid lookup chunk follows the chunk lookup
+# table (5 entries with its terminator) and the fanout.
+GRAPH_OID_LOOKUP=$((8 + 5 * 12 + 4 * 256))
+
+test_expect_success 'find the commit data of the graph' '
+	num_commits=$(git rev-list --all | wc -l) &&
+	echo $(($GRAPH_OID_LOOKUP + 20 * $num_commits)) >data-offset
+'
+
+# usage: corrupt_graph_and_verify <offset> <bytes> <expected error>
+corrupt_graph_and_verify () {
+	graph=.git/objects/info/commit-graph &&
+	cp $graph graph-backup &&
+	test_when_finished "mv graph-backup $graph" &&
+	chmod u+w $graph &&
+	printf "$2" |
+	dd of=$graph bs=1 seek=$1 conv=notrunc 2>/dev/null &&
+	test_must_fail git commit-graph verify 2>err &&
+	grep "$3" err
+}
+
+test_expect_success 'verify detects a corrupt commit oid' '
+	corrupt_graph_and_verify $(($GRAPH_OID_LOOKUP + 19)) "\377" \
+		"from object database"
+'
+
+test_expect_success 'verify detects a corrupt root tree' '
+	corrupt_graph_and_verify $(cat data-offset) "\001" "root tree"
+'
+
+test_expect_success 'verify detects a corrupt generation number' '
+	corrupt_graph_and_verify $(($(cat data-offset) + 28)) "\377" \
+		"generation for commit"
+'
+
+test_expect_success 'verify detects a corrupt checksum' '
+	size=$(wc -c <.git/objects/info/commit-graph) &&
+	corrupt_graph_and_verify $(($size - 1)) "\000" "incorrect checksum"
+'
+
+test_done
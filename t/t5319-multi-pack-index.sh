@@ -0,0 +1,115 @@
+#!/bin/sh
+
+test_description='multi-pack index'
+. ./test-lib.sh
+
+midx_git_two_modes() {
+	git -c core.multiPackIndex=true $1 <${2:-/dev/null} >output &&
+	git -c core.multiPackIndex=false $1 <${2:-/dev/null} >expect &&
+	test_cmp expect output
+}
+
+midx_git_behavior() {
+	test_expect_success "check normal git operations: $1" '
+		midx_git_two_modes "rev-list --objects --all" &&
+		midx_git_two_modes "log --raw --all" &&
+		git rev-list --objects --all | cut -d" " -f1 >objs &&
+		midx_git_two_modes "cat-file --batch-check" objs &&
+		midx_git_two_modes "count-objects -v"
+	'
+}
+
+test_expect_success 'setup several packs' '
+	for i in 1 2 3
+	do
+		test_commit "one-$i" &&
+		git repack -d || return 1
+	done &&
+	test $(ls .git/objects/pack/*.pack | wc -l) = 3
+'
+
+test_expect_success 'write multi-pack-index' '
+	git multi-pack-index write &&
+	test_path_is_file .git/objects/pack/multi-pack-index
+'
+
+test_expect_success 'verify multi-pack-index' '
+	git multi-pack-index verify
+'
+
+midx_git_behavior 'index covers all packs'
+
+test_expect_success 'count-objects does not report the index as garbage' '
+	git count-objects -v >counts &&
+	grep "^garbage: 0" counts
+'
+
+test_expect_success 'pack added after the index was written' '
+	test_commit two &&
+	git -c repack.writeMultiPackIndex=false repack -d &&
+	test $(ls .git/objects/pack/*.pack | wc -l) = 4
+'
+
+midx_git_behavior 'index misses one pack'
+
+test_expect_success 'incremental write covers the new pack' '
+	cp .git/objects/pack/multi-pack-index midx.old &&
+	git multi-pack-index write &&
+	! cmp -s midx.old .git/objects/pack/multi-pack-index &&
+	git multi-pack-index verify
+'
+
+midx_git_behavior 'index covers the new pack'
+
+test_expect_success 'duplicate objects are indexed once' '
+	git pack-objects --all .git/objects/pack/pack </dev/null &&
+	git multi-pack-index write &&
+	git multi-pack-index verify &&
+	git rev-list --objects --all | cut -d" " -f1 >objs &&
+	midx_git_two_modes "cat-file --batch-check" objs
+'
+
+test_expect_success 'repack -ad rewrites an existing index' '
+	git repack -ad &&
+	git multi-pack-index verify &&
+	test $(ls .git/objects/pack/*.pack | wc -l) = 1
+'
+
+midx_git_behavior 'after repack -ad'
+
+test_expect_success 'repack.writeMultiPackIndex creates the index' '
+	rm -f .git/objects/pack/multi-pack-index &&
+	test_commit three &&
+	git -c repack.writeMultiPackIndex=true repack -d &&
+	test_path_is_file .git/objects/pack/multi-pack-index &&
+	git multi-pack-index verify
+'
+
+test_expect_success 'verify notices a corrupt offset' '
+	cp .git/objects/pack/multi-pack-index midx.good &&
+	test_when_finished "mv midx.good .git/objects/pack/multi-pack-index" &&
+	chmod +w .git/objects/pack/multi-pack-index &&
+	size=$(wc -c <.git/objects/pack/multi-pack-index) &&
+	printf "\377" |
+	dd of=.git/objects/pack/multi-pack-index bs=1 conv=notrunc \
+		seek=$(($size - 21)) 2>/dev/null &&
+	test_must_fail git multi-pack-index verify
+'
+
+test_expect_success 'a pack whose index cannot be read is left out' '
+	test_commit four &&
+	pack=$(git pack-objects .git/objects/pack/pack <<-EOF
+	$(git rev-parse four)
+	EOF
+	) &&
+	idx=pack-$pack.idx &&
+	test_when_finished "rm -f .git/objects/pack/pack-$pack.*" &&
+	chmod +w .git/objects/pack/$idx &&
+	echo garbage >.git/objects/pack/$idx &&
+	git multi-pack-index write 2>err &&
+	grep "failed to open pack-index" err &&
+	! grep -a "$idx" .git/objects/pack/multi-pack-index &&
+	git multi-pack-index verify
+'
+
+test_done
@@ -0,0 +1,79 @@
+#!/bin/sh
+
+test_description='pack reverse index (.rev) files'
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	for i in 1 2 3 4 5
+	do
+		test_commit "commit-$i" &&
+		test-genrandom "$i" 4096 >"blob-$i" &&
+		git add "blob-$i" &&
+		git commit -m "blob $i" || return 1
+	done &&
+	git repack -ad &&
+	git rev-list --objects --all | cut -d" " -f1 >objs
+'
+
+test_expect_success 'repack writes a .rev next to the .idx' '
+	for idx in .git/objects/pack/*.idx
+	do
+		test_path_is_file "${idx%.idx}.rev" || return 1
+	done
+'
+
+test_expect_success 'pack.writeReverseIndex=false writes none' '
+	git -c pack.writeReverseIndex=false repack -adf &&
+	! ls .git/objects/pack/*.rev
+'
+
+test_expect_success 'index-pack writes a .rev' '
+	pack=$(ls .git/objects/pack/*.pack) &&
+	cp "$pack" test.pack &&
+	git index-pack test.pack &&
+	test_path_is_file test.rev &&
+	git index-pack -o other.idx test.pack &&
+	test_path_is_file other.rev &&
+	git -c pack.writeReverseIndex=false index-pack -o none.idx test.pack &&
+	test_path_is_missing none.rev
+'
+
+test_expect_success 'on-disk sizes do not depend on the .rev' '
+	git cat-file --batch-check="%(objectname) %(objectsize:disk)" \
+		<objs >expect &&
+	git repack -adf &&
+	test_path_is_file $(ls .git/objects/pack/*.pack | sed "s/pack\$/rev/") &&
+	git cat-file --batch-check="%(objectname) %(objectsize:disk)" \
+		<objs >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'reused pack data does not depend on the .rev' '
+	git pack-objects --stdout --all --delta-base-offset </dev/null >with.pack &&
+	rev=$(ls .git/objects/pack/*.rev) &&
+	mv "$rev" rev.saved &&
+	git pack-objects --stdout --all --delta-base-offset </dev/null >without.pack &&
+	mv rev.saved "$rev" &&
+	cmp without.pack with.pack
+'
+
+test_expect_success 'a .rev that does not match the pack is ignored' '
+	rev=$(ls .git/objects/pack/*.rev) &&
+	cp "$rev" rev.saved &&
+	test_when_finished "mv rev.saved \"$rev\"" &&
+	chmod +w "$rev" &&
+	size=$(wc -c <"$rev") &&
+	printf "\377" |
+	dd of="$rev" bs=1 conv=notrunc seek=$(($size - 40)) 2>/dev/null &&
+	git cat-file --batch-check="%(objectname) %(objectsize:disk)" \
+		<objs >actual 2>err &&
+	test_cmp expect actual &&
+	test_i18ngrep "does not match the pack" err
+'
+
+test_expect_success 'count-objects does not report .rev files as garbage' '
+	git count-objects -v >counts &&
+	grep "^garbage: 0" counts
+'
+
+test_done
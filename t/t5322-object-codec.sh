@@ -0,0 +1,105 @@
+#!/bin/sh
+
+test_description='objects compressed with another codec than zlib'
+. ./test-lib.sh
+
+if ! test_have_prereq ZSTD
+then
+	skip_all='skipping object codec tests; git built without zstd'
+	test_done
+fi
+
+# how many zstd frames the files look like they contain
+count_zstd_frames () {
+	"$PERL_PATH" -0777 -ne 'print scalar(() = /\x28\xb5\x2f\xfd/g), "\n"' "$@"
+}
+
+zstd_repo () {
+	git init --bare "$1" &&
+	git -C "$1" config extensions.objectCodec zstd &&
+	git -C "$1" config core.repositoryformatversion 1
+}
+
+test_expect_success 'setup' '
+	# keep the packs we receive, to see what was sent
+	git config --global transfer.unpackLimit 1 &&
+	git config extensions.objectCodec zstd &&
+	git config core.repositoryformatversion 1 &&
+	for i in 1 2 3 4 5
+	do
+		test-genrandom "seed $i" 20000 >file$i &&
+		test_seq 1 $i >>file1 &&
+		git add file1 file$i &&
+		test_tick &&
+		git commit -q -m "commit $i" || return 1
+	done
+'
+
+test_expect_success 'loose objects are written with zstd' '
+	blob=$(git rev-parse HEAD:file1) &&
+	loose=.git/objects/$(echo $blob | sed "s|^..|&/|") &&
+	echo 1 >expect &&
+	count_zstd_frames "$loose" >actual &&
+	test_cmp expect actual &&
+	git cat-file blob $blob >actual &&
+	test_cmp file1 actual &&
+	git fsck
+'
+
+test_expect_success 'repack writes pack entries with zstd' '
+	git repack -adq &&
+	test $(count_zstd_frames .git/objects/pack/*.pack) -ge 15 &&
+	git fsck &&
+	for i in 1 2 3 4 5
+	do
+		git cat-file blob HEAD:file$i >actual &&
+		test_cmp file$i actual || return 1
+	done
+'
+
+test_expect_success 'objects in zlib are still read, and recompressed on -F' '
+	git init --bare zlib.git &&
+	git push -q zlib.git HEAD:refs/heads/master &&
+	test $(count_zstd_frames zlib.git/objects/pack/*.pack) = 0 &&
+	zstd_repo mixed.git &&
+	git -C mixed.git fetch -q ../zlib.git master:master &&
+	git -C mixed.git fsck &&
+	git -C mixed.git repack -adq &&
+	test $(count_zstd_frames mixed.git/objects/pack/*.pack) = 0 &&
+	git -C mixed.git repack -adFq &&
+	test $(count_zstd_frames mixed.git/objects/pack/*.pack) -ge 15 &&
+	git -C mixed.git fsck
+'
+
+test_expect_success 'fetch into a zlib repository gets zlib' '
+	git clone -q --bare --no-local . clone.git &&
+	test $(count_zstd_frames clone.git/objects/pack/*.pack) = 0 &&
+	git -C clone.git fsck
+'
+
+test_expect_success 'fetch into a zstd repository keeps zstd' '
+	zstd_repo fetch.git &&
+	GIT_TRACE_PACKET=$(pwd)/trace \
+		git -C fetch.git fetch -q "file://$(pwd)" master:master &&
+	grep "object-codec=zstd" trace &&
+	test $(count_zstd_frames fetch.git/objects/pack/*.pack) -ge 15 &&
+	git -C fetch.git fsck
+'
+
+test_expect_success 'bundles carry zlib' '
+	git bundle create all.bundle --all &&
+	test $(count_zstd_frames all.bundle) = 0 &&
+	git -C clone.git bundle verify ../all.bundle
+'
+
+test_expect_success 'pack-objects --object-codec' '
+	git rev-parse HEAD >revs &&
+	git pack-objects --revs --stdout <revs >zlib.pack &&
+	test $(count_zstd_frames zlib.pack) = 0 &&
+	git pack-objects --revs --stdout --object-codec=zstd <revs >zstd.pack &&
+	test $(count_zstd_frames zstd.pack) -ge 15 &&
+	test_must_fail git pack-objects --revs --stdout \
+		--object-codec=bogus <revs >/dev/null
+'
+
+test_done
@@ -0,0 +1,96 @@
+#!/bin/sh
+
+test_description='upload-pack pack cache'
+
+. ./test-lib.sh
+
+check_stats () {
+	printf "hits %d\nmisses %d\n" "$1" "$2" >expect &&
+	test_cmp expect .git/pack-cache/stats
+}
+
+test_expect_success 'setup' '
+	test_commit one &&
+	test_commit two &&
+	git tag -a -m annotated three &&
+	git config uploadpack.packCache true
+'
+
+test_expect_success 'first clone fills the cache' '
+	git clone --no-local . first &&
+	check_stats 0 1 &&
+	ls .git/pack-cache/*.pack >packs &&
+	test_line_count = 1 packs
+'
+
+test_expect_success 'identical clone is served from the cache' '
+	git clone --no-local . second &&
+	check_stats 1 1 &&
+	git -C second fsck &&
+	git rev-parse HEAD three >expect &&
+	git -C second rev-parse HEAD three >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'cached pack works with and without side-band' '
+	printf "0032want %s\n00000009done\n0000" \
+		$(git rev-parse HEAD) >input &&
+	git upload-pack . <input >plain.out &&
+	check_stats 1 2 &&
+	printf "0040want %s side-band-64k\n00000009done\n0000" \
+		$(git rev-parse HEAD) >input &&
+	git upload-pack . <input >sideband.out &&
+	check_stats 2 2 &&
+	printf "0032want %s\n00000009done\n0000" \
+		$(git rev-parse HEAD) >input &&
+	git upload-pack . <input >plain-again.out &&
+	check_stats 3 2 &&
+	cmp plain.out plain-again.out
+'
+
+test_expect_success 'ref updates invalidate the cache' '
+	test_commit four &&
+	git clone --no-local . third &&
+	check_stats 3 3 &&
+	git -C third rev-parse four
+'
+
+test_expect_success 'fetches with haves are cached too' '
+	test_commit five &&
+	git -C first fetch &&
+	git -C second fetch &&
+	check_stats 4 4 &&
+	git -C second rev-parse origin/master >actual &&
+	git rev-parse master >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'expired entries are not used' '
+	for pack in .git/pack-cache/*.pack
+	do
+		test-chmtime -7200 $pack || return 1
+	done &&
+	git clone --no-local . fourth &&
+	check_stats 4 5 &&
+	ls .git/pack-cache/*.pack >packs &&
+	test_line_count = 1 packs
+'
+
+test_expect_success 'cache is kept within its size limit' '
+	git config uploadpack.packCacheLimit 1 &&
+	test_commit six &&
+	git clone --no-local . fifth &&
+	check_stats 4 6 &&
+	! ls .git/pack-cache/*.pack
+'
+
+test_expect_success 'a cache that cannot be created is skipped' '
+	rm -rf .git/pack-cache &&
+	>.git/pack-cache &&
+	git clone --no-local . sixth 2>err &&
+	grep "unable to create" err &&
+	git -C sixth fsck &&
+	test_path_is_file .git/pack-cache
+'
+
+test_done
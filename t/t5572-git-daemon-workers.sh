@@ -0,0 +1,62 @@
+#!/bin/sh
+
+test_description='git daemon with pre-forked workers'
+. ./test-lib.sh
+
+. "$TEST_DIRECTORY"/lib-git-daemon.sh
+start_git_daemon --workers=2 --listen-backlog=64
+
+test_expect_success 'setup repository' '
+	test_commit one &&
+	git clone --bare . "$GIT_DAEMON_DOCUMENT_ROOT_PATH/repo.git" &&
+	: >"$GIT_DAEMON_DOCUMENT_ROOT_PATH/repo.git/git-daemon-export-ok"
+'
+
+test_expect_success 'clone through a worker' '
+	git clone "$GIT_DAEMON_URL/repo.git" clone &&
+	test_cmp one.t clone/one.t
+'
+
+test_expect_success 'workers serve more connections than there are workers' '
+	pids= &&
+	for i in 1 2 3 4 5 6
+	do
+		git ls-remote "$GIT_DAEMON_URL/repo.git" >ls-remote.$i &
+		pids="$pids $!"
+	done &&
+	for pid in $pids
+	do
+		wait $pid || return 1
+	done &&
+	for i in 1 2 3 4 5 6
+	do
+		grep refs/heads/master ls-remote.$i || return 1
+	done
+'
+
+test_expect_success 'a worker goes on after a failed request' '
+	test_must_fail git ls-remote "$GIT_DAEMON_URL/nowhere.git" &&
+	git ls-remote "$GIT_DAEMON_URL/repo.git" >output &&
+	grep refs/heads/master output
+'
+
+test_expect_success 'workers start from the base directory again' '
+	mkdir "$GIT_DAEMON_DOCUMENT_ROOT_PATH/sub" &&
+	git clone --bare . "$GIT_DAEMON_DOCUMENT_ROOT_PATH/sub/other.git" &&
+	: >"$GIT_DAEMON_DOCUMENT_ROOT_PATH/sub/other.git/git-daemon-export-ok" &&
+	for i in 1 2 3
+	do
+		git ls-remote "$GIT_DAEMON_URL/sub/other.git" &&
+		git ls-remote "$GIT_DAEMON_URL/repo.git" || return 1
+	done
+'
+
+test_expect_success 'fetch through a worker' '
+	test_commit two &&
+	git push "$GIT_DAEMON_DOCUMENT_ROOT_PATH/repo.git" master &&
+	(cd clone && git pull) &&
+	test_cmp two.t clone/two.t
+'
+
+stop_git_daemon
+test_done
@@ -0,0 +1,181 @@
+#!/bin/sh
+
+test_description='git status with the untracked cache'
+
+. ./test-lib.sh
+
+# Directories are read again when they changed in the same second as
+# the index was written; move the mtime of those that just changed
+# away (to a different second each time), so that what is replayed
+# from the cache can be checked.
+backdate=600
+backdate_dirs () {
+	backdate=$(($backdate - 1)) &&
+	for d in $(find wt -name .git -prune -o -type d -mmin -5 -print)
+	do
+		test-chmtime =-$backdate "$d" || return 1
+	done
+}
+
+status_with_stats () {
+	rm -f trace &&
+	GIT_TRACE_UNTRACKED_STATS="$TRASH_DIRECTORY/trace" \
+	git -C wt status --porcelain >actual &&
+	test_cmp expect actual
+}
+
+check_stats () {
+	echo "untracked cache: read $1, replayed $2, gitignore invalidated $3" >expect.stats &&
+	test_cmp expect.stats trace
+}
+
+test_expect_success 'setup' '
+	git init wt &&
+	git -C wt config core.untrackedCache true &&
+	mkdir -p wt/done wt/dtwo wt/dthree/sub &&
+	: >wt/done/one &&
+	: >wt/dtwo/two &&
+	: >wt/dthree/sub/three &&
+	: >wt/top &&
+	echo "*.o" >wt/.gitignore &&
+	: >wt/done/ignored.o &&
+	git -C wt add .gitignore done/one &&
+	git -C wt commit -m initial &&
+	backdate_dirs
+'
+
+cat >expect <<\EOF
+?? dthree/
+?? dtwo/
+?? top
+EOF
+
+test_expect_success 'first status fills the cache' '
+	status_with_stats &&
+	check_stats 5 0 0 &&
+	grep -q UNTR wt/.git/index
+'
+
+test_expect_success 'second status replays it' '
+	status_with_stats &&
+	check_stats 0 5 0
+'
+
+cat >expect <<\EOF
+?? done/two
+?? dthree/
+?? dtwo/
+?? top
+EOF
+
+test_expect_success 'new file in a tracked directory' '
+	: >wt/done/two &&
+	backdate_dirs &&
+	status_with_stats &&
+	check_stats 1 4 0
+'
+
+test_expect_success 'new file deep in an untracked directory' '
+	mkdir wt/dthree/sub/deeper &&
+	: >wt/dthree/sub/deeper/four &&
+	backdate_dirs &&
+	status_with_stats &&
+	status_with_stats &&
+	check_stats 0 5 0
+'
+
+cat >expect <<\EOF
+?? done/two
+?? dtwo/
+?? top
+EOF
+
+test_expect_success 'directory left without untracked files' '
+	rm -r wt/dthree/sub &&
+	backdate_dirs &&
+	status_with_stats
+'
+
+cat >expect <<\EOF
+ M .gitignore
+?? done/ignored.o
+?? done/two
+?? dtwo/
+?? top
+EOF
+
+test_expect_success '.gitignore change is noticed' '
+	echo "*.so" >wt/.gitignore &&
+	backdate_dirs &&
+	status_with_stats &&
+	grep "gitignore invalidated 1" trace
+'
+
+cat >expect <<\EOF
+ M .gitignore
+A  done/two
+?? done/ignored.o
+?? dtwo/
+?? top
+EOF
+
+test_expect_success 'git add removes a file from the untracked ones' '
+	git -C wt add done/two &&
+	backdate_dirs &&
+	status_with_stats
+'
+
+cat >expect <<\EOF
+ M .gitignore
+?? done/ignored.o
+?? done/two
+?? dtwo/
+?? top
+EOF
+
+test_expect_success 'git rm --cached makes a file untracked again' '
+	git -C wt rm -q --cached done/two &&
+	backdate_dirs &&
+	status_with_stats
+'
+
+cat >expect <<\EOF
+ M .gitignore
+?? done/two
+?? dtwo/
+?? top
+EOF
+
+test_expect_success 'info/exclude change rebuilds the cache' '
+	echo "ignored.o" >wt/.git/info/exclude &&
+	status_with_stats &&
+	grep "replayed 0" trace
+'
+
+cat >expect <<\EOF
+ M .gitignore
+?? done/two
+?? top
+EOF
+
+test_expect_success 'checkout of a branch that tracks a directory' '
+	git -C wt checkout -b other &&
+	git -C wt add dtwo/two &&
+	git -C wt commit -m "add dtwo" &&
+	git -C wt checkout master &&
+	status_with_stats &&
+	git -C wt checkout other &&
+	backdate_dirs &&
+	status_with_stats
+'
+
+test_expect_success 'core.untrackedCache=false drops the cache' '
+	git -C wt config core.untrackedCache false &&
+	status_with_stats &&
+	test_must_fail grep -q UNTR wt/.git/index &&
+	git -C wt config --unset core.untrackedCache &&
+	status_with_stats &&
+	test_must_fail grep -q UNTR wt/.git/index
+'
+
+test_done
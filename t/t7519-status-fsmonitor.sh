@@ -0,0 +1,137 @@
+#!/bin/sh
+
+test_description='git status with a file system monitor'
+
+. ./test-lib.sh
+
+# The stand-in for the monitor reports the paths listed in
+# .git/fsmonitor-changes, whatever time it is asked about, and logs
+# the queries it gets.
+test_expect_success 'setup' '
+	mkdir dir1 dir2 &&
+	echo 1 >dir1/a &&
+	echo 2 >dir2/b &&
+	echo 3 >c &&
+	git add dir1 dir2 c &&
+	git commit -m initial &&
+	write_script .git/fsmonitor-test <<-\EOF &&
+	echo "$*" >>.git/fsmonitor-queries
+	tr "\n" "\0" <.git/fsmonitor-changes
+	EOF
+	: >.git/fsmonitor-changes &&
+	git config core.fsmonitor .git/fsmonitor-test &&
+	cat >.git/info/exclude <<-\EOF
+	actual
+	expect
+	EOF
+'
+
+test_expect_success 'the monitor is asked from the second run on' '
+	git status &&
+	grep -q FSMN .git/index &&
+	test_path_is_missing .git/fsmonitor-queries &&
+	git status &&
+	test_line_count = 1 .git/fsmonitor-queries &&
+	grep "^1 [0-9][0-9]*$" .git/fsmonitor-queries
+'
+
+test_expect_success 'the time asked about moves on' '
+	echo 4 >c &&
+	echo c >.git/fsmonitor-changes &&
+	git status &&
+	git status &&
+	test_line_count = 3 .git/fsmonitor-queries &&
+	sed -n "2p" .git/fsmonitor-queries >first &&
+	sed -n "3p" .git/fsmonitor-queries >second &&
+	! test_cmp first second &&
+	rm first second &&
+	git checkout c
+'
+
+test_expect_success 'unreported changes are not looked for' '
+	: >.git/fsmonitor-changes &&
+	git status &&
+	echo changed >dir1/a &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'reported changes are seen' '
+	echo dir1/a >.git/fsmonitor-changes &&
+	echo " M dir1/a" >expect &&
+	git status --porcelain >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a reported directory covers what is below it' '
+	git checkout dir1/a &&
+	: >.git/fsmonitor-changes &&
+	git status &&
+	echo changed >dir2/b &&
+	echo dir2 >.git/fsmonitor-changes &&
+	echo " M dir2/b" >expect &&
+	git status --porcelain >actual &&
+	test_cmp expect actual &&
+	git checkout dir2/b
+'
+
+test_expect_success 'a reported directory is not hidden by a sibling file' '
+	echo 5 >dir2.c &&
+	git add dir2.c &&
+	git commit -m sibling &&
+	: >.git/fsmonitor-changes &&
+	git status &&
+	echo changed >dir2/b &&
+	echo dir2 >.git/fsmonitor-changes &&
+	echo " M dir2/b" >expect &&
+	git status --porcelain >actual &&
+	test_cmp expect actual &&
+	git checkout dir2/b
+'
+
+test_expect_success 'a monitor that can not tell makes everything checked' '
+	: >.git/fsmonitor-changes &&
+	git status &&
+	echo changed >c &&
+	echo / >.git/fsmonitor-changes &&
+	echo " M c" >expect &&
+	git status --porcelain >actual &&
+	test_cmp expect actual &&
+	git checkout c
+'
+
+test_expect_success 'a failing monitor makes everything checked' '
+	: >.git/fsmonitor-changes &&
+	git status &&
+	echo changed >c &&
+	git -c core.fsmonitor=false status --porcelain >actual &&
+	echo " M c" >expect &&
+	test_cmp expect actual &&
+	git checkout c
+'
+
+test_expect_success 'the untracked cache goes by the monitor too' '
+	git config core.untrackedCache true &&
+	: >.git/fsmonitor-changes &&
+	git status &&
+	git status &&
+	: >dir1/new &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual &&
+	echo dir1/new >.git/fsmonitor-changes &&
+	echo "?? dir1/new" >expect &&
+	git status --porcelain >actual &&
+	test_cmp expect actual &&
+	rm dir1/new &&
+	echo dir1/new >.git/fsmonitor-changes &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'unsetting core.fsmonitor drops its data' '
+	git config --unset core.fsmonitor &&
+	git status &&
+	test_must_fail grep -q FSMN .git/index
+'
+
+test_done
@@ -781,6 +781,8 @@ esac
 test -z "$NO_PERL" && test_set_prereq PERL
 test -z "$NO_PYTHON" && test_set_prereq PYTHON
 test -n "$USE_LIBPCRE" && test_set_prereq LIBPCRE
+test -n "$USE_ZSTD" && test_set_prereq ZSTD
+test -z "$NO_PTHREADS" && test_set_prereq PTHREADS
 test -z "$NO_GETTEXT" && test_set_prereq GETTEXT
 
 # Can we rely on git's output in the C locale?
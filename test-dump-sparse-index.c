@@ -0,0 +1,19 @@
+#include "cache.h"
+
+/* Show the entries of the index as they are, sparse directories too */
+int main(int argc, char **argv)
+{
+	int i;
+
+	setup_git_directory();
+	command_requires_full_index = 0;
+	if (read_cache() < 0)
+		die("unable to read index file");
+	printf("%s\n", the_index.sparse_index ? "sparse" : "full");
+	for (i = 0; i < active_nr; i++) {
+		const struct cache_entry *ce = active_cache[i];
+		printf("%06o %s %s\n", ce->ce_mode,
+		       sha1_to_hex(ce->sha1), ce->name);
+	}
+	return 0;
+}
@@ -708,6 +708,11 @@ static int push_update_ref_status(struct strbuf *buf,
 			free(msg);
 			msg = NULL;
 		}
+		else if (!strcmp(msg, "atomic push failed")) {
+			status = REF_STATUS_ATOMIC_PUSH_FAILED;
+			free(msg);
+			msg = NULL;
+		}
 		else if (!strcmp(msg, "forced update")) {
 			forced = 1;
 			free(msg);
@@ -842,6 +847,11 @@ static int push_refs_with_push(struct transport *transport,
 			die("helper %s does not support dry-run", data->name);
 	}
 
+	if (flags & TRANSPORT_PUSH_ATOMIC) {
+		if (set_helper_option(transport, "atomic", "true") != 0)
+			die("helper %s does not support --atomic", data->name);
+	}
+
 	strbuf_addch(&buf, '\n');
 	sendline(data, &buf);
 	strbuf_release(&buf);
@@ -8,6 +8,8 @@
 #include "progress.h"
 #include "refs.h"
 #include "attr.h"
+#include "parallel-checkout.h"
+#include "sparse-index.h"
 
 /*
  * Error messages expected by scripts out of plumbing commands such as
@@ -223,17 +225,26 @@ static int check_updates(struct unpack_trees_options *o)
 	remove_marked_cache_entries(&o->result);
 	remove_scheduled_dirs();
 
+	if (o->update && !o->dry_run)
+		init_parallel_checkout();
 	for (i = 0; i < index->cache_nr; i++) {
 		struct cache_entry *ce = index->cache[i];
 
 		if (ce->ce_flags & CE_UPDATE) {
-			display_progress(progress, ++cnt);
 			ce->ce_flags &= ~CE_UPDATE;
 			if (o->update && !o->dry_run) {
+				int queued = parallel_checkout_queued();
+
 				errs |= checkout_entry(ce, &state, NULL);
+				/* counted once written */
+				if (parallel_checkout_queued() != queued)
+					continue;
 			}
+			display_progress(progress, ++cnt);
 		}
 	}
+	if (o->update && !o->dry_run)
+		errs |= run_parallel_checkout(&state, progress, &cnt);
 	stop_progress(&progress);
 	if (o->update)
 		git_attr_set_direction(GIT_ATTR_CHECKIN, NULL);
@@ -817,6 +828,19 @@ static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, str
 				o->cache_bottom += matches;
 				return mask;
 			}
+
+			/* or a directory of a sparse index, the same tree */
+			if (o->src_index->sparse_index) {
+				struct cache_entry *ce = next_cache_entry(o);
+
+				if (ce && S_ISSPARSEDIR(ce->ce_mode) &&
+				    !hashcmp(ce->sha1, names->sha1) &&
+				    ce_namelen(ce) == traverse_path_len(info, names) + 1 &&
+				    !do_compare_entry(ce, info, names)) {
+					mark_ce_used(ce, o);
+					return mask;
+				}
+			}
 		}
 
 		if (traverse_trees_recursive(n, dirmask, mask & ~dirmask,
@@ -848,10 +872,6 @@ static int clear_ce_flags_dir(struct cache_entry **cache, int nr,
 
 	strbuf_addch(prefix, '/');
 
-	/* If undecided, use matching result of parent dir in defval */
-	if (ret < 0)
-		ret = defval;
-
 	for (cache_end = cache; cache_end != cache + nr; cache_end++) {
 		struct cache_entry *ce = *cache_end;
 		if (strncmp(ce->name, prefix->buf, prefix->len))
@@ -859,12 +879,32 @@ static int clear_ce_flags_dir(struct cache_entry **cache, int nr,
 	}
 
 	/*
-	 * TODO: check el, if there are no patterns that may conflict
-	 * with ret (iow, we know in advance the incl/excl
+	 * With cone patterns, a directory that is decided is so for
+	 * everything in it, which need not be matched entry by entry.
+	 *
+	 * TODO: otherwise, check el, if there are no patterns that may
+	 * conflict with ret (iow, we know in advance the incl/excl
 	 * decision for the entire directory), clear flag here without
 	 * calling clear_ce_flags_1(). That function will call
 	 * the expensive is_excluded_from_list() on every entry.
 	 */
+	if (el->use_cone_patterns && ret >= 0) {
+		struct cache_entry **ce;
+
+		for (ce = cache; ce != cache_end; ce++) {
+			if (select_mask && !((*ce)->ce_flags & select_mask))
+				continue;
+			if (ret)
+				(*ce)->ce_flags &= ~clear_mask;
+		}
+		strbuf_setlen(prefix, prefix->len - 1);
+		return cache_end - cache;
+	}
+
+	/* If undecided, use matching result of parent dir in defval */
+	if (ret < 0)
+		ret = defval;
+
 	rc = clear_ce_flags_1(cache, cache_end - cache,
 			      prefix,
 			      select_mask, clear_mask,
@@ -1003,6 +1043,24 @@ static void mark_new_skip_worktree(struct exclude_list *el,
 		       select_flag, skip_wt_flag, el);
 }
 
+/*
+ * The skip-worktree bits were set from the same patterns, and no entry
+ * was added since: they are what the patterns would give.
+ */
+static void keep_skip_worktree(struct index_state *the_index)
+{
+	int i;
+
+	for (i = 0; i < the_index->cache_nr; i++) {
+		struct cache_entry *ce = the_index->cache[i];
+
+		if (!ce_stage(ce) && ce_skip_worktree(ce))
+			ce->ce_flags |= CE_NEW_SKIP_WORKTREE;
+		else
+			ce->ce_flags &= ~CE_NEW_SKIP_WORKTREE;
+	}
+}
+
 static int verify_absent(const struct cache_entry *,
 			 enum unpack_trees_error_types,
 			 struct unpack_trees_options *);
@@ -1017,9 +1075,13 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	int i, ret;
 	static struct cache_entry *dfc;
 	struct exclude_list el;
+	unsigned char sparse_sha1[20];
 
 	if (len > MAX_UNPACK_TREES)
 		die("unpack_trees takes at most %d trees", MAX_UNPACK_TREES);
+	/* only "diff-index --cached" knows of sparse directories */
+	if (!o->diff_index_cached || len != 1)
+		ensure_full_index(o->src_index);
 	memset(&state, 0, sizeof(state));
 	state.base_dir = "";
 	state.force = 1;
@@ -1032,8 +1094,16 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	if (!o->skip_sparse_checkout) {
 		if (add_excludes_from_file_to_list(git_path("info/sparse-checkout"), "", 0, &el, 0) < 0)
 			o->skip_sparse_checkout = 1;
-		else
+		else {
+			git_SHA_CTX ctx;
+
+			if (core_sparse_checkout_cone)
+				use_cone_patterns(&el);
+			git_SHA1_Init(&ctx);
+			hash_exclude_list(&ctx, &el);
+			git_SHA1_Final(sparse_sha1, &ctx);
 			o->el = &el;
+		}
 	}
 
 	memset(&o->result, 0, sizeof(o->result));
@@ -1047,8 +1117,12 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	/*
 	 * Sparse checkout loop #1: set NEW_SKIP_WORKTREE on existing entries
 	 */
-	if (!o->skip_sparse_checkout)
-		mark_new_skip_worktree(o->el, o->src_index, 0, CE_NEW_SKIP_WORKTREE);
+	if (!o->skip_sparse_checkout) {
+		if (!hashcmp(o->src_index->sparse_checkout_sha1, sparse_sha1))
+			keep_skip_worktree(o->src_index);
+		else
+			mark_new_skip_worktree(o->el, o->src_index, 0, CE_NEW_SKIP_WORKTREE);
+	}
 
 	if (!dfc)
 		dfc = xcalloc(1, cache_entry_size(0));
@@ -1152,8 +1226,18 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 			ret = unpack_failed(o, "Sparse checkout leaves no entry on working directory");
 			goto done;
 		}
+		hashcpy(o->result.sparse_checkout_sha1, sparse_sha1);
 	}
 
+	/* paths that changed have been invalidated in it already */
+	if (o->dst_index == o->src_index) {
+		o->result.untracked = o->src_index->untracked;
+		o->src_index->untracked = NULL;
+		o->result.fsmonitor_last_update = o->src_index->fsmonitor_last_update;
+		o->result.fsmonitor_trusted = o->src_index->fsmonitor_trusted;
+		o->result.split_index = o->src_index->split_index;
+		o->src_index->split_index = NULL;
+	}
 	o->src_index = NULL;
 	ret = check_updates(o) ? (-2) : 0;
 	if (o->dst_index) {
@@ -1258,8 +1342,10 @@ static int verify_uptodate_sparse(const struct cache_entry *ce,
 static void invalidate_ce_path(const struct cache_entry *ce,
 			       struct unpack_trees_options *o)
 {
-	if (ce)
-		cache_tree_invalidate_path(o->src_index->cache_tree, ce->name);
+	if (!ce)
+		return;
+	cache_tree_invalidate_path(o->src_index->cache_tree, ce->name);
+	untracked_cache_invalidate_path(o->src_index, ce->name);
 }
 
 /*
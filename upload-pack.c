@@ -14,6 +14,8 @@
 #include "sigchain.h"
 #include "version.h"
 #include "string-list.h"
+#include "pack.h"
+#include "pack-bitmap.h"
 
 static const char upload_pack_usage[] = "git upload-pack [--strict] [--timeout=<n>] <dir>";
 
@@ -35,6 +37,7 @@ static int multi_ack;
 static int no_done;
 static int use_thin_pack, use_ofs_delta, use_include_tag;
 static int no_progress, daemon_mode;
+static int use_object_codec;
 static int allow_tip_sha1_in_want;
 static int shallow_nr;
 static struct object_array have_obj;
@@ -49,6 +52,14 @@ static int use_sideband;
 static int advertise_refs;
 static int stateless_rpc;
 
+/* see "uploadpack.packCache" */
+static int pack_cache;
+static unsigned long pack_cache_limit = 1024 * 1024 * 1024;
+static int pack_cache_expiry = 3600;
+static git_SHA_CTX pack_cache_refs;
+static int pack_cache_fd = -1;
+static struct strbuf pack_cache_tmp = STRBUF_INIT;
+
 static void reset_timeout(void)
 {
 	alarm(timeout);
@@ -70,6 +81,233 @@ static ssize_t send_client_data(int fd, const char *data, ssize_t sz)
 	return sz;
 }
 
+static int sha1_ptr_cmp(const void *a_, const void *b_)
+{
+	const unsigned char * const *a = a_, * const *b = b_;
+	return hashcmp(*a, *b);
+}
+
+static void hash_object_array(git_SHA_CTX *ctx, const char *what,
+			      struct object_array *array)
+{
+	const unsigned char **sha1 = xmalloc(array->nr * sizeof(*sha1));
+	int i;
+
+	for (i = 0; i < array->nr; i++)
+		sha1[i] = array->objects[i].item->sha1;
+	qsort(sha1, array->nr, sizeof(*sha1), sha1_ptr_cmp);
+	git_SHA1_Update(ctx, what, strlen(what) + 1);
+	for (i = 0; i < array->nr; i++)
+		git_SHA1_Update(ctx, sha1[i], 20);
+	free(sha1);
+}
+
+/*
+ * A cached pack is named after everything that decides its contents:
+ * the refs we advertised (so that any ref update starts a new set of
+ * entries), the sorted wants and haves, and the capabilities that
+ * change what pack-objects writes. Progress and the side-band are not
+ * part of it; the stream is stored without any framing. Returns -1 if
+ * the cache directory cannot be created; the fetch is then served
+ * without the cache.
+ */
+static int pack_cache_path(struct strbuf *path)
+{
+	git_SHA_CTX ctx = pack_cache_refs;
+	unsigned char sha1[20];
+	char caps[4];
+
+	hash_object_array(&ctx, "want", &want_obj);
+	hash_object_array(&ctx, "have", &have_obj);
+	caps[0] = use_thin_pack ? 't' : '-';
+	caps[1] = use_ofs_delta ? 'o' : '-';
+	caps[2] = use_include_tag ? 'i' : '-';
+	caps[3] = use_object_codec ? '0' + object_codec : '-';
+	git_SHA1_Update(&ctx, caps, sizeof(caps));
+	git_SHA1_Final(sha1, &ctx);
+	strbuf_addf(path, "%s/%s.pack",
+		    git_path("pack-cache"), sha1_to_hex(sha1));
+	if (safe_create_leading_directories(path->buf)) {
+		warning("unable to create '%s': %s",
+			git_path("pack-cache"), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int pack_cache_expired(time_t mtime)
+{
+	return 0 < pack_cache_expiry && mtime + pack_cache_expiry < time(NULL);
+}
+
+/*
+ * Record a hit or a miss in "pack-cache/stats". Losing a count when
+ * another upload-pack holds the lock is fine.
+ */
+static void count_pack_cache(int hit)
+{
+	static struct lock_file lock;
+	struct strbuf buf = STRBUF_INIT;
+	unsigned long hits = 0, misses = 0;
+	const char *path = git_path("pack-cache/stats");
+	int fd;
+
+	fd = hold_lock_file_for_update(&lock, path, 0);
+	if (fd < 0)
+		return;
+	if (strbuf_read_file(&buf, path, 0) > 0)
+		sscanf(buf.buf, "hits %lu\nmisses %lu", &hits, &misses);
+	if (hit)
+		hits++;
+	else
+		misses++;
+	strbuf_reset(&buf);
+	strbuf_addf(&buf, "hits %lu\nmisses %lu\n", hits, misses);
+	if (write_in_full(fd, buf.buf, buf.len) != buf.len)
+		rollback_lock_file(&lock);
+	else
+		commit_lock_file(&lock);
+	strbuf_release(&buf);
+}
+
+/*
+ * Replay a cached pack stream straight from its mapping. Returns -1,
+ * without having sent anything, if there is no usable entry.
+ */
+static int send_cached_pack(const char *path)
+{
+	struct stat st;
+	unsigned char *map;
+	size_t off;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !st.st_size || pack_cache_expired(st.st_mtime)) {
+		close(fd);
+		return -1;
+	}
+	map = xmmap(NULL, xsize_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	for (off = 0; off < st.st_size; ) {
+		size_t len = st.st_size - off;
+
+		if (len > LARGE_PACKET_MAX * 16)
+			len = LARGE_PACKET_MAX * 16;
+		reset_timeout();
+		send_client_data(1, (char *)map + off, len);
+		off += len;
+	}
+	munmap(map, st.st_size);
+	if (use_sideband)
+		packet_flush(1);
+	return 0;
+}
+
+static void write_pack_cache(const char *data, ssize_t sz)
+{
+	if (pack_cache_fd < 0 || write_in_full(pack_cache_fd, data, sz) == sz)
+		return;
+	close(pack_cache_fd);
+	pack_cache_fd = -1;
+	unlink_or_warn(pack_cache_tmp.buf);
+}
+
+struct pack_cache_entry {
+	char *path;
+	off_t size;
+	time_t mtime;
+};
+
+static int pack_cache_entry_cmp(const void *a_, const void *b_)
+{
+	const struct pack_cache_entry *a = a_, *b = b_;
+
+	if (a->mtime != b->mtime)
+		return a->mtime < b->mtime ? 1 : -1;
+	return strcmp(a->path, b->path);
+}
+
+/*
+ * Drop expired entries and then the oldest ones until the cache fits
+ * in "uploadpack.packCacheLimit" again.
+ */
+static void prune_pack_cache(void)
+{
+	struct pack_cache_entry *entry = NULL;
+	int nr = 0, alloc = 0, i;
+	unsigned long total = 0;
+	struct strbuf path = STRBUF_INIT;
+	struct dirent *de;
+	size_t dirlen;
+	DIR *dir;
+
+	strbuf_addstr(&path, git_path("pack-cache"));
+	dir = opendir(path.buf);
+	if (!dir)
+		return;
+	strbuf_addch(&path, '/');
+	dirlen = path.len;
+	while ((de = readdir(dir)) != NULL) {
+		struct stat st;
+
+		int tmp = starts_with(de->d_name, "tmp_pack_");
+
+		if (!tmp && !ends_with(de->d_name, ".pack"))
+			continue;
+		strbuf_setlen(&path, dirlen);
+		strbuf_addstr(&path, de->d_name);
+		if (stat(path.buf, &st))
+			continue;
+		if (pack_cache_expired(st.st_mtime)) {
+			/* also sweeps files left by a killed upload-pack */
+			unlink_or_warn(path.buf);
+			continue;
+		}
+		if (tmp)
+			continue;
+		ALLOC_GROW(entry, nr + 1, alloc);
+		entry[nr].path = xstrdup(path.buf);
+		entry[nr].size = st.st_size;
+		entry[nr].mtime = st.st_mtime;
+		nr++;
+	}
+	closedir(dir);
+	strbuf_release(&path);
+
+	/* newest first */
+	qsort(entry, nr, sizeof(*entry), pack_cache_entry_cmp);
+	for (i = 0; i < nr; i++) {
+		total += entry[i].size;
+		if (total > pack_cache_limit)
+			unlink_or_warn(entry[i].path);
+		free(entry[i].path);
+	}
+	free(entry);
+}
+
+static void start_pack_cache(void)
+{
+	strbuf_reset(&pack_cache_tmp);
+	strbuf_addf(&pack_cache_tmp, "%s/tmp_pack_XXXXXX",
+		    git_path("pack-cache"));
+	pack_cache_fd = mkstemp(pack_cache_tmp.buf);
+}
+
+static void finish_pack_cache(const char *path, int ok)
+{
+	if (pack_cache_fd < 0)
+		return;
+	if (close(pack_cache_fd) || !ok)
+		unlink_or_warn(pack_cache_tmp.buf);
+	else if (rename(pack_cache_tmp.buf, path))
+		unlink_or_warn(pack_cache_tmp.buf);
+	else
+		prune_pack_cache();
+	pack_cache_fd = -1;
+}
+
 static void create_pack_file(void)
 {
 	struct child_process pack_objects;
@@ -79,9 +317,21 @@ static void create_pack_file(void)
 	int buffered = -1;
 	ssize_t sz;
 	const char *argv[12];
+	char codec_arg[32];
 	int i, arg = 0;
 	FILE *pipe_fd;
 	char *shallow_file = NULL;
+	struct strbuf cache_path = STRBUF_INIT;
+
+	if (pack_cache && !shallow_nr && !pack_cache_path(&cache_path)) {
+		if (!send_cached_pack(cache_path.buf)) {
+			count_pack_cache(1);
+			strbuf_release(&cache_path);
+			return;
+		}
+		count_pack_cache(0);
+		start_pack_cache();
+	}
 
 	if (shallow_nr) {
 		shallow_file = setup_temporary_shallow(NULL);
@@ -100,6 +350,11 @@ static void create_pack_file(void)
 		argv[arg++] = "--delta-base-offset";
 	if (use_include_tag)
 		argv[arg++] = "--include-tag";
+	if (use_object_codec) {
+		snprintf(codec_arg, sizeof(codec_arg), "--object-codec=%s",
+			 object_codec_name(object_codec));
+		argv[arg++] = codec_arg;
+	}
 	argv[arg++] = NULL;
 
 	memset(&pack_objects, 0, sizeof(pack_objects));
@@ -217,6 +472,7 @@ static void create_pack_file(void)
 			}
 			else
 				buffered = -1;
+			write_pack_cache(data, sz);
 			sz = send_client_data(1, data, sz);
 			if (sz < 0)
 				goto fail;
@@ -251,16 +507,20 @@ static void create_pack_file(void)
 	/* flush the data */
 	if (0 <= buffered) {
 		data[0] = buffered;
+		write_pack_cache(data, 1);
 		sz = send_client_data(1, data, 1);
 		if (sz < 0)
 			goto fail;
 		fprintf(stderr, "flushed.\n");
 	}
+	finish_pack_cache(cache_path.buf, 1);
+	strbuf_release(&cache_path);
 	if (use_sideband)
 		packet_flush(1);
 	return;
 
  fail:
+	finish_pack_cache(cache_path.buf, 0);
 	send_client_data(3, abort_msg, sizeof(abort_msg));
 	die("git upload-pack: %s", abort_msg);
 }
@@ -333,6 +593,60 @@ static int reachable(struct commit *want)
 	return (want->object.flags & COMMON_KNOWN);
 }
 
+/*
+ * With a pack bitmap, the objects reachable from each want are computed
+ * once, and a want is settled as soon as one of the haves (or one of
+ * their parents, which got_sha1() marks too) is found in that set. This
+ * is exact, does not depend on commit dates, and does not walk the
+ * history again for each round of haves.
+ */
+static int use_bitmap_negotiation = -1;
+static struct want_reach {
+	struct bitmap *reach;
+	unsigned int haves_checked;
+} *want_reach;
+
+static int reachable_by_bitmap(int nr, struct commit *want)
+{
+	struct want_reach *wr;
+
+	if (want->object.flags & COMMON_KNOWN)
+		return 1;
+
+	if (!want_reach)
+		want_reach = xcalloc(want_obj.nr, sizeof(*want_reach));
+	wr = &want_reach[nr];
+	if (!wr->reach)
+		wr->reach = bitmap_for_reachable_commit(want);
+	if (!wr->reach)
+		return reachable(want);
+
+	for (; wr->haves_checked < have_obj.nr; wr->haves_checked++) {
+		struct object *o = have_obj.objects[wr->haves_checked].item;
+		struct commit_list *parents;
+
+		if (o->type != OBJ_COMMIT)
+			continue;
+		if (bitmap_has_object(wr->reach, o->sha1))
+			break;
+		for (parents = ((struct commit *)o)->parents;
+		     parents;
+		     parents = parents->next)
+			if (bitmap_has_object(wr->reach,
+					      parents->item->object.sha1))
+				break;
+		if (parents)
+			break;
+	}
+	if (wr->haves_checked == have_obj.nr)
+		return 0;
+
+	want->object.flags |= COMMON_KNOWN;
+	bitmap_free(wr->reach);
+	wr->reach = NULL;
+	return 1;
+}
+
 static int ok_to_give_up(void)
 {
 	int i;
@@ -340,6 +654,11 @@ static int ok_to_give_up(void)
 	if (!have_obj.nr)
 		return 0;
 
+	if (use_bitmap_negotiation < 0)
+		use_bitmap_negotiation = !shallow_nr &&
+			!is_repository_shallow() &&
+			!prepare_bitmap_git();
+
 	for (i = 0; i < want_obj.nr; i++) {
 		struct object *want = want_obj.objects[i].item;
 
@@ -355,7 +674,10 @@ static int ok_to_give_up(void)
 			want_obj.objects[i].item->flags |= COMMON_KNOWN;
 			continue;
 		}
-		if (!reachable((struct commit *)want))
+		if (use_bitmap_negotiation) {
+			if (!reachable_by_bitmap(i, (struct commit *)want))
+				return 0;
+		} else if (!reachable((struct commit *)want))
 			return 0;
 	}
 	return 1;
@@ -524,6 +846,22 @@ error:
 	}
 }
 
+/*
+ * Whether the client takes objects in the codec of our repository,
+ * the only one besides zlib it may ask for.
+ */
+static int is_our_object_codec(const char *features)
+{
+	const char *name = object_codec_name(object_codec);
+	const char *value;
+	int len;
+
+	if (object_codec == OBJECT_CODEC_ZLIB)
+		return 0;
+	value = parse_feature_value(features, "object-codec", &len);
+	return value && len == strlen(name) && !strncmp(value, name, len);
+}
+
 static void receive_needs(void)
 {
 	struct object_array shallows = OBJECT_ARRAY_INIT;
@@ -588,6 +926,8 @@ static void receive_needs(void)
 			no_progress = 1;
 		if (parse_feature_request(features, "include-tag"))
 			use_include_tag = 1;
+		if (is_our_object_codec(features))
+			use_object_codec = 1;
 
 		o = parse_object(sha1_buf);
 		if (!o)
@@ -685,6 +1025,10 @@ static int mark_our_ref(const char *refname, const unsigned char *sha1, int flag
 	if (!o)
 		die("git upload-pack: cannot find object %s:", sha1_to_hex(sha1));
 	o->flags |= OUR_REF;
+	if (pack_cache) {
+		git_SHA1_Update(&pack_cache_refs, refname, strlen(refname) + 1);
+		git_SHA1_Update(&pack_cache_refs, sha1, 20);
+	}
 	return 0;
 }
 
@@ -711,15 +1055,22 @@ static int send_ref(const char *refname, const unsigned char *sha1, int flag, vo
 
 	if (capabilities) {
 		struct strbuf symref_info = STRBUF_INIT;
+		struct strbuf codec_info = STRBUF_INIT;
 
 		format_symref_info(&symref_info, cb_data);
-		packet_write(1, "%s %s%c%s%s%s%s agent=%s\n",
+		/* our packs may hand out objects in our codec as they are */
+		if (object_codec != OBJECT_CODEC_ZLIB)
+			strbuf_addf(&codec_info, " object-codec=%s",
+				    object_codec_name(object_codec));
+		packet_write(1, "%s %s%c%s%s%s%s%s agent=%s\n",
 			     sha1_to_hex(sha1), refname_nons,
 			     0, capabilities,
 			     allow_tip_sha1_in_want ? " allow-tip-sha1-in-want" : "",
 			     stateless_rpc ? " no-done" : "",
+			     codec_info.buf,
 			     symref_info.buf,
 			     git_user_agent_sanitized());
+		strbuf_release(&codec_info);
 		strbuf_release(&symref_info);
 	} else {
 		packet_write(1, "%s %s\n", sha1_to_hex(sha1), refname_nons);
@@ -782,7 +1133,12 @@ static int upload_pack_config(const char *var, const char *value, void *unused)
 		keepalive = git_config_int(var, value);
 		if (!keepalive)
 			keepalive = -1;
-	}
+	} else if (!strcmp("uploadpack.packcache", var))
+		pack_cache = git_config_bool(var, value);
+	else if (!strcmp("uploadpack.packcachelimit", var))
+		pack_cache_limit = git_config_ulong(var, value);
+	else if (!strcmp("uploadpack.packcacheexpiry", var))
+		pack_cache_expiry = git_config_int(var, value);
 	return parse_hide_refs_config(var, value, "uploadpack");
 }
 
@@ -837,6 +1193,7 @@ int main(int argc, char **argv)
 		die("'%s' does not appear to be a git repository", dir);
 
 	git_config(upload_pack_config, NULL);
+	git_SHA1_Init(&pack_cache_refs);
 	upload_pack();
 	return 0;
 }
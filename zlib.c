@@ -1,8 +1,212 @@
 /*
  * zlib wrappers to make sure we don't silently miss errors
  * at init time.
+ *
+ * Object data may also be in another codec; git_inflate() tells which
+ * from the first bytes it is fed, and git_deflate_init_codec() writes
+ * it.  Other streams are zlib through and through.
  */
 #include "cache.h"
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+static const char *object_codec_names[] = {
+	"zlib",
+	"zstd"
+};
+
+int object_codec_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(object_codec_names); i++)
+		if (!strcasecmp(name, object_codec_names[i]))
+			return i;
+	return -1;
+}
+
+const char *object_codec_name(enum object_codec codec)
+{
+	return object_codec_names[codec];
+}
+
+int object_codec_supported(enum object_codec codec)
+{
+	switch (codec) {
+	case OBJECT_CODEC_ZLIB:
+		return 1;
+#ifdef USE_ZSTD
+	case OBJECT_CODEC_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * A zstd frame starts with the magic number 0xFD2FB528, stored
+ * little-endian.  Its first two bytes are no zlib header, which must
+ * be a multiple of 31 when read big-endian, so they are all it takes
+ * to tell the two apart; anything else is zlib or broken, and left to
+ * zlib to complain about.
+ */
+static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+int object_codec_of(const unsigned char *buf, unsigned long len)
+{
+	if (!len)
+		return -1;
+	if (buf[0] != zstd_magic[0])
+		return OBJECT_CODEC_ZLIB;
+	if (len < 2)
+		return -1;
+	return buf[1] == zstd_magic[1] ? OBJECT_CODEC_ZSTD : OBJECT_CODEC_ZLIB;
+}
+
+#ifdef USE_ZSTD
+
+static int zstd_level(int level)
+{
+	if (level == Z_DEFAULT_COMPRESSION)
+		return ZSTD_CLEVEL_DEFAULT;
+	/* zstd cannot store data as is; its fastest level comes closest */
+	return level ? level : 1;
+}
+
+static void zstd_post_call(git_zstream *s, ZSTD_inBuffer *in, ZSTD_outBuffer *out)
+{
+	s->next_in += in->pos;
+	s->avail_in -= in->pos;
+	s->total_in += in->pos;
+	s->next_out += out->pos;
+	s->avail_out -= out->pos;
+	s->total_out += out->pos;
+}
+
+static void zstd_inflate_init(git_zstream *strm)
+{
+	strm->codec_stream = ZSTD_createDCtx();
+	if (!strm->codec_stream)
+		die("inflate: out of memory");
+	if (strm->codec_peeked) {
+		ZSTD_inBuffer in = { zstd_magic, 1, 0 };
+		ZSTD_outBuffer out = { strm->next_out, 0, 0 };
+
+		ZSTD_decompressStream(strm->codec_stream, &out, &in);
+	}
+}
+
+static int zstd_inflate(git_zstream *strm, int flush)
+{
+	ZSTD_DCtx *dctx = strm->codec_stream;
+	ZSTD_inBuffer in = { strm->next_in, strm->avail_in, 0 };
+	ZSTD_outBuffer out = { strm->next_out, strm->avail_out, 0 };
+	size_t ret;
+
+	/* zstd would start on another frame; zlib keeps saying it is done */
+	if (strm->codec_stream_end)
+		return Z_STREAM_END;
+
+	/*
+	 * Callers that know the size of the object, and say Z_FINISH
+	 * with room for all of it, get a frame we have in whole
+	 * decoded in one go, straight into their buffer, instead of
+	 * through the window of the streaming decoder.  Should that
+	 * fail, the streaming decoder has the final word.
+	 */
+	if (flush == Z_FINISH && !strm->total_in) {
+		size_t frame = ZSTD_findFrameCompressedSize(in.src, in.size);
+
+		if (!ZSTD_isError(frame)) {
+			ret = ZSTD_decompressDCtx(dctx, out.dst, out.size,
+						  in.src, frame);
+			if (!ZSTD_isError(ret)) {
+				in.pos = frame;
+				out.pos = ret;
+				zstd_post_call(strm, &in, &out);
+				strm->codec_stream_end = 1;
+				return Z_STREAM_END;
+			}
+		}
+	}
+
+	ret = ZSTD_decompressStream(dctx, &out, &in);
+	zstd_post_call(strm, &in, &out);
+	if (ZSTD_isError(ret)) {
+		error("inflate: %s (zstd)", ZSTD_getErrorName(ret));
+		return Z_DATA_ERROR;
+	}
+	/* zstd stops at the end of the frame, like zlib does */
+	if (!ret) {
+		strm->codec_stream_end = 1;
+		return Z_STREAM_END;
+	}
+	return (in.pos || out.pos) ? Z_OK : Z_BUF_ERROR;
+}
+
+static void zstd_inflate_end(git_zstream *strm)
+{
+	ZSTD_freeDCtx(strm->codec_stream);
+	strm->codec_stream = NULL;
+}
+
+static void zstd_deflate_init(git_zstream *strm, int level)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+	if (!cctx)
+		die("deflate: out of memory");
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zstd_level(level));
+	/* check the data on the way out, as zlib does with its adler32 */
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	strm->codec_stream = cctx;
+}
+
+static int zstd_deflate(git_zstream *strm, int flush)
+{
+	ZSTD_inBuffer in = { strm->next_in, strm->avail_in, 0 };
+	ZSTD_outBuffer out = { strm->next_out, strm->avail_out, 0 };
+	ZSTD_EndDirective op;
+	size_t ret;
+
+	if (flush == Z_FINISH)
+		op = ZSTD_e_end;
+	else if (flush)
+		op = ZSTD_e_flush;
+	else
+		op = ZSTD_e_continue;
+
+	ret = ZSTD_compressStream2(strm->codec_stream, &out, &in, op);
+	zstd_post_call(strm, &in, &out);
+	if (ZSTD_isError(ret)) {
+		error("deflate: %s (zstd)", ZSTD_getErrorName(ret));
+		return Z_STREAM_ERROR;
+	}
+	if (op == ZSTD_e_end && !ret)
+		return Z_STREAM_END;
+	return (in.pos || out.pos) ? Z_OK : Z_BUF_ERROR;
+}
+
+static void zstd_deflate_end(git_zstream *strm)
+{
+	ZSTD_freeCCtx(strm->codec_stream);
+	strm->codec_stream = NULL;
+}
+
+#else
+
+/* object_codec_supported() keeps us from getting here */
+#define zstd_inflate_init(strm) die("BUG: no zstd support")
+#define zstd_inflate(strm, flush) Z_STREAM_ERROR
+#define zstd_inflate_end(strm)
+#define zstd_deflate_init(strm, level) die("BUG: no zstd support")
+#define zstd_deflate(strm, flush) Z_STREAM_ERROR
+#define zstd_deflate_end(strm)
+#define ZSTD_compressBound(size) (size)
+
+#endif
 
 static const char *zerr_to_string(int status)
 {
@@ -68,6 +272,10 @@ void git_inflate_init(git_zstream *strm)
 {
 	int status;
 
+	strm->codec = OBJECT_CODEC_ZLIB;
+	strm->detect_codec = 1;
+	strm->codec_peeked = 0;
+	strm->codec_stream = NULL;
 	zlib_pre_call(strm);
 	status = inflateInit(&strm->z);
 	zlib_post_call(strm);
@@ -86,6 +294,9 @@ void git_inflate_init_gzip_only(git_zstream *strm)
 	const int windowBits = 15 + 16;
 	int status;
 
+	strm->codec = OBJECT_CODEC_ZLIB;
+	strm->detect_codec = 0;
+	strm->codec_stream = NULL;
 	zlib_pre_call(strm);
 	status = inflateInit2(&strm->z, windowBits);
 	zlib_post_call(strm);
@@ -99,6 +310,10 @@ void git_inflate_end(git_zstream *strm)
 {
 	int status;
 
+	if (strm->codec == OBJECT_CODEC_ZSTD) {
+		zstd_inflate_end(strm);
+		return;
+	}
 	zlib_pre_call(strm);
 	status = inflateEnd(&strm->z);
 	zlib_post_call(strm);
@@ -108,10 +323,79 @@ void git_inflate_end(git_zstream *strm)
 	      strm->z.msg ? strm->z.msg : "no message");
 }
 
+/*
+ * Switch to the codec the data we are fed is in, once there is enough
+ * of it to tell.  Until then, returns -1 with what git_inflate() is
+ * to return in *status.
+ */
+static int detect_codec(git_zstream *strm, int flush, int *status)
+{
+	unsigned char head[2];
+	unsigned long len = 0, i;
+	int codec;
+
+	if (strm->codec_peeked)
+		head[len++] = zstd_magic[0];
+	for (i = 0; len < sizeof(head) && i < strm->avail_in; i++)
+		head[len++] = strm->next_in[i];
+	codec = object_codec_of(head, len);
+
+	if (codec < 0 && !strm->avail_in) {
+		*status = Z_BUF_ERROR;
+		return -1;
+	}
+	if (codec < 0 && flush != Z_FINISH) {
+		/*
+		 * We are fed the stream a byte at a time; keep the one
+		 * byte that could start either codec to ourselves until
+		 * the next one tells which it is.
+		 */
+		strm->codec_peeked = 1;
+		strm->next_in++;
+		strm->avail_in--;
+		strm->total_in++;
+		*status = Z_OK;
+		return -1;
+	}
+	if (codec < 0)	/* that is all there is, and zlib will say so */
+		codec = OBJECT_CODEC_ZLIB;
+
+	strm->detect_codec = 0;
+	if (codec != OBJECT_CODEC_ZLIB && !object_codec_supported(codec)) {
+		/* zlib will fail on it, but let's say why */
+		error("inflate: data compressed with %s, which this git "
+		      "cannot read", object_codec_name(codec));
+		codec = OBJECT_CODEC_ZLIB;
+	}
+
+	if (codec == OBJECT_CODEC_ZLIB) {
+		if (strm->codec_peeked) {
+			/* the byte we kept counts in total_in already */
+			strm->z.next_in = (unsigned char *)zstd_magic;
+			strm->z.avail_in = 1;
+			strm->z.next_out = strm->next_out;
+			strm->z.avail_out = 0;
+			inflate(&strm->z, 0);
+		}
+		return 0;
+	}
+
+	inflateEnd(&strm->z);
+	strm->codec = codec;
+	strm->codec_stream_end = 0;
+	zstd_inflate_init(strm);
+	return 0;
+}
+
 int git_inflate(git_zstream *strm, int flush)
 {
 	int status;
 
+	if (strm->detect_codec && detect_codec(strm, flush, &status) < 0)
+		return status;
+	if (strm->codec == OBJECT_CODEC_ZSTD)
+		return zstd_inflate(strm, flush);
+
 	for (;;) {
 		zlib_pre_call(strm);
 		/* Never say Z_FINISH unless we are feeding everything */
@@ -152,6 +436,8 @@ int git_inflate(git_zstream *strm, int flush)
 
 unsigned long git_deflate_bound(git_zstream *strm, unsigned long size)
 {
+	if (strm->codec == OBJECT_CODEC_ZSTD)
+		return ZSTD_compressBound(size);
 	return deflateBound(&strm->z, size);
 }
 
@@ -159,6 +445,9 @@ void git_deflate_init(git_zstream *strm, int level)
 {
 	int status;
 
+	strm->codec = OBJECT_CODEC_ZLIB;
+	strm->detect_codec = 0;
+	strm->codec_stream = NULL;
 	zlib_pre_call(strm);
 	status = deflateInit(&strm->z, level);
 	zlib_post_call(strm);
@@ -172,6 +461,9 @@ static void do_git_deflate_init(git_zstream *strm, int level, int windowBits)
 {
 	int status;
 
+	strm->codec = OBJECT_CODEC_ZLIB;
+	strm->detect_codec = 0;
+	strm->codec_stream = NULL;
 	zlib_pre_call(strm);
 	status = deflateInit2(&strm->z, level,
 				  Z_DEFLATED, windowBits,
@@ -201,10 +493,29 @@ void git_deflate_init_raw(git_zstream *strm, int level)
 	do_git_deflate_init(strm, level, -15);
 }
 
+void git_deflate_init_codec(git_zstream *strm, int level,
+			    enum object_codec codec)
+{
+	if (codec == OBJECT_CODEC_ZLIB) {
+		git_deflate_init(strm, level);
+		return;
+	}
+	if (!object_codec_supported(codec))
+		die("BUG: deflating with unsupported codec %d", codec);
+
+	strm->codec = codec;
+	strm->detect_codec = 0;
+	zstd_deflate_init(strm, level);
+}
+
 int git_deflate_abort(git_zstream *strm)
 {
 	int status;
 
+	if (strm->codec == OBJECT_CODEC_ZSTD) {
+		zstd_deflate_end(strm);
+		return Z_OK;
+	}
 	zlib_pre_call(strm);
 	status = deflateEnd(&strm->z);
 	zlib_post_call(strm);
@@ -223,18 +534,16 @@ void git_deflate_end(git_zstream *strm)
 
 int git_deflate_end_gently(git_zstream *strm)
 {
-	int status;
-
-	zlib_pre_call(strm);
-	status = deflateEnd(&strm->z);
-	zlib_post_call(strm);
-	return status;
+	return git_deflate_abort(strm);
 }
 
 int git_deflate(git_zstream *strm, int flush)
 {
 	int status;
 
+	if (strm->codec == OBJECT_CODEC_ZSTD)
+		return zstd_deflate(strm, flush);
+
 	for (;;) {
 		zlib_pre_call(strm);
 